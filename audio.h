@@ -0,0 +1,33 @@
+#ifndef RTMPCAST_AUDIO_H
+#define RTMPCAST_AUDIO_H
+
+// Common structures shared between rtmpcast lib and the audio modules.
+
+// samples per channel in each AAC frame
+#define AUDIO_FRAME_SAMPLES 1024
+// most bytes in one AAC frame: 6144 bits per channel
+#define AUDIO_MAX_FRAME(channels) (768 * (channels))
+
+// An audio encoder (or passthrough): each module keeps its own state in opaque
+struct encoder_audio {
+	void * opaque;
+	// where samples come from, for modules that encode them (else NULL)
+	int (* callback)(void * input);
+};
+
+// An encoder backend: what rtmpcast calls, and nothing else.  Every entry
+//  is required; rtmpcast_param_t picks one by name (see backend.h).
+struct audio_backend_t {
+	const char * name;
+
+	struct encoder_audio * (* create)(unsigned int channels, unsigned int bitrate, unsigned int samplerate);
+	// Writes the AudioSpecificConfig, returns its size
+	int (* init)(const struct encoder_audio * audio, unsigned char * destination);
+	// Encodes count samples (all channels: one frame's worth, interleaved
+	//  int16) into destination, which has room for AUDIO_MAX_FRAME.
+	//  Returns the size, or negative on error
+	int (* encode)(const struct encoder_audio * audio, const void * samples, int count, unsigned char * destination);
+	void (* close)(struct encoder_audio * audio);
+};
+
+#endif
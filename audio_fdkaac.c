@@ -112,8 +112,7 @@ struct encoder_audio * audio_fdkaac_create(
 	const unsigned int channels,
 	const unsigned int bitrate,
 	const unsigned int samplerate,
-	int (* callback)(void * input),
-	unsigned char * const destination)
+	int (* callback)(void * input))
 {
 	// create a structure
 	struct encoder_audio * e = malloc(sizeof(struct encoder_audio));
@@ -215,10 +214,11 @@ struct encoder_audio * audio_fdkaac_create(
 	// ////////
 	// set up the OUTPUT buffer
 	o->out_buf.numBufs           = 1;
-	o->out_buffer_sizes[0]       = 768 * channels * sizeof(unsigned char);
+	o->out_buffer_sizes[0]       = AUDIO_FDKAAC_MAX_FRAME(channels) * sizeof(unsigned char);
 	o->out_buf.bufSizes          = o->out_buffer_sizes;
 
-	o->out_buffers[0]            = destination;
+	// set per call, to wherever the caller wants the frame
+	o->out_buffers[0]            = NULL;
 	o->out_buf.bufs              = o->out_buffers;
 	// use the constants
 	o->out_buf.bufferIdentifiers = out_buffer_identifiers;
@@ -228,35 +228,49 @@ struct encoder_audio * audio_fdkaac_create(
 }
 
 // Copy the encoder info into the provided buffer, and return the length of copied bytes
-int audio_fdkaac_init(const struct encoder_audio * const e)
+int audio_fdkaac_init(const struct encoder_audio * const e, unsigned char * const destination)
 {
 	struct encoder_audio_fdkaac * o = e->opaque;
-	memcpy(o->out_buffers[0], o->encoder_info.confBuf, o->encoder_info.confSize);
+	memcpy(destination, o->encoder_info.confBuf, o->encoder_info.confSize);
 	return o->encoder_info.confSize;
 }
 
 // Encode a block and put it into the provided buffer.  Return bytes copied.
-int audio_fdkaac_update(const struct encoder_audio * const e)
+int audio_fdkaac_update(const struct encoder_audio * const e, unsigned char * const destination)
 {
 	struct encoder_audio_fdkaac * o = e->opaque;
 
-	AACENC_ERROR err;
 	/* *************************************************** */
 	// CALL THE AUDIO CALLBACK
-	AACENC_InArgs in_args;
-	in_args.numAncBytes = 0;
 	int callback_ret = e->callback(o->in_buffers[0]);
 
 	// User indicated error, return
 	if (callback_ret < 0)
 		return callback_ret;
 
-	in_args.numInSamples = callback_ret;
+	return audio_fdkaac_encode(e, o->in_buffers[0], callback_ret, destination);
+}
+
+// Same, with samples the caller already has
+int audio_fdkaac_encode(const struct encoder_audio * const e, const void * const samples, const int count, unsigned char * const destination)
+{
+	struct encoder_audio_fdkaac * o = e->opaque;
+	o->out_buffers[0] = destination;
+
+	// our input description, pointed at the caller's samples
+	void * bufs[1] = { (void *)samples };
+	AACENC_BufDesc in_buf = o->in_buf;
+	in_buf.bufs = bufs;
+
+	AACENC_ERROR err;
+	AACENC_InArgs in_args;
+	in_args.numAncBytes = 0;
+	in_args.numInSamples = count;
 
 	// Perform the encode
 	//  Set output buffer to be start of tag
 	AACENC_OutArgs out_args; // does not need init - is set by encode
-	err = aacEncEncode(o->encoder, &o->in_buf, &o->out_buf, &in_args, &out_args);
+	err = aacEncEncode(o->encoder, &in_buf, &o->out_buf, &in_args, &out_args);
 
 	if (err != AACENC_OK) {
 		print_aacenc_error("Failed to encode audio", err);
@@ -277,3 +291,17 @@ void audio_fdkaac_close(struct encoder_audio * const e)
 	free(o);
 	free(e);
 }
+
+// the backend table: samples always come from rtmpcast, not the callback
+static struct encoder_audio * create(const unsigned int channels, const unsigned int bitrate, const unsigned int samplerate)
+{
+	return audio_fdkaac_create(channels, bitrate, samplerate, NULL);
+}
+
+const struct audio_backend_t audio_fdkaac_backend = {
+	.name = "fdkaac",
+	.create = create,
+	.init = audio_fdkaac_init,
+	.encode = audio_fdkaac_encode,
+	.close = audio_fdkaac_close
+};
@@ -3,9 +3,19 @@
 
 #include "audio.h"
 
-struct encoder_audio * audio_fdkaac_create(const unsigned int channels, const unsigned int bitrate, const unsigned int samplerate, int (* callback)(void * input), unsigned char * destination);
-int audio_fdkaac_init(const struct encoder_audio * audio);
-int audio_fdkaac_update(const struct encoder_audio * audio);
+// Most bytes audio_fdkaac_update will write for one frame
+#define AUDIO_FDKAAC_MAX_FRAME(channels) AUDIO_MAX_FRAME(channels)
+
+// these, as a backend for rtmpcast to pick
+extern const struct audio_backend_t audio_fdkaac_backend;
+
+struct encoder_audio * audio_fdkaac_create(const unsigned int channels, const unsigned int bitrate, const unsigned int samplerate, int (* callback)(void * input));
+// Writes the AudioSpecificConfig, returns its size
+int audio_fdkaac_init(const struct encoder_audio * audio, unsigned char * destination);
+// Encodes one frame into destination, returns its size or negative on error
+int audio_fdkaac_update(const struct encoder_audio * audio, unsigned char * destination);
+// Same, encoding count samples (all channels) the caller already has
+int audio_fdkaac_encode(const struct encoder_audio * audio, const void * samples, int count, unsigned char * destination);
 void audio_fdkaac_close(struct encoder_audio * audio);
 
 #endif
@@ -0,0 +1,101 @@
+#include "audio_null.h"
+
+// for malloc
+#include <stdlib.h>
+// for memset
+#include <string.h>
+// for perror
+#include <stdio.h>
+
+// sampling frequency index, as in AudioSpecificConfig
+static const unsigned int samplerates[13] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+// structure definition for the encoder (private data)
+struct encoder_audio_null {
+	// AAC-LC AudioSpecificConfig: 2 bytes, or 5 with an explicit rate
+	unsigned char config[5];
+	unsigned int config_size;
+
+	unsigned int size;
+};
+
+static struct encoder_audio * create(const unsigned int channels, const unsigned int bitrate, const unsigned int samplerate)
+{
+	// create a structure
+	struct encoder_audio * e = malloc(sizeof(struct encoder_audio));
+	if (e == NULL) {
+		perror("librtmpcast: ERROR: audio_null::create: malloc() returned NULL");
+		return NULL;
+	}
+
+	// create private area
+	struct encoder_audio_null * o = malloc(sizeof(struct encoder_audio_null));
+	if (o == NULL) {
+		perror("librtmpcast: ERROR: audio_null::create: malloc() returned NULL");
+		free(e);
+		return NULL;
+	}
+	e->opaque = o;
+	e->callback = NULL;
+
+	// object type 2 (LC), frequency index (15 escapes to 24 bits of
+	//  rate), channel configuration, then GASpecificConfig all zero
+	unsigned int index = 0;
+	while (index < 13 && samplerates[index] != samplerate)
+		index ++;
+	if (index < 13) {
+		o->config[0] = (2 << 3) | (index >> 1);
+		o->config[1] = ((index & 0x01) << 7) | ((channels & 0x0F) << 3);
+		o->config_size = 2;
+	} else {
+		o->config[0] = (2 << 3) | (15 >> 1);
+		o->config[1] = 0x80 | (samplerate >> 17 & 0x7F);
+		o->config[2] = samplerate >> 9 & 0xFF;
+		o->config[3] = samplerate >> 1 & 0xFF;
+		o->config[4] = ((samplerate & 0x01) << 7) | ((channels & 0x0F) << 3);
+		o->config_size = 5;
+	}
+
+	// the bitrate's share of a frame, within what AAC allows
+	unsigned long size = (unsigned long)bitrate * 1000 / 8 * AUDIO_FRAME_SAMPLES / samplerate;
+	if (size < 1)
+		size = 1;
+	if (size > AUDIO_MAX_FRAME(channels))
+		size = AUDIO_MAX_FRAME(channels);
+	o->size = size;
+
+	return e;
+}
+
+static int init(const struct encoder_audio * const e, unsigned char * const destination)
+{
+	const struct encoder_audio_null * o = e->opaque;
+	memcpy(destination, o->config, o->config_size);
+	return o->config_size;
+}
+
+static int encode(const struct encoder_audio * const e, const void * const samples, const int count, unsigned char * const destination)
+{
+	(void)samples;
+	(void)count;
+
+	const struct encoder_audio_null * o = e->opaque;
+	memset(destination, 0, o->size);
+	return o->size;
+}
+
+static void close_encoder(struct encoder_audio * const e)
+{
+	free(e->opaque);
+	free(e);
+}
+
+const struct audio_backend_t audio_null_backend = {
+	.name = "null",
+	.create = create,
+	.init = init,
+	.encode = encode,
+	.close = close_encoder
+};
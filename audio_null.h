@@ -0,0 +1,12 @@
+#ifndef RTMPCAST_AUDIO_NULL_H
+#define RTMPCAST_AUDIO_NULL_H
+
+// An audio "encoder" that encodes nothing: each block comes out as an AAC
+//  frame of filler, sized for the bitrate.  For timing the mux and the
+//  network on their own.
+
+#include "audio.h"
+
+extern const struct audio_backend_t audio_null_backend;
+
+#endif
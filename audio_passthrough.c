@@ -0,0 +1,256 @@
+#include "audio_passthrough.h"
+
+// for malloc
+#include <stdlib.h>
+// for memcpy
+#include <string.h>
+// for fprintf
+#include <stdio.h>
+
+// AudioSpecificConfig: room for anything a stream is likely to carry
+#define CONFIG_MAX 64
+// input held between writes: a frame waiting for its end, and the next
+#define BUFFER_SIZE (2 * AUDIO_PASSTHROUGH_MAX_FRAME)
+
+// sampling frequency index, as in ADTS headers and AudioSpecificConfig
+static const unsigned int samplerates[13] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+// structure definition for the passthrough (private data)
+struct encoder_audio_passthrough {
+	int adts;
+
+	// config of the next frame, and the one last written by init
+	unsigned char config[CONFIG_MAX];
+	unsigned int config_size;
+	unsigned char sent[CONFIG_MAX];
+	unsigned int sent_size;
+	unsigned int samplerate;
+
+	// input: start is where the unread part begins, length where it ends
+	unsigned char * buffer;
+	size_t start, length;
+
+	// the next whole frame, if ready: payload offset and size in buffer
+	int ready;
+	size_t frame_at, frame_size;
+
+	// skipping bytes that are not ADTS: reported once per stretch
+	int lost;
+};
+
+// n bits of c, from bit at on (0 past the end)
+static unsigned int readBits(const unsigned char * const c, const unsigned int size, const unsigned int at, const unsigned int n)
+{
+	unsigned int value = 0;
+	for (unsigned int i = at; i < at + n; i ++)
+		value = (value << 1) | (i / 8 < size ? (c[i / 8] >> (7 - i % 8)) & 1 : 0);
+	return value;
+}
+
+// Sample rate of an AudioSpecificConfig, 0 if it cannot be read
+static unsigned int configSamplerate(const unsigned char * const c, const unsigned int size)
+{
+	// 5 bits of object type (escaped to 6 more bits by 31), then 4 bits of
+	//  frequency index (escaped to 24 bits of rate by 15)
+	const unsigned int at = (readBits(c, size, 0, 5) == 31 ? 11 : 5);
+	if (size * 8 < at + 4)
+		return 0;
+
+	const unsigned int index = readBits(c, size, at, 4);
+	if (index < 13)
+		return samplerates[index];
+	if (index == 15 && size * 8 >= at + 4 + 24)
+		return readBits(c, size, at + 4, 24);
+	return 0;
+}
+
+struct encoder_audio * audio_passthrough_create(const unsigned char * const config, const unsigned int config_size)
+{
+	if (config && (config_size > CONFIG_MAX || configSamplerate(config, config_size) == 0)) {
+		fputs("librtmpcast: ERROR: audio_passthrough: cannot read the AudioSpecificConfig\n", stderr);
+		return NULL;
+	}
+
+	// create a structure
+	struct encoder_audio * e = malloc(sizeof(struct encoder_audio));
+	if (e == NULL) {
+		perror("librtmpcast: ERROR: audio_passthrough::audio_passthrough_create: malloc() returned NULL");
+		return NULL;
+	}
+
+	// create private area
+	struct encoder_audio_passthrough * o = calloc(1, sizeof(struct encoder_audio_passthrough));
+	if (o == NULL) {
+		perror("librtmpcast: ERROR: audio_passthrough::audio_passthrough_create: calloc() returned NULL");
+		free(e);
+		return NULL;
+	}
+	e->opaque = o;
+	// nothing to call: frames are written in
+	e->callback = NULL;
+
+	o->buffer = malloc(BUFFER_SIZE);
+	if (o->buffer == NULL) {
+		perror("librtmpcast: ERROR: audio_passthrough::audio_passthrough_create: malloc() returned NULL");
+		free(o);
+		free(e);
+		return NULL;
+	}
+
+	o->adts = (config == NULL);
+	if (config) {
+		memcpy(o->config, config, config_size);
+		o->config_size = config_size;
+		o->samplerate = configSamplerate(config, config_size);
+	}
+
+	return e;
+}
+
+// Copy the config into the provided buffer, and return the length of copied bytes
+int audio_passthrough_init(struct encoder_audio * const e, unsigned char * const destination)
+{
+	struct encoder_audio_passthrough * o = e->opaque;
+	memcpy(destination, o->config, o->config_size);
+
+	// the frames after this one can go out under it
+	memcpy(o->sent, o->config, o->config_size);
+	o->sent_size = o->config_size;
+
+	return o->config_size;
+}
+
+size_t audio_passthrough_write(struct encoder_audio * const e, const unsigned char * const data, const size_t size)
+{
+	struct encoder_audio_passthrough * o = e->opaque;
+
+	// raw: a frame a call, once the last has been taken
+	if (! o->adts) {
+		if (o->ready)
+			return 0;
+		if (size > AUDIO_PASSTHROUGH_MAX_FRAME) {
+			fprintf(stderr, "librtmpcast: ERROR: audio_passthrough: dropped a frame of %zu bytes, more than AAC allows\n", size);
+			return size;
+		}
+
+		memcpy(o->buffer, data, size);
+		o->frame_at = 0;
+		o->frame_size = size;
+		o->ready = (size > 0);
+		return size;
+	}
+
+	// ADTS: make room after what is still unread
+	if (o->start > 0 && ! o->ready) {
+		memmove(o->buffer, o->buffer + o->start, o->length - o->start);
+		o->length -= o->start;
+		o->start = 0;
+	}
+
+	const size_t n = (size < BUFFER_SIZE - o->length ? size : BUFFER_SIZE - o->length);
+	memcpy(o->buffer + o->length, data, n);
+	o->length += n;
+	return n;
+}
+
+int audio_passthrough_ready(struct encoder_audio * const e)
+{
+	struct encoder_audio_passthrough * o = e->opaque;
+
+	while (! o->ready && o->adts) {
+		// look for the 12-bit syncword, with layer 0
+		while (o->length - o->start >= 2 && ! (o->buffer[o->start] == 0xFF && (o->buffer[o->start + 1] & 0xF6) == 0xF0)) {
+			if (! o->lost)
+				fputs("librtmpcast: WARNING: audio_passthrough: skipping input that is not ADTS\n", stderr);
+			o->lost = 1;
+			o->start ++;
+		}
+		if (o->length - o->start < 7)
+			return 0;
+
+		const unsigned char * const h = o->buffer + o->start;
+		const unsigned int header = ((h[1] & 0x01) ? 7 : 9);
+		const unsigned int profile = h[2] >> 6;
+		const unsigned int index = (h[2] >> 2) & 0x0F;
+		const unsigned int channels = ((h[2] & 0x01) << 2) | (h[3] >> 6);
+		const size_t length = ((h[3] & 0x03) << 11) | (h[4] << 3) | (h[5] >> 5);
+		const unsigned int blocks = (h[6] & 0x03) + 1;
+
+		// not a header after all (or one we cannot describe in a config):
+		//  keep looking from the next byte
+		if (index >= 13 || channels == 0 || length <= header) {
+			if (! o->lost)
+				fputs("librtmpcast: WARNING: audio_passthrough: skipping input that is not ADTS\n", stderr);
+			o->lost = 1;
+			o->start ++;
+			continue;
+		}
+
+		// wait for the rest
+		if (o->length - o->start < length)
+			return 0;
+
+		// frames are sent whole, and cannot be split without decoding them
+		if (blocks != 1) {
+			fputs("librtmpcast: WARNING: audio_passthrough: dropped an ADTS frame holding several AAC frames\n", stderr);
+			o->start += length;
+			continue;
+		}
+
+		o->lost = 0;
+		o->frame_at = o->start + header;
+		o->frame_size = length - header;
+		o->ready = 1;
+
+		// AudioSpecificConfig: object type (profile + 1), frequency index,
+		//  channel configuration, then GASpecificConfig all zero
+		o->config[0] = ((profile + 1) << 3) | (index >> 1);
+		o->config[1] = ((index & 0x01) << 7) | (channels << 3);
+		o->config_size = 2;
+		o->samplerate = samplerates[index];
+	}
+
+	if (! o->ready)
+		return 0;
+	return (o->config_size != o->sent_size || memcmp(o->config, o->sent, o->config_size) ? 2 : 1);
+}
+
+unsigned int audio_passthrough_samplerate(const struct encoder_audio * const e)
+{
+	const struct encoder_audio_passthrough * o = e->opaque;
+	return o->samplerate;
+}
+
+int audio_passthrough_partial(const struct encoder_audio * const e)
+{
+	const struct encoder_audio_passthrough * o = e->opaque;
+	return o->adts && ! o->ready && o->length > o->start;
+}
+
+// Copy the frame into the provided buffer.  Return bytes copied.
+int audio_passthrough_update(struct encoder_audio * const e, unsigned char * const destination)
+{
+	struct encoder_audio_passthrough * o = e->opaque;
+
+	if (destination)
+		memcpy(destination, o->buffer + o->frame_at, o->frame_size);
+
+	o->start = o->frame_at + o->frame_size;
+	if (! o->adts)
+		o->start = o->length = 0;
+	o->ready = 0;
+
+	return o->frame_size;
+}
+
+// shut everything down
+void audio_passthrough_close(struct encoder_audio * const e)
+{
+	struct encoder_audio_passthrough * o = e->opaque;
+
+	free(o->buffer);
+	free(o);
+	free(e);
+}
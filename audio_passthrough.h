@@ -0,0 +1,37 @@
+#ifndef RTMPCAST_AUDIO_PASSTHROUGH_H
+#define RTMPCAST_AUDIO_PASSTHROUGH_H
+
+// AAC that is already encoded, sent on as it is: raw frames with their
+//  AudioSpecificConfig given up front, or an ADTS stream, whose headers give
+//  the config (and may change it).
+
+#include "audio.h"
+
+#include <stddef.h>
+
+// Most bytes in one frame (the ADTS length field is 13 bits)
+#define AUDIO_PASSTHROUGH_MAX_FRAME 8192
+
+// config is an AudioSpecificConfig of config_size bytes for raw frames, or
+//  NULL for ADTS
+struct encoder_audio * audio_passthrough_create(const unsigned char * config, unsigned int config_size);
+// Writes the AudioSpecificConfig of the next frame, returns its size
+//  (0 while an ADTS stream has yet to give one)
+int audio_passthrough_init(struct encoder_audio * audio, unsigned char * destination);
+// Take up to size bytes of input: for raw frames, one whole frame a call.
+//  Stops early when there is no room: take frames out, then write the rest.
+//  Returns the bytes taken
+size_t audio_passthrough_write(struct encoder_audio * audio, const unsigned char * data, size_t size);
+// Whether a whole frame is ready: 0 for no, 1 for yes, 2 if its config
+//  differs from the one audio_passthrough_init last wrote (send that first)
+int audio_passthrough_ready(struct encoder_audio * audio);
+// Samples per second of the next frame
+unsigned int audio_passthrough_samplerate(const struct encoder_audio * audio);
+// Whether part of a frame is waiting for the rest
+int audio_passthrough_partial(const struct encoder_audio * audio);
+// Copy the next frame (raw, without its ADTS header) to destination, or
+//  drop it if destination is NULL.  Only when ready.  Returns its size
+int audio_passthrough_update(struct encoder_audio * audio, unsigned char * destination);
+void audio_passthrough_close(struct encoder_audio * audio);
+
+#endif
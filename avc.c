@@ -0,0 +1,109 @@
+#include "avc.h"
+
+// for memcpy, memmove
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const uint8_t * avc_find_startcode(const uint8_t * p, const uint8_t * const end)
+{
+#ifdef __SSE2__
+	// 16 positions at once: a zero here, a zero next, and a one after that
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	for (; end - p >= 18; p += 16) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)p);
+		const __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+		const __m128i c = _mm_loadu_si128((const __m128i *)(p + 2));
+		const int mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)),
+			_mm_cmpeq_epi8(c, one)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+#endif
+
+	for (; end - p >= 3; p ++)
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			return p;
+	return end;
+}
+
+// The NAL after the start code at p: where it ends (less the zero bytes
+//  before the next start code), and that next start code
+static const uint8_t * nalEnd(const uint8_t * const p, const uint8_t * const end, const uint8_t ** const next)
+{
+	const uint8_t * const body = p + 3;
+	*next = avc_find_startcode(body, end);
+
+	const uint8_t * e = *next;
+	while (e > body && e[-1] == 0)
+		e --;
+	return e;
+}
+
+size_t avc_annexb_to_avcc(uint8_t * const data, const size_t size)
+{
+	// every NAL after a 3-byte start code grows by one: count them, and
+	//  start from that far in, so the output never overtakes the input
+	size_t grow = 0;
+	const uint8_t * next;
+	for (const uint8_t * p = avc_find_startcode(data, data + size); p < data + size; p = next)
+		if (nalEnd(p, data + size, &next) > p + 3 && (p == data || p[-1] != 0))
+			grow ++;
+
+	uint8_t * const src = data + grow;
+	const uint8_t * const end = src + size;
+	if (grow)
+		memmove(src, data, size);
+
+	uint8_t * w = data;
+	for (const uint8_t * p = avc_find_startcode(src, end); p < end; p = next) {
+		const uint8_t * const e = nalEnd(p, end, &next);
+		const size_t length = e - (p + 3);
+		if (length == 0)
+			continue;
+
+		w[0] = length >> 24 & 0xFF;
+		w[1] = length >> 16 & 0xFF;
+		w[2] = length >> 8 & 0xFF;
+		w[3] = length & 0xFF;
+		memmove(w + 4, p + 3, length);
+		w += 4 + length;
+	}
+
+	return w - data;
+}
+
+int avc_config_record(uint8_t * const destination, const unsigned int capacity, const uint8_t * const sps, const unsigned int sps_size, const uint8_t * const pps, const unsigned int pps_size)
+{
+	if (sps_size < 4 || sps_size > 0xFFFF || pps_size > 0xFFFF || 6 + 2 + sps_size + 1 + 2 + pps_size > capacity)
+		return -1;
+
+	// AVCDecoderConfigurationRecord - profile and level come out of the SPS
+	uint8_t * p = destination;
+	*p = 0x01;	// version
+	*(p + 1) = sps[1];	// Required profile ID
+	*(p + 2) = sps[2];	// Profile compatibility
+	*(p + 3) = sps[3];	// AVC Level
+	*(p + 4) = 0b11111100 | 0b11;	// NAL lengthSizeMinusOne (4 bytes)
+	*(p + 5) = 0b11100000 | 1;	// number of SPS sets
+	p += 6;
+
+	// write the SPS - length (uint16), then data
+	*p = sps_size >> 8 & 0xFF; p++;
+	*p = sps_size & 0xFF; p++;
+	memcpy(p, sps, sps_size);
+	p += sps_size;
+
+	// then the PPS, after its own count
+	*p = 1; p++;	// number of PPS sets
+	*p = pps_size >> 8 & 0xFF; p++;
+	*p = pps_size & 0xFF; p++;
+	memcpy(p, pps, pps_size);
+	p += pps_size;
+
+	return p - destination;
+}
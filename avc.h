@@ -0,0 +1,43 @@
+#ifndef RTMPCAST_AVC_H
+#define RTMPCAST_AVC_H
+
+// H.264 bitstream plumbing, shared by the video modules: finding Annex B
+//  start codes, rewriting them as the 4-byte lengths FLV wants, and the
+//  AVCDecoderConfigurationRecord that goes out as the sequence header.
+//  The start code scan uses SSE2 where the compiler targets it.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// NAL unit types (the low 5 bits of the first byte)
+#define AVC_NAL_SLICE 1
+#define AVC_NAL_IDR 5
+#define AVC_NAL_SEI 6
+#define AVC_NAL_SPS 7
+#define AVC_NAL_PPS 8
+#define AVC_NAL_AUD 9
+
+#define AVC_NAL_TYPE(header) ((header) & 0x1F)
+// nal_ref_idc 0: nothing else refers to it
+#define AVC_NAL_DISPOSABLE(header) (((header) & 0x60) == 0)
+
+// Room avc_annexb_to_avcc needs for size bytes of Annex B: 3-byte start
+//  codes grow by one, and each comes with at least a byte of NAL
+#define AVC_AVCC_CAPACITY(size) ((size) + (size) / 4 + 1)
+
+// The first 00 00 01 at or after data, or end if there is none
+const uint8_t * avc_find_startcode(const uint8_t * data, const uint8_t * end);
+
+// Rewrite size bytes of Annex B in place as NAL units each after a 4-byte
+//  big-endian length.  Anything before the first start code, zero bytes
+//  between NALs and empty NALs are dropped.  data must have
+//  AVC_AVCC_CAPACITY(size) bytes of room.
+//  Returns the new size
+size_t avc_annexb_to_avcc(uint8_t * data, size_t size);
+
+// Write the AVCDecoderConfigurationRecord for one SPS and one PPS (bare
+//  NAL units: no start code or length), returns its size or -1 if it
+//  does not fit in capacity
+int avc_config_record(uint8_t * destination, unsigned int capacity, const uint8_t * sps, unsigned int sps_size, const uint8_t * pps, unsigned int pps_size);
+
+#endif
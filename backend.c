@@ -0,0 +1,53 @@
+#include "backend.h"
+
+#ifdef RTMPCAST_X264
+#include "video_x264.h"
+#endif
+#ifdef RTMPCAST_FDK_AAC
+#include "audio_fdkaac.h"
+#endif
+#include "video_null.h"
+#include "audio_null.h"
+
+// for strcmp
+#include <string.h>
+// for fprintf
+#include <stdio.h>
+
+// the default first
+static const struct video_backend_t * const video_backends[] = {
+#ifdef RTMPCAST_X264
+	&video_x264_backend,
+#endif
+	&video_null_backend
+};
+
+static const struct audio_backend_t * const audio_backends[] = {
+#ifdef RTMPCAST_FDK_AAC
+	&audio_fdkaac_backend,
+#endif
+	&audio_null_backend
+};
+
+const struct video_backend_t * backend_video(const char * const name)
+{
+	for (size_t i = 0; i < sizeof(video_backends) / sizeof(video_backends[0]); i ++) {
+		// null is never a default
+		if (name == NULL ? video_backends[i] != &video_null_backend : strcmp(name, video_backends[i]->name) == 0)
+			return video_backends[i];
+	}
+
+	fprintf(stderr, "librtmpcast: ERROR: no video backend \"%s\" in this build\n", (name ? name : "x264"));
+	return NULL;
+}
+
+const struct audio_backend_t * backend_audio(const char * const name)
+{
+	for (size_t i = 0; i < sizeof(audio_backends) / sizeof(audio_backends[0]); i ++) {
+		if (name == NULL ? audio_backends[i] != &audio_null_backend : strcmp(name, audio_backends[i]->name) == 0)
+			return audio_backends[i];
+	}
+
+	fprintf(stderr, "librtmpcast: ERROR: no audio backend \"%s\" in this build\n", (name ? name : "fdkaac"));
+	return NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef RTMPCAST_BACKEND_H
+#define RTMPCAST_BACKEND_H
+
+// Encoder backends, picked at runtime by name: the ones this build has
+//  libraries for (x264, fdkaac), and "null" (see video_null.h, audio_null.h).
+//  Another encoder is a module with a backend table, and a line here.
+
+#include "video.h"
+#include "audio.h"
+
+// name NULL for the default (x264 / fdkaac).  Returns NULL, with a
+//  message, if there is no such backend in this build
+const struct video_backend_t * backend_video(const char * name);
+const struct audio_backend_t * backend_audio(const char * name);
+
+#endif
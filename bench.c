@@ -0,0 +1,775 @@
+/* ***************************************************************************
+bench.c - librtmpcast benchmarks
+Greg Kennedy 2021
+
+Times the muxing and encoding hot paths, and prints the results as JSON
+  for comparing runs.  No network involved.
+Build with "make bench", then run:
+	bench [<suite> ...]
+  with suites from: flv amf colorspace scale ring video audio update mux (default: all of these)
+	bench threads [<width> <height> <framerate> <bitrate> <frames>]
+  to compare encoder thread counts and modes instead.
+video and threads need x264, audio fdk-aac, and update both: without them,
+  those suites are left out.
+*************************************************************************** */
+
+#include "rtmpcast.h"
+
+#include "flv.h"
+#ifdef RTMPCAST_X264
+#include "video_x264.h"
+#endif
+#ifdef RTMPCAST_FDK_AAC
+#include "audio_fdkaac.h"
+#endif
+#include "colorspace.h"
+#include "scale.h"
+#include "ring.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// every benchmark runs this many times: the fastest and the median are reported
+#define BENCH_REPEATS 5
+
+// operations per repeat
+#define MUX_ITERATIONS 1000000
+#define VIDEO_FRAMES 60
+#define CONVERT_FRAMES 100
+#define SCALE_FRAMES 100
+#define RING_WRITES 10000
+// what a typical audio engine hands over at a time
+#define RING_PERIOD 480
+#define AUDIO_BLOCKS 200
+#define UPDATE_FRAMES 300
+
+// distinct test frames to cycle through
+#define PATTERN_FRAMES 8
+
+// thread sweep defaults: the 1080p60 case
+#define THREADS_WIDTH 1920
+#define THREADS_HEIGHT 1080
+#define THREADS_FRAMERATE 60
+#define THREADS_BITRATE 6000
+#define THREADS_FRAMES 600
+
+// video settings for the encoder and update benchmarks
+static const struct {
+	unsigned int width, height, framerate, bitrate;
+} video_sets[] = {
+	{ 640, 360, 30, 700 },
+	{ 1280, 720, 30, 2500 },
+	{ 1920, 1080, 60, 6000 }
+};
+
+static const struct {
+	unsigned int samplerate, channels, bitrate;
+} audio_sets[] = {
+	{ 44100, 1, 64 },
+	{ 44100, 2, 128 },
+	{ 48000, 2, 160 }
+};
+
+// GLOBALS
+// results are folded in here, so the compiler cannot skip the work
+static volatile uint32_t sink;
+// whether a result has been printed yet (for the commas)
+static int reported;
+
+// the current test pattern, and the frame the callbacks are on
+static unsigned int width, height;
+static uint8_t * pattern[PATTERN_FRAMES];
+static unsigned int frame_number;
+static unsigned int audio_channels;
+static unsigned int audio_packet_number;
+
+static double getTimestamp()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+/* ************************************************************************ */
+// test content
+// frames that change every time, so the encoder has real work to do
+//  generated up front, to keep the pattern out of the timings
+static int makePattern(const unsigned int w, const unsigned int h)
+{
+	width = w;
+	height = h;
+	frame_number = 0;
+
+	const size_t luma = width * height;
+	const size_t chroma = (width / 2) * (height / 2);
+
+	for (unsigned int f = 0; f < PATTERN_FRAMES; f ++) {
+		free(pattern[f]);
+		pattern[f] = malloc(luma + 2 * chroma);
+		if (pattern[f] == NULL)
+			return 0;
+
+		for (unsigned int y = 0; y < height; y ++)
+			for (unsigned int x = 0; x < width; x ++)
+				pattern[f][y * width + x] = x + y * 2 + f * 3;
+
+		for (unsigned int y = 0; y < height / 2; y ++) {
+			memset(&pattern[f][luma + width / 2 * y], f + y, width / 2);
+			memset(&pattern[f][luma + chroma + width / 2 * y], f * 2 + y, width / 2);
+		}
+	}
+
+	return 1;
+}
+
+static int callback_video(unsigned char * frame[3])
+{
+	const size_t luma = width * height;
+	const size_t chroma = (width / 2) * (height / 2);
+	const uint8_t * const src = pattern[frame_number % PATTERN_FRAMES];
+
+	memcpy(frame[0], src, luma);
+	memcpy(frame[1], src + luma, chroma);
+	memcpy(frame[2], src + luma + chroma, chroma);
+
+	frame_number ++;
+	return 0;
+}
+
+static int callback_audio(int16_t * buffer)
+{
+	for (int i = 0; i < 1024; i ++) {
+		for (unsigned int c = 0; c < audio_channels; c ++)
+			buffer[i * audio_channels + c] = audio_packet_number * i;
+	}
+
+	audio_packet_number = (audio_packet_number + 1) % 200;
+	return 1024 * audio_channels;
+}
+
+/* ************************************************************************ */
+// reporting
+static int compareDouble(const void * a, const void * b)
+{
+	const double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// One result: seconds[] holds each repeat's time for iterations operations
+//  params is a JSON object body, or NULL
+static void report(const char * const name, const char * const params, const unsigned long iterations, double * const seconds, const int repeats)
+{
+	qsort(seconds, repeats, sizeof(double), compareDouble);
+
+	printf("%s\n\t\t{ \"name\": \"%s\", \"params\": { %s }, \"iterations\": %lu, \"repeats\": %d, \"min_ns\": %.1f, \"median_ns\": %.1f }",
+		(reported ? "," : ""), name, (params ? params : ""), iterations, repeats,
+		seconds[0] * 1e9 / iterations,
+		seconds[repeats / 2] * 1e9 / iterations);
+	fflush(stdout);
+
+	reported = 1;
+}
+
+/* ************************************************************************ */
+// flv / amf: each loop body is one call, on a buffer that stays in cache
+static double benchTagHeader(const unsigned long iterations)
+{
+	uint8_t tag[16];
+	const double start = getTimestamp();
+	for (unsigned long i = 0; i < iterations; i ++) {
+		flv_TagHeader(tag, 9, i);
+		sink += tag[i & 7];
+	}
+	return getTimestamp() - start;
+}
+
+static double benchTagFinish(const unsigned long iterations)
+{
+	uint8_t tag[64];
+	memset(tag, 0, sizeof(tag));
+	const double start = getTimestamp();
+	for (unsigned long i = 0; i < iterations; i ++) {
+		sink += flv_TagFinish(tag, tag + 11 + (i & 31));
+	}
+	return getTimestamp() - start;
+}
+
+static double benchAVCVideoPacket(const unsigned long iterations)
+{
+	uint8_t header[5];
+	const double start = getTimestamp();
+	for (unsigned long i = 0; i < iterations; i ++) {
+		flv_AVCVideoPacket(header, i & 1, 1, i & 0xFF);
+		sink += header[i & 3];
+	}
+	return getTimestamp() - start;
+}
+
+static double benchNumber(const unsigned long iterations)
+{
+	uint8_t value[9];
+	const double start = getTimestamp();
+	for (unsigned long i = 0; i < iterations; i ++) {
+		amf_number(value, i * 0.5);
+		sink += value[i & 7];
+	}
+	return getTimestamp() - start;
+}
+
+// the onMetaData tag rtmpcast_connect sends
+static double benchMetaData(const unsigned long iterations)
+{
+	uint8_t tag[512];
+	const double start = getTimestamp();
+	for (unsigned long i = 0; i < iterations; i ++) {
+		uint8_t * p = flv_TagHeader(tag, 18, 0);
+		p = amf_string(p, "onMetaData");
+		p = amf_ecma_array(p, 9);
+		p = amf_ecma_array_entry(p, "width", 1920);
+		p = amf_ecma_array_entry(p, "height", 1080);
+		p = amf_ecma_array_entry(p, "framerate", 60);
+		p = amf_ecma_array_entry(p, "videocodecid", 7);
+		p = amf_ecma_array_entry(p, "videodatarate", i);
+		p = amf_ecma_array_entry(p, "audiocodecid", 10);
+		p = amf_ecma_array_entry(p, "audiodatarate", 128);
+		p = amf_ecma_array_entry(p, "audiosamplerate", 44100);
+		p = amf_boolean(pstring(p, "stereo"), 1);
+		p = amf_ecma_array_end(p);
+		sink += flv_TagFinish(tag, p);
+	}
+	return getTimestamp() - start;
+}
+
+static void measure(const char * const name, double (* const fn)(unsigned long))
+{
+	double seconds[BENCH_REPEATS];
+	for (int i = 0; i < BENCH_REPEATS; i ++)
+		seconds[i] = fn(MUX_ITERATIONS);
+
+	report(name, NULL, MUX_ITERATIONS, seconds, BENCH_REPEATS);
+}
+
+static int suiteFlv()
+{
+	measure("flv_TagHeader", benchTagHeader);
+	measure("flv_TagFinish", benchTagFinish);
+	measure("flv_AVCVideoPacket", benchAVCVideoPacket);
+	return 1;
+}
+
+static int suiteAmf()
+{
+	measure("amf_number", benchNumber);
+	measure("onMetaData", benchMetaData);
+	return 1;
+}
+
+/* ************************************************************************ */
+// format conversion to I420: time per 1080p frame, for each kernel the CPU has
+static int suiteColorspace()
+{
+	static const struct {
+		const char * name;
+		int format;
+	} formats[] = {
+		{ "NV12", COLORSPACE_NV12 },
+		{ "YUY2", COLORSPACE_YUY2 },
+		{ "RGB24", COLORSPACE_RGB24 },
+		{ "RGBA", COLORSPACE_RGBA },
+		{ "BGRA", COLORSPACE_BGRA }
+	};
+	static const char * const kernels[] = { "scalar", "sse2", "avx2" };
+	const unsigned int w = 1920, h = 1080;
+
+	uint8_t * const dst = malloc(w * h * 3 / 2);
+	if (dst == NULL)
+		return 0;
+	uint8_t * const out[3] = { dst, dst + w * h, dst + w * h + w * h / 4 };
+
+	for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f ++) {
+		struct colorspace_layout_t l;
+		colorspace_layout(formats[f].format, w, h, &l);
+		uint8_t * const src = malloc(l.size);
+		if (src == NULL) {
+			free(dst);
+			return 0;
+		}
+		for (size_t i = 0; i < l.size; i ++)
+			src[i] = i * 7 + i / l.stride[0];
+		const uint8_t * const in[3] = { src + l.offset[0], src + l.offset[1], src + l.offset[2] };
+
+		// asking for a kernel the CPU lacks (or any SIMD for RGB24) gets the
+		//  best below it, already measured: stop there
+		for (int k = COLORSPACE_SCALAR; k <= COLORSPACE_AVX2; k ++) {
+			struct colorspace_t * cs = colorspace_create(formats[f].format, w, h, k, 1);
+			if (cs == NULL) {
+				free(src);
+				free(dst);
+				return 0;
+			}
+			const int kernel = colorspace_kernel(cs);
+
+			double seconds[BENCH_REPEATS];
+			for (int r = 0; r < BENCH_REPEATS && kernel == k; r ++) {
+				const double start = getTimestamp();
+				for (unsigned int i = 0; i < CONVERT_FRAMES; i ++) {
+					colorspace_convert(cs, in, out);
+					sink += dst[i];
+				}
+				seconds[r] = getTimestamp() - start;
+			}
+			colorspace_close(cs);
+
+			if (kernel != k)
+				break;
+
+			char params[128];
+			snprintf(params, sizeof(params), "\"format\": \"%s\", \"kernel\": \"%s\", \"width\": %u, \"height\": %u",
+				formats[f].name, kernels[k], w, h);
+			report("colorspace_convert", params, CONVERT_FRAMES, seconds, BENCH_REPEATS);
+		}
+
+		free(src);
+	}
+
+	free(dst);
+	return 1;
+}
+
+/* ************************************************************************ */
+// scaler: time per 1080p frame, to one size and to a whole ladder at once
+static int suiteScale()
+{
+	static const struct {
+		const char * name;
+		unsigned int count;
+		unsigned int width[3], height[3];
+	} ladders[] = {
+		{ "720p", 1, { 1280 }, { 720 } },
+		{ "360p", 1, { 640 }, { 360 } },
+		{ "720p,480p,360p", 3, { 1280, 854, 640 }, { 720, 480, 360 } }
+	};
+	const unsigned int w = 1920, h = 1080;
+
+	uint8_t * const src = malloc(w * h * 3 / 2);
+	if (src == NULL)
+		return 0;
+	for (size_t i = 0; i < w * h * 3 / 2; i ++)
+		src[i] = i * 7 + i / w;
+	const uint8_t * const in[3] = { src, src + w * h, src + w * h + w * h / 4 };
+
+	for (size_t l = 0; l < sizeof(ladders) / sizeof(ladders[0]); l ++) {
+		struct scale_t * s = scale_create(w, h, ladders[l].count, ladders[l].width, ladders[l].height);
+		if (s == NULL) {
+			free(src);
+			return 0;
+		}
+
+		// one buffer per size, big enough for any of them
+		uint8_t * dst[3];
+		uint8_t * planes[3][3];
+		uint8_t * const * out[3];
+		for (unsigned int i = 0; i < ladders[l].count; i ++) {
+			const unsigned int size = ladders[l].width[i] * ladders[l].height[i];
+			dst[i] = malloc(size * 3 / 2);
+			if (dst[i] == NULL) {
+				while (i --)
+					free(dst[i]);
+				scale_close(s);
+				free(src);
+				return 0;
+			}
+			planes[i][0] = dst[i];
+			planes[i][1] = dst[i] + size;
+			planes[i][2] = dst[i] + size + size / 4;
+			out[i] = planes[i];
+		}
+
+		double seconds[BENCH_REPEATS];
+		for (int r = 0; r < BENCH_REPEATS; r ++) {
+			const double start = getTimestamp();
+			for (unsigned int i = 0; i < SCALE_FRAMES; i ++) {
+				scale_frame(s, in, out);
+				sink += dst[0][i];
+			}
+			seconds[r] = getTimestamp() - start;
+		}
+
+		for (unsigned int i = 0; i < ladders[l].count; i ++)
+			free(dst[i]);
+		scale_close(s);
+
+		char params[128];
+		snprintf(params, sizeof(params), "\"sizes\": \"%s\", \"width\": %u, \"height\": %u",
+			ladders[l].name, w, h);
+		report("scale_frame", params, SCALE_FRAMES, seconds, BENCH_REPEATS);
+	}
+
+	free(src);
+	return 1;
+}
+
+/* ************************************************************************ */
+// audio ring: time per write of one period, stereo, reading out every block
+static int suiteRing()
+{
+	static const struct {
+		const char * name;
+		int format;
+		unsigned int in_rate, out_rate;
+	} sets[] = {
+		{ "S16", RING_S16, 44100, 44100 },
+		{ "FLOAT", RING_FLOAT, 48000, 48000 },
+		{ "FLOAT", RING_FLOAT, 48000, 44100 },
+		{ "FLOAT_PLANAR", RING_FLOAT_PLANAR, 48000, 44100 },
+		{ "S16", RING_S16, 32000, 48000 }
+	};
+
+	float * const period = malloc(2 * RING_PERIOD * sizeof(float));
+	if (period == NULL)
+		return 0;
+	for (unsigned int i = 0; i < 2 * RING_PERIOD; i ++)
+		period[i] = (float)(i % 97) / 97 - 0.5f;
+	int16_t block[2 * RING_BLOCK];
+
+	for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s ++) {
+		struct ring_t * ring = ring_create(sets[s].format, 2, sets[s].in_rate, sets[s].out_rate);
+		if (ring == NULL) {
+			free(period);
+			return 0;
+		}
+
+		// the same bytes serve every format: only the time matters
+		const void * const data[2] = { period, period + RING_PERIOD };
+
+		double seconds[BENCH_REPEATS];
+		for (int r = 0; r < BENCH_REPEATS; r ++) {
+			const double start = getTimestamp();
+			for (unsigned int i = 0; i < RING_WRITES; i ++) {
+				for (unsigned int done = 0; done < RING_PERIOD; ) {
+					done += ring_write(ring, data, done, RING_PERIOD - done);
+					while (ring_ready(ring)) {
+						ring_read(ring, block);
+						sink += block[i % (2 * RING_BLOCK)];
+					}
+				}
+			}
+			seconds[r] = getTimestamp() - start;
+		}
+		ring_close(ring);
+
+		char params[128];
+		snprintf(params, sizeof(params), "\"format\": \"%s\", \"in_rate\": %u, \"out_rate\": %u, \"frames\": %u",
+			sets[s].name, sets[s].in_rate, sets[s].out_rate, RING_PERIOD);
+		report("ring_write", params, RING_WRITES, seconds, BENCH_REPEATS);
+	}
+
+	free(period);
+	return 1;
+}
+
+/* ************************************************************************ */
+// encoders: time per frame, once the encoder is up and running
+#ifdef RTMPCAST_X264
+static int suiteVideo()
+{
+	for (size_t s = 0; s < sizeof(video_sets) / sizeof(video_sets[0]); s ++) {
+		if (! makePattern(video_sets[s].width, video_sets[s].height))
+			return 0;
+
+		const struct video_options_t options = { 0 };
+		struct encoder_video * e = video_x264_create(width, height, video_sets[s].framerate, video_sets[s].bitrate, &options, callback_video);
+		if (e == NULL)
+			return 0;
+
+		double seconds[BENCH_REPEATS];
+		int64_t frame = 0;
+		for (int r = 0; r < BENCH_REPEATS; r ++) {
+			const double start = getTimestamp();
+			for (unsigned int i = 0; i < VIDEO_FRAMES; i ++, frame ++) {
+				const struct video_return_t v = video_x264_update(e, frame * 1000 / video_sets[s].framerate);
+				if (v.size < 0) {
+					video_x264_close(e);
+					return 0;
+				}
+				sink += v.size;
+			}
+			seconds[r] = getTimestamp() - start;
+		}
+
+		while (video_x264_delayed(e) > 0)
+			video_x264_flush(e);
+		video_x264_close(e);
+
+		char params[128];
+		snprintf(params, sizeof(params), "\"width\": %u, \"height\": %u, \"framerate\": %u, \"bitrate\": %u",
+			video_sets[s].width, video_sets[s].height, video_sets[s].framerate, video_sets[s].bitrate);
+		report("video_x264_update", params, VIDEO_FRAMES, seconds, BENCH_REPEATS);
+	}
+
+	return 1;
+}
+#endif
+
+#ifdef RTMPCAST_FDK_AAC
+static int suiteAudio()
+{
+	for (size_t s = 0; s < sizeof(audio_sets) / sizeof(audio_sets[0]); s ++) {
+		audio_channels = audio_sets[s].channels;
+		audio_packet_number = 0;
+
+		struct encoder_audio * e = audio_fdkaac_create(audio_sets[s].channels, audio_sets[s].bitrate, audio_sets[s].samplerate, (int (*)(void *))callback_audio);
+		if (e == NULL)
+			return 0;
+
+		unsigned char * const out = malloc(AUDIO_FDKAAC_MAX_FRAME(audio_sets[s].channels));
+		if (out == NULL) {
+			audio_fdkaac_close(e);
+			return 0;
+		}
+
+		double seconds[BENCH_REPEATS];
+		for (int r = 0; r < BENCH_REPEATS; r ++) {
+			const double start = getTimestamp();
+			for (unsigned int i = 0; i < AUDIO_BLOCKS; i ++) {
+				const int size = audio_fdkaac_update(e, out);
+				if (size < 0) {
+					free(out);
+					audio_fdkaac_close(e);
+					return 0;
+				}
+				sink += size;
+			}
+			seconds[r] = getTimestamp() - start;
+		}
+
+		free(out);
+		audio_fdkaac_close(e);
+
+		char params[128];
+		snprintf(params, sizeof(params), "\"samplerate\": %u, \"channels\": %u, \"bitrate\": %u",
+			audio_sets[s].samplerate, audio_sets[s].channels, audio_sets[s].bitrate);
+		report("audio_fdkaac_update", params, AUDIO_BLOCKS, seconds, BENCH_REPEATS);
+	}
+
+	return 1;
+}
+#endif
+
+/* ************************************************************************ */
+// The whole stream into /dev/null, encoded by the named backends
+static int runUpdate(const char * const backend, const char * const name)
+{
+	for (size_t s = 0; s < sizeof(video_sets) / sizeof(video_sets[0]); s ++) {
+		if (! makePattern(video_sets[s].width, video_sets[s].height))
+			return 0;
+		audio_channels = 2;
+		audio_packet_number = 0;
+
+		struct rtmpcast_param_t param = { 0 };
+		param.filename = "/dev/null";
+
+		param.video.enable = 1;
+		param.video.callback = (int (*)(void *))callback_video;
+		param.video.width = width;
+		param.video.height = height;
+		param.video.framerate = video_sets[s].framerate;
+		param.video.bitrate = video_sets[s].bitrate;
+		param.video.backend = backend;
+
+		param.audio.enable = 1;
+		param.audio.callback = (int (*)(void *))callback_audio;
+		param.audio.samplerate = 44100;
+		param.audio.channels = audio_channels;
+		param.audio.bitrate = 128;
+		param.audio.backend = backend;
+
+		struct rtmpcast_t * rtmpcast = rtmpcast_init(&param);
+		if (rtmpcast == NULL)
+			return 0;
+		if (! rtmpcast_connect(rtmpcast)) {
+			rtmpcast_close(rtmpcast);
+			return 0;
+		}
+
+		double seconds[BENCH_REPEATS];
+		for (int r = 0; r < BENCH_REPEATS; r ++) {
+			const unsigned int until = frame_number + UPDATE_FRAMES;
+			const double start = getTimestamp();
+			while (frame_number < until) {
+				if (rtmpcast_update(rtmpcast) < 0) {
+					rtmpcast_close(rtmpcast);
+					return 0;
+				}
+			}
+			seconds[r] = getTimestamp() - start;
+		}
+
+		rtmpcast_close(rtmpcast);
+
+		char params[128];
+		snprintf(params, sizeof(params), "\"width\": %u, \"height\": %u, \"framerate\": %u, \"bitrate\": %u",
+			video_sets[s].width, video_sets[s].height, video_sets[s].framerate, video_sets[s].bitrate);
+		report(name, params, UPDATE_FRAMES, seconds, BENCH_REPEATS);
+	}
+
+	return 1;
+}
+
+#if defined(RTMPCAST_X264) && defined(RTMPCAST_FDK_AAC)
+static int suiteUpdate()
+{
+	return runUpdate(NULL, "rtmpcast_update");
+}
+#endif
+
+// Same, with the null backends: what is left is the mux and the writes
+static int suiteMux()
+{
+	return runUpdate("null", "rtmpcast_update_null");
+}
+
+/* ************************************************************************ */
+// Encoder thread sweep: one run of each thread count and mode
+#ifdef RTMPCAST_X264
+static int suiteThreads(const unsigned int framerate, const unsigned int bitrate, const unsigned int frames)
+{
+	// up to one thread per core, doubling each time
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1)
+		cores = 1;
+
+	for (long threads = 1; ; threads *= 2) {
+		if (threads > cores)
+			threads = cores;
+
+		for (int sliced = 1; sliced >= 0; sliced --) {
+			// a single thread is the same either way
+			if (threads == 1 && ! sliced)
+				continue;
+
+			struct video_options_t options = { 0 };
+			options.threads = threads;
+			options.sliced_threads = sliced;
+
+			struct encoder_video * e = video_x264_create(width, height, framerate, bitrate, &options, callback_video);
+			if (e == NULL)
+				return 0;
+
+			frame_number = 0;
+			const double start = getTimestamp();
+
+			int ok = 1;
+			for (unsigned int i = 0; ok && i < frames; i ++)
+				ok = (video_x264_update(e, (int64_t)i * 1000 / framerate).size >= 0);
+
+			// frames still in flight (frame threads, lookahead) count too
+			while (ok && video_x264_delayed(e) > 0)
+				ok = (video_x264_flush(e).size >= 0);
+
+			// a single run each: the sweep is slow enough already
+			double seconds = getTimestamp() - start;
+			video_x264_close(e);
+
+			if (! ok)
+				return 0;
+
+			char params[160];
+			snprintf(params, sizeof(params), "\"width\": %u, \"height\": %u, \"framerate\": %u, \"bitrate\": %u, \"threads\": %ld, \"mode\": \"%s\", \"cores\": %ld",
+				width, height, framerate, bitrate, threads, (sliced ? "sliced" : "frame"), cores);
+			report("video_x264_threads", params, frames, &seconds, 1);
+		}
+
+		if (threads == cores)
+			break;
+	}
+
+	return 1;
+}
+#endif
+
+/* ************************************************************************ */
+int main(int argc, char * argv[])
+{
+	static const struct {
+		const char * name;
+		int (* run)();
+	} suites[] = {
+		{ "flv", suiteFlv },
+		{ "amf", suiteAmf },
+		{ "colorspace", suiteColorspace },
+		{ "scale", suiteScale },
+		{ "ring", suiteRing },
+#ifdef RTMPCAST_X264
+		{ "video", suiteVideo },
+#endif
+#ifdef RTMPCAST_FDK_AAC
+		{ "audio", suiteAudio },
+#endif
+#if defined(RTMPCAST_X264) && defined(RTMPCAST_FDK_AAC)
+		{ "update", suiteUpdate },
+#endif
+		{ "mux", suiteMux }
+	};
+	const int count = sizeof(suites) / sizeof(suites[0]);
+
+	const int threads = (argc > 1 && strcmp(argv[1], "threads") == 0);
+	if (threads && argc != 2 && argc != 7) {
+		printf("librtmpcast benchmarks\nUsage:\n\t%s threads [<width> <height> <framerate> <bitrate> <frames>]\n", argv[0]);
+		return EXIT_SUCCESS;
+	}
+
+	// check the names before running anything
+	for (int i = 1; ! threads && i < argc; i ++) {
+		int known = 0;
+		for (int s = 0; s < count; s ++)
+			known |= (strcmp(argv[i], suites[s].name) == 0);
+
+		if (! known) {
+			printf("librtmpcast benchmarks\nUsage:\n\t%s [<suite> ...]\nSuites:", argv[0]);
+			for (int s = 0; s < count; s ++)
+				printf(" %s", suites[s].name);
+			printf("\n\t%s threads [<width> <height> <framerate> <bitrate> <frames>]\n", argv[0]);
+			return EXIT_SUCCESS;
+		}
+	}
+
+	printf("{\n\t\"benchmarks\": [");
+
+	int ok = 1;
+	if (threads) {
+#ifdef RTMPCAST_X264
+		ok = makePattern(argc > 2 ? atoi(argv[2]) : THREADS_WIDTH, argc > 2 ? atoi(argv[3]) : THREADS_HEIGHT) &&
+			suiteThreads(argc > 2 ? atoi(argv[4]) : THREADS_FRAMERATE,
+				argc > 2 ? atoi(argv[5]) : THREADS_BITRATE,
+				argc > 2 ? atoi(argv[6]) : THREADS_FRAMES);
+#else
+		fputs("Built without x264: no thread sweep.\n", stderr);
+		ok = 0;
+#endif
+	} else {
+		for (int s = 0; ok && s < count; s ++) {
+			int wanted = (argc == 1);
+			for (int i = 1; i < argc; i ++)
+				wanted |= (strcmp(argv[i], suites[s].name) == 0);
+
+			if (wanted)
+				ok = suites[s].run();
+		}
+	}
+
+	printf("\n\t]\n}\n");
+
+	for (int f = 0; f < PATTERN_FRAMES; f ++)
+		free(pattern[f]);
+
+	if (! ok) {
+		fputs("Benchmark failed.\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
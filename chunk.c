@@ -0,0 +1,175 @@
+#include "chunk.h"
+
+// big-endian writers
+#include "flv.h"
+
+// for writev
+#include <sys/uio.h>
+// for malloc
+#include <stdlib.h>
+// for fprintf
+#include <stdio.h>
+#include <errno.h>
+
+// iovec entries per writev() call (Linux IOV_MAX)
+#define CHUNK_IOV_BATCH 1024
+
+// Write all of iov, retrying partial writes.  Returns 0 on socket error.
+static int writeAll(const int fd, struct iovec * iov, int count)
+{
+	while (count > 0) {
+		ssize_t n = writev(fd, iov, (count < CHUNK_IOV_BATCH ? count : CHUNK_IOV_BATCH));
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("librtmpcast: ERROR: chunk::writeAll: writev() failed");
+			return 0;
+		}
+
+		count = chunk_iov_advance(&iov, count, n);
+	}
+
+	return 1;
+}
+
+int chunk_set_size(RTMP * const rtmp, const uint32_t size)
+{
+	// through librtmp, which keeps its own record of the control channel
+	//  for header compression
+	char buf[RTMP_MAX_HEADER_SIZE + 4];
+
+	RTMPPacket packet = { 0 };
+	packet.m_nChannel = 0x02;
+	packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+	packet.m_packetType = RTMP_PACKET_TYPE_CHUNK_SIZE;
+	packet.m_body = buf + RTMP_MAX_HEADER_SIZE;
+	packet.m_nBodySize = 4;
+	u32be((uint8_t *)packet.m_body, size);
+
+	if (! RTMP_SendPacket(rtmp, &packet, 0)) {
+		fputs("librtmpcast: ERROR: chunk::chunk_set_size: RTMP_SendPacket failed\n", stderr);
+		return 0;
+	}
+
+	rtmp->m_outChunkSize = size;
+	return 1;
+}
+
+int chunk_iov_max(const RTMP * const rtmp, const uint32_t length, const int count)
+{
+	// a header and a slice per chunk, plus a split at each piece boundary
+	return 2 * (length / rtmp->m_outChunkSize + 1) + count;
+}
+
+int chunk_iov(const RTMP * const rtmp, struct chunk_header_t * const header, const unsigned int csid, const uint8_t type, const uint32_t timestamp, const struct iovec * const payload, const int count, struct iovec * const iov)
+{
+	const size_t chunkSize = rtmp->m_outChunkSize;
+
+	uint32_t length = 0;
+	for (int i = 0; i < count; i ++)
+		length += payload[i].iov_len;
+
+	// timestamps past 24 bits move to a 32-bit field after the header
+	const int extended = (timestamp >= 0xFFFFFF);
+
+	// First chunk carries a full (type 0) header
+	uint8_t * p = header->first;
+	*p = csid & 0x3F; p ++;
+	p = u24be(p, extended ? 0xFFFFFF : timestamp);
+	p = u24be(p, length);
+	*p = type; p ++;
+	// message stream ID is the one little-endian field in RTMP
+	*p = rtmp->m_stream_id & 0xFF; p ++;
+	*p = rtmp->m_stream_id >> 8 & 0xFF; p ++;
+	*p = rtmp->m_stream_id >> 16 & 0xFF; p ++;
+	*p = rtmp->m_stream_id >> 24 & 0xFF; p ++;
+	if (extended) p = u32be(p, timestamp);
+	const size_t firstSize = p - header->first;
+
+	// Continuation chunks (type 3) only repeat the chunk stream ID
+	p = header->next;
+	*p = 0xC0 | (csid & 0x3F); p ++;
+	if (extended) p = u32be(p, timestamp);
+	const size_t nextSize = p - header->next;
+
+	// Interleave chunk headers with slices of the payload
+	int n = 0;
+	iov[n].iov_base = header->first;
+	iov[n].iov_len = firstSize;
+	n ++;
+
+	size_t room = chunkSize;
+	for (int i = 0; i < count; i ++) {
+		uint8_t * src = payload[i].iov_base;
+		size_t left = payload[i].iov_len;
+
+		while (left > 0) {
+			if (room == 0) {
+				iov[n].iov_base = header->next;
+				iov[n].iov_len = nextSize;
+				n ++;
+				room = chunkSize;
+			}
+
+			const size_t slice = (left < room ? left : room);
+			iov[n].iov_base = src;
+			iov[n].iov_len = slice;
+			n ++;
+
+			src += slice;
+			left -= slice;
+			room -= slice;
+		}
+	}
+
+	return n;
+}
+
+int chunk_iov_advance(struct iovec ** const iov, int count, size_t n)
+{
+	struct iovec * v = *iov;
+
+	// skip over the entries written in full, trim the partial one
+	while (count > 0 && n >= v->iov_len) {
+		n -= v->iov_len;
+		v ++;
+		count --;
+	}
+	if (count > 0) {
+		v->iov_base = (uint8_t *)v->iov_base + n;
+		v->iov_len -= n;
+	}
+
+	*iov = v;
+	return count;
+}
+
+int chunk_writev(RTMP * const rtmp, const unsigned int csid, const uint8_t type, const uint32_t timestamp, const struct iovec * const payload, const int count)
+{
+	uint32_t length = 0;
+	for (int i = 0; i < count; i ++)
+		length += payload[i].iov_len;
+
+	// small messages build their list on the stack
+	struct iovec stack[CHUNK_IOV_BATCH];
+	struct iovec * iov = stack;
+
+	const int max = chunk_iov_max(rtmp, length, count);
+	if (max > CHUNK_IOV_BATCH) {
+		iov = malloc(max * sizeof(struct iovec));
+		if (iov == NULL) {
+			perror("librtmpcast: ERROR: chunk::chunk_writev: malloc() returned NULL");
+			return 0;
+		}
+	}
+
+	struct chunk_header_t header;
+	const int n = chunk_iov(rtmp, &header, csid, type, timestamp, payload, count, iov);
+	const int ret = writeAll(RTMP_Socket(rtmp), iov, n);
+
+	if (iov != stack)
+		free(iov);
+
+	return ret;
+}
@@ -0,0 +1,48 @@
+#ifndef RTMPCAST_CHUNK_H
+#define RTMPCAST_CHUNK_H
+
+// Native RTMP chunk writer.
+//  Frames one RTMP message around caller-owned payload pieces and sends it
+//  with gathered writes, so the payload is never copied into librtmp packets.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <librtmp/rtmp.h>
+
+// Chunk stream used for our media messages.
+//  Kept apart from librtmp's own channels (2 - 4), because every message here
+//  starts with a full header that librtmp's header compression knows nothing about.
+#define CHUNK_STREAM_MEDIA 6
+
+// Outgoing chunk size we ask for, in place of the default 128 bytes.
+//  Fewer, larger chunks mean fewer headers to build, send and parse.
+#define CHUNK_SIZE_OUT 4096
+
+// Chunk headers for one message.
+//  The gather list points into this, so it must outlive the list.
+struct chunk_header_t {
+	uint8_t first[1 + 11 + 4];
+	uint8_t next[1 + 4];
+};
+
+// Send Set Chunk Size, and use the new size from here on
+//  (librtmp's own writes included).  Returns 0 on socket error.
+int chunk_set_size(RTMP * rtmp, uint32_t size);
+
+// Most iovec entries chunk_iov can produce for this message
+int chunk_iov_max(const RTMP * rtmp, uint32_t length, int count);
+
+// Build the gather list for one message of the given type, made of count
+//  payload pieces.  iov needs room for chunk_iov_max entries.
+//  Returns the number of entries used.
+int chunk_iov(const RTMP * rtmp, struct chunk_header_t * header, unsigned int csid, uint8_t type, uint32_t timestamp, const struct iovec * payload, int count, struct iovec * iov);
+
+// Step a gather list past n written bytes.  Returns the entries left.
+int chunk_iov_advance(struct iovec ** iov, int count, size_t n);
+
+// Send one message, blocking until it is all written.
+//  Returns 0 on socket error.
+int chunk_writev(RTMP * rtmp, unsigned int csid, uint8_t type, uint32_t timestamp, const struct iovec * payload, int count);
+
+#endif
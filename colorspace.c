@@ -0,0 +1,718 @@
+#include "colorspace.h"
+
+// for malloc
+#include <stdlib.h>
+// for fprintf
+#include <stdio.h>
+// for memcpy
+#include <string.h>
+
+// band threads
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COLORSPACE_X86 1
+#include <immintrin.h>
+#endif
+
+// RGB to YUV weights (BT.601, scaled by 256), in the byte order of the pixel:
+//  a fourth byte (alpha) has weight 0
+struct weights_t {
+	int16_t y[4], u[4], v[4];
+};
+
+static const struct weights_t weights_rgb = {
+	{ 66, 129, 25, 0 },
+	{ -38, -74, 112, 0 },
+	{ 112, -94, -18, 0 }
+};
+static const struct weights_t weights_bgr = {
+	{ 25, 129, 66, 0 },
+	{ 112, -74, -38, 0 },
+	{ -18, -94, 112, 0 }
+};
+
+// structure definition for the converter (private data)
+struct colorspace_t {
+	int format;
+	unsigned int width, height;
+	struct colorspace_layout_t layout;
+
+	// RGB: bytes per pixel, and the weights for its byte order
+	unsigned int bpp;
+	const struct weights_t * weights;
+
+	// converts one pair of rows (y and y + 1) with the chosen kernel
+	void (* rows)(const struct colorspace_t * cs, const uint8_t * const src[3], uint8_t * const dst[3], unsigned int y);
+	int kernel;
+
+	// band threads: thread i converts band i + 1, the caller does band 0
+	unsigned int bands;
+	unsigned int band_rows;
+	pthread_t * thread;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	// bumped for each frame, so the threads know there is work
+	unsigned long generation;
+	unsigned int pending;
+	int quit;
+
+	// the frame being converted
+	const uint8_t * src[3];
+	uint8_t * dst[3];
+};
+
+/* ************************************************************************ */
+// plain C
+static inline uint8_t luma(const int16_t * const w, const uint8_t * const p)
+{
+	return ((w[0] * p[0] + w[1] * p[1] + w[2] * p[2] + 128) >> 8) + 16;
+}
+
+// from the sums of a 2x2 block
+static inline uint8_t chroma(const int16_t * const w, const int * const sum)
+{
+	return ((w[0] * sum[0] + w[1] * sum[1] + w[2] * sum[2] + 512) >> 10) + 128;
+}
+
+// Output pointers for row pair y
+#define DST_ROWS(cs, dst, y) \
+	uint8_t * const y0 = dst[0] + (size_t)(y) * cs->width; \
+	uint8_t * const y1 = y0 + cs->width; \
+	uint8_t * const u = dst[1] + (size_t)(y) / 2 * (cs->width / 2); \
+	uint8_t * const v = dst[2] + (size_t)(y) / 2 * (cs->width / 2)
+
+// RGB from pixel x on: SIMD kernels finish their rows with this
+static void rgbTail(const struct colorspace_t * const cs, const uint8_t * const s0, const uint8_t * const s1, uint8_t * const y0, uint8_t * const y1, uint8_t * const u, uint8_t * const v, unsigned int x)
+{
+	const unsigned int bpp = cs->bpp;
+	const struct weights_t * const w = cs->weights;
+
+	for ( ; x < cs->width; x += 2) {
+		const uint8_t * const a = s0 + x * bpp;
+		const uint8_t * const b = a + bpp;
+		const uint8_t * const c = s1 + x * bpp;
+		const uint8_t * const d = c + bpp;
+
+		y0[x] = luma(w->y, a);
+		y0[x + 1] = luma(w->y, b);
+		y1[x] = luma(w->y, c);
+		y1[x + 1] = luma(w->y, d);
+
+		const int sum[3] = {
+			a[0] + b[0] + c[0] + d[0],
+			a[1] + b[1] + c[1] + d[1],
+			a[2] + b[2] + c[2] + d[2]
+		};
+		u[x / 2] = chroma(w->u, sum);
+		v[x / 2] = chroma(w->v, sum);
+	}
+}
+
+static void rgbScalar(const struct colorspace_t * const cs, const uint8_t * const src[3], uint8_t * const dst[3], const unsigned int y)
+{
+	const uint8_t * const s0 = src[0] + (size_t)y * cs->layout.stride[0];
+	DST_ROWS(cs, dst, y);
+
+	rgbTail(cs, s0, s0 + cs->layout.stride[0], y0, y1, u, v, 0);
+}
+
+// NV12: luma as it is, chroma interleaved U, V
+static void nv12Tail(const struct colorspace_t * const cs, const uint8_t * const uv, uint8_t * const u, uint8_t * const v, unsigned int x)
+{
+	for ( ; x < cs->width / 2; x ++) {
+		u[x] = uv[2 * x];
+		v[x] = uv[2 * x + 1];
+	}
+}
+
+static void nv12Scalar(const struct colorspace_t * const cs, const uint8_t * const src[3], uint8_t * const dst[3], const unsigned int y)
+{
+	DST_ROWS(cs, dst, y);
+
+	memcpy(y0, src[0] + (size_t)y * cs->width, cs->width);
+	memcpy(y1, src[0] + (size_t)(y + 1) * cs->width, cs->width);
+	nv12Tail(cs, src[1] + (size_t)y / 2 * cs->width, u, v, 0);
+}
+
+// YUY2: Y0 U Y1 V for each pair of pixels, chroma averaged over both rows
+static void yuy2Tail(const struct colorspace_t * const cs, const uint8_t * const s0, const uint8_t * const s1, uint8_t * const y0, uint8_t * const y1, uint8_t * const u, uint8_t * const v, unsigned int x)
+{
+	for ( ; x < cs->width; x += 2) {
+		const uint8_t * const a = s0 + 2 * x;
+		const uint8_t * const b = s1 + 2 * x;
+
+		y0[x] = a[0];
+		y0[x + 1] = a[2];
+		y1[x] = b[0];
+		y1[x + 1] = b[2];
+		u[x / 2] = (a[1] + b[1] + 1) >> 1;
+		v[x / 2] = (a[3] + b[3] + 1) >> 1;
+	}
+}
+
+static void yuy2Scalar(const struct colorspace_t * const cs, const uint8_t * const src[3], uint8_t * const dst[3], const unsigned int y)
+{
+	const uint8_t * const s0 = src[0] + (size_t)y * cs->layout.stride[0];
+	DST_ROWS(cs, dst, y);
+
+	yuy2Tail(cs, s0, s0 + cs->layout.stride[0], y0, y1, u, v, 0);
+}
+
+#ifdef COLORSPACE_X86
+/* ************************************************************************ */
+// SSE2
+//  Pixels widen to 16 bits, and _mm_madd_epi16 weighs them two channels at
+//  a time: each sum then needs its other half added.  Results match the
+//  plain C versions exactly.
+
+// Weighted sums for four pixels, two in each of lo and hi (16 bits per channel)
+__attribute__((target("sse2")))
+static inline __m128i dotSSE2(const __m128i lo, const __m128i hi, const __m128i w)
+{
+	const __m128 a = _mm_castsi128_ps(_mm_madd_epi16(lo, w));
+	const __m128 b = _mm_castsi128_ps(_mm_madd_epi16(hi, w));
+
+	return _mm_add_epi32(
+		_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+		_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+// Channel sums of the 2x2 blocks in four pixels of two rows: two blocks
+__attribute__((target("sse2")))
+static inline __m128i blockSSE2(const __m128i a, const __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+	__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+	lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+	hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+
+	return _mm_unpacklo_epi64(lo, hi);
+}
+
+// Eight luma values from eight pixels
+__attribute__((target("sse2")))
+static inline __m128i lumaSSE2(const __m128i p0, const __m128i p1, const __m128i w)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(128);
+
+	const __m128i l0 = _mm_srai_epi32(_mm_add_epi32(dotSSE2(_mm_unpacklo_epi8(p0, zero), _mm_unpackhi_epi8(p0, zero), w), round), 8);
+	const __m128i l1 = _mm_srai_epi32(_mm_add_epi32(dotSSE2(_mm_unpacklo_epi8(p1, zero), _mm_unpackhi_epi8(p1, zero), w), round), 8);
+
+	return _mm_add_epi16(_mm_packs_epi32(l0, l1), _mm_set1_epi16(16));
+}
+
+// Four chroma values from the sums of four blocks
+__attribute__((target("sse2")))
+static inline __m128i chromaSSE2(const __m128i b0, const __m128i b1, const __m128i w)
+{
+	const __m128i c = _mm_srai_epi32(_mm_add_epi32(dotSSE2(b0, b1, w), _mm_set1_epi32(512)), 10);
+
+	return _mm_add_epi16(_mm_packs_epi32(c, c), _mm_set1_epi16(128));
+}
+
+// four bytes per pixel only
+__attribute__((target("sse2")))
+static void rgbSSE2(const struct colorspace_t * const cs, const uint8_t * const src[3], uint8_t * const dst[3], const unsigned int y)
+{
+	const uint8_t * const s0 = src[0] + (size_t)y * cs->layout.stride[0];
+	const uint8_t * const s1 = s0 + cs->layout.stride[0];
+	DST_ROWS(cs, dst, y);
+
+	const struct weights_t * const w = cs->weights;
+	const __m128i wy = _mm_set_epi16(w->y[3], w->y[2], w->y[1], w->y[0], w->y[3], w->y[2], w->y[1], w->y[0]);
+	const __m128i wu = _mm_set_epi16(w->u[3], w->u[2], w->u[1], w->u[0], w->u[3], w->u[2], w->u[1], w->u[0]);
+	const __m128i wv = _mm_set_epi16(w->v[3], w->v[2], w->v[1], w->v[0], w->v[3], w->v[2], w->v[1], w->v[0]);
+
+	unsigned int x = 0;
+	for ( ; x + 8 <= cs->width; x += 8) {
+		const __m128i a0 = _mm_loadu_si128((const __m128i *)(s0 + 4 * x));
+		const __m128i a1 = _mm_loadu_si128((const __m128i *)(s0 + 4 * x + 16));
+		const __m128i b0 = _mm_loadu_si128((const __m128i *)(s1 + 4 * x));
+		const __m128i b1 = _mm_loadu_si128((const __m128i *)(s1 + 4 * x + 16));
+
+		const __m128i l0 = lumaSSE2(a0, a1, wy);
+		const __m128i l1 = lumaSSE2(b0, b1, wy);
+		_mm_storel_epi64((__m128i *)(y0 + x), _mm_packus_epi16(l0, l0));
+		_mm_storel_epi64((__m128i *)(y1 + x), _mm_packus_epi16(l1, l1));
+
+		const __m128i k0 = blockSSE2(a0, b0);
+		const __m128i k1 = blockSSE2(a1, b1);
+		const __m128i cu = chromaSSE2(k0, k1, wu);
+		const __m128i cv = chromaSSE2(k0, k1, wv);
+		const uint32_t u4 = _mm_cvtsi128_si32(_mm_packus_epi16(cu, cu));
+		const uint32_t v4 = _mm_cvtsi128_si32(_mm_packus_epi16(cv, cv));
+		memcpy(u + x / 2, &u4, 4);
+		memcpy(v + x / 2, &v4, 4);
+	}
+
+	rgbTail(cs, s0, s1, y0, y1, u, v, x);
+}
+
+__attribute__((target("sse2")))
+static void nv12SSE2(const struct colorspace_t * const cs, const uint8_t * const src[3], uint8_t * const dst[3], const unsigned int y)
+{
+	const uint8_t * const uv = src[1] + (size_t)y / 2 * cs->width;
+	DST_ROWS(cs, dst, y);
+
+	memcpy(y0, src[0] + (size_t)y * cs->width, cs->width);
+	memcpy(y1, src[0] + (size_t)(y + 1) * cs->width, cs->width);
+
+	const __m128i low = _mm_set1_epi16(0x00FF);
+
+	unsigned int x = 0;
+	for ( ; x + 16 <= cs->width / 2; x += 16) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)(uv + 2 * x));
+		const __m128i b = _mm_loadu_si128((const __m128i *)(uv + 2 * x + 16));
+
+		_mm_storeu_si128((__m128i *)(u + x), _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+		_mm_storeu_si128((__m128i *)(v + x), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+	}
+
+	nv12Tail(cs, uv, u, v, x);
+}
+
+__attribute__((target("sse2")))
+static void yuy2SSE2(const struct colorspace_t * const cs, const uint8_t * const src[3], uint8_t * const dst[3], const unsigned int y)
+{
+	const uint8_t * const s0 = src[0] + (size_t)y * cs->layout.stride[0];
+	const uint8_t * const s1 = s0 + cs->layout.stride[0];
+	DST_ROWS(cs, dst, y);
+
+	const __m128i low = _mm_set1_epi16(0x00FF);
+	const __m128i zero = _mm_setzero_si128();
+
+	unsigned int x = 0;
+	for ( ; x + 16 <= cs->width; x += 16) {
+		const __m128i a0 = _mm_loadu_si128((const __m128i *)(s0 + 2 * x));
+		const __m128i a1 = _mm_loadu_si128((const __m128i *)(s0 + 2 * x + 16));
+		const __m128i b0 = _mm_loadu_si128((const __m128i *)(s1 + 2 * x));
+		const __m128i b1 = _mm_loadu_si128((const __m128i *)(s1 + 2 * x + 16));
+
+		_mm_storeu_si128((__m128i *)(y0 + x), _mm_packus_epi16(_mm_and_si128(a0, low), _mm_and_si128(a1, low)));
+		_mm_storeu_si128((__m128i *)(y1 + x), _mm_packus_epi16(_mm_and_si128(b0, low), _mm_and_si128(b1, low)));
+
+		// U V pairs, averaged over the rows
+		const __m128i c = _mm_packus_epi16(_mm_srli_epi16(_mm_avg_epu8(a0, b0), 8), _mm_srli_epi16(_mm_avg_epu8(a1, b1), 8));
+		_mm_storel_epi64((__m128i *)(u + x / 2), _mm_packus_epi16(_mm_and_si128(c, low), zero));
+		_mm_storel_epi64((__m128i *)(v + x / 2), _mm_packus_epi16(_mm_srli_epi16(c, 8), zero));
+	}
+
+	yuy2Tail(cs, s0, s1, y0, y1, u, v, x);
+}
+
+/* ************************************************************************ */
+// AVX2
+//  The same steps, twice as wide: most AVX2 instructions work on each 128-bit
+//  half separately, so results are put back in order where that matters.
+
+__attribute__((target("avx2")))
+static inline __m256i dotAVX2(const __m256i lo, const __m256i hi, const __m256i w)
+{
+	const __m256 a = _mm256_castsi256_ps(_mm256_madd_epi16(lo, w));
+	const __m256 b = _mm256_castsi256_ps(_mm256_madd_epi16(hi, w));
+
+	return _mm256_add_epi32(
+		_mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+		_mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+// eight pixels in, eight 32-bit luma values (without the +16) out, in order
+__attribute__((target("avx2")))
+static inline __m256i lumaAVX2(const __m256i p, const __m256i w)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	return _mm256_srai_epi32(_mm256_add_epi32(
+		dotAVX2(_mm256_unpacklo_epi8(p, zero), _mm256_unpackhi_epi8(p, zero), w),
+		_mm256_set1_epi32(128)), 8);
+}
+
+// eight pixels of two rows in, the sums of their four blocks out:
+//  the first two in the low half, the last two in the high half
+__attribute__((target("avx2")))
+static inline __m256i blockAVX2(const __m256i a, const __m256i b)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	__m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+	__m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+	lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+	hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+
+	return _mm256_unpacklo_epi64(lo, hi);
+}
+
+// eight chroma values, as bytes in the low 64 bits
+__attribute__((target("avx2")))
+static inline __m128i chromaAVX2(const __m256i k0, const __m256i k1, const __m256i w)
+{
+	// blocks 0 1 4 5 | 2 3 6 7: back in order
+	__m256i c = dotAVX2(k0, k1, w);
+	c = _mm256_permutevar8x32_epi32(c, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+	c = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_set1_epi32(512)), 10);
+
+	const __m128i c16 = _mm_add_epi16(
+		_mm_packs_epi32(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1)),
+		_mm_set1_epi16(128));
+	return _mm_packus_epi16(c16, c16);
+}
+
+// sixteen luma values as bytes, from two sets of eight
+__attribute__((target("avx2")))
+static inline __m128i packLumaAVX2(const __m256i l0, const __m256i l1)
+{
+	const __m128i sixteen = _mm_set1_epi16(16);
+	const __m128i a = _mm_add_epi16(_mm_packs_epi32(_mm256_castsi256_si128(l0), _mm256_extracti128_si256(l0, 1)), sixteen);
+	const __m128i b = _mm_add_epi16(_mm_packs_epi32(_mm256_castsi256_si128(l1), _mm256_extracti128_si256(l1, 1)), sixteen);
+
+	return _mm_packus_epi16(a, b);
+}
+
+__attribute__((target("avx2")))
+static void rgbAVX2(const struct colorspace_t * const cs, const uint8_t * const src[3], uint8_t * const dst[3], const unsigned int y)
+{
+	const uint8_t * const s0 = src[0] + (size_t)y * cs->layout.stride[0];
+	const uint8_t * const s1 = s0 + cs->layout.stride[0];
+	DST_ROWS(cs, dst, y);
+
+	const struct weights_t * const w = cs->weights;
+	int64_t wy, wu, wv;
+	memcpy(&wy, w->y, 8);
+	memcpy(&wu, w->u, 8);
+	memcpy(&wv, w->v, 8);
+	const __m256i vy = _mm256_set1_epi64x(wy);
+	const __m256i vu = _mm256_set1_epi64x(wu);
+	const __m256i vv = _mm256_set1_epi64x(wv);
+
+	unsigned int x = 0;
+	for ( ; x + 16 <= cs->width; x += 16) {
+		const __m256i a0 = _mm256_loadu_si256((const __m256i *)(s0 + 4 * x));
+		const __m256i a1 = _mm256_loadu_si256((const __m256i *)(s0 + 4 * x + 32));
+		const __m256i b0 = _mm256_loadu_si256((const __m256i *)(s1 + 4 * x));
+		const __m256i b1 = _mm256_loadu_si256((const __m256i *)(s1 + 4 * x + 32));
+
+		_mm_storeu_si128((__m128i *)(y0 + x), packLumaAVX2(lumaAVX2(a0, vy), lumaAVX2(a1, vy)));
+		_mm_storeu_si128((__m128i *)(y1 + x), packLumaAVX2(lumaAVX2(b0, vy), lumaAVX2(b1, vy)));
+
+		const __m256i k0 = blockAVX2(a0, b0);
+		const __m256i k1 = blockAVX2(a1, b1);
+		_mm_storel_epi64((__m128i *)(u + x / 2), chromaAVX2(k0, k1, vu));
+		_mm_storel_epi64((__m128i *)(v + x / 2), chromaAVX2(k0, k1, vv));
+	}
+
+	rgbTail(cs, s0, s1, y0, y1, u, v, x);
+}
+
+__attribute__((target("avx2")))
+static void nv12AVX2(const struct colorspace_t * const cs, const uint8_t * const src[3], uint8_t * const dst[3], const unsigned int y)
+{
+	const uint8_t * const uv = src[1] + (size_t)y / 2 * cs->width;
+	DST_ROWS(cs, dst, y);
+
+	memcpy(y0, src[0] + (size_t)y * cs->width, cs->width);
+	memcpy(y1, src[0] + (size_t)(y + 1) * cs->width, cs->width);
+
+	const __m256i low = _mm256_set1_epi16(0x00FF);
+
+	unsigned int x = 0;
+	for ( ; x + 32 <= cs->width / 2; x += 32) {
+		const __m256i a = _mm256_loadu_si256((const __m256i *)(uv + 2 * x));
+		const __m256i b = _mm256_loadu_si256((const __m256i *)(uv + 2 * x + 32));
+
+		// packing works per half: a0 b0 a1 b1, so swap the middle quarters
+		const __m256i cu = _mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low));
+		const __m256i cv = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+		_mm256_storeu_si256((__m256i *)(u + x), _mm256_permute4x64_epi64(cu, _MM_SHUFFLE(3, 1, 2, 0)));
+		_mm256_storeu_si256((__m256i *)(v + x), _mm256_permute4x64_epi64(cv, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+
+	nv12Tail(cs, uv, u, v, x);
+}
+
+__attribute__((target("avx2")))
+static void yuy2AVX2(const struct colorspace_t * const cs, const uint8_t * const src[3], uint8_t * const dst[3], const unsigned int y)
+{
+	const uint8_t * const s0 = src[0] + (size_t)y * cs->layout.stride[0];
+	const uint8_t * const s1 = s0 + cs->layout.stride[0];
+	DST_ROWS(cs, dst, y);
+
+	const __m256i low = _mm256_set1_epi16(0x00FF);
+
+	unsigned int x = 0;
+	for ( ; x + 32 <= cs->width; x += 32) {
+		const __m256i a0 = _mm256_loadu_si256((const __m256i *)(s0 + 2 * x));
+		const __m256i a1 = _mm256_loadu_si256((const __m256i *)(s0 + 2 * x + 32));
+		const __m256i b0 = _mm256_loadu_si256((const __m256i *)(s1 + 2 * x));
+		const __m256i b1 = _mm256_loadu_si256((const __m256i *)(s1 + 2 * x + 32));
+
+		const __m256i l0 = _mm256_packus_epi16(_mm256_and_si256(a0, low), _mm256_and_si256(a1, low));
+		const __m256i l1 = _mm256_packus_epi16(_mm256_and_si256(b0, low), _mm256_and_si256(b1, low));
+		_mm256_storeu_si256((__m256i *)(y0 + x), _mm256_permute4x64_epi64(l0, _MM_SHUFFLE(3, 1, 2, 0)));
+		_mm256_storeu_si256((__m256i *)(y1 + x), _mm256_permute4x64_epi64(l1, _MM_SHUFFLE(3, 1, 2, 0)));
+
+		// U V pairs, averaged over the rows and put in order
+		__m256i c = _mm256_packus_epi16(_mm256_srli_epi16(_mm256_avg_epu8(a0, b0), 8), _mm256_srli_epi16(_mm256_avg_epu8(a1, b1), 8));
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(3, 1, 2, 0));
+
+		// sixteen of each: the low half of each pack holds eight
+		const __m256i cu = _mm256_packus_epi16(_mm256_and_si256(c, low), _mm256_setzero_si256());
+		const __m256i cv = _mm256_packus_epi16(_mm256_srli_epi16(c, 8), _mm256_setzero_si256());
+		_mm_storeu_si128((__m128i *)(u + x / 2), _mm256_castsi256_si128(_mm256_permute4x64_epi64(cu, _MM_SHUFFLE(3, 1, 2, 0))));
+		_mm_storeu_si128((__m128i *)(v + x / 2), _mm256_castsi256_si128(_mm256_permute4x64_epi64(cv, _MM_SHUFFLE(3, 1, 2, 0))));
+	}
+
+	yuy2Tail(cs, s0, s1, y0, y1, u, v, x);
+}
+#endif
+
+/* ************************************************************************ */
+// The best kernel this CPU runs
+static int cpuKernel()
+{
+#ifdef COLORSPACE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return COLORSPACE_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return COLORSPACE_SSE2;
+#endif
+	return COLORSPACE_SCALAR;
+}
+
+// Convert the row pairs of one band
+static void convertBand(const struct colorspace_t * const cs, const unsigned int band)
+{
+	const unsigned int first = band * cs->band_rows;
+	const unsigned int last = (first + cs->band_rows < cs->height ? first + cs->band_rows : cs->height);
+
+	for (unsigned int y = first; y < last; y += 2)
+		cs->rows(cs, cs->src, cs->dst, y);
+}
+
+static void * threadBand(void * const arg)
+{
+	struct colorspace_t * const cs = arg;
+
+	pthread_mutex_lock(&cs->lock);
+	// which thread this is: the order they were started in
+	const unsigned int band = ++ cs->pending;
+	unsigned long generation = 0;
+
+	for (;;) {
+		while (cs->generation == generation && ! cs->quit)
+			pthread_cond_wait(&cs->start, &cs->lock);
+		if (cs->quit)
+			break;
+		generation = cs->generation;
+
+		pthread_mutex_unlock(&cs->lock);
+		convertBand(cs, band);
+		pthread_mutex_lock(&cs->lock);
+
+		if (-- cs->pending == 0)
+			pthread_cond_signal(&cs->done);
+	}
+
+	pthread_mutex_unlock(&cs->lock);
+	return NULL;
+}
+
+int colorspace_layout(const int format, const unsigned int width, const unsigned int height, struct colorspace_layout_t * const l)
+{
+	memset(l, 0, sizeof(struct colorspace_layout_t));
+
+	switch (format) {
+	case COLORSPACE_I420:
+		l->planes = 3;
+		l->stride[0] = width;
+		l->rows[0] = height;
+		l->stride[1] = l->stride[2] = width / 2;
+		l->rows[1] = l->rows[2] = height / 2;
+		break;
+	case COLORSPACE_NV12:
+		l->planes = 2;
+		l->stride[0] = l->stride[1] = width;
+		l->rows[0] = height;
+		l->rows[1] = height / 2;
+		break;
+	case COLORSPACE_YUY2:
+		l->planes = 1;
+		l->stride[0] = 2 * width;
+		l->rows[0] = height;
+		break;
+	case COLORSPACE_RGB24:
+		l->planes = 1;
+		l->stride[0] = 3 * width;
+		l->rows[0] = height;
+		break;
+	case COLORSPACE_RGBA:
+	case COLORSPACE_BGRA:
+		l->planes = 1;
+		l->stride[0] = 4 * width;
+		l->rows[0] = height;
+		break;
+	default:
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < l->planes; i ++) {
+		l->offset[i] = l->size;
+		l->size += (size_t)l->stride[i] * l->rows[i];
+	}
+
+	return 1;
+}
+
+struct colorspace_t * colorspace_create(const int format, const unsigned int width, const unsigned int height, const int kernel, const unsigned int threads)
+{
+	if (width % 2 || height % 2 || width == 0 || height == 0) {
+		fprintf(stderr, "librtmpcast: ERROR: colorspace: frame size must be even, not %ux%u\n", width, height);
+		return NULL;
+	}
+
+	// create a structure
+	struct colorspace_t * cs = malloc(sizeof(struct colorspace_t));
+	if (cs == NULL) {
+		perror("librtmpcast: ERROR: colorspace::colorspace_create: malloc() returned NULL");
+		return NULL;
+	}
+
+	if (format == COLORSPACE_I420 || ! colorspace_layout(format, width, height, &cs->layout)) {
+		fprintf(stderr, "librtmpcast: ERROR: colorspace: cannot convert from format %d\n", format);
+		free(cs);
+		return NULL;
+	}
+
+	cs->format = format;
+	cs->width = width;
+	cs->height = height;
+	cs->bpp = (format == COLORSPACE_RGB24 ? 3 : 4);
+	cs->weights = (format == COLORSPACE_BGRA ? &weights_bgr : &weights_rgb);
+
+	cs->kernel = cpuKernel();
+	if (kernel >= 0 && kernel < cs->kernel)
+		cs->kernel = kernel;
+
+	// RGB24 has no SIMD kernel: three-byte pixels do not split evenly
+	switch (format) {
+	case COLORSPACE_NV12: cs->rows = nv12Scalar; break;
+	case COLORSPACE_YUY2: cs->rows = yuy2Scalar; break;
+	default: cs->rows = rgbScalar; break;
+	}
+	if (format == COLORSPACE_RGB24)
+		cs->kernel = COLORSPACE_SCALAR;
+#ifdef COLORSPACE_X86
+	if (cs->kernel == COLORSPACE_SSE2) {
+		switch (format) {
+		case COLORSPACE_NV12: cs->rows = nv12SSE2; break;
+		case COLORSPACE_YUY2: cs->rows = yuy2SSE2; break;
+		case COLORSPACE_RGBA:
+		case COLORSPACE_BGRA: cs->rows = rgbSSE2; break;
+		}
+	} else if (cs->kernel == COLORSPACE_AVX2) {
+		switch (format) {
+		case COLORSPACE_NV12: cs->rows = nv12AVX2; break;
+		case COLORSPACE_YUY2: cs->rows = yuy2AVX2; break;
+		case COLORSPACE_RGBA:
+		case COLORSPACE_BGRA: cs->rows = rgbAVX2; break;
+		}
+	}
+#endif
+
+	// bands of whole row pairs, no more of them than there are pairs
+	cs->bands = (threads > 1 ? threads : 1);
+	if (cs->bands > height / 2)
+		cs->bands = height / 2;
+	cs->band_rows = (height / 2 + cs->bands - 1) / cs->bands * 2;
+
+	cs->thread = NULL;
+	cs->generation = 0;
+	cs->pending = 0;
+	cs->quit = 0;
+	pthread_mutex_init(&cs->lock, NULL);
+	pthread_cond_init(&cs->start, NULL);
+	pthread_cond_init(&cs->done, NULL);
+
+	if (cs->bands > 1) {
+		cs->thread = malloc((cs->bands - 1) * sizeof(pthread_t));
+		if (cs->thread == NULL) {
+			perror("librtmpcast: ERROR: colorspace::colorspace_create: malloc() returned NULL");
+			cs->bands = 1;
+		}
+	}
+
+	// if a thread cannot start, the bands are redrawn for the ones that did
+	for (unsigned int i = 0; i + 1 < cs->bands; i ++) {
+		if (pthread_create(&cs->thread[i], NULL, threadBand, cs) != 0) {
+			fputs("librtmpcast: WARNING: colorspace: could not start all conversion threads\n", stderr);
+			cs->bands = i + 1;
+			cs->band_rows = (height / 2 + cs->bands - 1) / cs->bands * 2;
+			break;
+		}
+	}
+
+	// wait until every thread has taken its band number
+	pthread_mutex_lock(&cs->lock);
+	while (cs->pending < cs->bands - 1) {
+		pthread_mutex_unlock(&cs->lock);
+		sched_yield();
+		pthread_mutex_lock(&cs->lock);
+	}
+	cs->pending = 0;
+	pthread_mutex_unlock(&cs->lock);
+
+	return cs;
+}
+
+int colorspace_kernel(const struct colorspace_t * const cs)
+{
+	return cs->kernel;
+}
+
+void colorspace_convert(struct colorspace_t * const cs, const uint8_t * const src[3], uint8_t * const dst[3])
+{
+	for (int i = 0; i < 3; i ++) {
+		cs->src[i] = src[i];
+		cs->dst[i] = dst[i];
+	}
+
+	if (cs->bands == 1) {
+		convertBand(cs, 0);
+		return;
+	}
+
+	// start the other bands, do the first one here, then wait for the rest
+	pthread_mutex_lock(&cs->lock);
+	cs->pending = cs->bands - 1;
+	cs->generation ++;
+	pthread_cond_broadcast(&cs->start);
+	pthread_mutex_unlock(&cs->lock);
+
+	convertBand(cs, 0);
+
+	pthread_mutex_lock(&cs->lock);
+	while (cs->pending > 0)
+		pthread_cond_wait(&cs->done, &cs->lock);
+	pthread_mutex_unlock(&cs->lock);
+}
+
+void colorspace_close(struct colorspace_t * const cs)
+{
+	pthread_mutex_lock(&cs->lock);
+	cs->quit = 1;
+	pthread_cond_broadcast(&cs->start);
+	pthread_mutex_unlock(&cs->lock);
+
+	for (unsigned int i = 0; i + 1 < cs->bands; i ++)
+		pthread_join(cs->thread[i], NULL);
+
+	pthread_cond_destroy(&cs->done);
+	pthread_cond_destroy(&cs->start);
+	pthread_mutex_destroy(&cs->lock);
+	free(cs->thread);
+	free(cs);
+}
@@ -0,0 +1,53 @@
+#ifndef RTMPCAST_COLORSPACE_H
+#define RTMPCAST_COLORSPACE_H
+
+// Conversion of application frames to the planar I420 the encoder takes.
+//  RGB goes through BT.601 limited range, as x264 assumes; chroma is the
+//  average of each 2x2 block.  Kernels use SSE2 or AVX2 when the CPU has
+//  them (checked at runtime), else plain C.  A frame can be split across
+//  threads by bands of rows.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// pixel formats, same values as RTMPCAST_FORMAT_*
+#define COLORSPACE_I420 0
+#define COLORSPACE_NV12 1
+#define COLORSPACE_YUY2 2
+#define COLORSPACE_RGB24 3
+#define COLORSPACE_RGBA 4
+#define COLORSPACE_BGRA 5
+
+// kernels, best last
+#define COLORSPACE_SCALAR 0
+#define COLORSPACE_SSE2 1
+#define COLORSPACE_AVX2 2
+
+// Where each plane of a frame lies in one buffer: byte offset, bytes per
+//  row and rows.  Planes past the format's count are empty.
+struct colorspace_layout_t {
+	unsigned int planes;
+	size_t offset[3];
+	unsigned int stride[3];
+	unsigned int rows[3];
+	// the whole frame
+	size_t size;
+};
+
+// Returns 0 for an unknown format
+int colorspace_layout(int format, unsigned int width, unsigned int height, struct colorspace_layout_t * layout);
+
+struct colorspace_t;
+
+// A converter from format (not I420) for frames of one size, which must be
+//  even.  kernel caps the instruction set (-1 for the best there is), and
+//  threads is how many bands each frame is split into (0 or 1 for none).
+struct colorspace_t * colorspace_create(int format, unsigned int width, unsigned int height, int kernel, unsigned int threads);
+// The kernel in use (COLORSPACE_SCALAR etc.)
+int colorspace_kernel(const struct colorspace_t * cs);
+// Convert one frame: src planes as colorspace_layout describes, into dst
+//  (I420, strides width and width / 2)
+void colorspace_convert(struct colorspace_t * cs, const uint8_t * const src[3], uint8_t * const dst[3]);
+void colorspace_close(struct colorspace_t * cs);
+
+#endif
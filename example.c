@@ -34,7 +34,7 @@ static unsigned int frame_number = 0;
 static unsigned int audio_packet_number = 0;
 // Flag to indicate whether we should keep playing the movie
 //  Set to 0 to close the program
-static int running;
+static volatile sig_atomic_t running;
 // replacement signal handler that sets running to 0 for clean shutdown
 static void sig_handler(int signum)
 {
@@ -108,6 +108,9 @@ int main(int argc, char * argv[])
 	param.audio.channels = AUDIO_CHANNELS;
 	param.audio.bitrate = AUDIO_BITRATE;
 
+	// librtmp's own connection messages (process-wide, so set here, once)
+	rtmpcast_set_log_level(RTMPCAST_LOG_INFO);
+
 	// All done setting up params!  Let's create the rtmpcast object.
 	struct rtmpcast_t * rtmpcast = rtmpcast_init(&param);
 
@@ -133,19 +136,14 @@ int main(int argc, char * argv[])
 
 	/* *************************************************** */
 	// Ready to start throwing frames at the streamer
-	while (running) {
-		double delay = rtmpcast_update(rtmpcast);
-
-		if (delay < 0) {
-			// a negative return value indicates an error
-			fputs("Update failed on rtmpcast object.", stderr);
-			rtmpcast_close(rtmpcast);
-			return EXIT_SUCCESS;
-		}
-
-		// sleep for delay ms
-		fprintf(stderr, "Sleeping for %lf seconds\n", delay);
-		usleep(delay * 1000000);
+	//  rtmpcast_run sleeps until the next frame is due, or the server has
+	//  something for us.  To use your own event loop instead, call
+	//  rtmpcast_update whenever rtmpcast_get_pollfds / rtmpcast_get_deadline say so.
+	if (! rtmpcast_run(rtmpcast, &running)) {
+		// an error ended the stream
+		fputs("Update failed on rtmpcast object.", stderr);
+		rtmpcast_close(rtmpcast);
+		return EXIT_SUCCESS;
 	}
 
 	// User has decided to shut down - or the streamer crashed.
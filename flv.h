@@ -0,0 +1,138 @@
+#ifndef RTMPCAST_FLV_H
+#define RTMPCAST_FLV_H
+
+// Serializers for FLV tags and the AMF values inside them.
+//  Shared by the muxer and the RTMP chunk writer.
+
+#include <stdint.h>
+#include <string.h>
+
+// write big-endian values to memory area
+static inline uint8_t * u16be(uint8_t * const p, const uint16_t value) {
+	*p = value >> 8 & 0xFF;
+	*(p + 1) = value & 0xFF;
+	return p + 2;
+}
+static inline uint8_t * u24be(uint8_t * const p, const uint32_t value) {
+	*p = value >> 16 & 0xFF;
+	*(p + 1) = value >> 8 & 0xFF;
+	*(p + 2) = value & 0xFF;
+	return p + 3;
+}
+static inline uint8_t * u32be(uint8_t * const p, const uint32_t value) {
+	*p = value >> 24 & 0xFF;
+	*(p + 1) = value >> 16 & 0xFF;
+	*(p + 2) = value >> 8 & 0xFF;
+	*(p + 3) = value & 0xFF;
+	return p + 4;
+}
+
+// repack a host-native double as big-endian IEEE 754 double
+//  through its bit pattern as an integer, so no byte order test is needed
+static inline uint8_t * f64be(uint8_t * const p, const double input) {
+	uint64_t value;
+	memcpy(&value, &input, 8);
+
+	p[0] = value >> 56 & 0xFF;
+	p[1] = value >> 48 & 0xFF;
+	p[2] = value >> 40 & 0xFF;
+	p[3] = value >> 32 & 0xFF;
+	p[4] = value >> 24 & 0xFF;
+	p[5] = value >> 16 & 0xFF;
+	p[6] = value >> 8 & 0xFF;
+	p[7] = value & 0xFF;
+	return p + 8;
+}
+
+// "pascal" string (uint16 strlen, string content)
+static inline uint8_t * pstring(uint8_t * p, const char * const str) {
+	uint16_t string_length = strlen(str);
+	p = u16be(p, string_length);
+	memcpy(p, str, string_length);
+	return p + string_length;
+}
+
+// AMF (Action Message Format) serializers
+static inline uint8_t * amf_number(uint8_t * const p, const double value) {
+	*p = 0x00;
+	return f64be(p + 1, value);
+}
+static inline uint8_t * amf_boolean(uint8_t * const p, const uint8_t value) {
+	*p = 0x01;
+	*(p+1) = (value ? 1 : 0);
+	return p + 2;
+}
+static inline uint8_t * amf_string(uint8_t * const p, const char * const str) {
+	*p = 0x02;
+	return pstring(p + 1, str);
+}
+static inline uint8_t * amf_ecma_array(uint8_t * const p, const uint32_t entries) {
+	*p = 0x08;
+	return u32be(p + 1, entries);
+}
+static inline uint8_t * amf_ecma_array_end(uint8_t * const p) {
+	return u24be(p, 0x000009);
+}
+static inline uint8_t * amf_ecma_array_entry(uint8_t * const p, const char * const str, const double value) {
+	return amf_number(pstring(p, str), value);
+}
+static inline uint8_t * amf_object(uint8_t * const p) {
+	*p = 0x03;
+	return p + 1;
+}
+static inline uint8_t * amf_object_end(uint8_t * const p) {
+	return u24be(p, 0x000009);
+}
+// entries follow, each a bare value (no name)
+static inline uint8_t * amf_strict_array(uint8_t * const p, const uint32_t entries) {
+	*p = 0x0A;
+	return u32be(p + 1, entries);
+}
+
+/* ************************************************************************ */
+// sets up the first 11 bytes of a tag
+//  returns pointer to the start of payload area
+static inline uint8_t * flv_TagHeader(uint8_t * p, const uint8_t type, const uint32_t timestamp)
+{
+	*p = type; p ++; // message type
+	// tag[1 - 3] are the message size, which we don't know yet
+	p += 3;
+
+	// FLV timestamp is written in an odd format
+	p = u24be(p, timestamp & 0x00FFFFFF);
+	*p = timestamp >> 24 & 0xFF; p ++;
+
+	return u24be(p, 0); // stream ID
+}
+
+// Finishes a tag (corrects Payload Size in bytes 1-3, and appends Tag Size)
+//  Returns complete tag size, ready for writing
+static inline uint32_t flv_TagFinish(uint8_t * tag, uint8_t * p)
+{
+	uint32_t payloadSize = p - (tag + 11);
+	u24be(tag + 1, payloadSize);
+	u32be(p, 11 + payloadSize);
+
+	return 11 + payloadSize + 4;
+}
+
+// Reads back the timestamp written by flv_TagHeader
+static inline uint32_t flv_TagTimestamp(const uint8_t * const tag)
+{
+	return (uint32_t)tag[7] << 24 | (uint32_t)tag[4] << 16 | (uint32_t)tag[5] << 8 | tag[6];
+}
+
+// FLV Video Packet (AVC format)
+//  Composition Time is 0 for all-I frames, but otherwise should be the time diff. between PTS and DTS
+static inline uint8_t * flv_AVCVideoPacket(uint8_t * const p, const unsigned int keyframe, const uint8_t type, const long composition_time)
+{
+	if (keyframe)
+		*p = 0x17;
+	else
+		*p = 0x27;
+
+	*(p + 1) = type;
+	return u24be(p + 2, composition_time);
+}
+
+#endif
@@ -0,0 +1,483 @@
+/* ***************************************************
+librtmpcast host:
+Many streams in one process, on one event loop and a shared pool of
+  workers.  Built on the public stream API only: a worker runs
+  rtmpcast_update for one stream at a time, and the loop watches what
+  rtmpcast_get_pollfds says to.
+
+Greg Kennedy 2021
+*************************************************** */
+
+#include "rtmpcast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// events taken from epoll at once
+#define HOST_EVENTS 64
+// epoll ids: 0 is the host's own wake fd.  A stream's is its slot in the
+//  table (low 32 bits) and a serial number counting up from 1 (high 32),
+//  so an event still in flight for a stream removed since finds its slot
+//  empty, or holding another stream
+#define HOST_WAKE 0
+#define HOST_SLOT(id) ((uint32_t)(id))
+
+struct host_stream_t {
+	struct rtmpcast_t * rtmpcast;
+	uint64_t id;
+
+	// when the next update is due (CLOCK_MONOTONIC seconds), and where
+	//  the stream sits in the heap (-1 while out of it)
+	double deadline;
+	int slot;
+
+	// being updated by a worker; an fd was ready meanwhile
+	int running;
+	int woken;
+	// out of the schedule for good
+	int removed;
+	int failed;
+
+	// what rtmpcast_get_pollfds last gave (worker side only)
+	struct pollfd * fds;
+	int fd_max;
+};
+
+struct rtmpcast_host_t {
+	pthread_mutex_t lock;
+	// workers wait on cond for work; remove waits on done for a worker
+	pthread_cond_t cond;
+	pthread_cond_t done;
+	int stopping;
+	// the deadline a worker is already waiting for (INFINITY for none):
+	//  the others only wait for it if nothing is due sooner
+	double keeping;
+
+	void (* on_error)(struct rtmpcast_t *, void *);
+	void * user;
+
+	// every stream added, and those waiting for an update: a min-heap on
+	//  deadline, so the earliest deadline always goes first
+	struct host_stream_t ** streams;
+	unsigned int stream_count, stream_max;
+	struct host_stream_t ** heap;
+	unsigned int heap_size;
+	// streams by slot, for the loop to find from an event; and the slots
+	//  freed by removes, to use again first
+	struct host_stream_t ** table;
+	unsigned int table_used;
+	unsigned int * vacant;
+	unsigned int vacant_count;
+	uint64_t next_serial;
+
+	int epfd;
+	int wake;
+	pthread_t loop;
+	int looping;
+	pthread_t * workers;
+	unsigned int worker_count;
+};
+
+static double getTimestamp() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+static struct timespec toTimespec(const double seconds) {
+	struct timespec ts;
+	ts.tv_sec = seconds;
+	ts.tv_nsec = (seconds - ts.tv_sec) * 1000000000;
+	if (ts.tv_nsec >= 1000000000) ts.tv_nsec = 999999999;
+	return ts;
+}
+
+/* ************************************************************************ */
+// Deadline heap.  Call with the lock held.
+static void heapSet(struct rtmpcast_host_t * const h, const unsigned int i, struct host_stream_t * const s)
+{
+	h->heap[i] = s;
+	s->slot = i;
+}
+
+static void heapUp(struct rtmpcast_host_t * const h, unsigned int i)
+{
+	struct host_stream_t * const s = h->heap[i];
+	while (i > 0 && h->heap[(i - 1) / 2]->deadline > s->deadline) {
+		heapSet(h, i, h->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heapSet(h, i, s);
+}
+
+static void heapDown(struct rtmpcast_host_t * const h, unsigned int i)
+{
+	struct host_stream_t * const s = h->heap[i];
+	for (;;) {
+		unsigned int child = 2 * i + 1;
+		if (child >= h->heap_size)
+			break;
+		if (child + 1 < h->heap_size && h->heap[child + 1]->deadline < h->heap[child]->deadline)
+			child ++;
+		if (h->heap[child]->deadline >= s->deadline)
+			break;
+		heapSet(h, i, h->heap[child]);
+		i = child;
+	}
+	heapSet(h, i, s);
+}
+
+// the heap has room for every stream, so this cannot fail
+static void heapPush(struct rtmpcast_host_t * const h, struct host_stream_t * const s)
+{
+	heapSet(h, h->heap_size ++, s);
+	heapUp(h, s->slot);
+}
+
+static void heapRemove(struct rtmpcast_host_t * const h, struct host_stream_t * const s)
+{
+	const unsigned int i = s->slot;
+	s->slot = -1;
+	h->heap_size --;
+	if (i == h->heap_size)
+		return;
+
+	// the last one fills the gap, and moves whichever way it has to
+	heapSet(h, i, h->heap[h->heap_size]);
+	heapUp(h, i);
+	heapDown(h, i);
+}
+
+// removed since, if not found
+static struct host_stream_t * findStream(const struct rtmpcast_host_t * const h, const uint64_t id)
+{
+	const uint32_t slot = HOST_SLOT(id);
+	if (slot >= h->table_used)
+		return NULL;
+
+	struct host_stream_t * const s = h->table[slot];
+	return (s && s->id == id ? s : NULL);
+}
+
+/* ************************************************************************ */
+// Worker side: (re)arm the stream's fds with the loop, one shot each, so
+//  a ready fd wakes the loop once per update instead of until it is read.
+//  A socket closed since is already gone from epoll, and a new one may be
+//  on the same number, so nothing is removed here.
+static void watchStream(struct rtmpcast_host_t * const h, struct host_stream_t * const s)
+{
+	int n = rtmpcast_get_pollfds(s->rtmpcast, s->fds, s->fd_max);
+	if (n > s->fd_max) {
+		struct pollfd * fds = realloc(s->fds, n * sizeof(struct pollfd));
+		if (fds == NULL) {
+			perror("librtmpcast: ERROR: host::watchStream: realloc() returned NULL");
+			n = s->fd_max;
+		} else {
+			s->fds = fds;
+			s->fd_max = n;
+			n = rtmpcast_get_pollfds(s->rtmpcast, s->fds, s->fd_max);
+		}
+	}
+
+	for (int i = 0; i < n; i ++) {
+		struct epoll_event ev;
+		ev.events = EPOLLONESHOT | (s->fds[i].events & POLLIN ? EPOLLIN : 0) | (s->fds[i].events & POLLOUT ? EPOLLOUT : 0);
+		ev.data.u64 = s->id;
+
+		if (epoll_ctl(h->epfd, EPOLL_CTL_MOD, s->fds[i].fd, &ev) == -1 &&
+			! (errno == ENOENT && epoll_ctl(h->epfd, EPOLL_CTL_ADD, s->fds[i].fd, &ev) == 0))
+			perror("librtmpcast: ERROR: host::watchStream: epoll_ctl() failed");
+	}
+}
+
+static void * threadWorker(void * const arg)
+{
+	struct rtmpcast_host_t * const h = arg;
+
+	pthread_mutex_lock(&h->lock);
+	while (! h->stopping) {
+		// nothing to do, or nothing due: one worker sleeps until the
+		//  earliest deadline, the rest until they are woken.  A stream
+		//  due sooner than the one being waited for gets a worker of its
+		//  own to wait for it.
+		if (h->heap_size == 0 || (h->heap[0]->deadline > getTimestamp() && h->heap[0]->deadline >= h->keeping)) {
+			pthread_cond_wait(&h->cond, &h->lock);
+			continue;
+		}
+		if (h->heap[0]->deadline > getTimestamp()) {
+			const double deadline = h->heap[0]->deadline;
+			const struct timespec until = toTimespec(deadline);
+			h->keeping = deadline;
+			pthread_cond_timedwait(&h->cond, &h->lock, &until);
+			if (h->keeping == deadline)
+				h->keeping = INFINITY;
+			continue;
+		}
+
+		struct host_stream_t * const s = h->heap[0];
+		heapRemove(h, s);
+		s->running = 1;
+		// someone else keeps time for what is left
+		if (h->heap_size)
+			pthread_cond_signal(&h->cond);
+		pthread_mutex_unlock(&h->lock);
+
+		const int ok = (rtmpcast_update(s->rtmpcast) >= 0);
+		struct timespec deadline;
+		rtmpcast_get_deadline(s->rtmpcast, &deadline);
+		if (ok)
+			watchStream(h, s);
+
+		pthread_mutex_lock(&h->lock);
+		s->running = 0;
+		if (! ok)
+			s->failed = 1;
+		else if (! s->removed) {
+			// something became ready while updating: go again straight away
+			s->deadline = (s->woken ? 0 : deadline.tv_sec + deadline.tv_nsec / 1000000000.);
+			s->woken = 0;
+			heapPush(h, s);
+			// due before what the timekeeper waits for: wake a worker
+			if (s->slot == 0)
+				pthread_cond_signal(&h->cond);
+		}
+		pthread_cond_broadcast(&h->done);
+
+		// after this, the stream is the application's to remove
+		if (! ok && h->on_error && ! s->removed) {
+			struct rtmpcast_t * const r = s->rtmpcast;
+			pthread_mutex_unlock(&h->lock);
+			h->on_error(r, h->user);
+			pthread_mutex_lock(&h->lock);
+		}
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	return NULL;
+}
+
+// The event loop: a ready fd makes its stream due now
+static void * threadLoop(void * const arg)
+{
+	struct rtmpcast_host_t * const h = arg;
+
+	for (;;) {
+		struct epoll_event events[HOST_EVENTS];
+		const int n = epoll_wait(h->epfd, events, HOST_EVENTS, -1);
+		if (n == -1 && errno != EINTR) {
+			perror("librtmpcast: ERROR: host::threadLoop: epoll_wait() failed");
+			return NULL;
+		}
+
+		pthread_mutex_lock(&h->lock);
+		if (h->stopping) {
+			pthread_mutex_unlock(&h->lock);
+			return NULL;
+		}
+
+		const double now = getTimestamp();
+		for (int i = 0; i < n; i ++) {
+			struct host_stream_t * const s = (events[i].data.u64 == HOST_WAKE ? NULL : findStream(h, events[i].data.u64));
+			if (s == NULL)
+				continue;
+
+			if (s->running)
+				s->woken = 1;
+			else if (s->slot >= 0 && s->deadline > now) {
+				s->deadline = now;
+				heapUp(h, s->slot);
+			}
+		}
+		pthread_cond_signal(&h->cond);
+		pthread_mutex_unlock(&h->lock);
+	}
+}
+
+/* ************************************************************************ */
+struct rtmpcast_host_t * rtmpcast_host_create (unsigned int workers, void (* on_error)(struct rtmpcast_t *, void *), void * user)
+{
+	if (workers == 0) {
+		const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = (cores > 0 ? cores : 1);
+	}
+
+	// create a structure
+	struct rtmpcast_host_t * h = calloc(1, sizeof(struct rtmpcast_host_t));
+	if (h == NULL) {
+		perror("librtmpcast: ERROR: host::rtmpcast_host_create: calloc() returned NULL");
+		return NULL;
+	}
+
+	h->on_error = on_error;
+	h->user = user;
+	h->next_serial = 1;
+	h->keeping = INFINITY;
+	h->workers = calloc(workers, sizeof(pthread_t));
+	h->epfd = epoll_create1(EPOLL_CLOEXEC);
+	h->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	// deadlines are on CLOCK_MONOTONIC, so the timed waits are too
+	pthread_condattr_t attr;
+	int ok = (h->workers && h->epfd != -1 && h->wake != -1 && pthread_condattr_init(&attr) == 0);
+	if (ok) {
+		ok = (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0 &&
+			pthread_mutex_init(&h->lock, NULL) == 0 &&
+			pthread_cond_init(&h->cond, &attr) == 0 &&
+			pthread_cond_init(&h->done, NULL) == 0);
+		pthread_condattr_destroy(&attr);
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = HOST_WAKE;
+	if (! ok || epoll_ctl(h->epfd, EPOLL_CTL_ADD, h->wake, &ev) == -1) {
+		fputs("librtmpcast: ERROR: host::rtmpcast_host_create: setup failed\n", stderr);
+		if (h->wake != -1) close(h->wake);
+		if (h->epfd != -1) close(h->epfd);
+		free(h->workers);
+		free(h);
+		return NULL;
+	}
+
+	if (pthread_create(&h->loop, NULL, threadLoop, h) != 0) {
+		fputs("librtmpcast: ERROR: host::rtmpcast_host_create: pthread_create() failed\n", stderr);
+		rtmpcast_host_close(h);
+		return NULL;
+	}
+	h->looping = 1;
+	for (unsigned int i = 0; i < workers; i ++) {
+		if (pthread_create(&h->workers[i], NULL, threadWorker, h) != 0) {
+			fputs("librtmpcast: ERROR: host::rtmpcast_host_create: pthread_create() failed\n", stderr);
+			rtmpcast_host_close(h);
+			return NULL;
+		}
+		h->worker_count = i + 1;
+	}
+
+	return h;
+}
+
+int rtmpcast_host_add (struct rtmpcast_host_t * h, struct rtmpcast_t * r)
+{
+	struct host_stream_t * s = calloc(1, sizeof(struct host_stream_t));
+	if (s == NULL) {
+		perror("librtmpcast: ERROR: host::rtmpcast_host_add: calloc() returned NULL");
+		return 0;
+	}
+	s->rtmpcast = r;
+	s->slot = -1;
+
+	pthread_mutex_lock(&h->lock);
+
+	// the heap and the table have room for every stream
+	if (h->stream_count == h->stream_max) {
+		const unsigned int max = (h->stream_max ? 2 * h->stream_max : 16);
+		struct host_stream_t ** streams = realloc(h->streams, max * sizeof(struct host_stream_t *));
+		if (streams)
+			h->streams = streams;
+		struct host_stream_t ** heap = (streams ? realloc(h->heap, max * sizeof(struct host_stream_t *)) : NULL);
+		if (heap)
+			h->heap = heap;
+		struct host_stream_t ** table = (heap ? realloc(h->table, max * sizeof(struct host_stream_t *)) : NULL);
+		if (table)
+			h->table = table;
+		unsigned int * vacant = (table ? realloc(h->vacant, max * sizeof(unsigned int)) : NULL);
+		if (vacant == NULL) {
+			pthread_mutex_unlock(&h->lock);
+			perror("librtmpcast: ERROR: host::rtmpcast_host_add: realloc() returned NULL");
+			free(s);
+			return 0;
+		}
+		h->vacant = vacant;
+		h->stream_max = max;
+	}
+
+	// due now: its first update registers its fds
+	const unsigned int slot = (h->vacant_count ? h->vacant[-- h->vacant_count] : h->table_used ++);
+	s->id = (h->next_serial ++ << 32) | slot;
+	h->table[slot] = s;
+	s->deadline = 0;
+	h->streams[h->stream_count ++] = s;
+	heapPush(h, s);
+	pthread_cond_signal(&h->cond);
+
+	pthread_mutex_unlock(&h->lock);
+	return 1;
+}
+
+int rtmpcast_host_remove (struct rtmpcast_host_t * h, struct rtmpcast_t * r)
+{
+	pthread_mutex_lock(&h->lock);
+
+	unsigned int i = 0;
+	while (i < h->stream_count && h->streams[i]->rtmpcast != r)
+		i ++;
+	if (i == h->stream_count) {
+		pthread_mutex_unlock(&h->lock);
+		fputs("librtmpcast: ERROR: rtmpcast_host_remove: the stream is not on this host\n", stderr);
+		return 0;
+	}
+
+	struct host_stream_t * const s = h->streams[i];
+	s->removed = 1;
+	if (s->slot >= 0)
+		heapRemove(h, s);
+	while (s->running)
+		pthread_cond_wait(&h->done, &h->lock);
+	h->streams[i] = h->streams[-- h->stream_count];
+	h->table[HOST_SLOT(s->id)] = NULL;
+	h->vacant[h->vacant_count ++] = HOST_SLOT(s->id);
+
+	pthread_mutex_unlock(&h->lock);
+
+	// still open, so still its own: stop watching them
+	const int n = rtmpcast_get_pollfds(r, s->fds, s->fd_max);
+	for (int j = 0; j < n && j < s->fd_max; j ++)
+		epoll_ctl(h->epfd, EPOLL_CTL_DEL, s->fds[j].fd, NULL);
+
+	const int ok = ! s->failed;
+	free(s->fds);
+	free(s);
+	return ok;
+}
+
+void rtmpcast_host_close (struct rtmpcast_host_t * h)
+{
+	pthread_mutex_lock(&h->lock);
+	h->stopping = 1;
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->lock);
+
+	const uint64_t one = 1;
+	if (write(h->wake, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		perror("librtmpcast: ERROR: host::rtmpcast_host_close: write() to eventfd failed");
+
+	if (h->looping)
+		pthread_join(h->loop, NULL);
+	for (unsigned int i = 0; i < h->worker_count; i ++)
+		pthread_join(h->workers[i], NULL);
+
+	for (unsigned int i = 0; i < h->stream_count; i ++) {
+		free(h->streams[i]->fds);
+		free(h->streams[i]);
+	}
+	free(h->streams);
+	free(h->heap);
+	free(h->table);
+	free(h->vacant);
+
+	pthread_cond_destroy(&h->done);
+	pthread_cond_destroy(&h->cond);
+	pthread_mutex_destroy(&h->lock);
+	close(h->wake);
+	close(h->epfd);
+	free(h->workers);
+	free(h);
+}
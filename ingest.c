@@ -0,0 +1,772 @@
+/* ***************************************************************************
+ingest.c - minimal RTMP ingest server, for testing librtmpcast
+Greg Kennedy 2021
+
+Accepts one publisher at a time on the loopback interface, completes the
+  handshake and connect / createStream / publish, then reads the stream:
+  every FLV, AVC and AAC payload is checked, and each message's arrival is
+  compared with its own timestamp to see how far behind the sender falls.
+  One line of JSON per second reports throughput, lateness and errors.
+The reader can also be slowed down, to see what the sender does about it:
+  a bandwidth cap, and / or a stall (no reads at all) at regular intervals.
+Build with "make ingest", then run e.g.:
+	ingest -b 2000
+	example rtmp://127.0.0.1/live/test
+*************************************************************************** */
+
+// writers for the replies
+#include "flv.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_PORT 1935
+
+// handshake blocks are fixed size
+#define HANDSHAKE_SIZE 1536
+// chunk streams we keep state for (librtmp uses low numbers)
+#define MAX_CHUNK_STREAMS 64
+// largest message we accept
+#define MAX_MESSAGE (16 * 1024 * 1024)
+// our replies are small, so they go out in default-size chunks
+#define OUT_CHUNK_SIZE 128
+// asked of the client, and how often we acknowledge what it sent
+#define WINDOW_SIZE 2500000
+// bytes per read (and granularity of the bandwidth cap)
+#define READ_SIZE 4096
+// report validation failures in full, up to this many
+#define MAX_ERROR_REPORTS 20
+
+// GLOBALS
+// options
+static unsigned int cap_kbps;
+static unsigned int stall_ms;
+static unsigned int stall_interval;
+
+// per-message state of one chunk stream
+struct chunk_stream_t {
+	uint32_t timestamp;
+	uint32_t delta;
+	uint32_t length;
+	uint8_t type;
+	uint32_t stream_id;
+	int extended;
+
+	uint8_t * data;
+	uint32_t received;
+};
+
+// one publisher
+struct connection_t {
+	int fd;
+
+	uint32_t in_chunk_size;
+	uint64_t bytes_read;
+	uint64_t bytes_acked;
+
+	// for the bandwidth cap and stalls
+	double read_start;
+	uint64_t read_bytes;
+	double next_stall;
+
+	struct chunk_stream_t streams[MAX_CHUNK_STREAMS];
+
+	// the stream clock: arrival and timestamp of the first media message
+	int started;
+	double base_arrival;
+	uint32_t base_timestamp;
+
+	// this second, and overall
+	struct {
+		double start;
+		unsigned long messages;
+		uint64_t bytes;
+		double late_max;
+		unsigned long errors;
+	} period;
+	unsigned long messages;
+	uint64_t bytes;
+	double late_max;
+	unsigned long errors;
+	int sequence_header[2];
+};
+
+static double getTimestamp()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+static void sleepFor(const double seconds)
+{
+	if (seconds <= 0)
+		return;
+
+	struct timespec ts;
+	ts.tv_sec = seconds;
+	ts.tv_nsec = (seconds - ts.tv_sec) * 1000000000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static uint32_t readU24(const uint8_t * const p)
+{
+	return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static uint32_t readU32(const uint8_t * const p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void invalid(struct connection_t * const c, const char * const what, const uint32_t timestamp)
+{
+	if (c->errors < MAX_ERROR_REPORTS)
+		fprintf(stderr, "ingest: invalid payload at %u ms: %s\n", timestamp, what);
+	c->errors ++;
+	c->period.errors ++;
+}
+
+/* ************************************************************************ */
+// socket
+// Read exactly size bytes, slowed down by the options
+//  Returns 0 when the connection is gone
+static int readFull(struct connection_t * const c, uint8_t * p, size_t size)
+{
+	while (size > 0) {
+		const double now = getTimestamp();
+
+		// stall: stop reading, so the socket buffers fill up
+		if (stall_ms && now >= c->next_stall) {
+			sleepFor(stall_ms / 1000.0);
+			c->next_stall = getTimestamp() + stall_interval;
+			c->read_start = getTimestamp();
+			c->read_bytes = 0;
+		}
+
+		// cap: wait until the average rate allows more
+		if (cap_kbps)
+			sleepFor(c->read_bytes * 8 / (cap_kbps * 1000.0) - (now - c->read_start));
+
+		const ssize_t n = read(c->fd, p, (size < READ_SIZE ? size : READ_SIZE));
+		if (n == 0)
+			return 0;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("ingest: read() failed");
+			return 0;
+		}
+
+		p += n;
+		size -= n;
+		c->bytes_read += n;
+		c->read_bytes += n;
+	}
+
+	return 1;
+}
+
+static int writeFull(const struct connection_t * const c, const uint8_t * p, size_t size)
+{
+	while (size > 0) {
+		const ssize_t n = write(c->fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("ingest: write() failed");
+			return 0;
+		}
+		p += n;
+		size -= n;
+	}
+
+	return 1;
+}
+
+// Send one message, in OUT_CHUNK_SIZE chunks
+static int sendMessage(const struct connection_t * const c, const unsigned int csid, const uint8_t type, const uint32_t stream_id, const uint8_t * const payload, const uint32_t length)
+{
+	uint8_t header[12];
+	uint8_t * p = header;
+	*p = csid; p ++;
+	p = u24be(p, 0);
+	p = u24be(p, length);
+	*p = type; p ++;
+	// little-endian
+	*p = stream_id & 0xFF; p ++;
+	*p = stream_id >> 8 & 0xFF; p ++;
+	*p = stream_id >> 16 & 0xFF; p ++;
+	*p = stream_id >> 24 & 0xFF; p ++;
+
+	if (! writeFull(c, header, 12))
+		return 0;
+
+	for (uint32_t sent = 0; sent < length; ) {
+		if (sent > 0) {
+			const uint8_t next = 0xC0 | csid;
+			if (! writeFull(c, &next, 1))
+				return 0;
+		}
+
+		const uint32_t n = (length - sent < OUT_CHUNK_SIZE ? length - sent : OUT_CHUNK_SIZE);
+		if (! writeFull(c, payload + sent, n))
+			return 0;
+		sent += n;
+	}
+
+	return 1;
+}
+
+/* ************************************************************************ */
+// AMF: just enough to read a command name and transaction ID,
+//  and to write the replies
+static uint8_t * amfNull(uint8_t * const p)
+{
+	*p = 0x05;
+	return p + 1;
+}
+
+static uint8_t * amfProperty(uint8_t * const p, const char * const name, const char * const value)
+{
+	return amf_string(pstring(p, name), value);
+}
+
+// Reads an AMF0 string at *p, returns 0 if there is none
+static int readString(const uint8_t ** const p, const uint8_t * const end, char * const out, const size_t size)
+{
+	if (end - *p < 3 || **p != 0x02)
+		return 0;
+
+	const size_t length = (*p)[1] << 8 | (*p)[2];
+	if ((size_t)(end - *p) < 3 + length || length >= size)
+		return 0;
+
+	memcpy(out, *p + 3, length);
+	out[length] = '\0';
+	*p += 3 + length;
+	return 1;
+}
+
+static int readNumber(const uint8_t ** const p, const uint8_t * const end, double * const out)
+{
+	if (end - *p < 9 || **p != 0x00)
+		return 0;
+
+	uint64_t bits = 0;
+	for (int i = 1; i <= 8; i ++)
+		bits = bits << 8 | (*p)[i];
+	memcpy(out, &bits, 8);
+
+	*p += 9;
+	return 1;
+}
+
+static int replyConnect(const struct connection_t * const c, const double transaction)
+{
+	uint8_t buf[512];
+
+	// window acknowledgement size, and peer bandwidth (dynamic)
+	u32be(buf, WINDOW_SIZE);
+	if (! sendMessage(c, 2, 5, 0, buf, 4))
+		return 0;
+	u32be(buf, WINDOW_SIZE);
+	buf[4] = 2;
+	if (! sendMessage(c, 2, 6, 0, buf, 5))
+		return 0;
+
+	uint8_t * p = amf_string(buf, "_result");
+	p = amf_number(p, transaction);
+	p = amf_object(p);
+	p = amfProperty(p, "fmsVer", "FMS/3,0,1,123");
+	p = amf_number(pstring(p, "capabilities"), 31);
+	p = amf_object_end(p);
+	p = amf_object(p);
+	p = amfProperty(p, "level", "status");
+	p = amfProperty(p, "code", "NetConnection.Connect.Success");
+	p = amfProperty(p, "description", "Connection succeeded.");
+	p = amf_number(pstring(p, "objectEncoding"), 0);
+	p = amf_object_end(p);
+
+	return sendMessage(c, 3, 20, 0, buf, p - buf);
+}
+
+static int replyCreateStream(const struct connection_t * const c, const double transaction)
+{
+	uint8_t buf[64];
+
+	uint8_t * p = amf_string(buf, "_result");
+	p = amf_number(p, transaction);
+	p = amfNull(p);
+	p = amf_number(p, 1);
+
+	return sendMessage(c, 3, 20, 0, buf, p - buf);
+}
+
+static int replyPublish(const struct connection_t * const c, const uint32_t stream_id)
+{
+	uint8_t buf[256];
+
+	uint8_t * p = amf_string(buf, "onStatus");
+	p = amf_number(p, 0);
+	p = amfNull(p);
+	p = amf_object(p);
+	p = amfProperty(p, "level", "status");
+	p = amfProperty(p, "code", "NetStream.Publish.Start");
+	p = amfProperty(p, "description", "Publishing.");
+	p = amf_object_end(p);
+
+	return sendMessage(c, 5, 20, stream_id, buf, p - buf);
+}
+
+// Returns 0 to end the connection
+static int handleCommand(struct connection_t * const c, const struct chunk_stream_t * const m, const uint8_t * p)
+{
+	const uint8_t * const end = m->data + m->length;
+
+	char name[64];
+	double transaction = 0;
+	if (! readString(&p, end, name, sizeof(name))) {
+		invalid(c, "command without a name", m->timestamp);
+		return 1;
+	}
+	readNumber(&p, end, &transaction);
+
+	if (strcmp(name, "connect") == 0)
+		return replyConnect(c, transaction);
+	if (strcmp(name, "createStream") == 0)
+		return replyCreateStream(c, transaction);
+	if (strcmp(name, "publish") == 0) {
+		fputs("ingest: publishing\n", stderr);
+		return replyPublish(c, m->stream_id);
+	}
+	if (strcmp(name, "FCUnpublish") == 0 || strcmp(name, "deleteStream") == 0)
+		fprintf(stderr, "ingest: %s\n", name);
+
+	// releaseStream, FCPublish etc. need no answer
+	return 1;
+}
+
+/* ************************************************************************ */
+// payload checks
+static void checkData(struct connection_t * const c, const struct chunk_stream_t * const m)
+{
+	const uint8_t * p = m->data;
+	const uint8_t * const end = m->data + m->length;
+
+	char name[64];
+	if (! readString(&p, end, name, sizeof(name))) {
+		invalid(c, "data message without a name", m->timestamp);
+		return;
+	}
+	// librtmp prepends this to metadata it forwards
+	if (strcmp(name, "@setDataFrame") == 0 && ! readString(&p, end, name, sizeof(name))) {
+		invalid(c, "@setDataFrame without a handler name", m->timestamp);
+		return;
+	}
+	if (strcmp(name, "onMetaData") != 0)
+		return;
+
+	// an ECMA array (or object) should follow
+	if (p == end || (*p != 0x08 && *p != 0x03))
+		invalid(c, "onMetaData without an array", m->timestamp);
+}
+
+static void checkVideo(struct connection_t * const c, const struct chunk_stream_t * const m)
+{
+	const uint8_t * const d = m->data;
+
+	if (m->length < 5 || (d[0] & 0x0F) != 7) {
+		invalid(c, "video is not AVC", m->timestamp);
+		return;
+	}
+	if ((d[0] >> 4) != 1 && (d[0] >> 4) != 2) {
+		invalid(c, "video frame type is not key / inter", m->timestamp);
+		return;
+	}
+
+	switch (d[1]) {
+	case 0: {
+		// AVCDecoderConfigurationRecord: version, profile, compat, level,
+		//  length size, then SPS and PPS lists
+		c->sequence_header[1] = 1;
+		const uint8_t * p = d + 5;
+		const uint8_t * const end = d + m->length;
+		if (end - p < 6 || p[0] != 1 || (p[4] & 0x03) != 3) {
+			invalid(c, "bad AVC decoder configuration header", m->timestamp);
+			return;
+		}
+		unsigned int count = p[5] & 0x1F;
+		p += 6;
+		for (int list = 0; list < 2; list ++) {
+			if (list == 1) {
+				if (p == end) {
+					invalid(c, "AVC decoder configuration has no PPS count", m->timestamp);
+					return;
+				}
+				count = *p;
+				p ++;
+			}
+			if (count == 0) {
+				invalid(c, (list ? "AVC decoder configuration has no PPS" : "AVC decoder configuration has no SPS"), m->timestamp);
+				return;
+			}
+			for (unsigned int i = 0; i < count; i ++) {
+				if (end - p < 2 || (size_t)(end - p) < 2u + (p[0] << 8 | p[1])) {
+					invalid(c, "AVC parameter set overruns the record", m->timestamp);
+					return;
+				}
+				p += 2 + (p[0] << 8 | p[1]);
+			}
+		}
+		break;
+	}
+	case 1: {
+		if (! c->sequence_header[1])
+			invalid(c, "AVC frame before the sequence header", m->timestamp);
+		// 4-byte length-prefixed NAL units, filling the payload exactly
+		const uint8_t * p = d + 5;
+		const uint8_t * const end = d + m->length;
+		if (p == end)
+			invalid(c, "AVC frame with no NAL units", m->timestamp);
+		while (p < end) {
+			if (end - p < 4 || (size_t)(end - p) - 4 < readU32(p)) {
+				invalid(c, "NAL unit overruns the frame", m->timestamp);
+				return;
+			}
+			if (readU32(p) == 0 || (p[4] & 0x80)) {
+				invalid(c, "bad NAL unit header", m->timestamp);
+				return;
+			}
+			p += 4 + readU32(p);
+		}
+		break;
+	}
+	case 2:
+		// end of sequence
+		break;
+	default:
+		invalid(c, "unknown AVC packet type", m->timestamp);
+	}
+}
+
+static void checkAudio(struct connection_t * const c, const struct chunk_stream_t * const m)
+{
+	const uint8_t * const d = m->data;
+
+	if (m->length < 2 || (d[0] >> 4) != 10) {
+		invalid(c, "audio is not AAC", m->timestamp);
+		return;
+	}
+
+	if (d[1] == 0) {
+		// AudioSpecificConfig: object type, frequency index, channels
+		c->sequence_header[0] = 1;
+		if (m->length < 4 || (d[2] >> 3) == 0 || (d[2] >> 3) == 31)
+			invalid(c, "bad AudioSpecificConfig", m->timestamp);
+	} else if (d[1] == 1) {
+		if (! c->sequence_header[0])
+			invalid(c, "AAC frame before the sequence header", m->timestamp);
+		if (m->length < 3)
+			invalid(c, "empty AAC frame", m->timestamp);
+	} else
+		invalid(c, "unknown AAC packet type", m->timestamp);
+}
+
+// How late a media message is, against the first one's arrival
+static void timeArrival(struct connection_t * const c, const struct chunk_stream_t * const m, const double now)
+{
+	if (! c->started) {
+		c->started = 1;
+		c->base_arrival = now;
+		c->base_timestamp = m->timestamp;
+	}
+
+	const double expected = c->base_arrival + ((double)m->timestamp - c->base_timestamp) / 1000;
+	const double late = now - expected;
+
+	if (late > c->period.late_max) c->period.late_max = late;
+	if (late > c->late_max) c->late_max = late;
+}
+
+/* ************************************************************************ */
+static void report(struct connection_t * const c, const double now, const int final)
+{
+	const double elapsed = now - c->period.start;
+
+	if (final)
+		printf("{ \"final\": true, \"messages\": %lu, \"bytes\": %lu, \"late_max_ms\": %.1f, \"errors\": %lu }\n",
+			c->messages, (unsigned long)c->bytes, c->late_max * 1000, c->errors);
+	else
+		printf("{ \"messages\": %lu, \"kbps\": %.1f, \"late_max_ms\": %.1f, \"errors\": %lu }\n",
+			c->period.messages, (elapsed > 0 ? c->period.bytes * 8 / elapsed / 1000 : 0),
+			c->period.late_max * 1000, c->period.errors);
+	fflush(stdout);
+
+	c->period.start = now;
+	c->period.messages = 0;
+	c->period.bytes = 0;
+	c->period.late_max = 0;
+	c->period.errors = 0;
+}
+
+// Returns 0 to end the connection
+static int handleMessage(struct connection_t * const c, const struct chunk_stream_t * const m)
+{
+	const double now = getTimestamp();
+
+	switch (m->type) {
+	case 1:
+		// Set Chunk Size
+		if (m->length < 4 || (readU32(m->data) & 0x7FFFFFFF) == 0) {
+			invalid(c, "bad Set Chunk Size", m->timestamp);
+			return 0;
+		}
+		c->in_chunk_size = readU32(m->data) & 0x7FFFFFFF;
+		return 1;
+	case 17:
+		// AMF3 command: same as AMF0 after a format byte
+		return (m->length > 0 ? handleCommand(c, m, m->data + 1) : 1);
+	case 20:
+		return handleCommand(c, m, m->data);
+	case 18:
+		checkData(c, m);
+		break;
+	case 9:
+		checkVideo(c, m);
+		timeArrival(c, m, now);
+		break;
+	case 8:
+		checkAudio(c, m);
+		timeArrival(c, m, now);
+		break;
+	default:
+		// acknowledgements, user control, window size...
+		return 1;
+	}
+
+	c->messages ++;
+	c->bytes += m->length;
+	c->period.messages ++;
+	c->period.bytes += m->length;
+
+	if (now - c->period.start >= 1)
+		report(c, now, 0);
+
+	return 1;
+}
+
+// Read one chunk, and handle the message if it completes one
+//  Returns 0 when the connection ends
+static int readChunk(struct connection_t * const c)
+{
+	uint8_t b[11];
+	if (! readFull(c, b, 1))
+		return 0;
+
+	const unsigned int fmt = b[0] >> 6;
+	unsigned int csid = b[0] & 0x3F;
+	if (csid < 2) {
+		// 2 or 3 byte basic header
+		if (! readFull(c, b + 1, csid + 1))
+			return 0;
+		csid = 64 + b[1] + (csid == 1 ? b[2] * 256 : 0);
+	}
+	if (csid >= MAX_CHUNK_STREAMS) {
+		fprintf(stderr, "ingest: chunk stream %u not supported\n", csid);
+		return 0;
+	}
+
+	struct chunk_stream_t * const m = &c->streams[csid];
+	static const unsigned int headerSize[4] = { 11, 7, 3, 0 };
+	if (! readFull(c, b, headerSize[fmt]))
+		return 0;
+
+	uint32_t field = 0;
+	if (fmt < 3) {
+		field = readU24(b);
+		m->extended = (field == 0xFFFFFF);
+	}
+	if (fmt < 2) {
+		m->length = readU24(b + 3);
+		m->type = b[6];
+	}
+	if (fmt == 0)
+		m->stream_id = b[7] | b[8] << 8 | b[9] << 16 | (uint32_t)b[10] << 24;
+
+	// the extended timestamp follows, type 3 chunks included
+	if (m->extended) {
+		uint8_t e[4];
+		if (! readFull(c, e, 4))
+			return 0;
+		field = readU32(e);
+	}
+
+	// a new message: work out its timestamp
+	if (m->received == 0) {
+		if (fmt == 0)
+			m->timestamp = field;
+		else if (fmt < 3) {
+			m->delta = field;
+			m->timestamp += field;
+		} else
+			m->timestamp += m->delta;
+
+		if (m->length > MAX_MESSAGE) {
+			fprintf(stderr, "ingest: message of %u bytes is too large\n", m->length);
+			return 0;
+		}
+		uint8_t * data = realloc(m->data, m->length ? m->length : 1);
+		if (data == NULL) {
+			perror("ingest: realloc() returned NULL");
+			return 0;
+		}
+		m->data = data;
+	}
+
+	uint32_t n = m->length - m->received;
+	if (n > c->in_chunk_size)
+		n = c->in_chunk_size;
+	if (! readFull(c, m->data + m->received, n))
+		return 0;
+	m->received += n;
+
+	// acknowledge every window's worth
+	if (c->bytes_read - c->bytes_acked >= WINDOW_SIZE) {
+		uint8_t ack[4];
+		u32be(ack, c->bytes_read);
+		if (! sendMessage(c, 2, 3, 0, ack, 4))
+			return 0;
+		c->bytes_acked = c->bytes_read;
+	}
+
+	if (m->received < m->length)
+		return 1;
+
+	m->received = 0;
+	return handleMessage(c, m);
+}
+
+// Simple handshake: C0 + C1 in, S0 + S1 + S2 out (S2 echoes C1), then C2 in
+static int handshake(struct connection_t * const c)
+{
+	uint8_t * const in = malloc(1 + HANDSHAKE_SIZE);
+	uint8_t * const out = malloc(1 + 2 * HANDSHAKE_SIZE);
+	int ok = (in && out);
+
+	if (ok)
+		ok = readFull(c, in, 1 + HANDSHAKE_SIZE);
+
+	if (ok) {
+		out[0] = 3;
+		// S1: time, zero, then anything
+		memset(out + 1, 0, 8);
+		for (int i = 8; i < HANDSHAKE_SIZE; i ++)
+			out[1 + i] = rand();
+		memcpy(out + 1 + HANDSHAKE_SIZE, in + 1, HANDSHAKE_SIZE);
+
+		ok = writeFull(c, out, 1 + 2 * HANDSHAKE_SIZE) &&
+			readFull(c, in, HANDSHAKE_SIZE);
+	}
+
+	free(out);
+	free(in);
+	return ok;
+}
+
+static void serve(const int fd)
+{
+	struct connection_t * const c = calloc(1, sizeof(struct connection_t));
+	if (c == NULL) {
+		perror("ingest: calloc() returned NULL");
+		close(fd);
+		return;
+	}
+
+	c->fd = fd;
+	c->in_chunk_size = 128;
+	c->read_start = getTimestamp();
+	c->next_stall = c->read_start + stall_interval;
+	c->period.start = c->read_start;
+
+	if (handshake(c))
+		while (readChunk(c));
+
+	report(c, getTimestamp(), 1);
+
+	for (int i = 0; i < MAX_CHUNK_STREAMS; i ++)
+		free(c->streams[i].data);
+	free(c);
+	close(fd);
+}
+
+int main(int argc, char * argv[])
+{
+	unsigned int port = DEFAULT_PORT;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:b:s:i:")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 'b': cap_kbps = atoi(optarg); break;
+		case 's': stall_ms = atoi(optarg); break;
+		case 'i': stall_interval = atoi(optarg); break;
+		default:
+			printf("librtmpcast test ingest server\nUsage:\n\t%s [-p port] [-b kbps] [-s stall_ms -i interval_seconds]\n", argv[0]);
+			return EXIT_SUCCESS;
+		}
+	}
+	if (stall_ms && stall_interval == 0)
+		stall_interval = 10;
+
+	const int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server == -1) {
+		perror("ingest: socket() failed");
+		return EXIT_FAILURE;
+	}
+
+	const int one = 1;
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(server, 1) == -1) {
+		perror("ingest: bind() / listen() failed");
+		close(server);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "ingest: listening on 127.0.0.1:%u\n", port);
+
+	// one publisher at a time
+	for (;;) {
+		const int fd = accept(server, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("ingest: accept() failed");
+			break;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fputs("ingest: publisher connected\n", stderr);
+		serve(fd);
+		fputs("ingest: publisher disconnected\n", stderr);
+	}
+
+	close(server);
+	return EXIT_FAILURE;
+}
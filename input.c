@@ -0,0 +1,152 @@
+#include "input.h"
+
+// buffers travel between sides through two lock-free queues
+#include "queue.h"
+
+// for malloc
+#include <stdlib.h>
+// for fprintf
+#include <stdio.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// structure definition for the input (private data)
+//  ready: producers -> encoder, free: encoder -> producers.
+//  The queues allow one thread per side, so producers take a lock.
+struct input_t {
+	struct queue_t * ready;
+	struct queue_t * free;
+
+	pthread_mutex_t lock;
+	int fd;
+
+	// every buffer, for cleanup
+	struct input_buffer_t * buffers;
+	unsigned int count;
+};
+
+struct input_t * input_create(const size_t capacity, const unsigned int count)
+{
+	// create a structure
+	struct input_t * in = malloc(sizeof(struct input_t));
+
+	if (in == NULL) {
+		perror("librtmpcast: ERROR: input::input_create: malloc() returned NULL");
+		return NULL;
+	}
+
+	in->ready = queue_create(count);
+	in->free = queue_create(count);
+	in->buffers = calloc(count, sizeof(struct input_buffer_t));
+	in->count = count;
+	in->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (in->ready == NULL || in->free == NULL || in->buffers == NULL || in->fd == -1 || pthread_mutex_init(&in->lock, NULL)) {
+		fputs("librtmpcast: ERROR: input::input_create: setup failed\n", stderr);
+		if (in->fd != -1) close(in->fd);
+		free(in->buffers);
+		if (in->free) queue_close(in->free);
+		if (in->ready) queue_close(in->ready);
+		free(in);
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < count; i ++) {
+		struct input_buffer_t * b = &in->buffers[i];
+		b->capacity = capacity;
+		b->user = NULL;
+		b->data = malloc(capacity);
+		if (b->data == NULL) {
+			perror("librtmpcast: ERROR: input::input_create: malloc() returned NULL");
+			input_close(in);
+			return NULL;
+		}
+		queue_push(in->free, b);
+	}
+
+	return in;
+}
+
+struct input_buffer_t * input_buffers(struct input_t * const in, unsigned int * const count)
+{
+	*count = in->count;
+	return in->buffers;
+}
+
+struct input_buffer_t * input_get(struct input_t * const in)
+{
+	pthread_mutex_lock(&in->lock);
+	struct input_buffer_t * b = queue_pop(in->free);
+	pthread_mutex_unlock(&in->lock);
+
+	if (b) b->size = 0;
+	return b;
+}
+
+int input_reserve(struct input_buffer_t * const b, const size_t capacity)
+{
+	if (capacity <= b->capacity)
+		return 1;
+
+	// grow with some headroom, so a run of growing frames does not realloc every time
+	const size_t size = capacity + capacity / 4;
+	uint8_t * data = realloc(b->data, size);
+	if (data == NULL) {
+		perror("librtmpcast: ERROR: input::input_reserve: realloc() returned NULL");
+		return 0;
+	}
+
+	b->data = data;
+	b->capacity = size;
+	return 1;
+}
+
+void input_submit(struct input_t * const in, struct input_buffer_t * const b)
+{
+	// there is always room: ready holds every buffer if it has to
+	pthread_mutex_lock(&in->lock);
+	queue_push(in->ready, b);
+	pthread_mutex_unlock(&in->lock);
+
+	const uint64_t one = 1;
+	if (write(in->fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		perror("librtmpcast: ERROR: input::input_submit: write() to eventfd failed");
+}
+
+struct input_buffer_t * input_peek(struct input_t * const in)
+{
+	return queue_peek(in->ready);
+}
+
+void input_done(struct input_t * const in)
+{
+	queue_push(in->free, queue_pop(in->ready));
+}
+
+int input_fd(const struct input_t * const in)
+{
+	return in->fd;
+}
+
+void input_reset(struct input_t * const in)
+{
+	uint64_t count;
+	if (read(in->fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		perror("librtmpcast: ERROR: input::input_reset: read() from eventfd failed");
+}
+
+void input_close(struct input_t * const in)
+{
+	for (unsigned int i = 0; i < in->count; i ++)
+		free(in->buffers[i].data);
+
+	close(in->fd);
+	pthread_mutex_destroy(&in->lock);
+	free(in->buffers);
+	queue_close(in->free);
+	queue_close(in->ready);
+	free(in);
+}
@@ -0,0 +1,54 @@
+#ifndef RTMPCAST_INPUT_H
+#define RTMPCAST_INPUT_H
+
+// Raw frames (or blocks of samples) pushed by the application, on their way
+//  to an encoder.  Any thread may get / submit, one encoder thread peeks and
+//  recycles.  Nothing here blocks: once every buffer is in flight input_get
+//  returns NULL, and the producer decides what to drop.
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct input_buffer_t {
+	// seconds, on the producer's clock
+	double timestamp;
+	// bytes used in data
+	size_t size;
+
+	size_t capacity;
+	uint8_t * data;
+
+	// for the owner of the input to hang its own description on
+	void * user;
+};
+
+struct input_t;
+
+// count buffers of capacity bytes, all allocated now
+struct input_t * input_create(size_t capacity, unsigned int count);
+
+// Every buffer, in or out of flight (to set up user)
+struct input_buffer_t * input_buffers(struct input_t * input, unsigned int * count);
+
+// Producer side: a free buffer to fill, or NULL if all are in flight
+struct input_buffer_t * input_get(struct input_t * input);
+// Producer side: make room for capacity bytes in a buffer it holds (for
+//  input that varies in size).  Returns 0 if out of memory
+int input_reserve(struct input_buffer_t * buffer, size_t capacity);
+// Producer side: pass a filled buffer on, in order
+void input_submit(struct input_t * input, struct input_buffer_t * buffer);
+
+// Encoder side: oldest submitted buffer, or NULL if none
+struct input_buffer_t * input_peek(struct input_t * input);
+// Encoder side: recycle the buffer input_peek returned
+void input_done(struct input_t * input);
+
+// eventfd, readable once a buffer is submitted
+int input_fd(const struct input_t * input);
+// Clear the eventfd.  Call before draining, so no submit goes unnoticed.
+void input_reset(struct input_t * input);
+
+// Buffers still in flight are freed too
+void input_close(struct input_t * input);
+
+#endif
@@ -0,0 +1,222 @@
+/* ***************************************************
+librtmpcast ladder:
+One input, encoded at several sizes at once.  Each rendition is a threaded
+  stream in push mode, fed straight into its frame pool: the input is
+  converted to I420 once, then scaled to every size in one pass.
+
+Greg Kennedy 2021
+*************************************************** */
+
+#include "rtmpcast.h"
+
+#include "colorspace.h"
+#include "scale.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct rtmpcast_ladder_t {
+	struct rtmpcast_t ** renditions;
+	unsigned int count;
+	int connected;
+
+	// input frames not in I420 are converted into frame first
+	struct colorspace_t * convert;
+	uint8_t * frame;
+	uint8_t * plane[3];
+
+	struct scale_t * scale;
+	// per rendition, for each frame: what it gave from its pool, and its
+	//  planes (or NULL for a dropped frame)
+	struct rtmpcast_frame_t ** taken;
+	uint8_t * const ** dst;
+};
+
+struct rtmpcast_ladder_t * rtmpcast_ladder_init (const struct rtmpcast_param_t * param, const struct rtmpcast_rendition_t * renditions, unsigned int count)
+{
+	if (count == 0) {
+		fputs("librtmpcast: ERROR: rtmpcast_ladder_init: no renditions\n", stderr);
+		return NULL;
+	}
+	if (! param->video.enable || param->video.callback || param->video.passthrough || param->video.bitrate == 0) {
+		fputs("librtmpcast: ERROR: rtmpcast_ladder_init: needs video in push mode (not passthrough), with a bitrate\n", stderr);
+		return NULL;
+	}
+	if (param->audio.enable && param->audio.callback) {
+		fputs("librtmpcast: ERROR: rtmpcast_ladder_init: audio must be in push mode\n", stderr);
+		return NULL;
+	}
+
+	struct rtmpcast_ladder_t * l = calloc(1, sizeof(struct rtmpcast_ladder_t));
+	if (l == NULL) {
+		perror("librtmpcast: ERROR: rtmpcast_ladder_init: calloc() returned NULL");
+		return NULL;
+	}
+
+	l->renditions = calloc(count, sizeof(struct rtmpcast_t *));
+	l->taken = calloc(count, sizeof(struct rtmpcast_frame_t *));
+	l->dst = calloc(count, sizeof(uint8_t * const *));
+	unsigned int * const size = malloc(2 * count * sizeof(unsigned int));
+	if (l->renditions == NULL || l->taken == NULL || l->dst == NULL || size == NULL) {
+		perror("librtmpcast: ERROR: rtmpcast_ladder_init: malloc() returned NULL");
+		free(size);
+		rtmpcast_ladder_close(l);
+		return NULL;
+	}
+
+	const unsigned int width = param->video.width, height = param->video.height;
+	for (unsigned int i = 0; i < count; i ++) {
+		size[i] = renditions[i].width;
+		size[count + i] = renditions[i].height;
+	}
+	l->scale = scale_create(width, height, count, size, size + count);
+	free(size);
+	if (l->scale == NULL) {
+		rtmpcast_ladder_close(l);
+		return NULL;
+	}
+
+	if (param->video.format != RTMPCAST_FORMAT_I420) {
+		l->convert = colorspace_create(param->video.format, width, height, -1, param->video.convert_threads);
+		l->frame = malloc((size_t)width * height * 3 / 2);
+		if (l->convert == NULL || l->frame == NULL) {
+			fputs("librtmpcast: ERROR: rtmpcast_ladder_init: failed to set up format conversion\n", stderr);
+			rtmpcast_ladder_close(l);
+			return NULL;
+		}
+		l->plane[0] = l->frame;
+		l->plane[1] = l->frame + (size_t)width * height;
+		l->plane[2] = l->plane[1] + (size_t)width * height / 4;
+	}
+
+	for (unsigned int i = 0; i < count; i ++) {
+		const struct rtmpcast_rendition_t * const r = &renditions[i];
+
+		struct rtmpcast_param_t p = *param;
+		p.url = r->url;
+		p.filename = r->filename;
+		p.destinations = r->destinations;
+		p.destination_count = r->destination_count;
+		p.threaded = 1;
+		p.video.width = r->width;
+		p.video.height = r->height;
+		p.video.bitrate = r->bitrate;
+		p.video.min_bitrate = (unsigned long)param->video.min_bitrate * r->bitrate / param->video.bitrate;
+		// the ladder converts and scales, into the pools
+		p.video.format = RTMPCAST_FORMAT_I420;
+		p.video.convert_threads = 0;
+
+		l->renditions[i] = rtmpcast_init(&p);
+		if (l->renditions[i] == NULL) {
+			fprintf(stderr, "librtmpcast: ERROR: rtmpcast_ladder_init: failed to set up rendition %u (%ux%u)\n", i, r->width, r->height);
+			rtmpcast_ladder_close(l);
+			return NULL;
+		}
+		l->count = i + 1;
+	}
+
+	return l;
+}
+
+int rtmpcast_ladder_connect (struct rtmpcast_ladder_t * l)
+{
+	for (unsigned int i = 0; i < l->count; i ++) {
+		if (! rtmpcast_connect(l->renditions[i])) {
+			fprintf(stderr, "librtmpcast: ERROR: rtmpcast_ladder_connect: rendition %u failed to connect\n", i);
+			return 0;
+		}
+	}
+
+	l->connected = 1;
+	return 1;
+}
+
+double rtmpcast_ladder_update (struct rtmpcast_ladder_t * l)
+{
+	double next = -1;
+	for (unsigned int i = 0; i < l->count; i ++) {
+		const double d = rtmpcast_update(l->renditions[i]);
+		if (d < 0)
+			return d;
+		if (next < 0 || d < next)
+			next = d;
+	}
+	return next;
+}
+
+int rtmpcast_ladder_push_video (struct rtmpcast_ladder_t * l, const uint8_t * const plane[3], double timestamp)
+{
+	if (! l->connected) {
+		fputs("librtmpcast: ERROR: rtmpcast_ladder_push_video needs rtmpcast_ladder_connect first\n", stderr);
+		return -1;
+	}
+
+	// a rendition that is behind skips this frame, the others still get it
+	unsigned int taken = 0;
+	for (unsigned int i = 0; i < l->count; i ++) {
+		l->taken[i] = rtmpcast_get_frame(l->renditions[i]);
+		l->dst[i] = (l->taken[i] ? l->taken[i]->plane : NULL);
+		if (l->taken[i])
+			taken ++;
+	}
+	if (taken == 0)
+		return 0;
+
+	const uint8_t * const * src = plane;
+	if (l->convert) {
+		colorspace_convert(l->convert, plane, l->plane);
+		src = (const uint8_t * const *)l->plane;
+	}
+	scale_frame(l->scale, src, l->dst);
+
+	for (unsigned int i = 0; i < l->count; i ++) {
+		if (l->taken[i])
+			rtmpcast_submit_frame(l->renditions[i], l->taken[i], timestamp);
+	}
+
+	return (taken == l->count);
+}
+
+int rtmpcast_ladder_push_audio (struct rtmpcast_ladder_t * l, const void * samples, unsigned int count, double timestamp)
+{
+	int ret = 1;
+	for (unsigned int i = 0; i < l->count; i ++) {
+		const int r = rtmpcast_push_audio(l->renditions[i], samples, count, timestamp);
+		if (r < ret)
+			ret = r;
+	}
+	return ret;
+}
+
+int rtmpcast_ladder_push_audio_planar (struct rtmpcast_ladder_t * l, const void * const planes[], unsigned int count, double timestamp)
+{
+	int ret = 1;
+	for (unsigned int i = 0; i < l->count; i ++) {
+		const int r = rtmpcast_push_audio_planar(l->renditions[i], planes, count, timestamp);
+		if (r < ret)
+			ret = r;
+	}
+	return ret;
+}
+
+struct rtmpcast_t * rtmpcast_ladder_rendition (const struct rtmpcast_ladder_t * l, unsigned int index)
+{
+	return (index < l->count ? l->renditions[index] : NULL);
+}
+
+void rtmpcast_ladder_close (struct rtmpcast_ladder_t * l)
+{
+	for (unsigned int i = 0; i < l->count; i ++)
+		rtmpcast_close(l->renditions[i]);
+
+	if (l->scale)
+		scale_close(l->scale);
+	if (l->convert)
+		colorspace_close(l->convert);
+
+	free(l->frame);
+	free(l->dst);
+	free(l->taken);
+	free(l->renditions);
+	free(l);
+}
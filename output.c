@@ -0,0 +1,973 @@
+#include "output.h"
+
+// chunk framing for media messages
+#include "chunk.h"
+// tag header readers
+#include "flv.h"
+
+#include <librtmp/rtmp.h>
+
+// for malloc
+#include <stdlib.h>
+// for fprintf
+#include <stdio.h>
+// for strdup
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+// for SIOCOUTQ
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+// reconnects happen on a thread of their own
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// iovec entries per writev() call (Linux IOV_MAX)
+#define OUTPUT_IOV_BATCH 1024
+
+// how far writeQueue goes
+#define WRITE_ALL 0
+#define WRITE_CURRENT 1
+
+// reconnect attempts when none are configured
+#define OUTPUT_DEFAULT_RECONNECT 10
+// seconds before the first attempt, doubling each time up to the max
+#define OUTPUT_RECONNECT_DELAY 0.5
+#define OUTPUT_RECONNECT_DELAY_MAX 30
+// seconds librtmp waits on the network during a reconnect
+//  (also how long output_close can wait for one in progress)
+#define OUTPUT_RECONNECT_TIMEOUT 5
+
+// connection states
+#define OUTPUT_CONNECTED 0
+#define OUTPUT_RECONNECTING 1
+#define OUTPUT_RECONNECTED 2
+#define OUTPUT_FAILED 3
+
+// stream headers kept for a reconnect: onMetaData, AVC and AAC configuration
+#define HEADER_METADATA 0
+#define HEADER_VIDEO 1
+#define HEADER_AUDIO 2
+#define HEADER_COUNT 3
+// they are small, but the buffers grow if need be
+#define HEADER_TAG_SIZE 1024
+
+// structure definition for the output (private data)
+struct output_t {
+	// librtmp keeps pointers into the URL, and may cut it up while parsing:
+	//  it gets a copy of its own, refreshed from url for each reconnect
+	char * url;
+	char * link;
+
+	RTMP * rtmp;
+	int fd;
+
+	// media goes out through the chunk writer on a non-blocking socket
+	//  (plain TCP only: librtmp handles HTTP tunneling, RTMPE and TLS,
+	//  and those connections stay blocking)
+	int native;
+
+	// ring of queued tags, oldest first
+	//  (the counts are atomic for output_pending and friends: the stats
+	//  come from any thread, and only need to be close)
+	struct tag_t ** queue;
+	unsigned int head, length;
+	atomic_uint count;
+
+	// milliseconds of queued media allowed before dropping video
+	unsigned int watermark;
+	// a GOP was cut short, so drop video until the next keyframe
+	int wait_keyframe;
+	atomic_ulong dropped;
+	// payload bytes sent: audio, video
+	atomic_uint_least64_t sent[2];
+
+	// message being written, and the part of its gather list still to go
+	//  (writing: whether there is one, for output_pending)
+	struct tag_t * current;
+	atomic_int writing;
+	struct chunk_header_t header;
+	struct iovec * iov;
+	int iov_max;
+	struct iovec * pos;
+	int left;
+
+	// bytes of a direct send that went out before the socket filled up
+	size_t partial;
+
+	// After the connection drops, a thread reconnects (OUTPUT_RECONNECTING)
+	//  while tags are held here.  Nothing else touches the RTMP object, and
+	//  fd is -1, until that thread is done and has been joined.
+	atomic_int state;
+	atomic_int cancel;
+	pthread_t thread;
+	int reconnect;
+
+	// copies of the stream headers, sent again first thing after a reconnect
+	//  (resend is the next one to go, HEADER_COUNT when none are left)
+	struct pool_t * cache;
+	struct tag_t * headers[HEADER_COUNT];
+	unsigned int resend;
+	// the video to replay does not start with a keyframe: ask for one
+	int want_keyframe;
+};
+
+// AMF string "@setDataFrame", ahead of onMetaData
+static const uint8_t setDataFrame[] = {
+	0x02, 0x00, 0x0D, '@', 's', 'e', 't', 'D', 'a', 't', 'a', 'F', 'r', 'a', 'm', 'e'
+};
+
+/* ************************************************************************ */
+// helper functions
+static void setBlocking(const int fd, const int blocking)
+{
+	const int flags = fcntl(fd, F_GETFL);
+	if (flags == -1)
+		return;
+
+	fcntl(fd, F_SETFL, (blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK));
+}
+
+// AVC NAL unit tags are the only ones the drop policy touches
+//  (not sequence headers or end-of-stream)
+static int isVideoFrame(const struct tag_t * const tag)
+{
+	return tag->data[0] == 9 && tag->size > 12 && tag->data[12] == 1;
+}
+
+// Which stream header a tag is, or -1 for media
+static int headerIndex(const struct tag_t * const tag)
+{
+	if (tag->data[0] == 18)
+		return HEADER_METADATA;
+	// AVC / AAC packet type 0: sequence header
+	if (tag->size > 12 && tag->data[12] == 0)
+		return (tag->data[0] == 9 ? HEADER_VIDEO : tag->data[0] == 8 ? HEADER_AUDIO : -1);
+	return -1;
+}
+
+// A whole message went out
+static void countSent(struct output_t * const o, const uint8_t type, const uint32_t size)
+{
+	if (type == 8 || type == 9)
+		atomic_fetch_add_explicit(&o->sent[type - 8], size, memory_order_relaxed);
+}
+
+static void countDropped(struct output_t * const o)
+{
+	atomic_fetch_add_explicit(&o->dropped, 1, memory_order_relaxed);
+}
+
+static void setCurrent(struct output_t * const o, struct tag_t * const tag)
+{
+	o->current = tag;
+	atomic_store_explicit(&o->writing, tag != NULL, memory_order_relaxed);
+}
+
+static struct tag_t * queueAt(const struct output_t * const o, const unsigned int i)
+{
+	return o->queue[(o->head + i) % o->length];
+}
+
+static void queuePush(struct output_t * const o, struct tag_t * const tag)
+{
+	o->queue[(o->head + o->count) % o->length] = tag;
+	atomic_store_explicit(&o->count, o->count + 1, memory_order_relaxed);
+}
+
+static struct tag_t * queuePop(struct output_t * const o)
+{
+	struct tag_t * tag = o->queue[o->head];
+	o->head = (o->head + 1) % o->length;
+	atomic_store_explicit(&o->count, o->count - 1, memory_order_relaxed);
+	return tag;
+}
+
+// Milliseconds of media between the oldest unsent tag and the newest
+static uint32_t queueDuration(const struct output_t * const o)
+{
+	if (o->count == 0)
+		return 0;
+
+	const uint32_t first = flv_TagTimestamp(o->current ? o->current->data : queueAt(o, 0)->data);
+	const uint32_t last = flv_TagTimestamp(queueAt(o, o->count - 1)->data);
+
+	// tracks can interleave a little out of order
+	return (last > first ? last - first : 0);
+}
+
+// Remove queued video frames: the disposable ones, or every one before index until
+//  Returns how many were removed
+static unsigned int removeVideo(struct output_t * const o, const int disposable, const unsigned int until)
+{
+	unsigned int kept = 0;
+
+	for (unsigned int i = 0; i < o->count; i ++) {
+		struct tag_t * tag = queueAt(o, i);
+
+		if (isVideoFrame(tag) && (disposable ? (tag->flags & TAG_DISPOSABLE) : i < until)) {
+			pool_put(tag);
+			countDropped(o);
+		} else {
+			o->queue[(o->head + kept) % o->length] = tag;
+			kept ++;
+		}
+	}
+
+	const unsigned int removed = o->count - kept;
+	atomic_store_explicit(&o->count, kept, memory_order_relaxed);
+
+	return removed;
+}
+
+// Bring the queue back under the watermark, if video can make up the difference
+static void applyDropPolicy(struct output_t * const o)
+{
+	if (queueDuration(o) <= o->watermark)
+		return;
+
+	// non-reference frames first, nothing depends on them
+	removeVideo(o, 1, 0);
+	if (queueDuration(o) <= o->watermark)
+		return;
+
+	// then whole GOPs: everything before the newest queued keyframe
+	unsigned int keyframe = o->count;
+	for (unsigned int i = o->count; i -- > 0; ) {
+		const struct tag_t * tag = queueAt(o, i);
+		if (isVideoFrame(tag) && (tag->flags & TAG_KEYFRAME)) {
+			keyframe = i;
+			break;
+		}
+	}
+
+	if (keyframe < o->count) {
+		removeVideo(o, 0, keyframe);
+	} else {
+		// no keyframe queued yet: drop this whole GOP, including what is still to come
+		removeVideo(o, 0, o->count);
+		o->wait_keyframe = 1;
+	}
+}
+
+// Set up the gather list for a tag, to go out with the given timestamp
+//  Returns 0 if out of memory.
+static int startMessage(struct output_t * const o, struct tag_t * const tag, const uint32_t timestamp)
+{
+	// the chunk header replaces the tag header and trailing size
+	struct iovec body[2] = {
+		{ tag->data + 11, tag->size - 11 - 4 }
+	};
+	int count = 1;
+
+	// metadata is sent as a call to @setDataFrame, which stores it on the
+	//  server for viewers joining later (as RTMP_Write does)
+	if (tag->data[0] == 18) {
+		body[1] = body[0];
+		body[0].iov_base = (void *)setDataFrame;
+		body[0].iov_len = sizeof(setDataFrame);
+		count = 2;
+	}
+
+	const int max = chunk_iov_max(o->rtmp, body[0].iov_len + body[1].iov_len, count);
+	if (max > o->iov_max) {
+		struct iovec * iov = realloc(o->iov, max * sizeof(struct iovec));
+		if (iov == NULL) {
+			perror("librtmpcast: ERROR: output::startMessage: realloc() returned NULL");
+			return 0;
+		}
+		o->iov = iov;
+		o->iov_max = max;
+	}
+
+	setCurrent(o, tag);
+	o->pos = o->iov;
+	o->left = chunk_iov(o->rtmp, &o->header, CHUNK_STREAM_MEDIA, tag->data[0], timestamp, body, count, o->iov);
+
+	return 1;
+}
+
+// Connect and publish, blocking.  Returns 0 on failure.
+static int connectRTMP(struct output_t * const o)
+{
+	// Make RTMP connection to server
+	if (! RTMP_Connect(o->rtmp, NULL)) {
+		fputs("Failed to connect to remote RTMP server\n", stderr);
+		return 0;
+	}
+
+	// Connect to RTMP stream
+	if (! RTMP_ConnectStream(o->rtmp, 0)) {
+		fputs("Failed to connect to RTMP stream\n", stderr);
+		return 0;
+	}
+
+	// large chunks: a keyframe goes out as tens of chunks, not thousands
+	return chunk_set_size(o->rtmp, CHUNK_SIZE_OUT);
+}
+
+// Take over a connection made by connectRTMP
+static void attach(struct output_t * const o)
+{
+	// track the fd for rtmp
+	o->fd = RTMP_Socket(o->rtmp);
+	o->native = ! (o->rtmp->Link.protocol & (RTMP_FEATURE_HTTP | RTMP_FEATURE_ENC | RTMP_FEATURE_SSL));
+
+	if (o->native)
+		setBlocking(o->fd, 0);
+}
+
+// Sleep, unless output_close wants the thread back.  Returns 0 if it does.
+static int waitFor(struct output_t * const o, double seconds)
+{
+	while (seconds > 0 && ! atomic_load(&o->cancel)) {
+		const double step = (seconds < 0.1 ? seconds : 0.1);
+		struct timespec ts = { 0, step * 1000000000 };
+		nanosleep(&ts, NULL);
+		seconds -= step;
+	}
+
+	return ! atomic_load(&o->cancel);
+}
+
+// Try again with growing delays, until connected or out of attempts
+static void * threadReconnect(void * const arg)
+{
+	struct output_t * const o = arg;
+	double delay = OUTPUT_RECONNECT_DELAY;
+
+	for (int attempt = 1; attempt <= o->reconnect; attempt ++) {
+		if (! waitFor(o, delay))
+			break;
+
+		fprintf(stderr, "Reconnecting to '%s' (attempt %d of %d)\n", o->url, attempt, o->reconnect);
+
+		// a fresh start, as in output_create
+		strcpy(o->link, o->url);
+		RTMP_Init(o->rtmp);
+		if (! RTMP_SetupURL(o->rtmp, o->link)) {
+			fprintf(stderr, "Failed to parse RTMP URL '%s'\n", o->url);
+			break;
+		}
+		RTMP_EnableWrite(o->rtmp);
+		o->rtmp->Link.timeout = OUTPUT_RECONNECT_TIMEOUT;
+
+		if (connectRTMP(o)) {
+			atomic_store(&o->state, OUTPUT_RECONNECTED);
+			return NULL;
+		}
+		RTMP_Close(o->rtmp);
+
+		delay *= 2;
+		if (delay > OUTPUT_RECONNECT_DELAY_MAX)
+			delay = OUTPUT_RECONNECT_DELAY_MAX;
+	}
+
+	atomic_store(&o->state, OUTPUT_FAILED);
+	return NULL;
+}
+
+// Keep only what is worth replaying after a reconnect: everything from the
+//  newest queued keyframe on, or without one, no video at all, and none
+//  until the next keyframe (even with nothing queued: the next frame is
+//  most likely mid-GOP)
+static void trimForReplay(struct output_t * const o)
+{
+	for (unsigned int i = o->count; i -- > 0; ) {
+		const struct tag_t * tag = queueAt(o, i);
+		if (isVideoFrame(tag) && (tag->flags & TAG_KEYFRAME)) {
+			for ( ; i > 0; i --) {
+				pool_put(queuePop(o));
+				countDropped(o);
+			}
+			return;
+		}
+	}
+
+	removeVideo(o, 0, o->count);
+	o->wait_keyframe = 1;
+}
+
+// The connection is gone: start reconnecting, if allowed
+//  Returns 0 if the destination should be given up on
+static int lost(struct output_t * const o)
+{
+	if (o->reconnect <= 0)
+		return 0;
+
+	fprintf(stderr, "Lost connection to '%s'\n", o->url);
+
+	// the message being written can never be finished
+	if (o->current) {
+		pool_put(o->current);
+		setCurrent(o, NULL);
+		o->left = 0;
+		countDropped(o);
+	}
+	trimForReplay(o);
+
+	// no goodbye (deleteStream) on a dead connection
+	o->rtmp->m_stream_id = 0;
+	RTMP_Close(o->rtmp);
+	o->fd = -1;
+	o->native = 0;
+
+	atomic_store(&o->state, OUTPUT_RECONNECTING);
+	if (pthread_create(&o->thread, NULL, threadReconnect, o) != 0) {
+		fputs("librtmpcast: ERROR: output::lost: pthread_create() failed\n", stderr);
+		atomic_store(&o->state, OUTPUT_CONNECTED);
+		o->reconnect = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+// Catch up with the reconnect thread
+//  Returns 1 if connected, 0 if still reconnecting, or -1 if it gave up
+static int checkReconnect(struct output_t * const o)
+{
+	switch (atomic_load(&o->state)) {
+	case OUTPUT_CONNECTED:
+		return 1;
+	case OUTPUT_RECONNECTING:
+		return 0;
+	case OUTPUT_FAILED:
+		return -1;
+	}
+
+	pthread_join(o->thread, NULL);
+	atomic_store(&o->state, OUTPUT_CONNECTED);
+	attach(o);
+	fprintf(stderr, "Reconnected to '%s'\n", o->url);
+
+	// headers first, then the replay; which must start with a keyframe
+	o->resend = 0;
+	o->want_keyframe = o->wait_keyframe;
+
+	return 1;
+}
+
+// Hold a tag while reconnecting: the current GOP, with the audio alongside it
+static int holdTag(struct output_t * const o, struct tag_t * const tag)
+{
+	if (isVideoFrame(tag)) {
+		if (tag->flags & TAG_KEYFRAME) {
+			// a new GOP: the one before is not needed any more
+			while (o->count) {
+				pool_put(queuePop(o));
+				countDropped(o);
+			}
+			o->wait_keyframe = 0;
+		} else if (o->wait_keyframe) {
+			pool_put(tag);
+			countDropped(o);
+			return 1;
+		}
+	}
+
+	// the GOP outgrew the queue: start again from the next keyframe
+	if (o->count == o->length) {
+		while (o->count) {
+			pool_put(queuePop(o));
+			countDropped(o);
+		}
+		o->wait_keyframe = 1;
+
+		// and this frame is not one
+		if (isVideoFrame(tag) && ! (tag->flags & TAG_KEYFRAME)) {
+			pool_put(tag);
+			countDropped(o);
+			return 1;
+		}
+	}
+
+	queuePush(o, tag);
+	return 1;
+}
+
+// Keep a copy of a stream header, to send again after a reconnect
+//  Returns 0 if out of memory
+static int cacheHeader(struct output_t * const o, const struct tag_t * const tag)
+{
+	const int i = headerIndex(tag);
+	if (i < 0 || o->reconnect <= 0)
+		return 1;
+
+	// the old copy may be on its way out right now
+	if (o->headers[i] && o->headers[i] == o->current) {
+		pool_put(o->headers[i]);
+		o->headers[i] = NULL;
+	}
+	if (o->headers[i] == NULL)
+		o->headers[i] = pool_get(o->cache);
+	if (o->headers[i] == NULL || ! pool_reserve(o->headers[i], tag->size))
+		return 0;
+
+	memcpy(o->headers[i]->data, tag->data, tag->size);
+	o->headers[i]->size = tag->size;
+	o->headers[i]->timestamp = tag->timestamp;
+	o->headers[i]->flags = tag->flags;
+
+	return 1;
+}
+
+// The next cached header still to go out after a reconnect, or NULL
+static struct tag_t * nextHeader(struct output_t * const o)
+{
+	while (o->resend < HEADER_COUNT) {
+		struct tag_t * tag = o->headers[o->resend];
+		o->resend ++;
+		if (tag) {
+			// the cache keeps its hold, the write takes another
+			pool_share(tag, 2);
+			return tag;
+		}
+	}
+
+	return NULL;
+}
+
+// Let librtmp write a tag itself (a connection we cannot frame)
+static int writeLibrtmp(struct output_t * const o, const struct tag_t * const tag)
+{
+	// librtmp treats a would-block as a dead connection
+	if (o->native) setBlocking(o->fd, 1);
+
+	//  cast to char* avoids a warning
+	const int ret = RTMP_Write(o->rtmp, (const char *)tag->data, tag->size) > 0;
+
+	if (o->native) setBlocking(o->fd, 0);
+
+	return ret;
+}
+
+// Write queued tags until the socket is full, or until enough is done
+//  Returns 0 on socket error
+static int writeQueue(struct output_t * const o, const int until)
+{
+	for (;;) {
+		if (o->current == NULL) {
+			// after a reconnect, the headers go again before anything queued,
+			//  stamped to match what follows them
+			struct tag_t * tag = (until == WRITE_ALL ? nextHeader(o) : NULL);
+			uint32_t timestamp = 0;
+			if (tag)
+				timestamp = (o->count ? flv_TagTimestamp(queueAt(o, 0)->data) : flv_TagTimestamp(tag->data));
+			else {
+				if (o->count == 0 || until == WRITE_CURRENT)
+					return 1;
+
+				tag = queuePop(o);
+				timestamp = flv_TagTimestamp(tag->data);
+			}
+
+			if (! o->native) {
+				const int ok = writeLibrtmp(o, tag);
+				if (ok)
+					countSent(o, tag->data[0], tag->size - 11 - 4);
+				pool_put(tag);
+				if (! ok) {
+					fputs("Failed to RTMP_Write\n", stderr);
+					return lost(o);
+				}
+				continue;
+			}
+
+			if (! startMessage(o, tag, timestamp)) {
+				pool_put(tag);
+				return 0;
+			}
+
+		}
+
+		const ssize_t n = writev(o->fd, o->pos, (o->left < OUTPUT_IOV_BATCH ? o->left : OUTPUT_IOV_BATCH));
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			perror("librtmpcast: ERROR: output::writeQueue: writev() failed");
+			return lost(o);
+		}
+
+		o->left = chunk_iov_advance(&o->pos, o->left, n);
+		if (o->left == 0) {
+			countSent(o, o->current->data[0], o->current->size - 11 - 4);
+			pool_put(o->current);
+			setCurrent(o, NULL);
+		}
+	}
+}
+
+// Same, with the socket switched to blocking for the duration
+static int writeQueueBlocking(struct output_t * const o, const int until)
+{
+	if (o->native) setBlocking(o->fd, 1);
+	const int ret = writeQueue(o, until);
+	if (o->native) setBlocking(o->fd, 0);
+
+	return ret;
+}
+
+/* ************************************************************************ */
+struct output_t * output_create(const char * const url, const unsigned int length, const unsigned int watermark, const int reconnect)
+{
+	// create a structure
+	struct output_t * o = malloc(sizeof(struct output_t));
+
+	if (o == NULL) {
+		perror("librtmpcast: ERROR: output::output_create: malloc() returned NULL");
+		return NULL;
+	}
+
+	o->url = strdup(url);
+	o->link = strdup(url);
+	o->queue = malloc(length * sizeof(struct tag_t *));
+	o->cache = pool_create(HEADER_TAG_SIZE, HEADER_COUNT);
+	if (o->url == NULL || o->link == NULL || o->queue == NULL || o->cache == NULL) {
+		perror("librtmpcast: ERROR: output::output_create: malloc() returned NULL");
+		if (o->cache) pool_close(o->cache);
+		free(o->queue);
+		free(o->link);
+		free(o->url);
+		free(o);
+		return NULL;
+	}
+
+	o->head = 0;
+	atomic_init(&o->count, 0);
+	o->length = length;
+	o->watermark = watermark;
+	o->wait_keyframe = 0;
+	atomic_init(&o->dropped, 0);
+	atomic_init(&o->sent[0], 0);
+	atomic_init(&o->sent[1], 0);
+
+	o->current = NULL;
+	atomic_init(&o->writing, 0);
+	o->iov = NULL;
+	o->iov_max = 0;
+	o->pos = NULL;
+	o->left = 0;
+	o->partial = 0;
+
+	o->fd = -1;
+	o->native = 0;
+
+	atomic_init(&o->state, OUTPUT_CONNECTED);
+	atomic_init(&o->cancel, 0);
+	o->reconnect = (reconnect ? reconnect : OUTPUT_DEFAULT_RECONNECT);
+	for (int i = 0; i < HEADER_COUNT; i ++)
+		o->headers[i] = NULL;
+	o->resend = HEADER_COUNT;
+	o->want_keyframe = 0;
+
+	/* *************************************************** */
+	// Init RTMP code
+	o->rtmp = RTMP_Alloc();
+
+	if (o->rtmp == NULL) {
+		fputs("Failed to create RTMP object\n", stderr);
+		pool_close(o->cache);
+		free(o->queue);
+		free(o->link);
+		free(o->url);
+		free(o);
+		return NULL;
+	}
+
+	RTMP_Init(o->rtmp);
+
+	if (! RTMP_SetupURL(o->rtmp, o->link)) {
+		fprintf(stderr, "Failed to parse RTMP URL '%s'\n", url);
+		RTMP_Free(o->rtmp);
+		pool_close(o->cache);
+		free(o->queue);
+		free(o->link);
+		free(o->url);
+		free(o);
+		return NULL;
+	}
+	RTMP_EnableWrite(o->rtmp);
+
+	return o;
+}
+
+int output_connect(struct output_t * const o)
+{
+	if (! connectRTMP(o))
+		return 0;
+
+	attach(o);
+	return 1;
+}
+
+int output_send(struct output_t * const o, struct tag_t * const tag)
+{
+	const int state = checkReconnect(o);
+	if (state < 0 || ! cacheHeader(o, tag)) {
+		pool_put(tag);
+		return 0;
+	}
+	if (state == 0)
+		return holdTag(o, tag);
+
+	// full: make room by dropping all queued video, even under the watermark
+	if (o->count == o->length) {
+		if (! output_flush(o)) {
+			pool_put(tag);
+			return 0;
+		}
+		if (o->count == o->length && removeVideo(o, 0, o->count))
+			o->wait_keyframe = 1;
+	}
+
+	if (isVideoFrame(tag)) {
+		if (o->wait_keyframe && ! (tag->flags & TAG_KEYFRAME)) {
+			pool_put(tag);
+			countDropped(o);
+			return output_flush(o);
+		}
+		o->wait_keyframe = 0;
+	}
+
+	// still full of audio and headers: this destination cannot keep up at all,
+	//  but the encoder (and any other destination) must not wait for it
+	if (o->count == o->length) {
+		pool_put(tag);
+		countDropped(o);
+		return 1;
+	}
+
+	queuePush(o, tag);
+	applyDropPolicy(o);
+
+	return output_flush(o);
+}
+
+int output_send_direct(struct output_t * const o, const uint8_t type, const uint32_t timestamp, const unsigned int flags, const struct iovec * const payload, const int count)
+{
+	o->partial = 0;
+
+	// the drop policy applies here just as in output_send
+	if (type == 9) {
+		if (o->wait_keyframe && ! (flags & TAG_KEYFRAME)) {
+			countDropped(o);
+			return 1;
+		}
+		o->wait_keyframe = 0;
+	}
+
+	// only when this would be the next message on the wire anyway
+	//  (not while reconnecting, or with headers to send again first)
+	if (! o->native || o->current || o->count || o->resend < HEADER_COUNT)
+		return 0;
+
+	uint32_t length = 0;
+	for (int i = 0; i < count; i ++)
+		length += payload[i].iov_len;
+
+	const int max = chunk_iov_max(o->rtmp, length, count);
+	if (max > o->iov_max) {
+		struct iovec * iov = realloc(o->iov, max * sizeof(struct iovec));
+		if (iov == NULL) {
+			perror("librtmpcast: ERROR: output::output_send_direct: realloc() returned NULL");
+			return -1;
+		}
+		o->iov = iov;
+		o->iov_max = max;
+	}
+
+	struct iovec * pos = o->iov;
+	int left = chunk_iov(o->rtmp, &o->header, CHUNK_STREAM_MEDIA, type, timestamp, payload, count, o->iov);
+
+	while (left > 0) {
+		const ssize_t n = writev(o->fd, pos, (left < OUTPUT_IOV_BATCH ? left : OUTPUT_IOV_BATCH));
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			perror("librtmpcast: ERROR: output::output_send_direct: writev() failed");
+			// reconnecting: the frame is held, as if the socket were full
+			o->partial = 0;
+			return (lost(o) ? 0 : -1);
+		}
+
+		o->partial += n;
+		left = chunk_iov_advance(&pos, left, n);
+	}
+
+	countSent(o, type, length);
+	return 1;
+}
+
+int output_resume(struct output_t * const o, struct tag_t * const tag)
+{
+	// nothing went out, so this is just a regular send
+	if (o->partial == 0)
+		return output_send(o, tag);
+
+	if (! startMessage(o, tag, flv_TagTimestamp(tag->data))) {
+		pool_put(tag);
+		return 0;
+	}
+
+	// the tag frames the same way, so skip what the socket already has
+	o->left = chunk_iov_advance(&o->pos, o->left, o->partial);
+	o->partial = 0;
+
+	return output_flush(o);
+}
+
+int output_flush(struct output_t * const o)
+{
+	const int state = checkReconnect(o);
+	if (state <= 0)
+		return state + 1;
+
+	return writeQueue(o, WRITE_ALL);
+}
+
+// while reconnecting, there is nothing to drain into: what is held stays
+int output_drain(struct output_t * const o)
+{
+	const int state = checkReconnect(o);
+	if (state <= 0)
+		return state + 1;
+
+	return writeQueueBlocking(o, WRITE_ALL);
+}
+
+// Handle any packets from the remote to us.
+//  We will use poll() to see if packet is waiting,
+//  then read it and dispatch to the handler.
+int output_service(struct output_t * const o)
+{
+	const int state = checkReconnect(o);
+	if (state <= 0)
+		return state + 1;
+
+	struct pollfd pfd = { o->fd, POLLIN, 0 };
+
+	if (poll(&pfd, 1, 0) == -1) {
+		if (errno != EINTR)
+			perror("Error calling poll()");
+		return 1;
+	}
+
+	if (! (pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+		return 1;
+
+	// librtmp may answer with a (blocking) write of its own, which must not
+	//  land in the middle of one of our chunks: finish the current message first
+	if (o->native) setBlocking(o->fd, 1);
+
+	int ok = writeQueue(o, WRITE_CURRENT);
+
+	// socket is readable, safe to call RTMP_ReadPacket
+	//  (unless that write found the connection gone)
+	if (ok && o->fd != -1) {
+		RTMPPacket packet = { 0 };
+
+		if (RTMP_ReadPacket(o->rtmp, &packet) && RTMPPacket_IsReady(&packet)) {
+			// this function does all the internal stuff we need
+			RTMP_ClientPacket(o->rtmp, &packet);
+			RTMPPacket_Free(&packet);
+		}
+
+		if (! RTMP_IsConnected(o->rtmp)) {
+			fputs("RTMP connection closed\n", stderr);
+			ok = lost(o);
+		}
+	}
+
+	if (o->native) setBlocking(o->fd, 0);
+
+	return ok;
+}
+
+unsigned int output_backlog(const struct output_t * const o, const unsigned int kbps)
+{
+	unsigned int backlog = queueDuration(o);
+
+	// bytes in the socket's send buffer, not yet acknowledged by the peer
+	int unsent;
+	if (kbps && ioctl(o->fd, SIOCOUTQ, &unsent) == 0 && unsent > 0)
+		backlog += (uint64_t)unsent * 8 / kbps;
+
+	return backlog;
+}
+
+unsigned int output_pending(const struct output_t * const o)
+{
+	return atomic_load_explicit(&o->count, memory_order_relaxed) + atomic_load_explicit(&o->writing, memory_order_relaxed);
+}
+
+unsigned long output_dropped(const struct output_t * const o)
+{
+	return atomic_load_explicit(&o->dropped, memory_order_relaxed);
+}
+
+uint64_t output_sent(const struct output_t * const o, const uint8_t type)
+{
+	return (type == 8 || type == 9 ? atomic_load_explicit(&o->sent[type - 8], memory_order_relaxed) : 0);
+}
+
+int output_wants_keyframe(struct output_t * const o)
+{
+	const int ret = o->want_keyframe;
+	o->want_keyframe = 0;
+	return ret;
+}
+
+int output_fd(const struct output_t * const o)
+{
+	return o->fd;
+}
+
+const char * output_url(const struct output_t * const o)
+{
+	return o->url;
+}
+
+void output_close(struct output_t * const o)
+{
+	// a reconnect in progress is called off (it may be mid-connect: librtmp
+	//  gives up after OUTPUT_RECONNECT_TIMEOUT)
+	int state = atomic_load(&o->state);
+	if (state != OUTPUT_CONNECTED) {
+		atomic_store(&o->cancel, 1);
+		pthread_join(o->thread, NULL);
+		state = atomic_load(&o->state);
+	}
+
+	while (o->count)
+		pool_put(queuePop(o));
+	if (o->current)
+		pool_put(o->current);
+	for (int i = 0; i < HEADER_COUNT; i ++)
+		if (o->headers[i]) pool_put(o->headers[i]);
+
+	// librtmp sends deleteStream on close, with blocking writes
+	//  (after a failed reconnect, the thread already closed it)
+	if (o->native) setBlocking(o->fd, 1);
+	if (state != OUTPUT_FAILED)
+		RTMP_Close(o->rtmp);
+	RTMP_Free(o->rtmp);
+
+	pool_close(o->cache);
+	free(o->iov);
+	free(o->queue);
+	free(o->link);
+	free(o->url);
+	free(o);
+}
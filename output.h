@@ -0,0 +1,71 @@
+#ifndef RTMPCAST_OUTPUT_H
+#define RTMPCAST_OUTPUT_H
+
+// One RTMP destination: the connection, and a bounded queue of outgoing tags
+//  drained from a non-blocking socket.
+//
+// When the queued media spans more than the watermark, video is dropped:
+//  first disposable frames, then whole GOPs up to the newest keyframe.
+//  A full queue drops all queued video.  Audio and headers are only dropped
+//  when the queue is full of nothing else.  Sending never waits on the
+//  network, so one slow destination cannot hold up the encoder or the others.
+//
+// Tags may be shared with other outputs (see pool_share): each output puts
+//  its own reference, and never modifies the tag.
+//
+// If the connection drops, a background thread reconnects with growing
+//  delays between attempts.  Meanwhile tags are held: the current GOP, from
+//  its keyframe, with the audio alongside it.  Once reconnected, the stream
+//  headers go out again (copies are kept of the last ones sent), then the
+//  held tags.  Calls report a socket error only once the attempts run out.
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "pool.h"
+
+struct output_t;
+
+// reconnect: attempts before giving up, 0 for the default, -1 for none
+struct output_t * output_create(const char * url, unsigned int length, unsigned int watermark, int reconnect);
+// Connect and publish (blocking)
+int output_connect(struct output_t * output);
+
+// Queue a finished tag.  The output puts its reference once sent or dropped.
+//  Returns 0 on socket error.
+int output_send(struct output_t * output, struct tag_t * tag);
+
+// Send a video frame straight from encoder memory, only while nothing is queued.
+//  Returns 1 if it was sent (or dropped by policy), -1 on error, or 0 if it
+//  could not be sent in full.  0 must be followed by output_resume with a tag
+//  holding the same frame, which takes over from where the socket stopped.
+int output_send_direct(struct output_t * output, uint8_t type, uint32_t timestamp, unsigned int flags, const struct iovec * payload, int count);
+int output_resume(struct output_t * output, struct tag_t * tag);
+
+// Write as much as the socket takes without blocking.  Returns 0 on socket error.
+int output_flush(struct output_t * output);
+// Write everything queued, blocking.  Returns 0 on socket error.
+int output_drain(struct output_t * output);
+// Handle packets from the server.  Returns 0 on socket error.
+int output_service(struct output_t * output);
+
+// Milliseconds of media not yet on the wire: the queued tags, plus what
+//  the kernel still holds unsent (SIOCOUTQ), at kbps for the whole stream
+unsigned int output_backlog(const struct output_t * output, unsigned int kbps);
+// Tags waiting (including a partly written one)
+unsigned int output_pending(const struct output_t * output);
+// Tags dropped so far
+unsigned long output_dropped(const struct output_t * output);
+// Payload bytes of one tag type (8 audio, 9 video) sent in full so far
+uint64_t output_sent(const struct output_t * output, uint8_t type);
+// After a reconnect with no keyframe to replay: once, whether the encoder
+//  should make one
+int output_wants_keyframe(struct output_t * output);
+// -1 while reconnecting
+int output_fd(const struct output_t * output);
+const char * output_url(const struct output_t * output);
+
+// Queued tags are discarded, call output_drain first to send them
+void output_close(struct output_t * output);
+
+#endif
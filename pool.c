@@ -0,0 +1,214 @@
+#include "pool.h"
+
+// for malloc
+#include <stdlib.h>
+// for fprintf
+#include <stdio.h>
+
+#include <pthread.h>
+
+// structure definition for the pool (private data)
+struct pool_t {
+	pthread_mutex_t lock;
+
+	// free list
+	struct tag_t * free;
+	unsigned int free_count;
+	// how many free buffers to hold on to
+	unsigned int keep;
+
+	// size for new buffers, raised whenever one has to grow
+	size_t size;
+
+	// bytes of buffer memory currently allocated, and the high-water mark
+	size_t allocated;
+	size_t peak;
+};
+
+// Account for a change in allocated bytes.  Call with the lock held.
+static void account(struct pool_t * const pool, const size_t add, const size_t remove)
+{
+	pool->allocated += add;
+	pool->allocated -= remove;
+	if (pool->allocated > pool->peak)
+		pool->peak = pool->allocated;
+}
+
+static struct tag_t * newTag(struct pool_t * const pool, const size_t size)
+{
+	struct tag_t * tag = malloc(sizeof(struct tag_t));
+	if (tag == NULL) {
+		perror("librtmpcast: ERROR: pool::newTag: malloc() returned NULL");
+		return NULL;
+	}
+
+	tag->data = malloc(size);
+	if (tag->data == NULL) {
+		perror("librtmpcast: ERROR: pool::newTag: malloc() returned NULL");
+		free(tag);
+		return NULL;
+	}
+
+	tag->pool = pool;
+	tag->next = NULL;
+	tag->timestamp = 0;
+	tag->size = 0;
+	tag->flags = 0;
+	tag->refs = 1;
+	tag->capacity = size;
+
+	return tag;
+}
+
+static void freeTag(struct tag_t * const tag)
+{
+	free(tag->data);
+	free(tag);
+}
+
+struct pool_t * pool_create(const size_t size, const unsigned int count)
+{
+	struct pool_t * pool = malloc(sizeof(struct pool_t));
+
+	if (pool == NULL) {
+		perror("librtmpcast: ERROR: pool::pool_create: malloc() returned NULL");
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&pool->lock, NULL)) {
+		fputs("librtmpcast: ERROR: pool::pool_create: pthread_mutex_init() failed\n", stderr);
+		free(pool);
+		return NULL;
+	}
+
+	pool->free = NULL;
+	pool->free_count = 0;
+	pool->keep = count;
+	pool->size = size;
+	pool->allocated = 0;
+	pool->peak = 0;
+
+	for (unsigned int i = 0; i < count; i ++) {
+		struct tag_t * tag = newTag(pool, size);
+		if (tag == NULL) {
+			pool_close(pool);
+			return NULL;
+		}
+
+		account(pool, size, 0);
+		tag->next = pool->free;
+		pool->free = tag;
+		pool->free_count ++;
+	}
+
+	return pool;
+}
+
+struct tag_t * pool_get(struct pool_t * const pool)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	struct tag_t * tag = pool->free;
+	if (tag) {
+		pool->free = tag->next;
+		pool->free_count --;
+		pthread_mutex_unlock(&pool->lock);
+
+		tag->next = NULL;
+		tag->size = 0;
+		tag->flags = 0;
+		tag->refs = 1;
+		return tag;
+	}
+
+	// none free, make another at the current size
+	const size_t size = pool->size;
+	account(pool, size, 0);
+	pthread_mutex_unlock(&pool->lock);
+
+	tag = newTag(pool, size);
+	if (tag == NULL) {
+		pthread_mutex_lock(&pool->lock);
+		account(pool, 0, size);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return tag;
+}
+
+int pool_reserve(struct tag_t * const tag, const size_t capacity)
+{
+	if (capacity <= tag->capacity)
+		return 1;
+
+	// grow with some headroom, so a run of growing frames does not realloc every time
+	const size_t size = capacity + capacity / 4;
+	uint8_t * data = realloc(tag->data, size);
+	if (data == NULL) {
+		perror("librtmpcast: ERROR: pool::pool_reserve: realloc() returned NULL");
+		return 0;
+	}
+
+	struct pool_t * const pool = tag->pool;
+	pthread_mutex_lock(&pool->lock);
+	account(pool, size, tag->capacity);
+	if (size > pool->size)
+		pool->size = size;
+	pthread_mutex_unlock(&pool->lock);
+
+	tag->data = data;
+	tag->capacity = size;
+
+	return 1;
+}
+
+void pool_share(struct tag_t * const tag, const unsigned int count)
+{
+	tag->refs = count;
+}
+
+void pool_put(struct tag_t * const tag)
+{
+	struct pool_t * const pool = tag->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	// other owners still need it
+	if (-- tag->refs > 0) {
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+
+	if (pool->free_count < pool->keep) {
+		tag->next = pool->free;
+		pool->free = tag;
+		pool->free_count ++;
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+
+	// enough spares already, release this one
+	account(pool, 0, tag->capacity);
+	pthread_mutex_unlock(&pool->lock);
+
+	freeTag(tag);
+}
+
+void pool_usage(struct pool_t * const pool, size_t * const allocated, size_t * const peak)
+{
+	pthread_mutex_lock(&pool->lock);
+	if (allocated) *allocated = pool->allocated;
+	if (peak) *peak = pool->peak;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_close(struct pool_t * const pool)
+{
+	while (pool->free) {
+		struct tag_t * tag = pool->free;
+		pool->free = tag->next;
+		freeTag(tag);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
@@ -0,0 +1,54 @@
+#ifndef RTMPCAST_POOL_H
+#define RTMPCAST_POOL_H
+
+// Recyclable tag buffers, one pool per track.
+//  Buffers start at a size suited to the track's bitrate and grow on demand.
+//  get / put may be called from different threads.
+//  A tag can be shared by several owners (one per destination):
+//  it goes back to the pool when the last of them puts it.
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pool_t;
+
+// tag flags
+#define TAG_KEYFRAME 1
+#define TAG_DISPOSABLE 2
+
+// A complete FLV tag (header, payload, trailing size) in a pooled buffer
+struct tag_t {
+	struct pool_t * pool;
+	struct tag_t * next;
+
+	// in milliseconds, same as written in the tag header
+	uint32_t timestamp;
+	// bytes used in data
+	uint32_t size;
+	// TAG_* hints for the send queue
+	unsigned int flags;
+	// owners still holding the tag
+	unsigned int refs;
+
+	size_t capacity;
+	uint8_t * data;
+};
+
+// Preallocate count buffers of size bytes, and keep up to that many for reuse
+struct pool_t * pool_create(size_t size, unsigned int count);
+// returns NULL if out of memory
+struct tag_t * pool_get(struct pool_t * pool);
+// Make sure tag->data can hold at least capacity bytes (contents are kept)
+//  returns 0 if out of memory
+int pool_reserve(struct tag_t * tag, size_t capacity);
+// Hand the tag to count owners, each of which must pool_put it.
+//  Call while the tag still has its one owner from pool_get.
+void pool_share(struct tag_t * tag, unsigned int count);
+// Give up one owner's hold on a buffer, returning it to its pool after the last
+void pool_put(struct tag_t * tag);
+// Bytes allocated by the pool right now, and the most it has ever held
+void pool_usage(struct pool_t * pool, size_t * allocated, size_t * peak);
+// All buffers must have been returned first
+void pool_close(struct pool_t * pool);
+
+#endif
@@ -0,0 +1,99 @@
+#include "queue.h"
+
+// for aligned_alloc
+#include <stdlib.h>
+// for fprintf
+#include <stdio.h>
+
+#include <stdatomic.h>
+
+// structure definition for the queue (private data)
+//  head is only written by the consumer, tail only by the producer,
+//  so each side owns one index and reads the other with acquire order.
+struct queue_t {
+	// capacity is a power of two, so index wrap is a mask
+	unsigned int mask;
+
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+
+	void * slot[];
+};
+
+struct queue_t * queue_create(unsigned int capacity)
+{
+	// round capacity up to a power of two
+	unsigned int size = 1;
+	while (size < capacity)
+		size <<= 1;
+
+	// the indices are on their own cache lines only if the struct starts on
+	//  one (and aligned_alloc wants a multiple of the alignment)
+	const size_t bytes = sizeof(struct queue_t) + size * sizeof(void *);
+	struct queue_t * q = aligned_alloc(_Alignof(struct queue_t), (bytes + _Alignof(struct queue_t) - 1) & ~(_Alignof(struct queue_t) - 1));
+
+	if (q == NULL) {
+		perror("librtmpcast: ERROR: queue::queue_create: aligned_alloc() returned NULL");
+		return NULL;
+	}
+
+	q->mask = size - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+
+	return q;
+}
+
+// Producer side: append an item, or return 0 if there is no room
+int queue_push(struct queue_t * const q, void * const item)
+{
+	const unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	const unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	if (tail - head > q->mask)
+		return 0;
+
+	q->slot[tail & q->mask] = item;
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+	return 1;
+}
+
+// Consumer side: look at the oldest item without removing it
+void * queue_peek(struct queue_t * const q)
+{
+	const unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	const unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	if (head == tail)
+		return NULL;
+
+	return q->slot[head & q->mask];
+}
+
+// Consumer side: remove and return the oldest item
+void * queue_pop(struct queue_t * const q)
+{
+	const unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	const unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	if (head == tail)
+		return NULL;
+
+	void * item = q->slot[head & q->mask];
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+	return item;
+}
+
+// Approximate when called from a third thread, exact from either end
+unsigned int queue_count(struct queue_t * const q)
+{
+	return atomic_load_explicit(&q->tail, memory_order_acquire) -
+		atomic_load_explicit(&q->head, memory_order_acquire);
+}
+
+void queue_close(struct queue_t * const q)
+{
+	free(q);
+}
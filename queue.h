@@ -0,0 +1,17 @@
+#ifndef RTMPCAST_QUEUE_H
+#define RTMPCAST_QUEUE_H
+
+// Bounded lock-free queue of pointers, single-producer / single-consumer.
+//  Exactly one thread may push and exactly one thread may peek / pop.
+struct queue_t;
+
+struct queue_t * queue_create(unsigned int capacity);
+// returns 0 if the queue is full
+int queue_push(struct queue_t * queue, void * item);
+// return NULL if the queue is empty
+void * queue_peek(struct queue_t * queue);
+void * queue_pop(struct queue_t * queue);
+unsigned int queue_count(struct queue_t * queue);
+void queue_close(struct queue_t * queue);
+
+#endif
@@ -0,0 +1,400 @@
+#include "recorder.h"
+
+// onMetaData serializers
+#include "flv.h"
+
+// for malloc
+#include <stdlib.h>
+// for fprintf
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// bytes of tags that may wait for the disk
+#define RECORDER_BUFFER (8 * 1024 * 1024)
+// the writer waits for this much before writing, or for the flush interval
+#define RECORDER_CHUNK (1024 * 1024)
+#define RECORDER_FLUSH_INTERVAL 1
+// keyframes the index has room for (a few hours at usual keyframe intervals);
+//  longer recordings keep every second, third... keyframe instead
+#define RECORDER_INDEX_MAX 4096
+
+// where the onMetaData tag goes: straight after the FLV header
+#define META_OFFSET 13
+
+struct keyframe_t {
+	uint32_t timestamp;
+	uint64_t position;
+};
+
+// structure definition for the recorder (private data)
+struct recorder_t {
+	int fd;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	// writer waits for data, and blocking writes for room
+	pthread_cond_t more;
+	pthread_cond_t room;
+
+	// ring buffer: total bytes ever queued (in) and written (out)
+	//  both under lock
+	uint8_t * ring;
+	uint64_t in;
+	uint64_t out;
+	int closing;
+	// a write failed: everything after is discarded
+	int error;
+
+	int blocking;
+
+	// only touched by the side calling recorder_write
+	int wait_keyframe;
+	unsigned long dropped;
+	uint32_t timestamp_last;
+	struct keyframe_t * index;
+	unsigned int index_count;
+	unsigned int index_max;
+
+	// the caller's onMetaData entries, and the payload size set aside for it
+	struct {
+		uint8_t * entries;
+		size_t size;
+		unsigned int count;
+		size_t payload;
+	} meta;
+};
+
+/* ************************************************************************ */
+// onMetaData
+static unsigned int indexCount(const struct recorder_t * const rec, const unsigned int step)
+{
+	return (rec->index_count + step - 1) / step;
+}
+
+// Bytes metaBody will write
+static size_t metaBodySize(const struct recorder_t * const rec, const unsigned int step)
+{
+	const size_t n = indexCount(rec, step);
+
+	return 13 + 5 + rec->meta.size + // "onMetaData", array, caller's entries
+		19 + 19 + // duration, filesize
+		11 + 1 + // "keyframes" object
+		7 + 5 + 9 * n + // times
+		15 + 5 + 9 * n + // filepositions
+		3; // object end
+}
+
+// onMetaData up to the end of the keyframe index, with every step'th keyframe
+static uint8_t * metaBody(const struct recorder_t * const rec, uint8_t * p, const double duration, const double filesize, const unsigned int step)
+{
+	const uint32_t n = indexCount(rec, step);
+
+	p = amf_string(p, "onMetaData");
+	// the caller's entries, then ours, then padding
+	p = amf_ecma_array(p, rec->meta.count + 4);
+	memcpy(p, rec->meta.entries, rec->meta.size);
+	p += rec->meta.size;
+
+	p = amf_ecma_array_entry(p, "duration", duration);
+	p = amf_ecma_array_entry(p, "filesize", filesize);
+
+	p = amf_object(pstring(p, "keyframes"));
+	p = amf_strict_array(pstring(p, "times"), n);
+	for (unsigned int i = 0; i < rec->index_count; i += step)
+		p = amf_number(p, rec->index[i].timestamp / 1000.0);
+	p = amf_strict_array(pstring(p, "filepositions"), n);
+	for (unsigned int i = 0; i < rec->index_count; i += step)
+		p = amf_number(p, rec->index[i].position);
+
+	return amf_object_end(p);
+}
+
+// The whole onMetaData tag, padded out to its reserved size
+//  Returns the tag size
+static size_t metaTag(const struct recorder_t * const rec, uint8_t * const tag, const double duration, const double filesize, const unsigned int step)
+{
+	uint8_t * p = flv_TagHeader(tag, 18, 0);
+	p = metaBody(rec, p, duration, filesize, step);
+
+	// a long string fills the rest: 9 bytes of name, 5 of type and length
+	const size_t padding = rec->meta.payload - (p - (tag + 11)) - 14 - 3;
+	p = pstring(p, "padding");
+	*p = 0x0C;
+	p = u32be(p + 1, padding);
+	memset(p, ' ', padding);
+	p += padding;
+
+	p = amf_ecma_array_end(p);
+	return flv_TagFinish(tag, p);
+}
+
+/* ************************************************************************ */
+// Write all of it, or give up
+static int writeAll(const int fd, const uint8_t * p, size_t size)
+{
+	while (size > 0) {
+		const ssize_t n = write(fd, p, size);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("librtmpcast: ERROR: recorder: write() failed");
+			return 0;
+		}
+		p += n;
+		size -= n;
+	}
+
+	return 1;
+}
+
+static void * threadWrite(void * const arg)
+{
+	struct recorder_t * const rec = arg;
+
+	pthread_mutex_lock(&rec->lock);
+	for (;;) {
+		// a big write, or whatever is there after the flush interval
+		if (rec->in - rec->out < RECORDER_CHUNK && ! rec->closing) {
+			struct timespec until;
+			clock_gettime(CLOCK_MONOTONIC, &until);
+			until.tv_sec += RECORDER_FLUSH_INTERVAL;
+			pthread_cond_timedwait(&rec->more, &rec->lock, &until);
+		}
+
+		if (rec->in == rec->out) {
+			if (rec->closing)
+				break;
+			continue;
+		}
+
+		// up to the end of the ring at most; the rest next time around
+		const size_t start = rec->out % RECORDER_BUFFER;
+		size_t size = rec->in - rec->out;
+		if (size > RECORDER_BUFFER - start)
+			size = RECORDER_BUFFER - start;
+
+		// the producer only adds after in, so this stretch is ours
+		pthread_mutex_unlock(&rec->lock);
+		const int ok = rec->error || writeAll(rec->fd, rec->ring + start, size);
+		pthread_mutex_lock(&rec->lock);
+
+		if (! ok)
+			rec->error = 1;
+		rec->out += size;
+		pthread_cond_signal(&rec->room);
+	}
+	pthread_mutex_unlock(&rec->lock);
+
+	return NULL;
+}
+
+/* ************************************************************************ */
+struct recorder_t * recorder_create(const char * const filename, const uint8_t flags, const uint8_t * const entries, const size_t size, const unsigned int count, const int blocking)
+{
+	// create a structure
+	struct recorder_t * rec = calloc(1, sizeof(struct recorder_t));
+
+	if (rec == NULL) {
+		perror("librtmpcast: ERROR: recorder::recorder_create: calloc() returned NULL");
+		return NULL;
+	}
+
+	rec->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (rec->fd == -1) {
+		fprintf(stderr, "librtmpcast: ERROR: recorder::recorder_create: failed to open '%s': %s\n", filename, strerror(errno));
+		free(rec);
+		return NULL;
+	}
+
+	rec->blocking = blocking;
+	rec->ring = malloc(RECORDER_BUFFER);
+	rec->index = malloc(RECORDER_INDEX_MAX * sizeof(struct keyframe_t));
+	rec->index_max = RECORDER_INDEX_MAX;
+	rec->meta.entries = malloc(size);
+	rec->meta.size = size;
+	rec->meta.count = count;
+
+	// room for a full index, whatever the stream turns out to be
+	rec->meta.payload = metaBodySize(rec, 1) + 18 * RECORDER_INDEX_MAX + 14 + 3;
+
+	uint8_t * const tag = malloc(11 + rec->meta.payload + 4);
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+	int ok = (rec->ring && rec->index && rec->meta.entries && tag);
+	if (! ok)
+		perror("librtmpcast: ERROR: recorder::recorder_create: malloc() returned NULL");
+	else {
+		memcpy(rec->meta.entries, entries, size);
+
+		// FLV header, then onMetaData with nothing known yet
+		const uint8_t flvHeader[] = { 0x46, 0x4C, 0x56, 0x01, flags, 0, 0, 0, 9, 0, 0, 0, 0 };
+		const size_t tagSize = metaTag(rec, tag, 0, 0, 1);
+
+		ok = writeAll(rec->fd, flvHeader, META_OFFSET) && writeAll(rec->fd, tag, tagSize);
+		rec->in = rec->out = META_OFFSET + tagSize;
+	}
+
+	if (ok) {
+		pthread_mutex_init(&rec->lock, NULL);
+		pthread_cond_init(&rec->more, &attr);
+		pthread_cond_init(&rec->room, NULL);
+
+		if (pthread_create(&rec->thread, NULL, threadWrite, rec)) {
+			fputs("librtmpcast: ERROR: recorder::recorder_create: pthread_create() failed\n", stderr);
+			pthread_cond_destroy(&rec->room);
+			pthread_cond_destroy(&rec->more);
+			pthread_mutex_destroy(&rec->lock);
+			ok = 0;
+		}
+	}
+
+	pthread_condattr_destroy(&attr);
+	free(tag);
+
+	if (! ok) {
+		close(rec->fd);
+		free(rec->meta.entries);
+		free(rec->index);
+		free(rec->ring);
+		free(rec);
+		return NULL;
+	}
+
+	return rec;
+}
+
+int recorder_write(struct recorder_t * const rec, const uint32_t timestamp, const int keyframe, const struct iovec * const iov, const int count)
+{
+	const int video = (((const uint8_t *)iov[0].iov_base)[0] == 9);
+
+	// after a gap, video is useless until the next keyframe
+	if (video && rec->wait_keyframe && ! keyframe) {
+		rec->dropped ++;
+		return 0;
+	}
+
+	size_t size = 0;
+	for (int i = 0; i < count; i ++)
+		size += iov[i].iov_len;
+
+	pthread_mutex_lock(&rec->lock);
+
+	if (rec->blocking) {
+		while (size > RECORDER_BUFFER - (rec->in - rec->out) && ! rec->error)
+			pthread_cond_wait(&rec->room, &rec->lock);
+	}
+
+	// the disk is behind (or gone): leave this one out
+	if (rec->error || size > RECORDER_BUFFER - (rec->in - rec->out)) {
+		pthread_mutex_unlock(&rec->lock);
+
+		if (rec->dropped ++ == 0)
+			fputs("librtmpcast: WARNING: recorder: disk is behind, leaving tags out of the file\n", stderr);
+		if (video)
+			rec->wait_keyframe = 1;
+		return 0;
+	}
+
+	const uint64_t position = rec->in;
+
+	// copy in, wrapping around the end of the ring
+	size_t at = rec->in % RECORDER_BUFFER;
+	for (int i = 0; i < count; i ++) {
+		const uint8_t * p = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		while (left > 0) {
+			size_t n = RECORDER_BUFFER - at;
+			if (n > left)
+				n = left;
+			memcpy(rec->ring + at, p, n);
+			at = (at + n) % RECORDER_BUFFER;
+			p += n;
+			left -= n;
+		}
+	}
+
+	const int wake = (rec->in - rec->out < RECORDER_CHUNK && rec->in + size - rec->out >= RECORDER_CHUNK);
+	rec->in += size;
+	if (wake)
+		pthread_cond_signal(&rec->more);
+
+	pthread_mutex_unlock(&rec->lock);
+
+	if (video && keyframe) {
+		rec->wait_keyframe = 0;
+
+		// sequence headers count as keyframes too, but are not worth seeking to
+		if (count > 0 && iov[0].iov_len >= 13 && ((const uint8_t *)iov[0].iov_base)[12] == 0)
+			return 1;
+
+		if (rec->index_count == rec->index_max) {
+			struct keyframe_t * index = realloc(rec->index, 2 * rec->index_max * sizeof(struct keyframe_t));
+			if (index) {
+				rec->index = index;
+				rec->index_max *= 2;
+			}
+		}
+		if (rec->index_count < rec->index_max) {
+			rec->index[rec->index_count].timestamp = timestamp;
+			rec->index[rec->index_count].position = position;
+			rec->index_count ++;
+		}
+	}
+
+	if (timestamp > rec->timestamp_last)
+		rec->timestamp_last = timestamp;
+
+	return 1;
+}
+
+unsigned long recorder_dropped(const struct recorder_t * const rec)
+{
+	return rec->dropped;
+}
+
+void recorder_close(struct recorder_t * const rec)
+{
+	// let the writer finish
+	pthread_mutex_lock(&rec->lock);
+	rec->closing = 1;
+	pthread_cond_signal(&rec->more);
+	pthread_mutex_unlock(&rec->lock);
+	pthread_join(rec->thread, NULL);
+
+	// fill in onMetaData, thinning the index until it fits
+	if (! rec->error) {
+		unsigned int step = 1;
+		while (metaBodySize(rec, step) + 14 + 3 > rec->meta.payload)
+			step ++;
+
+		uint8_t * const tag = malloc(11 + rec->meta.payload + 4);
+		if (tag == NULL)
+			perror("librtmpcast: ERROR: recorder::recorder_close: malloc() returned NULL");
+		else {
+			const size_t tagSize = metaTag(rec, tag, rec->timestamp_last / 1000.0, rec->in, step);
+			if (pwrite(rec->fd, tag, tagSize, META_OFFSET) != (ssize_t)tagSize)
+				perror("librtmpcast: ERROR: recorder: pwrite() of onMetaData failed");
+			free(tag);
+		}
+	}
+
+	if (close(rec->fd) == -1)
+		perror("librtmpcast: ERROR: recorder: close() failed");
+
+	pthread_cond_destroy(&rec->room);
+	pthread_cond_destroy(&rec->more);
+	pthread_mutex_destroy(&rec->lock);
+	free(rec->meta.entries);
+	free(rec->index);
+	free(rec->ring);
+	free(rec);
+}
@@ -0,0 +1,30 @@
+#ifndef RTMPCAST_RECORDER_H
+#define RTMPCAST_RECORDER_H
+
+// Local FLV copy of the stream, written out by a background thread.
+//  Tags are copied into a large ring buffer and go to disk in big writes,
+//  so a slow disk does not hold up the stream: if it falls too far behind,
+//  tags are left out of the file instead (video until the next keyframe).
+//  On close, onMetaData is rewritten in place with the duration, file size
+//  and a keyframe index, so players can seek without scanning the file.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct recorder_t;
+
+// Open filename, and write the FLV header (flags: its audio / video bits)
+//  and an onMetaData tag holding count ECMA array entries, already
+//  serialized, with room left for the fields filled in at close.
+// blocking: wait for the disk instead of leaving tags out (offline mode)
+struct recorder_t * recorder_create(const char * filename, uint8_t flags, const uint8_t * entries, size_t size, unsigned int count, int blocking);
+// Queue one complete tag, in pieces (the first one starts with the tag header)
+//  Returns 0 if the tag was left out of the file
+int recorder_write(struct recorder_t * rec, uint32_t timestamp, int keyframe, const struct iovec * iov, int count);
+// Tags left out of the file so far
+unsigned long recorder_dropped(const struct recorder_t * rec);
+// Write out everything queued, fill in onMetaData, and close the file
+void recorder_close(struct recorder_t * rec);
+
+#endif
@@ -0,0 +1,469 @@
+#include "ring.h"
+
+// for malloc
+#include <stdlib.h>
+// for fprintf
+#include <stdio.h>
+// for memcpy
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// input frames converted at a time
+#define RING_CHUNK 256
+// output buffer, frames: room for a block plus a chunk's output, at up to 6x
+#define RING_CAPACITY 8192
+// resampler: taps on each side of the output sample, and the most phases
+//  (the output rate over the greatest common divisor of the two rates)
+#define RING_HALF 16
+#define RING_TAPS (2 * RING_HALF)
+#define RING_MAX_PHASES 1024
+// passband edge, as a fraction of the lower Nyquist frequency
+#define RING_CUTOFF 0.91
+
+// structure definition for the ring (private data)
+struct ring_t {
+	int format;
+	unsigned int channels;
+	unsigned int in_rate, out_rate;
+
+	// interleaved int16 at the output rate, RING_CAPACITY frames
+	int16_t * out;
+	// frames written / read since the last reset
+	uint64_t written, read;
+	// input frames taken since the last reset
+	uint64_t taken;
+
+	// resampler: output frame n is at input frame n * step / phases
+	//  0 phases means the rates match
+	unsigned int phases, step;
+	// RING_TAPS coefficients for each phase
+	float * filter;
+	// position of the next output frame: history frame index, plus phase / phases
+	unsigned int index, phase;
+
+	// per channel: input as float (history of RING_TAPS frames, and a chunk),
+	//  and the resampler's output for one chunk
+	float * x[RING_CHANNELS];
+	unsigned int x_len;
+	float * y[RING_CHANNELS];
+	unsigned int y_max;
+	float * memory;
+};
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	while (b) {
+		const unsigned int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* ************************************************************************ */
+// Format conversion
+//  into planar float for the resampler, and back out to interleaved int16
+
+static void s16ToFloat(float * const dst, const int16_t * const src, const unsigned int count)
+{
+	unsigned int i = 0;
+#ifdef __SSE2__
+	const __m128 scale = _mm_set1_ps(1.0f / 32768);
+	for ( ; i + 8 <= count; i += 8) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		// sign-extend each half to 32 bits
+		const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+#endif
+	for ( ; i < count; i ++)
+		dst[i] = src[i] * (1.0f / 32768);
+}
+
+// Deinterleave count frames of stereo
+static void splitS16Stereo(float * const l, float * const r, const int16_t * const src, const unsigned int count)
+{
+	unsigned int i = 0;
+#ifdef __SSE2__
+	const __m128 scale = _mm_set1_ps(1.0f / 32768);
+	for ( ; i + 4 <= count; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		// left is the low half of each 32-bit pair, right the high
+		const __m128i left = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+		const __m128i right = _mm_srai_epi32(v, 16);
+		_mm_storeu_ps(l + i, _mm_mul_ps(_mm_cvtepi32_ps(left), scale));
+		_mm_storeu_ps(r + i, _mm_mul_ps(_mm_cvtepi32_ps(right), scale));
+	}
+#endif
+	for ( ; i < count; i ++) {
+		l[i] = src[2 * i] * (1.0f / 32768);
+		r[i] = src[2 * i + 1] * (1.0f / 32768);
+	}
+}
+
+static void splitFloatStereo(float * const l, float * const r, const float * const src, const unsigned int count)
+{
+	unsigned int i = 0;
+#ifdef __SSE2__
+	for ( ; i + 4 <= count; i += 4) {
+		const __m128 a = _mm_loadu_ps(src + 2 * i);
+		const __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+		_mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+#endif
+	for ( ; i < count; i ++) {
+		l[i] = src[2 * i];
+		r[i] = src[2 * i + 1];
+	}
+}
+
+static inline int16_t floatToS16(const float f)
+{
+	const float s = f * 32768;
+	return (s >= 32767 ? 32767 : (s <= -32768 ? -32768 : (int16_t)lrintf(s)));
+}
+
+// Planar float to interleaved int16, clipping
+static void joinS16(int16_t * const dst, float * const * const src, const unsigned int offset, const unsigned int channels, const unsigned int count)
+{
+	unsigned int i = 0;
+#ifdef __SSE2__
+	// clamp first: out of range conversions give INT_MIN, whatever the sign
+	const __m128 scale = _mm_set1_ps(32768);
+	const __m128 top = _mm_set1_ps(1);
+	const __m128 bottom = _mm_set1_ps(-1);
+	#define RING_CVT(p) _mm_cvtps_epi32(_mm_mul_ps(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(p), top), bottom), scale))
+
+	if (channels == 1) {
+		for ( ; i + 8 <= count; i += 8)
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(RING_CVT(src[0] + offset + i), RING_CVT(src[0] + offset + i + 4)));
+	} else if (channels == 2) {
+		for ( ; i + 4 <= count; i += 4) {
+			const __m128i l = RING_CVT(src[0] + offset + i);
+			const __m128i r = RING_CVT(src[1] + offset + i);
+			_mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_packs_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r)));
+		}
+	}
+	#undef RING_CVT
+#endif
+	for ( ; i < count; i ++)
+		for (unsigned int c = 0; c < channels; c ++)
+			dst[i * channels + c] = floatToS16(src[c][offset + i]);
+}
+
+// count frames of the application's samples, from offset, into x at x_len
+static void convertIn(struct ring_t * const ring, const void * const data[], const unsigned int offset, const unsigned int count)
+{
+	const unsigned int channels = ring->channels;
+	const unsigned int at = ring->x_len;
+
+	switch (ring->format) {
+	case RING_FLOAT_PLANAR:
+		for (unsigned int c = 0; c < channels; c ++)
+			memcpy(ring->x[c] + at, (const float *)data[c] + offset, count * sizeof(float));
+		break;
+	case RING_S16_PLANAR:
+		for (unsigned int c = 0; c < channels; c ++)
+			s16ToFloat(ring->x[c] + at, (const int16_t *)data[c] + offset, count);
+		break;
+	case RING_FLOAT: {
+		const float * const src = (const float *)data[0] + (size_t)offset * channels;
+		if (channels == 1)
+			memcpy(ring->x[0] + at, src, count * sizeof(float));
+		else if (channels == 2)
+			splitFloatStereo(ring->x[0] + at, ring->x[1] + at, src, count);
+		else
+			for (unsigned int i = 0; i < count; i ++)
+				for (unsigned int c = 0; c < channels; c ++)
+					ring->x[c][at + i] = src[i * channels + c];
+		break;
+	}
+	case RING_S16: {
+		const int16_t * const src = (const int16_t *)data[0] + (size_t)offset * channels;
+		if (channels == 1)
+			s16ToFloat(ring->x[0] + at, src, count);
+		else if (channels == 2)
+			splitS16Stereo(ring->x[0] + at, ring->x[1] + at, src, count);
+		else
+			for (unsigned int i = 0; i < count; i ++)
+				for (unsigned int c = 0; c < channels; c ++)
+					ring->x[c][at + i] = src[i * channels + c] * (1.0f / 32768);
+		break;
+	}
+	}
+}
+
+/* ************************************************************************ */
+// Resampling
+
+static inline float dot(const float * const x, const float * const h)
+{
+#ifdef __SSE2__
+	__m128 sum = _mm_mul_ps(_mm_loadu_ps(x), _mm_load_ps(h));
+	for (unsigned int k = 4; k < RING_TAPS; k += 4)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_load_ps(h + k)));
+	// horizontal add
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+#else
+	float sum = 0;
+	for (unsigned int k = 0; k < RING_TAPS; k ++)
+		sum += x[k] * h[k];
+	return sum;
+#endif
+}
+
+// Blackman-windowed sinc, each phase scaled to unity gain
+//  Tap k of phase p sits k - (RING_HALF - 1) - p / phases input frames from
+//  the output frame.
+static int makeFilter(struct ring_t * const ring)
+{
+	ring->filter = aligned_alloc(16, (size_t)ring->phases * RING_TAPS * sizeof(float));
+	if (ring->filter == NULL) {
+		perror("librtmpcast: ERROR: ring::makeFilter: aligned_alloc() returned NULL");
+		return 0;
+	}
+
+	// normalized to the input rate: lowpass below the lower of the two Nyquists
+	const double cutoff = RING_CUTOFF * (ring->out_rate < ring->in_rate ? (double)ring->out_rate / ring->in_rate : 1);
+
+	for (unsigned int p = 0; p < ring->phases; p ++) {
+		float * const h = ring->filter + (size_t)p * RING_TAPS;
+		double sum = 0;
+		for (unsigned int k = 0; k < RING_TAPS; k ++) {
+			const double d = (double)k - (RING_HALF - 1) - (double)p / ring->phases;
+			const double s = (d == 0 ? 1 : sin(M_PI * cutoff * d) / (M_PI * cutoff * d));
+			const double w = (fabs(d) >= RING_HALF ? 0 :
+				0.42 + 0.5 * cos(M_PI * d / RING_HALF) + 0.08 * cos(2 * M_PI * d / RING_HALF));
+			h[k] = s * w;
+			sum += h[k];
+		}
+		for (unsigned int k = 0; k < RING_TAPS; k ++)
+			h[k] /= sum;
+	}
+
+	return 1;
+}
+
+// Run the filter over x, leaving the history for next time
+//  Returns how many frames went to y
+static unsigned int resample(struct ring_t * const ring)
+{
+	unsigned int n = 0;
+	while (ring->index + RING_TAPS <= ring->x_len) {
+		const float * const h = ring->filter + (size_t)ring->phase * RING_TAPS;
+		for (unsigned int c = 0; c < ring->channels; c ++)
+			ring->y[c][n] = dot(ring->x[c] + ring->index, h);
+		n ++;
+
+		ring->phase += ring->step;
+		ring->index += ring->phase / ring->phases;
+		ring->phase %= ring->phases;
+	}
+
+	// keep what the next output frames need
+	const unsigned int keep = (ring->index < ring->x_len ? ring->x_len - ring->index : 0);
+	for (unsigned int c = 0; c < ring->channels; c ++)
+		memmove(ring->x[c], ring->x[c] + ring->index, keep * sizeof(float));
+	ring->index -= ring->x_len - keep;
+	ring->x_len = keep;
+
+	return n;
+}
+
+/* ************************************************************************ */
+// Output side
+
+static unsigned int space(const struct ring_t * const ring)
+{
+	return RING_CAPACITY - (unsigned int)(ring->written - ring->read);
+}
+
+// Append count planar float frames, from offset in each channel
+static void store(struct ring_t * const ring, float * const * const src, unsigned int offset, unsigned int count)
+{
+	while (count > 0) {
+		const unsigned int at = ring->written % RING_CAPACITY;
+		const unsigned int n = (count < RING_CAPACITY - at ? count : RING_CAPACITY - at);
+
+		joinS16(ring->out + (size_t)at * ring->channels, src, offset, ring->channels, n);
+		ring->written += n;
+		offset += n;
+		count -= n;
+	}
+}
+
+// Same, for int16 frames that need no conversion
+static void storeS16(struct ring_t * const ring, const int16_t * src, unsigned int count)
+{
+	while (count > 0) {
+		const unsigned int at = ring->written % RING_CAPACITY;
+		const unsigned int n = (count < RING_CAPACITY - at ? count : RING_CAPACITY - at);
+
+		memcpy(ring->out + (size_t)at * ring->channels, src, (size_t)n * ring->channels * sizeof(int16_t));
+		ring->written += n;
+		src += (size_t)n * ring->channels;
+		count -= n;
+	}
+}
+
+/* ************************************************************************ */
+unsigned int ring_sample_size(const int format)
+{
+	switch (format) {
+	case RING_S16:
+	case RING_S16_PLANAR:
+		return sizeof(int16_t);
+	case RING_FLOAT:
+	case RING_FLOAT_PLANAR:
+		return sizeof(float);
+	default:
+		return 0;
+	}
+}
+
+struct ring_t * ring_create(const int format, const unsigned int channels, const unsigned int in_rate, const unsigned int out_rate)
+{
+	if (ring_sample_size(format) == 0) {
+		fprintf(stderr, "librtmpcast: ERROR: ring: unknown sample format %d\n", format);
+		return NULL;
+	}
+	if (channels < 1 || channels > RING_CHANNELS) {
+		fprintf(stderr, "librtmpcast: ERROR: ring: cannot take %u channels\n", channels);
+		return NULL;
+	}
+
+	// the rates in lowest terms: a phase for each output frame until they line up again
+	const unsigned int g = (in_rate && out_rate ? gcd(in_rate, out_rate) : 1);
+	const unsigned int phases = out_rate / g, step = in_rate / g;
+	if (in_rate == 0 || out_rate == 0 || phases > RING_MAX_PHASES || (uint64_t)RING_CHUNK * phases / step + 2 > RING_CAPACITY - RING_BLOCK) {
+		fprintf(stderr, "librtmpcast: ERROR: ring: cannot resample from %u to %u Hz\n", in_rate, out_rate);
+		return NULL;
+	}
+
+	// create a structure
+	struct ring_t * ring = calloc(1, sizeof(struct ring_t));
+	if (ring == NULL) {
+		perror("librtmpcast: ERROR: ring::ring_create: calloc() returned NULL");
+		return NULL;
+	}
+
+	ring->format = format;
+	ring->channels = channels;
+	ring->in_rate = in_rate;
+	ring->out_rate = out_rate;
+	ring->phases = (in_rate == out_rate ? 0 : phases);
+	ring->step = step;
+
+	ring->out = malloc((size_t)RING_CAPACITY * channels * sizeof(int16_t));
+	// history, then a chunk, per channel; and for resampling, its output
+	const size_t x_size = RING_TAPS + RING_CHUNK;
+	ring->y_max = (ring->phases ? (unsigned int)((uint64_t)RING_CHUNK * phases / step + 2) : 0);
+	ring->memory = malloc(channels * (x_size + ring->y_max) * sizeof(float));
+	if (ring->out == NULL || ring->memory == NULL) {
+		perror("librtmpcast: ERROR: ring::ring_create: malloc() returned NULL");
+		ring_close(ring);
+		return NULL;
+	}
+	for (unsigned int c = 0; c < channels; c ++) {
+		ring->x[c] = ring->memory + c * x_size;
+		ring->y[c] = ring->memory + channels * x_size + c * ring->y_max;
+	}
+
+	if (ring->phases && ! makeFilter(ring)) {
+		ring_close(ring);
+		return NULL;
+	}
+
+	ring_reset(ring);
+	return ring;
+}
+
+unsigned int ring_write(struct ring_t * const ring, const void * const data[], const unsigned int offset, const unsigned int count)
+{
+	unsigned int done = 0;
+	while (done < count) {
+		const unsigned int n = (count - done < RING_CHUNK ? count - done : RING_CHUNK);
+		// most frames this chunk can make
+		const unsigned int most = (ring->phases ? ring->y_max : n);
+		if (space(ring) < most)
+			break;
+
+		if (ring->format == RING_S16 && ! ring->phases)
+			storeS16(ring, (const int16_t *)data[0] + (size_t)(offset + done) * ring->channels, n);
+		else {
+			convertIn(ring, data, offset + done, n);
+			ring->x_len += n;
+			if (ring->phases)
+				store(ring, ring->y, 0, resample(ring));
+			else {
+				store(ring, ring->x, 0, n);
+				ring->x_len = 0;
+			}
+		}
+
+		done += n;
+	}
+
+	ring->taken += done;
+	return done;
+}
+
+int ring_ready(const struct ring_t * const ring)
+{
+	return ring->written - ring->read >= RING_BLOCK;
+}
+
+void ring_read(struct ring_t * const ring, int16_t * block)
+{
+	unsigned int count = RING_BLOCK;
+	while (block && count > 0) {
+		const unsigned int at = ring->read % RING_CAPACITY;
+		const unsigned int n = (count < RING_CAPACITY - at ? count : RING_CAPACITY - at);
+
+		memcpy(block, ring->out + (size_t)at * ring->channels, (size_t)n * ring->channels * sizeof(int16_t));
+		block += (size_t)n * ring->channels;
+		ring->read += n;
+		count -= n;
+	}
+	ring->read += count;
+}
+
+double ring_read_time(const struct ring_t * const ring)
+{
+	return (double)ring->read / ring->out_rate;
+}
+
+double ring_write_time(const struct ring_t * const ring)
+{
+	return (double)ring->taken / ring->in_rate;
+}
+
+void ring_reset(struct ring_t * const ring)
+{
+	ring->written = ring->read = 0;
+	ring->taken = 0;
+	ring->index = ring->phase = 0;
+
+	// the filter reaches back RING_HALF - 1 frames from the first output
+	//  frame: silence before the input starts
+	ring->x_len = (ring->phases ? RING_HALF - 1 : 0);
+	for (unsigned int c = 0; c < ring->channels; c ++)
+		memset(ring->x[c], 0, ring->x_len * sizeof(float));
+}
+
+void ring_close(struct ring_t * const ring)
+{
+	free(ring->filter);
+	free(ring->memory);
+	free(ring->out);
+	free(ring);
+}
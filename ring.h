@@ -0,0 +1,55 @@
+#ifndef RTMPCAST_RING_H
+#define RTMPCAST_RING_H
+
+// Application audio on its way to the encoder: takes writes of any length,
+//  in int16 or float, interleaved or planar, at the application's rate, and
+//  hands back whole blocks of interleaved int16 at the encoder's rate.
+//  Rate conversion is a polyphase windowed-sinc filter; format conversion
+//  and the filter use SSE2 where the compiler targets it.
+// One thread at a time.
+
+#include <stdint.h>
+
+// sample formats, same values as RTMPCAST_SAMPLE_*
+#define RING_S16 0
+#define RING_FLOAT 1
+#define RING_S16_PLANAR 2
+#define RING_FLOAT_PLANAR 3
+
+// frames per block read out: one AAC frame
+#define RING_BLOCK 1024
+// most channels a ring takes
+#define RING_CHANNELS 8
+
+// Returns the bytes in one sample of format (0 if unknown)
+unsigned int ring_sample_size(int format);
+
+struct ring_t;
+
+// Returns NULL if the formats or the pair of rates is not supported
+struct ring_t * ring_create(int format, unsigned int channels, unsigned int in_rate, unsigned int out_rate);
+
+// Take count frames from data (one pointer per channel for planar formats,
+//  else one), starting offset frames in.  Stops early when there is not room
+//  for more: read blocks out, then write the rest.
+//  Returns the frames taken
+unsigned int ring_write(struct ring_t * ring, const void * const data[], unsigned int offset, unsigned int count);
+
+// Whether a whole block is ready
+int ring_ready(const struct ring_t * ring);
+// Copy the next block to block (RING_BLOCK interleaved frames), or skip it
+//  if block is NULL.  Only when ring_ready.
+void ring_read(struct ring_t * ring, int16_t * block);
+
+// Since the last reset, in seconds: where the next block starts, and where
+//  the next frame written will go.  Blocks line up with the input, filter
+//  delay and all, so these are the same clock.
+double ring_read_time(const struct ring_t * ring);
+double ring_write_time(const struct ring_t * ring);
+
+// Drop everything held, and start the clock again (after a gap in the input)
+void ring_reset(struct ring_t * ring);
+
+void ring_close(struct ring_t * ring);
+
+#endif
@@ -7,16 +7,21 @@ Greg Kennedy 2021
 
 #include "rtmpcast.h"
 
-// aac encoder
-#include "audio_fdkaac.h"
+// encoders, picked by name
+#include "backend.h"
+// or what is already encoded, sent on as it is
+#include "audio_passthrough.h"
+#include "video_passthrough.h"
+#include "avc.h"
 
-#include "video.h"
-// h264 encoder
-#include "video_x264.h"
+// tag / AMF serializers
+#include "flv.h"
 
 // push packets to stream
 #include <librtmp/rtmp.h>
 #include <librtmp/log.h>
+// connection and outgoing queue
+#include "output.h"
 
 // other necessary includes
 #include <stdio.h>
@@ -28,10 +33,102 @@ Greg Kennedy 2021
 
 #include <float.h>
 
-#include <sys/time.h>
+// event loop
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+// threaded mode
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "queue.h"
+
+// recyclable tag buffers
+#include "pool.h"
+// frames pushed by the application
+#include "input.h"
+// converts other frame formats to I420
+#include "colorspace.h"
+// gathers samples into AAC frames, converting format and rate
+#include "ring.h"
+// local copy, written in the background
+#include "recorder.h"
 
 // maximum size of a tag is 11 byte header, 0xFFFFFF payload, 4 byte size
 #define MAX_TAG_SIZE 11 + 16777215 + 4
+// video tag buffers start at a few average frames at the configured bitrate,
+//  and grow when a bigger frame comes along
+#define VIDEO_TAG_SIZE(bitrate, framerate) (11 + 5 + 4 + 4 * (bitrate) * 1000 / 8 / (framerate))
+#define VIDEO_TAG_SIZE_MIN 4096
+// AAC frames have a known maximum size, plus 2 byte AAC header
+#define AUDIO_TAG_SIZE(channels) (11 + 2 + AUDIO_MAX_FRAME(channels) + 4)
+// onMetaData / sequence header / end-of-stream tags are always small
+#define META_TAG_SIZE 1024
+// outgoing queue defaults: tags, and milliseconds of media before dropping video
+#define OUTPUT_DEFAULT_LENGTH 512
+#define OUTPUT_DEFAULT_WATERMARK 1000
+// how soon to come back while the socket still has data to take
+#define OUTPUT_RETRY_INTERVAL 0.005
+// longest rtmpcast_update delay, when no track runs on a schedule
+#define IDLE_UPDATE_INTERVAL 0.25
+// offline mode: frames / blocks encoded per rtmpcast_update call
+#define OFFLINE_BATCH 64
+
+// push mode: raw frames / seconds of audio that may wait for the encoder
+#define PUSH_VIDEO_FRAMES 8
+#define PUSH_AUDIO_SECONDS 1
+// pushed samples this far (seconds) from where their count says they should
+//  be start the audio clock again
+#define PUSH_AUDIO_RESYNC 0.1
+
+// marks a push mode audio buffer holding a passthrough stream's
+//  AudioSpecificConfig, rather than a frame
+static char audio_config_buffer;
+// marks the first pushed H.264 access unit after some were dropped
+static char video_gap_buffer;
+
+// spare buffers each track keeps: one in flight, or a few queued when threaded
+#define POOL_KEEP 1
+#define POOL_KEEP_THREADED 4
+
+// in threaded mode, how many seconds of finished tags may wait for the network
+#define THREAD_QUEUE_SECONDS 2
+// how often (ms) the send thread checks for incoming packets when idle
+#define THREAD_IDLE_INTERVAL 100
+// rtmpcast_update delay in threaded mode (only checks for errors)
+#define THREAD_UPDATE_INTERVAL 0.25
+
+// rtmpcast_get_stats: seconds the quantizer and bitrate averages cover
+#define STATS_WINDOW 1.0
+
+// adaptive bitrate: seconds between checks on the destinations
+#define ABR_INTERVAL 0.5
+// milliseconds of backlog that count as falling behind, or as keeping up
+#define ABR_BACKLOG_HIGH 300
+#define ABR_BACKLOG_LOW 50
+// step down by this factor at once, step up only after this many checks
+//  in a row with a clear network, and by a smaller factor
+#define ABR_STEP_DOWN 0.75
+#define ABR_STEP_UP 1.1
+#define ABR_CLEAR_CHECKS 10
+
+// rtmpcast_run: events handled per epoll_wait
+#define RUN_EVENTS 16
+
+// threads started in threaded mode
+#define THREAD_SEND 1
+#define THREAD_VIDEO 2
+#define THREAD_AUDIO 4
+
+// rtmpcast_latency_t as kept while running: counted from more than one
+//  thread, so the buckets are atomic (relaxed: they are only ever summed)
+struct latency_t {
+	atomic_uint_least64_t count[RTMPCAST_LATENCY_BUCKETS];
+};
 
 /* ************************************************************************ */
 // opaque ptr
@@ -39,27 +136,115 @@ Greg Kennedy 2021
 struct rtmpcast_t
 {
 	struct {
-		// rtmp stuff
-		RTMP * rtmp;
-		int fd;
+		// one connection and outgoing queue per destination
+		//  entries go NULL when a destination fails, the rest carry on
+		struct output_t ** output;
+		unsigned int outputs;
+		// written by the side that sends, read by get_stats
+		atomic_uint live;
+		// scratch for sendVideo: destinations that still need the frame
+		unsigned char * resume;
 
 		// local copy
-		FILE * flv;
+		struct recorder_t * recorder;
+
+		// buffers for metadata / control tags
+		struct pool_t * pool;
 
-		uint8_t * tag;
+		// file-only: no destinations, and a virtual clock that runs
+		//  as fast as the encoders do
+		int offline;
+		double clock;
 
+		// both on the CLOCK_MONOTONIC timeline (or the virtual one)
 		double start;
+		// when rtmpcast_update next has work to do
+		double deadline;
+
+		// ms added to every media timestamp, so video decode times
+		//  (which run behind presentation with B-frames) never go negative
+		uint32_t shift;
 	} rtmp;
 
+	// push mode: timestamps arrive on the application's clock,
+	//  offset so the first pushed frame lines up with "now" on ours
+	struct {
+		pthread_mutex_t lock;
+		int started;
+		double origin;
+	} push;
+
+	// threaded mode: each track encodes on its own thread,
+	//  and one more thread sends the finished tags
+	struct {
+		int enable;
+
+		// bitmask of THREAD_* that were started
+		unsigned int started;
+
+		// encode threads run until this is cleared
+		atomic_int running;
+		// send thread exits once this is set and the queues are empty
+		atomic_int draining;
+		// set by any thread on a fatal error
+		atomic_int error;
+
+		// eventfd the encode threads signal when a tag is queued
+		int wake;
+		pthread_t send;
+	} thread;
+
 	struct {
 		unsigned int width, height;
 		unsigned int framerate;
 		unsigned int bitrate;
 
 		struct encoder_video * encoder;
-
-		double timestamp_next;
+		const struct video_backend_t * backend;
+		// H.264 pushed already encoded: encoder is a video_passthrough
+		int passthrough;
+		// pull mode: the application's callback, and the frame it fills
+		int (* callback)(void *);
+		unsigned char * source[3];
+		// where each plane of an application frame lies
+		struct colorspace_layout_t layout;
+		// formats other than I420: the converter, and the I420 frame it
+		//  writes for the encoder (NULL / the same as source for I420)
+		struct colorspace_t * convert;
+		unsigned char * frame[3];
+
+		// tag buffers for this track
+		struct pool_t * pool;
+
+		// skip SEI and non-reference slices
+		int drop_disposable;
+		// gather list for sending NALs straight from the encoder
+		struct iovec * iov;
+		int iov_max;
+
+		// frames this far behind schedule are skipped, not encoded
+		double late_limit;
+
+		// push mode: frames waiting to be encoded (NULL for the callback),
+		//  and the public side of each of their buffers
+		struct input_t * input;
+		struct rtmpcast_frame_t * frames;
+		// passthrough: access units were dropped since the last one queued
+		//  (under push.lock)
+		int gap;
+
+		// of the last frame sent, for the end-of-stream tag
+		uint32_t timestamp_last;
+		// a destination reconnected with no keyframe to replay
+		atomic_int keyframe;
+
+		// atomic for get_stats, from any thread
+		_Atomic double timestamp_next;
 		double timestamp_increment;
+
+		// threaded mode only
+		pthread_t thread;
+		struct queue_t * queue;
 	} video;
 
 	struct {
@@ -68,132 +253,1107 @@ struct rtmpcast_t
 		unsigned int bitrate;
 
 		struct encoder_audio * encoder;
-
-		double timestamp_next;
+		const struct audio_backend_t * backend;
+		// sending pushed AAC as it is, instead of encoding samples
+		int passthrough;
+		// pull mode: the application's callback, the buffer it fills (in
+		//  the application's format; planes points into it for planar
+		//  formats), and the block read from the ring for the encoder
+		int (* callback)(void *);
+		int format;
+		unsigned int input_samplerate;
+		void * buffer;
+		void * planes[RING_CHANNELS];
+		int16_t * samples;
+
+		// the application's samples, converted and gathered into blocks
+		//  (push mode: under push.lock); and the time of its clock's start,
+		//  on our clock for the callback, or in stream seconds for push mode
+		//  (passthrough: no ring, and base is the time of the next frame)
+		struct ring_t * ring;
+		double base;
+
+		// push mode: sample blocks waiting to be encoded (NULL for the callback)
+		struct input_t * input;
+
+		// tag buffers for this track
+		struct pool_t * pool;
+
+		_Atomic double timestamp_next;
 		double timestamp_increment;
+
+		// threaded mode only
+		pthread_t thread;
+		struct queue_t * queue;
 	} audio;
+
+	// adaptive bitrate: the side that writes to the sockets picks a target,
+	//  the video encoder applies it before its next frame
+	struct {
+		// 0: off
+		unsigned int min, max;
+		atomic_uint target;
+		// what the encoder is set to (video side only)
+		unsigned int current;
+
+		double next_check;
+		unsigned int clear;
+		// drops seen at the last check
+		uint64_t dropped;
+	} abr;
+
+	// counters for rtmpcast_get_stats
+	//  (atomic, or under lock: get_stats may come from any thread)
+	struct {
+		atomic_uint_least64_t frames;
+		// skipped on the encode side, or by a push from any thread
+		atomic_uint_least64_t frames_late;
+		atomic_uint_least64_t samples;
+		atomic_uint_least64_t samples_late;
+
+		// running averages of encoder output: only the video side writes
+		//  them, and publishes each update under lock
+		double qp;
+		double bitrate;
+
+		// totals from destinations that have since failed; lock guards
+		//  them and the output slots, so get_stats never reads an output
+		//  as it is closed
+		pthread_mutex_t lock;
+		uint64_t dropped;
+		uint64_t sent[2];
+
+		// the video and audio threads both count into encode and mux
+		struct latency_t callback, encode, mux, write;
+	} stats;
 };
 
 /* ************************************************************************ */
 // helper functions
 // get "now" in seconds
+//  monotonic, so NTP adjustments cannot make frames bunch up or stall
 static double getTimestamp() {
-	struct timeval timecheck;
-	gettimeofday(&timecheck, NULL);
-	return timecheck.tv_sec + timecheck.tv_usec / 1000000.;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+static struct timespec toTimespec(const double seconds) {
+	struct timespec ts;
+	ts.tv_sec = seconds;
+	ts.tv_nsec = (seconds - ts.tv_sec) * 1000000000;
+	if (ts.tv_nsec >= 1000000000) ts.tv_nsec = 999999999;
+	return ts;
 }
 
-// write big-endian values to memory area
-static uint8_t * u16be(uint8_t * const p, const uint16_t value) {
-	*p = value >> 8 & 0xFF;
-	*(p + 1) = value & 0xFF;
-	return p + 2;
+// sleep for some (fractional) number of seconds
+static void sleepFor(const double seconds) {
+	if (seconds <= 0)
+		return;
+
+	struct timespec ts = toTimespec(seconds);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
 }
-static uint8_t * u24be(uint8_t * const p, const uint32_t value) {
-	*p = value >> 16 & 0xFF;
-	*(p + 1) = value >> 8 & 0xFF;
-	*(p + 2) = value & 0xFF;
-	return p + 3;
+
+// "now" for the stream
+//  offline, the virtual clock: it only moves when rtmpcast_update advances it
+static double streamNow(const struct rtmpcast_t * const r) {
+	return (r->rtmp.offline ? r->rtmp.clock : getTimestamp());
 }
-static uint8_t * u32be(uint8_t * const p, const uint32_t value) {
-	*p = value >> 24 & 0xFF;
-	*(p + 1) = value >> 16 & 0xFF;
-	*(p + 2) = value >> 8 & 0xFF;
-	*(p + 3) = value & 0xFF;
-	return p + 4;
+
+// Count a stage's duration, given when it started; returns now
+static double recordLatency(struct latency_t * const h, const double start)
+{
+	const double now = getTimestamp();
+
+	unsigned long us = (now - start) * 1000000;
+	unsigned int bucket = 0;
+	while (us > 1 && bucket < RTMPCAST_LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket ++;
+	}
+	atomic_fetch_add_explicit(&h->count[bucket], 1, memory_order_relaxed);
+
+	return now;
 }
 
-// deconstruct a host-native double, repack it as big-endian IEEE 754 double
-//  TODO: rather than the test patterns, use actual float.h funcs
-static uint8_t * f64be(uint8_t * const p, const double input) {
-	const uint8_t * const value = (uint8_t *)&input;
-	static const double testVal = 1;
-	static const uint8_t testBE[8] = { 0x3F, 0xF0 };
-	static const uint8_t testLE[8] = { 0, 0, 0, 0, 0, 0, 0xF0, 0x3F };
+/* ************************************************************************ */
+// Encode / write steps shared by the polling and threaded modes
 
-	if (memcmp(&testVal, testBE, 8) == 0) {
-		// already in big-endian
-		memcpy(p, value, 8);
-	} else { // if (memcmp(&testVal, testLE, 8) == 0)
-		// byteswap
-		for (int i = 0; i < 8; i++)
-			p[i] = value[7 - i];
+// Whether there is still somewhere for the stream to go
+//  offline, the file is the only output and is always there
+static int outputsLive(const struct rtmpcast_t * const r)
+{
+	return r->rtmp.offline || r->rtmp.live > 0;
+}
+
+// Give up on a destination after a socket error (and failed reconnects)
+static void dropOutput(struct rtmpcast_t * const r, const unsigned int i)
+{
+	fprintf(stderr, "Giving up on '%s'\n", output_url(r->rtmp.output[i]));
+
+	// its counts still go in the stats
+	pthread_mutex_lock(&r->stats.lock);
+	r->stats.dropped += output_dropped(r->rtmp.output[i]);
+	r->stats.sent[0] += output_sent(r->rtmp.output[i], 8);
+	r->stats.sent[1] += output_sent(r->rtmp.output[i], 9);
+
+	output_close(r->rtmp.output[i]);
+	r->rtmp.output[i] = NULL;
+	pthread_mutex_unlock(&r->stats.lock);
+	r->rtmp.live --;
+}
+
+// Send a finished tag to every server (not the local copy)
+//  The tag goes back to its pool once sent everywhere
+//  Returns 0 when no destinations are left
+static int sendTag(struct rtmpcast_t * const r, struct tag_t * const tag)
+{
+	if (r->rtmp.live == 0) {
+		pool_put(tag);
+		return r->rtmp.offline;
 	}
 
-	return p + 8;
+	// one encode, shared by all the queues
+	pool_share(tag, r->rtmp.live);
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		if (r->rtmp.output[i] && ! output_send(r->rtmp.output[i], tag))
+			dropOutput(r, i);
+	}
+
+	return outputsLive(r);
 }
 
-// "pascal" string (uint16 strlen, string content)
-static uint8_t * pstring(uint8_t * p, const char * const str) {
-	uint16_t string_length = strlen(str);
-	p = u16be(p, string_length);
-	memcpy(p, str, string_length);
-	return p + string_length;
+// Same, and to the local copy if there is one
+static int dispatchTag(struct rtmpcast_t * const r, struct tag_t * const tag)
+{
+	if (r->rtmp.recorder) {
+		const struct iovec iov = { tag->data, tag->size };
+		recorder_write(r->rtmp.recorder, tag->timestamp, tag->flags & TAG_KEYFRAME, &iov, 1);
+	}
+
+	return sendTag(r, tag);
+}
+
+// Write what each socket will take, and handle anything from the servers
+//  Returns 0 when no destinations are left
+static int serviceOutputs(struct rtmpcast_t * const r)
+{
+	const double start = getTimestamp();
+
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		struct output_t * const o = r->rtmp.output[i];
+		if (o && ! (output_flush(o) && output_service(o)))
+			dropOutput(r, i);
+		else if (o && output_wants_keyframe(o) && r->video.encoder)
+			atomic_store(&r->video.keyframe, 1);
+	}
+
+	if (r->rtmp.outputs)
+		recordLatency(&r->stats.write, start);
+
+	return outputsLive(r);
+}
+
+// Adaptive bitrate: every so often, look at how far behind the slowest
+//  destination is, and move the video bitrate target down or up
+static void adaptBitrate(struct rtmpcast_t * const r)
+{
+	const double now = getTimestamp();
+	if (r->abr.min == 0 || now < r->abr.next_check)
+		return;
+	r->abr.next_check = now + ABR_INTERVAL;
+
+	const unsigned int target = atomic_load(&r->abr.target);
+	const unsigned int kbps = target + r->audio.bitrate;
+
+	unsigned int backlog = 0;
+	uint64_t dropped = r->stats.dropped;
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		const struct output_t * const o = r->rtmp.output[i];
+		if (o == NULL)
+			continue;
+
+		const unsigned int b = output_backlog(o, kbps);
+		if (b > backlog)
+			backlog = b;
+		dropped += output_dropped(o);
+	}
+
+	// anything dropped since last time means the queue already overflowed
+	const int dropping = (dropped > r->abr.dropped);
+	r->abr.dropped = dropped;
+
+	unsigned int next = target;
+	if (dropping || backlog > ABR_BACKLOG_HIGH) {
+		next = fmax(r->abr.min, target * ABR_STEP_DOWN);
+		r->abr.clear = 0;
+	} else if (backlog < ABR_BACKLOG_LOW) {
+		if (++ r->abr.clear >= ABR_CLEAR_CHECKS) {
+			next = fmin(r->abr.max, ceil(target * ABR_STEP_UP));
+			r->abr.clear = 0;
+		}
+	} else
+		r->abr.clear = 0;
+
+	if (next != target) {
+		fprintf(stderr, "librtmpcast: video bitrate %u -> %u kbps (backlog %u ms)\n", target, next, backlog);
+		atomic_store(&r->abr.target, next);
+	}
+}
+
+// Write everything queued for every destination, blocking
+static int drainOutputs(struct rtmpcast_t * const r)
+{
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		if (r->rtmp.output[i] && ! output_drain(r->rtmp.output[i]))
+			dropOutput(r, i);
+	}
+
+	return outputsLive(r);
+}
+
+// Tags waiting on a connected socket (not on a reconnect)
+static int pendingOutputs(const struct rtmpcast_t * const r)
+{
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		const struct output_t * const o = r->rtmp.output[i];
+		if (o && output_fd(o) != -1 && output_pending(o))
+			return 1;
+	}
+
+	return 0;
+}
+
+// Pull a tag buffer for a control message: metadata, headers, end of stream
+static struct tag_t * controlTag(struct rtmpcast_t * const r)
+{
+	struct tag_t * tag = pool_get(r->rtmp.pool);
+
+	if (tag && ! pool_reserve(tag, META_TAG_SIZE)) {
+		pool_put(tag);
+		return NULL;
+	}
+
+	return tag;
+}
+
+// Video frames whose timestamp is too old to be worth encoding
+//  Returns how many were skipped
+static unsigned int skipLateVideo(struct rtmpcast_t * const r, const double now)
+{
+	const double late = now - r->video.timestamp_next;
+
+	if (late <= r->video.late_limit)
+		return 0;
+
+	const unsigned int frames = late / r->video.timestamp_increment;
+	r->video.timestamp_next += frames * r->video.timestamp_increment;
+	atomic_fetch_add_explicit(&r->stats.frames_late, frames, memory_order_relaxed);
+
+	return frames;
 }
 
-// AMF (Action Message Format) serializers
-static uint8_t * amf_number(uint8_t * const p, const double value) {
-	*p = 0x00;
-	return f64be(p + 1, value);
+// Milliseconds since the start of the stream, for a time on our clock
+static uint32_t streamTime(const struct rtmpcast_t * const r, const double timestamp)
+{
+	return 1000 * (timestamp - r->rtmp.start);
 }
-static uint8_t * amf_boolean(uint8_t * const p, const uint8_t value) {
-	*p = 0x01;
-	*(p+1) = (value ? 1 : 0);
-	return p + 2;
+
+// A frame in from the application, and what came out for it
+static void countVideo(struct rtmpcast_t * const r, const struct video_return_t * const v)
+{
+	atomic_fetch_add_explicit(&r->stats.frames, 1, memory_order_relaxed);
+	if (v->size > 0) {
+		// running averages, over about STATS_WINDOW
+		const double bitrate = v->size * 8 / r->video.timestamp_increment / 1000;
+		const double weight = fmin(1, r->video.timestamp_increment / STATS_WINDOW);
+		double qp_avg = v->qp, bitrate_avg = bitrate;
+		if (r->stats.bitrate != 0) {
+			qp_avg = r->stats.qp + (v->qp - r->stats.qp) * weight;
+			bitrate_avg = r->stats.bitrate + (bitrate - r->stats.bitrate) * weight;
+		}
+
+		pthread_mutex_lock(&r->stats.lock);
+		r->stats.qp = qp_avg;
+		r->stats.bitrate = bitrate_avg;
+		pthread_mutex_unlock(&r->stats.lock);
+	}
 }
-static uint8_t * amf_string(uint8_t * const p, const char * const str) {
-	*p = 0x02;
-	return pstring(p + 1, str);
+
+// Encode the next video frame: from the callback, or pushed planes
+//  On success v->size is 0 if the encoder held the frame back, and
+//  v->pts is the timestamp of whichever frame came out
+//  Returns 0 on error
+static int encodeVideo(struct rtmpcast_t * const r, struct video_return_t * const v, unsigned char * const * plane, const uint32_t timestamp)
+{
+	// adaptive bitrate: take up the latest target
+	const unsigned int target = atomic_load(&r->abr.target);
+	if (target != r->abr.current && r->video.backend->set_bitrate(r->video.encoder, target))
+		r->abr.current = target;
+
+	// so viewers of a reconnected destination see a picture straight away
+	if (atomic_exchange(&r->video.keyframe, 0))
+		r->video.backend->force_keyframe(r->video.encoder);
+
+	double start = getTimestamp();
+
+	// pull mode: have the application fill our frame
+	if (plane == NULL) {
+		r->video.callback(r->video.source);
+		start = recordLatency(&r->stats.callback, start);
+		plane = r->video.source;
+	}
+
+	// counted as part of the encode
+	if (r->video.convert) {
+		colorspace_convert(r->video.convert, (const uint8_t * const *)plane, r->video.frame);
+		plane = r->video.frame;
+	}
+
+	// call out to the chosen encoder
+	*v = r->video.backend->encode(r->video.encoder, plane, timestamp);
+	recordLatency(&r->stats.encode, start);
+
+	if (v->size < 0) {
+		// error in encoding
+		fputs("Error when encoding video\n", stderr);
+		return 0;
+	}
+
+	countVideo(r, v);
+	return 1;
 }
-static uint8_t * amf_ecma_array(uint8_t * const p, const uint32_t entries) {
-	*p = 0x08;
-	return u32be(p + 1, entries);
+
+// Copy encoder output into a tag buffer
+//  Returns the complete tag size, 0 if every NAL was dropped, or negative on error
+static int packVideo(struct rtmpcast_t * const r, const struct video_return_t * const v, const uint32_t timestamp, const int32_t composition_time, struct tag_t * const tag)
+{
+	// make room for all of it
+	const size_t tagSize = 11 + 5 + v->size + 4;
+	if (tagSize > MAX_TAG_SIZE) {
+		fputs("Encoded video frame is too large for a tag\n", stderr);
+		return -1;
+	}
+	if (! pool_reserve(tag, tagSize))
+		return -1;
+
+	// Post our video frame
+	tag->timestamp = timestamp;
+	uint8_t * p = flv_TagHeader(tag->data, 9, tag->timestamp);
+	p = flv_AVCVideoPacket(p, v->keyframe, 1, composition_time);
+
+	// the frame is disposable if every NAL in it is
+	tag->flags = (v->keyframe ? TAG_KEYFRAME : 0) | TAG_DISPOSABLE;
+
+	uint8_t * const payload = p;
+	for (int i = 0; i < v->nal_count; i ++) {
+		if (r->video.drop_disposable && v->nal[i].disposable)
+			continue;
+		if (! v->nal[i].disposable)
+			tag->flags &= ~TAG_DISPOSABLE;
+		memcpy(p, v->nal[i].payload, v->nal[i].size);
+		p += v->nal[i].size;
+	}
+
+	if (p == payload)
+		return 0;
+
+	// calculate tag size
+	tag->size = flv_TagFinish(tag->data, p);
+	return tag->size;
 }
-static uint8_t * amf_ecma_array_end(uint8_t * const p) {
-	return u24be(p, 0x000009);
+
+// Send encoder output straight from the encoder's buffers to each socket,
+//  without building a tag first.  If any socket cannot take all of it,
+//  the frame is packed into one tag, and queued wherever it is still needed.
+//  Returns 0 on error
+static int sendVideo(struct rtmpcast_t * const r, const struct video_return_t * const v, const uint32_t timestamp, const int32_t composition_time)
+{
+	double start = getTimestamp();
+
+	// the payload, plus a slot either side for the local copy's FLV framing
+	if (v->nal_count + 3 > r->video.iov_max) {
+		struct iovec * iov = realloc(r->video.iov, (v->nal_count + 3) * sizeof(struct iovec));
+		if (iov == NULL) {
+			perror("librtmpcast: ERROR: realloc() returned NULL");
+			return 0;
+		}
+		r->video.iov = iov;
+		r->video.iov_max = v->nal_count + 3;
+	}
+	struct iovec * const payload = r->video.iov + 1;
+
+	// AVC packet header, then every NAL we keep
+	uint8_t header[5];
+	flv_AVCVideoPacket(header, v->keyframe, 1, composition_time);
+
+	int count = 0;
+	uint32_t payloadSize = 5;
+	payload[count].iov_base = header;
+	payload[count].iov_len = 5;
+	count ++;
+
+	unsigned int flags = (v->keyframe ? TAG_KEYFRAME : 0) | TAG_DISPOSABLE;
+	for (int i = 0; i < v->nal_count; i ++) {
+		if (r->video.drop_disposable && v->nal[i].disposable)
+			continue;
+		if (! v->nal[i].disposable)
+			flags &= ~TAG_DISPOSABLE;
+		payload[count].iov_base = (void *)v->nal[i].payload;
+		payload[count].iov_len = v->nal[i].size;
+		payloadSize += v->nal[i].size;
+		count ++;
+	}
+
+	if (count == 1)
+		return 1;
+
+	// local copy wants the FLV framing around the same pieces
+	if (r->rtmp.recorder) {
+		uint8_t flvHeader[11], flvSize[4];
+		flv_TagHeader(flvHeader, 9, timestamp);
+		u24be(flvHeader + 1, payloadSize);
+		u32be(flvSize, 11 + payloadSize);
+
+		r->video.iov[0].iov_base = flvHeader;
+		r->video.iov[0].iov_len = 11;
+		payload[count].iov_base = flvSize;
+		payload[count].iov_len = 4;
+		recorder_write(r->rtmp.recorder, timestamp, flags & TAG_KEYFRAME, r->video.iov, count + 2);
+	}
+	start = recordLatency(&r->stats.mux, start);
+
+	unsigned int resume = 0;
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		r->rtmp.resume[i] = 0;
+		if (r->rtmp.output[i] == NULL)
+			continue;
+
+		const int sent = output_send_direct(r->rtmp.output[i], 9, timestamp, flags, payload, count);
+		if (sent < 0)
+			dropOutput(r, i);
+		else if (sent == 0) {
+			r->rtmp.resume[i] = 1;
+			resume ++;
+		}
+	}
+
+	if (r->rtmp.outputs)
+		start = recordLatency(&r->stats.write, start);
+
+	if (resume == 0)
+		return outputsLive(r);
+
+	// some socket is busy: copy the frame after all, and queue it there
+	struct tag_t * tag = pool_get(r->video.pool);
+	if (tag == NULL || packVideo(r, v, timestamp, composition_time, tag) <= 0) {
+		if (tag) pool_put(tag);
+		return 0;
+	}
+
+	pool_share(tag, resume);
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		if (r->rtmp.resume[i] && ! output_resume(r->rtmp.output[i], tag))
+			dropOutput(r, i);
+	}
+	recordLatency(&r->stats.mux, start);
+
+	return outputsLive(r);
 }
-static uint8_t * amf_ecma_array_entry(uint8_t * const p, const char * const str, const double value) {
-	return amf_number(pstring(p, str), value);
+
+// Encode the next audio block into a tag buffer (always big enough)
+//  from the callback, or pushed samples (one whole block)
+//  Returns the complete tag size, or negative on error
+static int encodeAudio(struct rtmpcast_t * const r, const uint32_t timestamp, const int16_t * const samples, struct tag_t * const tag)
+{
+	// build tag header for audio
+	tag->timestamp = timestamp + r->rtmp.shift;
+	uint8_t * p = flv_TagHeader(tag->data, 8, tag->timestamp);
+	*p = 0xAF; p++;
+	*p = 1; p++;
+
+	const double start = getTimestamp();
+
+	// call out to the chosen encoder, with one whole block
+	int audio_size = r->audio.backend->encode(r->audio.encoder, samples, RING_BLOCK * r->audio.channels, p);
+	recordLatency(&r->stats.encode, start);
+	if (audio_size < 0) {
+		// error in encoding
+		fputs("Error when encoding audio\n", stderr);
+		return -1;
+	}
+	p += audio_size;
+	atomic_fetch_add_explicit(&r->stats.samples, RING_BLOCK, memory_order_relaxed);
+
+	// calculate tag size
+	tag->size = flv_TagFinish(tag->data, p);
+	return tag->size;
 }
 
 /* ************************************************************************ */
-// sets up the first 11 bytes of a tag
-//  returns pointer to the start of payload area
-static uint8_t * flv_TagHeader(uint8_t * p, const uint8_t type, const uint32_t timestamp)
+// Threaded mode
+//  The video and audio threads keep the same schedule rtmpcast_update would,
+//  and pass finished tags through their queues to the send thread.
+//  After connect, the send thread is the only one to touch the RTMP object.
+
+// Hand a finished tag to the send thread, which returns it to its pool
+//  Blocks while the queue is full (network is behind), unless shutting down
+static void queueTag(struct rtmpcast_t * const r, struct queue_t * const queue, struct tag_t * const tag)
+{
+	while (! queue_push(queue, tag)) {
+		if (! atomic_load(&r->thread.running)) {
+			pool_put(tag);
+			return;
+		}
+		sleepFor(0.001);
+	}
+
+	const uint64_t one = 1;
+	if (write(r->thread.wake, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		perror("librtmpcast: ERROR: write() to eventfd failed");
+}
+
+// Send encoder output on: straight out in polling mode,
+//  or to the send thread in threaded mode
+//  Returns 0 on error
+static int emitEncoded(struct rtmpcast_t * const r, const struct video_return_t * const v)
+{
+	// the encoder held the frame back
+	if (v->size == 0)
+		return 1;
+
+	// tags go out in decode order, stamped with decode time;
+	//  the composition time offset carries the presentation time
+	int64_t dts = v->dts + r->rtmp.shift;
+	if (dts < 0) dts = 0;
+	const uint32_t timestamp = dts;
+	const int32_t composition_time = v->pts + r->rtmp.shift - dts;
+
+	r->video.timestamp_last = timestamp;
+
+	if (! r->thread.enable) {
+		if (! sendVideo(r, v, timestamp, composition_time)) {
+			fputs("librtmpcast: ERROR: sending a video frame failed: no destinations left\n", stderr);
+			return 0;
+		}
+		return 1;
+	}
+
+	const double start = getTimestamp();
+	struct tag_t * tag = pool_get(r->video.pool);
+	const int tagSize = (tag ? packVideo(r, v, timestamp, composition_time, tag) : -1);
+
+	if (tagSize > 0)
+		queueTag(r, r->video.queue, tag);
+	else if (tag)
+		pool_put(tag);
+	recordLatency(&r->stats.mux, start);
+
+	return tagSize >= 0;
+}
+
+// Encode a video frame and send on whatever comes out
+static int emitVideo(struct rtmpcast_t * const r, unsigned char * const plane[3], const uint32_t timestamp)
+{
+	struct video_return_t v;
+	if (! encodeVideo(r, &v, plane, timestamp))
+		return 0;
+
+	return emitEncoded(r, &v);
+}
+
+// End of stream: send the frames the encoder is still holding
+//  Returns 0 on error
+static int flushVideo(struct rtmpcast_t * const r)
+{
+	// passthrough holds nothing back
+	if (r->video.passthrough)
+		return 1;
+
+	while (r->video.backend->delayed(r->video.encoder) > 0) {
+		const struct video_return_t v = r->video.backend->flush(r->video.encoder);
+		if (v.size < 0) {
+			fputs("Error when encoding video\n", stderr);
+			return 0;
+		}
+
+		if (! emitEncoded(r, &v))
+			return 0;
+	}
+
+	return 1;
+}
+
+// Hand on a finished audio tag
+static int sendAudio(struct rtmpcast_t * const r, struct tag_t * const tag)
+{
+	const double start = getTimestamp();
+	if (r->thread.enable) {
+		queueTag(r, r->audio.queue, tag);
+		recordLatency(&r->stats.mux, start);
+		return 1;
+	}
+
+	const int ok = dispatchTag(r, tag);
+	recordLatency(&r->stats.mux, start);
+	if (! ok) {
+		fputs("librtmpcast: ERROR: sending an audio frame failed: no destinations left\n", stderr);
+		return 0;
+	}
+	return 1;
+}
+
+// Encode an audio block and send it on
+static int emitAudio(struct rtmpcast_t * const r, const int16_t * const samples, const uint32_t timestamp)
+{
+	struct tag_t * tag = pool_get(r->audio.pool);
+	if (tag == NULL || encodeAudio(r, timestamp, samples, tag) < 0) {
+		if (tag) pool_put(tag);
+		return 0;
+	}
+
+	return sendAudio(r, tag);
+}
+
+// Passthrough: an AAC frame as it came, or (packet type 0) its config
+static int emitPassthrough(struct rtmpcast_t * const r, const uint8_t * const data, const size_t size, const uint8_t packet, const uint32_t timestamp)
+{
+	struct tag_t * tag = pool_get(r->audio.pool);
+	if (tag == NULL || ! pool_reserve(tag, 11 + 2 + size + 4)) {
+		if (tag) pool_put(tag);
+		return 0;
+	}
+
+	tag->timestamp = timestamp + r->rtmp.shift;
+	uint8_t * p = flv_TagHeader(tag->data, 8, tag->timestamp);
+	*p = 0xAF; p++;
+	*p = packet; p++;
+	memcpy(p, data, size);
+	p += size;
+	tag->size = flv_TagFinish(tag->data, p);
+
+	if (packet == 1)
+		atomic_fetch_add_explicit(&r->stats.samples, AUDIO_FRAME_SAMPLES, memory_order_relaxed);
+
+	return sendAudio(r, tag);
+}
+
+
+// Passthrough: a sequence header for the SPS / PPS the stream just changed to
+static int emitVideoConfig(struct rtmpcast_t * const r, const uint32_t timestamp)
+{
+	struct tag_t * tag = pool_get(r->video.pool);
+	if (tag == NULL || ! pool_reserve(tag, META_TAG_SIZE)) {
+		if (tag) pool_put(tag);
+		return 0;
+	}
+
+	tag->timestamp = timestamp;
+	uint8_t * p = flv_TagHeader(tag->data, 9, tag->timestamp);
+	p = flv_AVCVideoPacket(p, 1, 0, 0);
+	const int size = video_passthrough_init(r->video.encoder, p, tag->capacity - (p - tag->data) - 4);
+	if (size <= 0) {
+		pool_put(tag);
+		return 0;
+	}
+	tag->size = flv_TagFinish(tag->data, p + size);
+
+	const double start = getTimestamp();
+	if (r->thread.enable) {
+		queueTag(r, r->video.queue, tag);
+		recordLatency(&r->stats.mux, start);
+		return 1;
+	}
+
+	const int ok = dispatchTag(r, tag);
+	recordLatency(&r->stats.mux, start);
+	if (! ok)
+		fputs("librtmpcast: ERROR: sending the video sequence header failed: no destinations left\n", stderr);
+	return ok;
+}
+
+// Passthrough: a pushed access unit, rewritten where it lies, then sent on
+//  as if it had just come out of an encoder
+static int relayVideo(struct rtmpcast_t * const r, const struct input_buffer_t * const b)
+{
+	// some were dropped on the way in: the frames that refer to them cannot
+	//  be decoded, so wait for the next IDR frame
+	if (b->user == &video_gap_buffer)
+		video_passthrough_resync(r->video.encoder);
+	if (b->size == 0)
+		return 1;
+
+	const double start = getTimestamp();
+	const struct video_return_t v = video_passthrough_encode(r->video.encoder, b->data, b->size, 1000 * b->timestamp);
+	recordLatency(&r->stats.encode, start);
+	if (v.size < 0)
+		return 0;
+
+	countVideo(r, &v);
+	if (v.size > 0 && video_passthrough_changed(r->video.encoder) && ! emitVideoConfig(r, v.dts + r->rtmp.shift))
+		return 0;
+
+	return emitEncoded(r, &v);
+}
+
+// Push mode: encode one pushed frame / block
+//  Their timestamps are already seconds since the start of the stream
+static int emitPushedVideo(struct rtmpcast_t * const r, const struct input_buffer_t * const b)
+{
+	if (r->video.passthrough)
+		return relayVideo(r, b);
+
+	const struct colorspace_layout_t * const l = &r->video.layout;
+	unsigned char * plane[3] = { b->data + l->offset[0], b->data + l->offset[1], b->data + l->offset[2] };
+
+	return emitVideo(r, plane, 1000 * b->timestamp);
+}
+
+static int emitPushedAudio(struct rtmpcast_t * const r, const struct input_buffer_t * const b)
+{
+	if (r->audio.passthrough)
+		return emitPassthrough(r, b->data, b->size, (b->user == &audio_config_buffer ? 0 : 1), 1000 * b->timestamp);
+	return emitAudio(r, (const int16_t *)b->data, 1000 * b->timestamp);
+}
+
+static void closeVideo(struct rtmpcast_t * const r)
+{
+	if (r->video.passthrough)
+		video_passthrough_close(r->video.encoder);
+	else
+		r->video.backend->close(r->video.encoder);
+}
+
+static void closeAudio(struct rtmpcast_t * const r)
+{
+	if (r->audio.passthrough)
+		audio_passthrough_close(r->audio.encoder);
+	else
+		r->audio.backend->close(r->audio.encoder);
+}
+
+// Pull mode: have the application fill our buffer, and encode the blocks
+//  that completes.  The next call is due once what it gave has played.
+//  Returns 0 on error
+static int pullAudio(struct rtmpcast_t * const r)
+{
+	// it returns how many samples it gave (all channels), or negative on error
+	const double start = getTimestamp();
+	const int count = r->audio.callback(r->audio.format >= RTMPCAST_SAMPLE_S16_PLANAR ? (void *)r->audio.planes : r->audio.buffer);
+	recordLatency(&r->stats.callback, start);
+	if (count < 0) {
+		fputs("Error when encoding audio\n", stderr);
+		return 0;
+	}
+
+	// nothing this time: leave a gap, rather than ask again straight away
+	const unsigned int frames = (count / r->audio.channels < RING_BLOCK ? count / r->audio.channels : RING_BLOCK);
+	if (frames == 0) {
+		r->audio.base += r->audio.timestamp_increment;
+		r->audio.timestamp_next += r->audio.timestamp_increment;
+		return 1;
+	}
+	r->audio.timestamp_next += (double)frames / r->audio.input_samplerate;
+
+	const void * const * data = (r->audio.format >= RTMPCAST_SAMPLE_S16_PLANAR ? (const void * const *)r->audio.planes : (const void * const *)&r->audio.buffer);
+	for (unsigned int done = 0; done < frames; ) {
+		done += ring_write(r->audio.ring, data, done, frames - done);
+
+		while (ring_ready(r->audio.ring)) {
+			const double t = r->audio.base + ring_read_time(r->audio.ring);
+			ring_read(r->audio.ring, r->audio.samples);
+			if (! emitAudio(r, r->audio.samples, streamTime(r, t)))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Encode everything pushed on one track so far
+//  Returns 0 on error
+static int drainInput(struct rtmpcast_t * const r, struct input_t * const input, int (* const emit)(struct rtmpcast_t *, const struct input_buffer_t *))
+{
+	input_reset(input);
+
+	const struct input_buffer_t * b;
+	while ((b = input_peek(input)) != NULL) {
+		const int ok = emit(r, b);
+		input_done(input);
+		if (! ok)
+			return 0;
+	}
+
+	return 1;
+}
+
+// Both tracks, oldest first, to keep them interleaved
+static int drainInputs(struct rtmpcast_t * const r)
+{
+	if (r->video.input) input_reset(r->video.input);
+	if (r->audio.input) input_reset(r->audio.input);
+
+	for (;;) {
+		const struct input_buffer_t * v = (r->video.input ? input_peek(r->video.input) : NULL);
+		const struct input_buffer_t * a = (r->audio.input ? input_peek(r->audio.input) : NULL);
+
+		int ok;
+		if (v && (! a || v->timestamp <= a->timestamp)) {
+			ok = emitPushedVideo(r, v);
+			input_done(r->video.input);
+		} else if (a) {
+			ok = emitPushedAudio(r, a);
+			input_done(r->audio.input);
+		} else
+			return 1;
+
+		if (! ok)
+			return 0;
+	}
+}
+
+// Sleep until something is pushed, or the idle interval passes
+static void waitInput(const struct input_t * const input)
+{
+	struct pollfd pfd = { input_fd(input), POLLIN, 0 };
+	if (poll(&pfd, 1, THREAD_IDLE_INTERVAL) == -1 && errno != EINTR)
+		perror("Error calling poll()");
+}
+
+static void * threadVideo(void * const arg)
+{
+	struct rtmpcast_t * const r = arg;
+
+	while (atomic_load(&r->thread.running)) {
+		// push mode: encode frames as they arrive
+		if (r->video.input) {
+			waitInput(r->video.input);
+			if (! drainInput(r, r->video.input, emitPushedVideo)) {
+				atomic_store(&r->thread.error, 1);
+				return NULL;
+			}
+			continue;
+		}
+
+		// wait until the frame is due, or skip ahead if far behind
+		const double now = getTimestamp();
+		skipLateVideo(r, now);
+		sleepFor(r->video.timestamp_next - now);
+
+		if (! emitVideo(r, NULL, streamTime(r, r->video.timestamp_next))) {
+			atomic_store(&r->thread.error, 1);
+			return NULL;
+		}
+
+		r->video.timestamp_next += r->video.timestamp_increment;
+	}
+
+	// push mode: whatever arrived before the stop
+	if (r->video.input && ! drainInput(r, r->video.input, emitPushedVideo))
+		atomic_store(&r->thread.error, 1);
+	// then what the encoder still holds
+	else if (! flushVideo(r))
+		atomic_store(&r->thread.error, 1);
+
+	return NULL;
+}
+
+static void * threadAudio(void * const arg)
+{
+	struct rtmpcast_t * const r = arg;
+
+	while (atomic_load(&r->thread.running)) {
+		// push mode: encode blocks as they arrive
+		if (r->audio.input) {
+			waitInput(r->audio.input);
+			if (! drainInput(r, r->audio.input, emitPushedAudio)) {
+				atomic_store(&r->thread.error, 1);
+				return NULL;
+			}
+			continue;
+		}
+
+		// wait until more samples are due
+		sleepFor(r->audio.timestamp_next - getTimestamp());
+
+		if (! pullAudio(r)) {
+			atomic_store(&r->thread.error, 1);
+			return NULL;
+		}
+	}
+
+	// push mode: whatever arrived before the stop
+	if (r->audio.input && ! drainInput(r, r->audio.input, emitPushedAudio))
+		atomic_store(&r->thread.error, 1);
+
+	return NULL;
+}
+
+// Take the queued tag with the earliest timestamp, to keep tracks interleaved
+static struct tag_t * nextTag(struct rtmpcast_t * const r)
 {
-	*p = type; p ++; // message type
-	// tag[1 - 3] are the message size, which we don't know yet
-	p += 3;
+	const struct tag_t * v = (r->video.queue ? queue_peek(r->video.queue) : NULL);
+	const struct tag_t * a = (r->audio.queue ? queue_peek(r->audio.queue) : NULL);
+
+	if (v && (! a || v->timestamp <= a->timestamp))
+		return queue_pop(r->video.queue);
+	if (a)
+		return queue_pop(r->audio.queue);
+
+	return NULL;
+}
+
+static void * threadSend(void * const arg)
+{
+	struct rtmpcast_t * const r = arg;
+
+	// the eventfd, then one socket per destination
+	const unsigned int n = 1 + r->rtmp.outputs;
+	struct pollfd * const fds = malloc(n * sizeof(struct pollfd));
+	if (fds == NULL) {
+		perror("librtmpcast: ERROR: malloc() returned NULL");
+		atomic_store(&r->thread.error, 1);
+		return NULL;
+	}
+
+	for (;;) {
+		// wait for a finished tag or a socket, or time out and check anyway
+		fds[0].fd = r->thread.wake;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+			const struct output_t * const o = r->rtmp.output[i];
+
+			// poll skips negative fds: failed destinations
+			fds[1 + i].fd = (o ? output_fd(o) : -1);
+			fds[1 + i].events = POLLIN | (o && output_pending(o) ? POLLOUT : 0);
+			fds[1 + i].revents = 0;
+		}
+		if (poll(fds, n, THREAD_IDLE_INTERVAL) == -1 && errno != EINTR)
+			perror("Error calling poll()");
+
+		if (fds[0].revents & POLLIN) {
+			uint64_t count;
+			if (read(r->thread.wake, &count, sizeof(count)) == -1 && errno != EAGAIN)
+				perror("librtmpcast: ERROR: read() from eventfd failed");
+		}
+
+		// read this first: once set, no more tags can arrive
+		const int last = atomic_load(&r->thread.draining);
+
+		int ok = 1;
+		struct tag_t * tag;
+		while (ok && (tag = nextTag(r)) != NULL)
+			ok = dispatchTag(r, tag);
+
+		ok = ok && serviceOutputs(r);
+		if (ok)
+			adaptBitrate(r);
+
+		if (ok && last)
+			ok = drainOutputs(r);
+
+		if (! ok) {
+			fputs("librtmpcast: ERROR: send thread: writing to the destinations failed: none left\n", stderr);
+			atomic_store(&r->thread.error, 1);
+		}
+
+		if (! ok || last)
+			break;
+	}
+
+	free(fds);
+	return NULL;
+}
+
+// Stop the encode threads, then let the send thread empty the queues
+static void stopThreads(struct rtmpcast_t * const r)
+{
+	atomic_store(&r->thread.running, 0);
+	if (r->thread.started & THREAD_VIDEO) pthread_join(r->video.thread, NULL);
+	if (r->thread.started & THREAD_AUDIO) pthread_join(r->audio.thread, NULL);
+
+	atomic_store(&r->thread.draining, 1);
+	if (r->thread.started & THREAD_SEND) {
+		const uint64_t one = 1;
+		if (write(r->thread.wake, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			perror("librtmpcast: ERROR: write() to eventfd failed");
+		pthread_join(r->thread.send, NULL);
+	}
+
+	// the send thread may have quit early on error
+	struct tag_t * tag;
+	while ((tag = nextTag(r)) != NULL)
+		pool_put(tag);
+
+	r->thread.started = 0;
+}
+
+// Start all threads, or none
+static int startThreads(struct rtmpcast_t * const r)
+{
+	atomic_store(&r->thread.running, 1);
+	atomic_store(&r->thread.draining, 0);
+
+	if (pthread_create(&r->thread.send, NULL, threadSend, r) == 0)
+		r->thread.started |= THREAD_SEND;
+	else {
+		stopThreads(r);
+		return 0;
+	}
+
+	if (r->video.encoder) {
+		if (pthread_create(&r->video.thread, NULL, threadVideo, r) == 0)
+			r->thread.started |= THREAD_VIDEO;
+		else {
+			stopThreads(r);
+			return 0;
+		}
+	}
 
-	// FLV timestamp is written in an odd format
-	p = u24be(p, timestamp & 0x00FFFFFF);
-	*p = timestamp >> 24 & 0xFF; p ++;
+	if (r->audio.encoder) {
+		if (pthread_create(&r->audio.thread, NULL, threadAudio, r) == 0)
+			r->thread.started |= THREAD_AUDIO;
+		else {
+			stopThreads(r);
+			return 0;
+		}
+	}
 
-	return u24be(p, 0); // stream ID
+	return 1;
 }
 
-// Finishes a tag (corrects Payload Size in bytes 1-3, and appends Tag Size)
-//  Returns complete tag size, ready for writing
-static uint32_t flv_TagFinish(uint8_t * tag, uint8_t * p)
+// Basic stream params for onMetaData, as ECMA array entries
+//  Returns the end of them, and how many there are in count
+static uint8_t * metaDataEntries(const struct rtmpcast_t * const r, uint8_t * p, unsigned int * const count)
 {
-	uint32_t payloadSize = p - (tag + 11);
-	u24be(tag + 1, payloadSize);
-	u32be(p, 11 + payloadSize);
+	*count = (r->video.encoder ? 5 : 0) + (r->audio.encoder ? 4 : 0);
+
+	if (r->video.encoder) {
+		p = amf_ecma_array_entry(p, "width", r->video.width);
+		p = amf_ecma_array_entry(p, "height", r->video.height);
+		p = amf_ecma_array_entry(p, "framerate", r->video.framerate);
+		p = amf_ecma_array_entry(p, "videocodecid", 7);
+		p = amf_ecma_array_entry(p, "videodatarate", r->video.bitrate);
+	}
+	if (r->audio.encoder) {
+		p = amf_ecma_array_entry(p, "audiocodecid", 10);
+		p = amf_ecma_array_entry(p, "audiodatarate", r->audio.bitrate);
+		p = amf_ecma_array_entry(p, "audiosamplerate", r->audio.samplerate);
+		//p = amf_ecma_array_entry(p, "audiosamplesize", 16);
+		p = amf_boolean(pstring(p, "stereo"), r->audio.channels == 2);
+	}
 
-	return 11 + payloadSize + 4;
+	return p;
 }
 
-// FLV Video Packet (AVC format)
-//  Composition Time is 0 for all-I frames, but otherwise should be the time diff. between PTS and DTS
-static uint8_t * flv_AVCVideoPacket(uint8_t * const p, const unsigned int keyframe, const uint8_t type, const long composition_time)
+// Queue setting for one destination: its own, else the shared one, else the default
+static unsigned int queueSetting(const unsigned int own, const unsigned int shared, const unsigned int fallback)
 {
-	if (keyframe)
-		*p = 0x17;
-	else
-		*p = 0x27;
-
-	*(p + 1) = type;
-	return u24be(p + 2, composition_time);
+	if (own) return own;
+	if (shared) return shared;
+	return fallback;
 }
 
 // Allocate an object and give it a URL to work with
@@ -204,8 +1364,12 @@ struct rtmpcast_t * rtmpcast_init (const struct rtmpcast_param_t * const p)
 		fputs("librtmpcast: ERROR: rtmpcast_param_t is NULL\n", stderr);
 		return NULL;
 	}
-	if (! p->url) {
-		fputs("librtmpcast: ERROR: rtmp.url is NULL\n", stderr);
+	if (! p->url && ! p->destination_count && ! p->filename) {
+		fputs("librtmpcast: ERROR: url and filename are NULL and there are no other destinations\n", stderr);
+		return NULL;
+	}
+	if (p->destination_count && ! p->destinations) {
+		fputs("librtmpcast: ERROR: destinations is NULL\n", stderr);
 		return NULL;
 	}
 	if (! (p->video.enable || p->audio.enable)) {
@@ -213,6 +1377,52 @@ struct rtmpcast_t * rtmpcast_init (const struct rtmpcast_param_t * const p)
 		return NULL;
 	}
 
+	// encoder options are checked now, rather than failing halfway through setup
+	const struct video_options_t videoOptions = {
+		.threads = p->video.options.threads,
+		.sliced_threads = p->video.options.sliced_threads,
+		.lookahead = p->video.options.lookahead,
+		.preset = p->video.options.preset,
+		.tune = p->video.options.tune,
+		.profile = p->video.options.profile,
+		.keyint = p->video.options.keyint,
+		.rc = p->video.options.rc,
+		.crf = p->video.options.crf
+	};
+	// passthrough has no encoder to tune, and no frames to convert
+	const int encode = (p->video.enable && ! p->video.passthrough);
+	const struct video_backend_t * const videoBackend = (encode ? backend_video(p->video.backend) : NULL);
+	if (encode && (videoBackend == NULL || ! videoBackend->validate(&videoOptions)))
+		return NULL;
+	const struct audio_backend_t * const audioBackend = (p->audio.enable && ! p->audio.passthrough ? backend_audio(p->audio.backend) : NULL);
+	if (p->audio.enable && ! p->audio.passthrough && audioBackend == NULL)
+		return NULL;
+	struct colorspace_layout_t layout;
+	if (encode && ! colorspace_layout(p->video.format, p->video.width, p->video.height, &layout)) {
+		fprintf(stderr, "librtmpcast: ERROR: unknown video.format %d\n", p->video.format);
+		return NULL;
+	}
+	if (encode && (p->video.width % 2 || p->video.height % 2)) {
+		fputs("librtmpcast: ERROR: video.width and video.height must be even\n", stderr);
+		return NULL;
+	}
+	if (p->video.enable && p->video.min_bitrate > p->video.bitrate) {
+		fputs("librtmpcast: ERROR: video.min_bitrate is above video.bitrate\n", stderr);
+		return NULL;
+	}
+	if (encode && p->video.min_bitrate && p->video.options.rc == RTMPCAST_RC_ABR) {
+		fputs("librtmpcast: ERROR: video.min_bitrate needs a capped rate control (CBR or CRF): ABR has no cap to adapt\n", stderr);
+		return NULL;
+	}
+	if (p->video.enable && p->video.passthrough && (p->video.callback || p->video.min_bitrate)) {
+		fputs("librtmpcast: ERROR: video.passthrough takes H.264 from rtmpcast_push_h264: video.callback must be NULL, and there is no bitrate to adapt\n", stderr);
+		return NULL;
+	}
+	if (p->audio.enable && p->audio.passthrough && p->audio.callback) {
+		fputs("librtmpcast: ERROR: audio.passthrough takes AAC from rtmpcast_push_aac: audio.callback must be NULL\n", stderr);
+		return NULL;
+	}
+
 	// allocate a struct
 	struct rtmpcast_t * r = malloc(sizeof(struct rtmpcast_t));
 	if (! r) {
@@ -221,8 +1431,86 @@ struct rtmpcast_t * rtmpcast_init (const struct rtmpcast_param_t * const p)
 	}
 
 	/* *************************************************** */
-	// allocate a very large buffer for all packets and operations
-	r->rtmp.tag = malloc(MAX_TAG_SIZE);
+	// small buffers for metadata and control packets
+	//  each track gets its own buffers, so they can be encoded concurrently
+	r->rtmp.pool = pool_create(META_TAG_SIZE, POOL_KEEP);
+	r->video.pool = NULL;
+	r->audio.pool = NULL;
+	r->video.iov = NULL;
+	r->video.iov_max = 0;
+	r->video.timestamp_last = 0;
+	atomic_init(&r->video.keyframe, 0);
+	r->video.callback = p->video.callback;
+	r->video.frame[0] = r->video.frame[1] = r->video.frame[2] = NULL;
+	r->video.source[0] = r->video.source[1] = r->video.source[2] = NULL;
+	r->video.convert = NULL;
+	r->video.passthrough = (p->video.enable && p->video.passthrough);
+	r->audio.callback = p->audio.callback;
+	r->audio.samples = NULL;
+	r->audio.buffer = NULL;
+	r->audio.ring = NULL;
+	r->audio.base = NAN;
+	// no schedule until connected
+	r->video.timestamp_next = INFINITY;
+	r->audio.timestamp_next = INFINITY;
+	memset(&r->stats, 0, sizeof(r->stats));
+	pthread_mutex_init(&r->stats.lock, NULL);
+	// adaptive bitrate, off until the video settings say otherwise
+	//  (and offline, where there is no network to adapt to)
+	r->abr.min = 0;
+	r->abr.max = 0;
+	atomic_init(&r->abr.target, 0);
+	r->abr.current = 0;
+	r->abr.next_check = 0;
+	r->abr.clear = 0;
+	r->abr.dropped = 0;
+	r->rtmp.shift = 0;
+	r->video.input = NULL;
+	r->video.frames = NULL;
+	r->video.gap = 0;
+	r->audio.input = NULL;
+
+	// push timestamps are only meaningful once connected
+	r->rtmp.start = INFINITY;
+	r->push.started = 0;
+	r->push.origin = 0;
+	pthread_mutex_init(&r->push.lock, NULL);
+
+	// no url and no destinations: write the file as fast as we can encode
+	r->rtmp.offline = (! p->url && ! p->destination_count);
+	r->rtmp.clock = 0;
+
+	// threaded mode: queues and threads are set up now, started on connect
+	//  (not offline: the threads pace themselves on the real clock)
+	r->thread.enable = p->threaded;
+	if (r->thread.enable && r->rtmp.offline) {
+		fputs("librtmpcast: WARNING: threaded mode is ignored without a url\n", stderr);
+		r->thread.enable = 0;
+	}
+	r->thread.started = 0;
+	atomic_init(&r->thread.running, 0);
+	atomic_init(&r->thread.draining, 0);
+	atomic_init(&r->thread.error, 0);
+	r->video.queue = NULL;
+	r->audio.queue = NULL;
+
+	r->thread.wake = -1;
+	if (r->thread.enable) {
+		r->thread.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (r->thread.wake == -1) {
+			perror("librtmpcast: ERROR: eventfd() failed");
+			r->thread.enable = 0;
+		}
+	}
+
+	// the outgoing queues bound latency: video further behind than this is dropped
+	//  (by the most patient destination, when there are several)
+	unsigned int watermark = (p->url ? queueSetting(0, p->queue.watermark, OUTPUT_DEFAULT_WATERMARK) : 0);
+	for (unsigned int i = 0; i < p->destination_count; i ++) {
+		const unsigned int w = queueSetting(p->destinations[i].queue.watermark, p->queue.watermark, OUTPUT_DEFAULT_WATERMARK);
+		if (w > watermark)
+			watermark = w;
+	}
 
 	// copy the callback param
 	if (p->video.enable) {
@@ -231,20 +1519,101 @@ struct rtmpcast_t * rtmpcast_init (const struct rtmpcast_param_t * const p)
 		r->video.height = p->video.height;
 		r->video.framerate = p->video.framerate;
 		r->video.bitrate = p->video.bitrate;
+		r->video.drop_disposable = p->video.drop_disposable;
+
+		r->abr.max = r->video.bitrate;
+		r->abr.current = r->video.bitrate;
+		atomic_init(&r->abr.target, r->video.bitrate);
+		if (! r->rtmp.offline && p->video.min_bitrate < p->video.bitrate)
+			r->abr.min = p->video.min_bitrate;
 
 		// calculate the timestamp interval
 		r->video.timestamp_increment = 1.0 / r->video.framerate;
 
+		// a frame that would be dropped from the queue anyway is not worth encoding
+		r->video.late_limit = watermark / 1000.0;
+
+		// buffers sized for this bitrate
+		size_t size = VIDEO_TAG_SIZE((size_t)r->video.bitrate, r->video.framerate);
+		if (size < VIDEO_TAG_SIZE_MIN)
+			size = VIDEO_TAG_SIZE_MIN;
+		r->video.pool = pool_create(size, r->thread.enable ? POOL_KEEP_THREADED : POOL_KEEP);
+
 		// set up the encoder
-		//  only x264 supported for now
-		r->video.encoder = video_x264_create(
-			p->video.width,
-			p->video.height,
-			p->video.framerate,
-			p->video.bitrate,
-			p->video.callback,
-			r->rtmp.tag + 11 + 5
-		);
+		//  the chosen backend, or H.264 sent on as it comes
+		r->video.backend = videoBackend;
+		if (r->video.passthrough)
+			r->video.encoder = video_passthrough_create();
+		else
+			r->video.encoder = r->video.backend->create(
+				p->video.width,
+				p->video.height,
+				p->video.framerate,
+				p->video.bitrate,
+				&videoOptions
+			);
+
+		// B-frames: start the whole stream late enough for their decode times
+		if (r->video.encoder && ! r->video.passthrough)
+			r->rtmp.shift = r->video.backend->dts_shift(r->video.encoder);
+
+		if (r->thread.enable)
+			r->video.queue = queue_create(THREAD_QUEUE_SECONDS * r->video.framerate);
+
+		// other formats are converted into an I420 frame of our own
+		colorspace_layout(p->video.format, r->video.width, r->video.height, &r->video.layout);
+		struct colorspace_layout_t i420;
+		colorspace_layout(RTMPCAST_FORMAT_I420, r->video.width, r->video.height, &i420);
+		if (p->video.format != RTMPCAST_FORMAT_I420 && ! r->video.passthrough)
+			r->video.convert = colorspace_create(p->video.format, r->video.width, r->video.height, -1, p->video.convert_threads);
+		if (r->video.convert || (p->video.callback && p->video.format == RTMPCAST_FORMAT_I420)) {
+			r->video.frame[0] = malloc(i420.size);
+			if (r->video.frame[0] == NULL)
+				perror("librtmpcast: ERROR: malloc() returned NULL");
+			else {
+				r->video.frame[1] = r->video.frame[0] + i420.offset[1];
+				r->video.frame[2] = r->video.frame[0] + i420.offset[2];
+			}
+		}
+
+		// the callback fills this, then it goes to the encoder (by way of
+		//  the converter, unless it is I420 already)
+		if (p->video.callback) {
+			if (r->video.convert == NULL)
+				r->video.source[0] = r->video.frame[0];
+			else if ((r->video.source[0] = malloc(r->video.layout.size)) == NULL)
+				perror("librtmpcast: ERROR: malloc() returned NULL");
+
+			for (unsigned int i = 1; r->video.source[0] && i < r->video.layout.planes; i ++)
+				r->video.source[i] = r->video.source[0] + r->video.layout.offset[i];
+		}
+
+		// passthrough: access units from rtmpcast_push_h264, in buffers
+		//  that grow to fit
+		if (r->video.passthrough)
+			r->video.input = input_create(size, PUSH_VIDEO_FRAMES);
+		// no callback: frames come from rtmpcast_push_video / rtmpcast_submit_frame
+		else if (p->video.callback == NULL) {
+			const struct colorspace_layout_t * const l = &r->video.layout;
+			r->video.input = input_create(l->size, PUSH_VIDEO_FRAMES);
+
+			unsigned int count = 0;
+			struct input_buffer_t * b = (r->video.input ? input_buffers(r->video.input, &count) : NULL);
+			r->video.frames = malloc(count * sizeof(struct rtmpcast_frame_t));
+			if (r->video.frames == NULL)
+				perror("librtmpcast: ERROR: malloc() returned NULL");
+
+			// the application fills these planes in place
+			for (unsigned int i = 0; r->video.frames && i < count; i ++) {
+				struct rtmpcast_frame_t * f = &r->video.frames[i];
+				for (unsigned int j = 0; j < 3; j ++) {
+					f->plane[j] = (j < l->planes ? b[i].data + l->offset[j] : NULL);
+					f->stride[j] = l->stride[j];
+				}
+				f->buffer = &b[i];
+				b[i].user = f;
+			}
+		}
 
 	} else {
 		// clear some values in the struct
@@ -252,8 +1621,10 @@ struct rtmpcast_t * rtmpcast_init (const struct rtmpcast_param_t * const p)
 		r->video.height = 0;
 		r->video.framerate = 0;
 		r->video.bitrate = 0;
+		r->video.drop_disposable = 0;
 
 		r->video.timestamp_increment = INFINITY;
+		r->video.late_limit = INFINITY;
 
 		r->video.encoder = NULL;
 	}
@@ -265,19 +1636,54 @@ struct rtmpcast_t * rtmpcast_init (const struct rtmpcast_param_t * const p)
 		r->audio.samplerate = p->audio.samplerate;
 		r->audio.channels = p->audio.channels;
 		r->audio.bitrate = p->audio.bitrate;
+		r->audio.format = p->audio.format;
+		r->audio.input_samplerate = (p->audio.input_samplerate ? p->audio.input_samplerate : p->audio.samplerate);
 
-		// calculate the timestamp interval
-		r->audio.timestamp_increment = 1024.0 / r->audio.samplerate;
+		// a block's worth of the application's samples
+		r->audio.timestamp_increment = (double)RING_BLOCK / r->audio.input_samplerate;
+
+		// AAC frames have a known maximum size
+		r->audio.pool = pool_create(AUDIO_TAG_SIZE(p->audio.channels), r->thread.enable ? POOL_KEEP_THREADED : POOL_KEEP);
 
 		// set up the encoder
-		//  only fdkaac supported for now
-		r->audio.encoder = audio_fdkaac_create(
-			p->audio.channels,
-			p->audio.bitrate,
-			p->audio.samplerate,
-			p->audio.callback,
-			r->rtmp.tag + 11 + 2
-		);
+		//  the chosen backend, or AAC sent on as it comes
+		r->audio.passthrough = p->audio.passthrough;
+		r->audio.backend = audioBackend;
+		if (r->audio.passthrough)
+			r->audio.encoder = audio_passthrough_create(p->audio.config, p->audio.config_size);
+		else
+			r->audio.encoder = r->audio.backend->create(
+				p->audio.channels,
+				p->audio.bitrate,
+				p->audio.samplerate
+			);
+
+		if (r->thread.enable)
+			r->audio.queue = queue_create(THREAD_QUEUE_SECONDS * r->audio.samplerate / 1024 + 1);
+
+		// whatever the application gives goes through here
+		if (! r->audio.passthrough)
+			r->audio.ring = ring_create(r->audio.format, r->audio.channels, r->audio.input_samplerate, r->audio.samplerate);
+
+		if (p->audio.callback) {
+			// a block at the application's rate, and one for the encoder
+			const size_t channel = RING_BLOCK * ring_sample_size(r->audio.format);
+			r->audio.buffer = malloc(r->audio.channels * channel);
+			r->audio.samples = malloc(RING_BLOCK * r->audio.channels * sizeof(int16_t));
+			if (r->audio.buffer == NULL || r->audio.samples == NULL) {
+				perror("librtmpcast: ERROR: malloc() returned NULL");
+				free(r->audio.samples);
+				r->audio.samples = NULL;
+			} else
+				for (unsigned int c = 0; c < r->audio.channels; c ++)
+					r->audio.planes[c] = (uint8_t *)r->audio.buffer + c * channel;
+		}
+
+		// no callback: samples come from rtmpcast_push_audio, in whole blocks
+		//  (passthrough: frames, and room for a config to go with one)
+		if (p->audio.callback == NULL)
+			r->audio.input = input_create(r->audio.passthrough ? AUDIO_PASSTHROUGH_MAX_FRAME : RING_BLOCK * r->audio.channels * sizeof(int16_t),
+				PUSH_AUDIO_SECONDS * r->audio.samplerate / RING_BLOCK + 1 + r->audio.passthrough);
 	} else {
 		r->audio.samplerate = 0;
 		r->audio.channels = 0;
@@ -289,41 +1695,92 @@ struct rtmpcast_t * rtmpcast_init (const struct rtmpcast_param_t * const p)
 	}
 
 	/* *************************************************** */
-	// Increase the log level for all RTMP actions
-	RTMP_LogSetLevel(RTMP_LOGINFO);
-	RTMP_LogSetOutput(stderr);
+	// Init RTMP code: the main url first, then the other destinations
+	r->rtmp.outputs = (p->url ? 1 : 0) + p->destination_count;
+	r->rtmp.live = 0;
+	r->rtmp.output = calloc(r->rtmp.outputs, sizeof(struct output_t *));
+	r->rtmp.resume = calloc(r->rtmp.outputs, 1);
+
+	int ok = r->rtmp.offline || (r->rtmp.output != NULL && r->rtmp.resume != NULL);
+	if (! ok)
+		perror("librtmpcast: ERROR: calloc() returned NULL");
+
+	// push mode needs its buffers, and so do the callbacks
+	if ((p->video.enable && ! r->video.passthrough && p->video.callback == NULL && r->video.frames == NULL) ||
+		(r->video.passthrough && (r->video.encoder == NULL || r->video.input == NULL)) ||
+		(p->audio.enable && p->audio.callback == NULL && r->audio.input == NULL) ||
+		(p->video.enable && p->video.callback && r->video.source[0] == NULL) ||
+		(p->video.enable && ! r->video.passthrough && p->video.format != RTMPCAST_FORMAT_I420 && r->video.frame[0] == NULL) ||
+		(p->audio.enable && p->audio.callback && r->audio.samples == NULL) ||
+		(p->audio.enable && ! r->audio.passthrough && r->audio.ring == NULL) ||
+		(p->audio.enable && r->audio.passthrough && r->audio.encoder == NULL))
+		ok = 0;
+
+	for (unsigned int i = 0; ok && i < r->rtmp.outputs; i ++) {
+		const unsigned int d = i - (p->url ? 1 : 0);
+
+		if (p->url && i == 0)
+			r->rtmp.output[i] = output_create(p->url,
+				queueSetting(0, p->queue.length, OUTPUT_DEFAULT_LENGTH),
+				queueSetting(0, p->queue.watermark, OUTPUT_DEFAULT_WATERMARK),
+				p->reconnect);
+		else
+			r->rtmp.output[i] = output_create(p->destinations[d].url,
+				queueSetting(p->destinations[d].queue.length, p->queue.length, OUTPUT_DEFAULT_LENGTH),
+				queueSetting(p->destinations[d].queue.watermark, p->queue.watermark, OUTPUT_DEFAULT_WATERMARK),
+				p->reconnect);
+
+		if (r->rtmp.output[i] == NULL)
+			ok = 0;
+		else
+			r->rtmp.live ++;
+	}
 
-	/* *************************************************** */
-	// Init RTMP code
-	r->rtmp.rtmp = RTMP_Alloc();
-	RTMP_Init(r->rtmp.rtmp);
-
-	if (r->rtmp.rtmp == NULL) {
-		fputs("Failed to create RTMP object\n", stderr);
-		audio_fdkaac_close(r->audio.encoder);
-		video_x264_close(r->video.encoder);
-		free(r->rtmp.tag);
+	if (! ok) {
+		for (unsigned int i = 0; r->rtmp.output && i < r->rtmp.outputs; i ++)
+			if (r->rtmp.output[i]) output_close(r->rtmp.output[i]);
+		free(r->rtmp.resume);
+		free(r->rtmp.output);
+		if (r->audio.encoder) closeAudio(r);
+		if (r->video.encoder) closeVideo(r);
+		if (r->audio.queue) queue_close(r->audio.queue);
+		if (r->video.queue) queue_close(r->video.queue);
+		if (r->audio.input) input_close(r->audio.input);
+		if (r->video.input) input_close(r->video.input);
+		free(r->video.frames);
+		if (r->video.convert) {
+			colorspace_close(r->video.convert);
+			free(r->video.source[0]);
+		}
+		free(r->video.frame[0]);
+		if (r->audio.ring) ring_close(r->audio.ring);
+		free(r->audio.buffer);
+		free(r->audio.samples);
+		pthread_mutex_destroy(&r->push.lock);
+		pthread_mutex_destroy(&r->stats.lock);
+		if (r->thread.wake != -1) close(r->thread.wake);
+		if (r->audio.pool) pool_close(r->audio.pool);
+		if (r->video.pool) pool_close(r->video.pool);
+		pool_close(r->rtmp.pool);
+		free(r);
 		return NULL;
 	}
 
-	RTMP_SetupURL(r->rtmp.rtmp, p->url);
-	RTMP_EnableWrite(r->rtmp.rtmp);
-
 	// if user added a filename, open it and prep for writing
 	//  if this fails it is non-fatal
+	//  offline, the recorder waits for the disk: there is no stream to hold up
+	r->rtmp.recorder = NULL;
 	if (p->filename != NULL)
 	{
-		r->rtmp.flv = fopen(p->filename, "wb");
-		if (r->rtmp.flv == NULL) {
+		uint8_t entries[META_TAG_SIZE];
+		unsigned int count;
+		const size_t size = metaDataEntries(r, entries, &count) - entries;
+
+		r->rtmp.recorder = recorder_create(p->filename,
+			(p->audio.enable ? 0x04 : 0) | (p->video.enable ? 0x01 : 0),
+			entries, size, count, r->rtmp.offline);
+		if (r->rtmp.recorder == NULL)
 			fprintf(stderr, "Failed to open '%s' for writing. Local file output will be disabled.\n", p->filename);
-			perror("Error reported was");
-			r->rtmp.flv = NULL;
-		} else {
-			const uint8_t flvHeader[] = { 0x46, 0x4C, 0x56, 0x01, (p->audio.enable ? 0x04 : 0) | (p->video.enable ? 0x01 : 0), 0, 0, 0, 9, 0, 0, 0, 0 };
-			fwrite(flvHeader, 1, 13, r->rtmp.flv);
-		}
-	} else {
-		r->rtmp.flv = NULL;
 	}
 
 	return r;
@@ -332,123 +1789,170 @@ struct rtmpcast_t * rtmpcast_init (const struct rtmpcast_param_t * const p)
 // Make connection to configured RTMP service, send initial metadata packets
 int rtmpcast_connect (struct rtmpcast_t * const r)
 {
-	// Make RTMP connection to server
-	if (! RTMP_Connect(r->rtmp.rtmp, NULL)) {
-		fputs("Failed to connect to remote RTMP server\n", stderr);
-		return 0;
+	// Make RTMP connection to each server
+	//  a destination that fails here is skipped, as long as one is left
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		if (r->rtmp.output[i] && ! output_connect(r->rtmp.output[i])) {
+			fprintf(stderr, "Skipping destination '%s'\n", output_url(r->rtmp.output[i]));
+			pthread_mutex_lock(&r->stats.lock);
+			output_close(r->rtmp.output[i]);
+			r->rtmp.output[i] = NULL;
+			pthread_mutex_unlock(&r->stats.lock);
+			r->rtmp.live --;
+		}
 	}
 
-	// Connect to RTMP stream
-	if (! RTMP_ConnectStream(r->rtmp.rtmp, 0)) {
-		fputs("Failed to connect to RTMP stream\n", stderr);
+	if (! outputsLive(r))
 		return 0;
-	}
-
-	// track the fd for rtmp
-	r->rtmp.fd = RTMP_Socket(r->rtmp.rtmp);
 
 	// READY to send the first packet!
 	// First event is the onMetaData, which uses AMF (Action Meta Format)
 	//  to serialize basic stream params
-	uint8_t * p = flv_TagHeader(r->rtmp.tag, 18, 0);
+	struct tag_t * tag = controlTag(r);
+	if (tag == NULL)
+		return 0;
+
+	uint8_t * p = flv_TagHeader(tag->data, 18, 0);
 
 	// script data type is "onMetaData"
 	p = amf_string(p, "onMetaData");
 	// associative array with various stream parameters
-	p = amf_ecma_array(p,
-		(r->video.encoder ? 5 : 0) +
-		(r->audio.encoder ? 4 : 0));
-	if (r->video.encoder) {
-		p = amf_ecma_array_entry(p, "width", r->video.width);
-		p = amf_ecma_array_entry(p, "height", r->video.height);
-		p = amf_ecma_array_entry(p, "framerate", r->video.framerate);
-		p = amf_ecma_array_entry(p, "videocodecid", 7);
-		p = amf_ecma_array_entry(p, "videodatarate", r->video.bitrate);
-	}
-	if (r->audio.encoder) {
-		p = amf_ecma_array_entry(p, "audiocodecid", 10);
-		p = amf_ecma_array_entry(p, "audiodatarate", r->audio.bitrate);
-		p = amf_ecma_array_entry(p, "audiosamplerate", r->audio.samplerate);
-		//p = amf_ecma_array_entry(p, "audiosamplesize", 16);
-		p = amf_boolean(pstring(p, "stereo"), r->audio.channels == 2);
-	}
+	uint8_t * const array = p;
+	unsigned int count;
+	p = metaDataEntries(r, p + 5, &count);
+	amf_ecma_array(array, count);
 	// finalize the array
 	p = amf_ecma_array_end(p);
 
 	// calculate tag size and write it
-	uint32_t tagSize = flv_TagFinish(r->rtmp.tag, p);
+	//  the local copy has its own, with room for the keyframe index
+	tag->size = flv_TagFinish(tag->data, p);
 
-	if (RTMP_Write(r->rtmp.rtmp, (const char *)r->rtmp.tag, tagSize) <= 0) {
-		fputs("Failed to RTMP_Write\n", stderr);
+	if (! sendTag(r, tag)) {
+		fputs("librtmpcast: ERROR: rtmpcast_connect: sending the metadata failed: no destinations left\n", stderr);
 		return 0;
 	}
-	if (r->rtmp.flv) fwrite(r->rtmp.tag, 1, tagSize, r->rtmp.flv);
 
+	// sequence headers are small enough for a metadata buffer too
 	if (r->video.encoder) {
-		p = flv_TagHeader(r->rtmp.tag, 9, 0);
+		if ((tag = controlTag(r)) == NULL)
+			return 0;
+
+		p = flv_TagHeader(tag->data, 9, 0);
 
 		// Set up an AVC Video Packet (is keyframe, type 0)
 		p = flv_AVCVideoPacket(p, 1, 0, 0);
 
 		// video init
-		int video_size = video_x264_init(r->video.encoder);
+		const unsigned int capacity = tag->capacity - (p - tag->data) - 4;
+		int video_size = (r->video.passthrough ? video_passthrough_init(r->video.encoder, p, capacity) : r->video.backend->init(r->video.encoder, p, capacity));
 		if (video_size < 0) {
 			// error occurred
-			fputs("Failed to fdkaac_init\n", stderr);
+			fputs("Failed to write the video sequence header\n", stderr);
+			pool_put(tag);
 			return 0;
 		}
 		p += video_size;
 
 		// calculate tag size and write it
-		tagSize = flv_TagFinish(r->rtmp.tag, p);
+		tag->size = flv_TagFinish(tag->data, p);
 
-		if (RTMP_Write(r->rtmp.rtmp, (const char *)r->rtmp.tag, tagSize) <= 0) {
-			fputs("Failed to RTMP_Write\n", stderr);
+		// passthrough: the SPS / PPS come with the first keyframe instead
+		if (video_size == 0)
+			pool_put(tag);
+		else if (! dispatchTag(r, tag)) {
+			fputs("librtmpcast: ERROR: rtmpcast_connect: sending the video sequence header failed: no destinations left\n", stderr);
 			return 0;
 		}
-		if (r->rtmp.flv) fwrite(r->rtmp.tag, 1, tagSize, r->rtmp.flv);
 	}
 
 	/* ************************************************************************** */
 	// NOW!!! we have set up the video encoder.
 	//  so let's do audio next - the Initial Audio Packet.
 	if (r->audio.encoder) {
-		p = flv_TagHeader(r->rtmp.tag, 8, 0);
+		if ((tag = controlTag(r)) == NULL)
+			return 0;
+
+		p = flv_TagHeader(tag->data, 8, 0);
 		// 0xA0 for "AAC"
 		// 0x0F for flags (44khz, stereo, 16bit)
 		*p = 0xAF; p++;
 		*p = 0; p++;
 
-		int audio_size = audio_fdkaac_init(r->audio.encoder);
+		int audio_size = (r->audio.passthrough ? audio_passthrough_init(r->audio.encoder, p) : r->audio.backend->init(r->audio.encoder, p));
 		if (audio_size < 0) {
 			// error occurred
-			fputs("Failed to fdkaac_init\n", stderr);
+			fputs("Failed to write the audio sequence header\n", stderr);
+			pool_put(tag);
 			return 0;
 		}
 		p += audio_size;
 		// calculate tag size and write it
-		tagSize = flv_TagFinish(r->rtmp.tag, p);
+		tag->size = flv_TagFinish(tag->data, p);
 
-		if (RTMP_Write(r->rtmp.rtmp, (const char *)r->rtmp.tag, tagSize) <= 0) {
-			fputs("Failed to RTMP_Write\n", stderr);
+		// ADTS passthrough: the config comes with the first frame instead
+		if (audio_size == 0)
+			pool_put(tag);
+		else if (! dispatchTag(r, tag)) {
+			fputs("librtmpcast: ERROR: rtmpcast_connect: sending the audio sequence header failed: no destinations left\n", stderr);
 			return 0;
 		}
-		if (r->rtmp.flv) fwrite(r->rtmp.tag, 1, tagSize, r->rtmp.flv);
+	}
+
+	// headers go out before any media
+	if (! drainOutputs(r)) {
+		fputs("librtmpcast: ERROR: rtmpcast_connect: writing the stream headers failed: no destinations left\n", stderr);
+		return 0;
+	}
+
+	// the file is all there is: without it, offline mode has nowhere to write
+	if (r->rtmp.offline && ! r->rtmp.recorder) {
+		fputs("librtmpcast: ERROR: no url and the local file could not be opened\n", stderr);
+		return 0;
 	}
 
 	// Starting timestamp of our video
-	r->rtmp.start = getTimestamp();
-	r->video.timestamp_next = (r->video.encoder ? r->rtmp.start : INFINITY);
-	r->audio.timestamp_next = (r->audio.encoder ? r->rtmp.start : INFINITY);
+	r->rtmp.start = streamNow(r);
+	r->rtmp.deadline = getTimestamp();
+	//  push mode tracks have no schedule of their own
+	r->video.timestamp_next = (r->video.encoder && ! r->video.input ? r->rtmp.start : INFINITY);
+	r->audio.timestamp_next = (r->audio.encoder && ! r->audio.input ? r->rtmp.start : INFINITY);
+	if (r->audio.encoder && ! r->audio.input)
+		r->audio.base = r->rtmp.start;
+
+	// threaded mode takes over from here
+	if (r->thread.enable && ! startThreads(r)) {
+		fputs("Failed to start encode / send threads\n", stderr);
+		return 0;
+	}
 
 	return 1;
 }
 
+// Offline mode: move the virtual clock to the next frame or block due
+//  Push mode tracks have no schedule, so with only those it stays put
+static double nextDue(struct rtmpcast_t * const r)
+{
+	const double next = fmin(r->video.timestamp_next, r->audio.timestamp_next);
+	if (! isinf(next))
+		r->rtmp.clock = next;
+
+	return r->rtmp.clock;
+}
+
 // Call this periodically to keep the stream flowing
 double rtmpcast_update (struct rtmpcast_t * r)
 {
 	// get the current time
-	double now = getTimestamp();
+	//  offline: the clock jumps straight to whichever track is due next
+	double now = (r->rtmp.offline ? nextDue(r) : getTimestamp());
+	unsigned int batch = 0;
+
+	// threaded mode: all the work happens elsewhere, just report on it
+	if (r->thread.enable) {
+		r->rtmp.deadline = now + THREAD_UPDATE_INTERVAL;
+		return (atomic_load(&r->thread.error) ? -1 : THREAD_UPDATE_INTERVAL);
+	}
 
 	// find out if we need to emit any frames
 
@@ -458,119 +1962,582 @@ double rtmpcast_update (struct rtmpcast_t * r)
 		//printf("now = %lf, vid_next = %lf, aud_next = %lf\n", now, r->video.timestamp_next, r->audio.timestamp_next);
 		// prioritize the most recent timestamp
 		if (r->video.timestamp_next < r->audio.timestamp_next) {
-			if (r->video.encoder) {
-				// Post our video frame
-				uint8_t * p = flv_TagHeader(r->rtmp.tag, 9, 1000 * (r->video.timestamp_next - r->rtmp.start));
-
-				// call out to the chosen encoder
-				struct video_return_t v = video_x264_update(r->video.encoder);
-
-				if (v.size < 0) {
-					// error in encoding
-					fputs("Error when encoding video\n", stderr);
-					return 0;
-				} else if (v.size > 0) {
-					// the encoder did something, need to package it up and ship
-					p = flv_AVCVideoPacket(p, v.keyframe, 1, 0);
-
-					// skip the encoder-written tag
-					p += v.size;
-
-					// calculate tag size and write it
-					uint32_t tagSize = flv_TagFinish(r->rtmp.tag, p);
-
-					//  cast to char* avoids a warning
-					if (RTMP_Write(r->rtmp.rtmp, (const char *)r->rtmp.tag, tagSize) <= 0) {
-						fputs("Failed to RTMP_Write a frame\n", stderr);
-					}
-					if (r->rtmp.flv) fwrite(r->rtmp.tag, 1, tagSize, r->rtmp.flv);
-				}
-			}
+			// too far behind: skip ahead instead of queueing frames to be dropped
+			if (skipLateVideo(r, now))
+				continue;
+
+			// the encoder did something, need to package it up and ship
+			if (r->video.encoder && ! emitVideo(r, NULL, streamTime(r, r->video.timestamp_next)))
+				return -1;
 			r->video.timestamp_next += r->video.timestamp_increment;
 		} else {
 			// time for an audio
-			if (r->audio.encoder) {
-				// build tag header for audio
-				uint8_t * p = flv_TagHeader(r->rtmp.tag, 8, 1000 * (r->audio.timestamp_next - r->rtmp.start));
-				*p = 0xAF; p++;
-				*p = 1; p++;
-
-				// call out to the chosen encoder
-				int audio_size = audio_fdkaac_update(r->audio.encoder);
-				if (audio_size < 0) {
-					// error in encoding
-					fputs("Error when encoding audio\n", stderr);
-					return 0;
-				}
-				p += audio_size;
+			if (r->audio.encoder && ! pullAudio(r))
+				return -1;
+		}
+
+		// advance now-time
+		//  offline: a batch at a time, so the caller gets control back
+		if (! r->rtmp.offline)
+			now = getTimestamp();
+		else if (++ batch < OFFLINE_BATCH)
+			now = nextDue(r);
+		else
+			break;
+	}
+	//printf(" -> now = %lf, vid_next = %lf, aud_next = %lf\n", now, r->video.timestamp_next, r->audio.timestamp_next);
 
-				// calculate tag size and write it
-				uint32_t tagSize = flv_TagFinish(r->rtmp.tag, p);
+	// push mode: encode whatever the application has handed over
+	if (! drainInputs(r))
+		return -1;
 
-				//  cast to char* avoids a warning
-				if (RTMP_Write(r->rtmp.rtmp, (const char *)r->rtmp.tag, tagSize) <= 0) {
-					fputs("Failed to RTMP_Write audio block\n", stderr);
-				}
-				if (r->rtmp.flv) fwrite(r->rtmp.tag, 1, tagSize, r->rtmp.flv);
+	// push out what the sockets will take, and handle anything from the servers
+	if (! serviceOutputs(r))
+		return -1;
+	adaptBitrate(r);
+
+	// the time to sleep is the duration between target framestamp and now
+	//  (push mode tracks have no schedule: their fds wake the caller instead)
+	double delay = fmax(0, fmin(r->video.timestamp_next, r->audio.timestamp_next) - now);
+	delay = fmin(delay, IDLE_UPDATE_INTERVAL);
+
+	// come back sooner if the queue is still emptying
+	if (pendingOutputs(r))
+		delay = fmin(delay, OUTPUT_RETRY_INTERVAL);
+
+	// offline: never wait, the next frame is due as soon as this one is done
+	//  and the deadline is for the caller's loop, so on the real clock
+	if (r->rtmp.offline) {
+		if (! isinf(fmin(r->video.timestamp_next, r->audio.timestamp_next)))
+			delay = 0;
+		now = getTimestamp();
+	}
+
+	r->rtmp.deadline = now + delay;
+	return delay;
+}
+
+// Push mode: convert the application's timestamp to seconds since the start
+//  of the stream.  Call with push.lock held.
+static double pushTime(struct rtmpcast_t * const r, const double timestamp)
+{
+	// the first push, on either track, happens "now"
+	if (! r->push.started) {
+		r->push.origin = timestamp - (streamNow(r) - r->rtmp.start);
+		r->push.started = 1;
+	}
+
+	return fmax(0, timestamp - r->push.origin);
+}
+
+struct rtmpcast_frame_t * rtmpcast_get_frame (struct rtmpcast_t * r)
+{
+	if (r->video.input == NULL || r->video.passthrough || isinf(r->rtmp.start)) {
+		fputs("librtmpcast: ERROR: rtmpcast_get_frame needs video in push mode (not passthrough), after rtmpcast_connect\n", stderr);
+		return NULL;
+	}
+
+	// NULL when every frame is in flight: the encoder is behind
+	struct input_buffer_t * b = input_get(r->video.input);
+	if (b == NULL) {
+		atomic_fetch_add_explicit(&r->stats.frames_late, 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	return b->user;
+}
+
+void rtmpcast_submit_frame (struct rtmpcast_t * r, struct rtmpcast_frame_t * frame, double timestamp)
+{
+	struct input_buffer_t * b = frame->buffer;
+	b->size = b->capacity;
+
+	pthread_mutex_lock(&r->push.lock);
+	b->timestamp = pushTime(r, timestamp);
+	pthread_mutex_unlock(&r->push.lock);
+
+	input_submit(r->video.input, b);
+}
+
+int rtmpcast_push_video (struct rtmpcast_t * r, const uint8_t * const plane[3], double timestamp)
+{
+	if (r->video.input == NULL || r->video.passthrough || isinf(r->rtmp.start)) {
+		fputs("librtmpcast: ERROR: rtmpcast_push_video needs video in push mode (not passthrough), after rtmpcast_connect\n", stderr);
+		return -1;
+	}
+
+	// encoder is behind: drop this frame rather than wait
+	struct rtmpcast_frame_t * f = rtmpcast_get_frame(r);
+	if (f == NULL)
+		return 0;
+
+	const struct colorspace_layout_t * const l = &r->video.layout;
+	for (unsigned int i = 0; i < l->planes; i ++)
+		memcpy(f->plane[i], plane[i], (size_t)l->stride[i] * l->rows[i]);
+
+	rtmpcast_submit_frame(r, f, timestamp);
+	return 1;
+}
+
+// Push mode: feed the ring, handing each block it completes to the encoder
+//  Call with push.lock held.  Returns 0 if any block was dropped.
+static int pushAudio(struct rtmpcast_t * const r, const void * const data[], const unsigned int count, const double timestamp)
+{
+	// the first push, a gap, or a jump: start the clock again from here
+	const double t = pushTime(r, timestamp);
+	if (isnan(r->audio.base) || fabs(t - (r->audio.base + ring_write_time(r->audio.ring))) > PUSH_AUDIO_RESYNC) {
+		ring_reset(r->audio.ring);
+		r->audio.base = t;
+	}
+
+	int ret = 1;
+	for (unsigned int done = 0; done < count; ) {
+		done += ring_write(r->audio.ring, data, done, count - done);
+
+		while (ring_ready(r->audio.ring)) {
+			const double start = r->audio.base + ring_read_time(r->audio.ring);
+
+			// encoder is behind: drop the block rather than wait
+			struct input_buffer_t * b = input_get(r->audio.input);
+			if (b == NULL) {
+				ring_read(r->audio.ring, NULL);
+				atomic_fetch_add_explicit(&r->stats.samples_late, RING_BLOCK, memory_order_relaxed);
+				ret = 0;
+				continue;
 			}
-			r->audio.timestamp_next += r->audio.timestamp_increment;
+
+			ring_read(r->audio.ring, (int16_t *)b->data);
+			b->size = b->capacity;
+			b->timestamp = start;
+			input_submit(r->audio.input, b);
 		}
+	}
 
-		// advance now-time
-		now = getTimestamp();
+	return ret;
+}
+
+int rtmpcast_push_audio (struct rtmpcast_t * r, const void * samples, unsigned int count, double timestamp)
+{
+	if (r->audio.input == NULL || isinf(r->rtmp.start)) {
+		fputs("librtmpcast: ERROR: rtmpcast_push_audio needs audio in push mode, after rtmpcast_connect\n", stderr);
+		return -1;
 	}
-	//printf(" -> now = %lf, vid_next = %lf, aud_next = %lf\n", now, r->video.timestamp_next, r->audio.timestamp_next);
+	if (r->audio.passthrough || r->audio.format >= RTMPCAST_SAMPLE_S16_PLANAR) {
+		fputs("librtmpcast: ERROR: rtmpcast_push_audio takes interleaved samples: use rtmpcast_push_audio_planar or rtmpcast_push_aac\n", stderr);
+		return -1;
+	}
+
+	const void * const data[1] = { samples };
+	pthread_mutex_lock(&r->push.lock);
+	const int ret = pushAudio(r, data, count, timestamp);
+	pthread_mutex_unlock(&r->push.lock);
+
+	return ret;
+}
 
-	// Handle any packets from the remote to us.
-	//  We will use select() to see if packet is waiting,
-	//  then read it and dispatch to the handler.
-	fd_set set;
-	FD_ZERO(&set);
-	FD_SET(r->rtmp.fd, &set);
+int rtmpcast_push_audio_planar (struct rtmpcast_t * r, const void * const planes[], unsigned int count, double timestamp)
+{
+	if (r->audio.input == NULL || isinf(r->rtmp.start)) {
+		fputs("librtmpcast: ERROR: rtmpcast_push_audio_planar needs audio in push mode, after rtmpcast_connect\n", stderr);
+		return -1;
+	}
+	if (r->audio.passthrough || r->audio.format < RTMPCAST_SAMPLE_S16_PLANAR) {
+		fputs("librtmpcast: ERROR: rtmpcast_push_audio_planar takes planar samples: use rtmpcast_push_audio or rtmpcast_push_aac\n", stderr);
+		return -1;
+	}
+
+	pthread_mutex_lock(&r->push.lock);
+	const int ret = pushAudio(r, planes, count, timestamp);
+	pthread_mutex_unlock(&r->push.lock);
 
-	struct timeval tv = {0, 0};
-	if (select(r->rtmp.fd + 1, &set, NULL, NULL, &tv) == -1) {
-		perror("Error calling select()");
+	return ret;
+}
+
+int rtmpcast_push_aac (struct rtmpcast_t * r, const uint8_t * data, size_t size, double timestamp)
+{
+	if (r->audio.input == NULL || ! r->audio.passthrough || isinf(r->rtmp.start)) {
+		fputs("librtmpcast: ERROR: rtmpcast_push_aac needs audio.passthrough, after rtmpcast_connect\n", stderr);
+		return -1;
 	}
 
-	// socket is present in read-ready set, safe to call RTMP_ReadPacket
-	if (FD_ISSET(r->rtmp.fd, &set)) {
-		RTMPPacket packet = { 0 };
+	struct encoder_audio * const e = r->audio.encoder;
+	int ret = 1;
+	pthread_mutex_lock(&r->push.lock);
+
+	// the first push, a gap, or a jump: start the clock again from here
+	//  (unless a frame begun earlier is still being finished)
+	const double t = pushTime(r, timestamp);
+	if (isnan(r->audio.base) || (! audio_passthrough_partial(e) && fabs(t - r->audio.base) > PUSH_AUDIO_RESYNC))
+		r->audio.base = t;
+
+	for (size_t done = 0; ; ) {
+		done += audio_passthrough_write(e, data + done, size - done);
+
+		int ready;
+		while ((ready = audio_passthrough_ready(e)) != 0) {
+			const double start = r->audio.base;
+			r->audio.base += (double)AUDIO_FRAME_SAMPLES / audio_passthrough_samplerate(e);
+
+			// a new config goes out first, in a buffer of its own
+			struct input_buffer_t * b = input_get(r->audio.input);
+			if (b && ready == 2) {
+				b->size = audio_passthrough_init(e, b->data);
+				b->timestamp = start;
+				b->user = &audio_config_buffer;
+				input_submit(r->audio.input, b);
+				b = input_get(r->audio.input);
+			}
+
+			// encoder is behind: drop the frame rather than wait
+			//  (a config that could not go out is tried again with the next)
+			if (b == NULL) {
+				audio_passthrough_update(e, NULL);
+				atomic_fetch_add_explicit(&r->stats.samples_late, AUDIO_FRAME_SAMPLES, memory_order_relaxed);
+				ret = 0;
+				continue;
+			}
 
-		if (RTMP_ReadPacket(r->rtmp.rtmp, &packet) && RTMPPacket_IsReady(&packet)) {
-			// this function does all the internal stuff we need
-			RTMP_ClientPacket(r->rtmp.rtmp, &packet);
-			RTMPPacket_Free(&packet);
+			b->size = audio_passthrough_update(e, b->data);
+			b->timestamp = start;
+			b->user = NULL;
+			input_submit(r->audio.input, b);
 		}
+
+		if (done >= size)
+			break;
 	}
 
-	// the time to sleep is the duration between target framestamp and now
-	return fmax(0, fmin(r->video.timestamp_next, r->audio.timestamp_next) - now);
+	pthread_mutex_unlock(&r->push.lock);
+	return ret;
+}
+
+int rtmpcast_push_h264 (struct rtmpcast_t * r, const uint8_t * data, size_t size, double timestamp)
+{
+	if (r->video.input == NULL || ! r->video.passthrough || isinf(r->rtmp.start)) {
+		fputs("librtmpcast: ERROR: rtmpcast_push_h264 needs video.passthrough, after rtmpcast_connect\n", stderr);
+		return -1;
+	}
+
+	// encoder is behind: drop this access unit rather than wait
+	//  (the conversion to length prefixes happens in place, so leave room)
+	struct input_buffer_t * b = input_get(r->video.input);
+	const int ok = (b && input_reserve(b, AVC_AVCC_CAPACITY(size)));
+	if (ok)
+		memcpy(b->data, data, size);
+
+	pthread_mutex_lock(&r->push.lock);
+	if (! ok) {
+		atomic_fetch_add_explicit(&r->stats.frames_late, 1, memory_order_relaxed);
+		r->video.gap = 1;
+	}
+	// a buffer that could not grow goes through empty, to be recycled
+	if (b) {
+		b->size = (ok ? size : 0);
+		b->timestamp = pushTime(r, timestamp);
+		b->user = (r->video.gap ? &video_gap_buffer : NULL);
+		if (ok)
+			r->video.gap = 0;
+		input_submit(r->video.input, b);
+	}
+	pthread_mutex_unlock(&r->push.lock);
+
+	return ok;
+}
+
+int rtmpcast_get_pollfds (const struct rtmpcast_t * r, struct pollfd * fds, int max)
+{
+	// threaded mode: the send thread watches the sockets itself
+	if (r->thread.enable)
+		return 0;
+
+	int n = 0;
+
+	// push mode: frames to encode
+	const struct input_t * const inputs[2] = { r->video.input, r->audio.input };
+	for (int i = 0; i < 2; i ++) {
+		if (inputs[i] == NULL)
+			continue;
+
+		if (n < max) {
+			fds[n].fd = input_fd(inputs[i]);
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+		}
+		n ++;
+	}
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		const struct output_t * const o = r->rtmp.output[i];
+		// failed, or no socket while reconnecting
+		if (o == NULL || output_fd(o) == -1)
+			continue;
+
+		if (n < max) {
+			fds[n].fd = output_fd(o);
+			fds[n].events = POLLIN | (output_pending(o) ? POLLOUT : 0);
+			fds[n].revents = 0;
+		}
+		n ++;
+	}
+
+	return n;
+}
+
+void rtmpcast_get_deadline (const struct rtmpcast_t * r, struct timespec * deadline)
+{
+	*deadline = toTimespec(r->rtmp.deadline);
+}
+
+// Keep the epoll set in step with the destinations' sockets
+//  watched[] remembers what each destination slot is registered with
+static void watchOutputs(const struct rtmpcast_t * const r, const int epfd, struct epoll_event * const watched)
+{
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		const struct output_t * const o = r->rtmp.output[i];
+
+		// a failed destination, or one reconnecting: its socket is closed,
+		//  which already removed it
+		if (o == NULL || output_fd(o) == -1) {
+			watched[i].events = 0;
+			continue;
+		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | (output_pending(o) ? EPOLLOUT : 0);
+		ev.data.fd = output_fd(o);
+
+		if (watched[i].events == ev.events && watched[i].data.fd == ev.data.fd)
+			continue;
+
+		// a new socket can reuse the old fd number, unregistered
+		if (epoll_ctl(epfd, (watched[i].events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD), ev.data.fd, &ev) == -1 &&
+			! (errno == ENOENT && epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) == 0))
+			perror("librtmpcast: ERROR: epoll_ctl() failed");
+		watched[i] = ev;
+	}
+}
+
+int rtmpcast_run (struct rtmpcast_t * r, const volatile sig_atomic_t * running)
+{
+	const int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror("librtmpcast: ERROR: epoll_create1() failed");
+		return 0;
+	}
+
+	// the frame clock: armed with an absolute deadline after each update
+	const int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd == -1) {
+		perror("librtmpcast: ERROR: timerfd_create() failed");
+		close(epfd);
+		return 0;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = tfd;
+	struct epoll_event * watched = calloc(r->rtmp.outputs, sizeof(struct epoll_event));
+
+	if (watched == NULL || epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) == -1) {
+		perror("librtmpcast: ERROR: rtmpcast_run setup failed");
+		free(watched);
+		close(tfd);
+		close(epfd);
+		return 0;
+	}
+
+	// push mode: wake as soon as a frame is handed over
+	const struct input_t * const inputs[2] = { r->video.input, r->audio.input };
+	for (int i = 0; i < 2; i ++) {
+		if (inputs[i] == NULL || r->thread.enable)
+			continue;
+
+		ev.events = EPOLLIN;
+		ev.data.fd = input_fd(inputs[i]);
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1)
+			perror("librtmpcast: ERROR: epoll_ctl() failed");
+	}
+
+	int ret = 1;
+	while (running == NULL || *running) {
+		if (rtmpcast_update(r) < 0) {
+			ret = 0;
+			break;
+		}
+
+		if (! r->thread.enable)
+			watchOutputs(r, epfd, watched);
+
+		// a deadline already past fires straight away
+		struct itimerspec timer = { { 0, 0 }, toTimespec(r->rtmp.deadline) };
+		if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0)
+			timer.it_value.tv_nsec = 1;
+		if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &timer, NULL) == -1) {
+			perror("librtmpcast: ERROR: timerfd_settime() failed");
+			ret = 0;
+			break;
+		}
+
+		struct epoll_event events[RUN_EVENTS];
+		const int n = epoll_wait(epfd, events, RUN_EVENTS, -1);
+		if (n == -1 && errno != EINTR) {
+			perror("librtmpcast: ERROR: epoll_wait() failed");
+			ret = 0;
+			break;
+		}
+
+		// clear the timer; sockets are handled by the next update either way
+		uint64_t expirations;
+		if (read(tfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+			perror("librtmpcast: ERROR: read() from timerfd failed");
+	}
+
+	free(watched);
+	close(tfd);
+	close(epfd);
+	return ret;
+}
+
+void rtmpcast_set_log_level (int level)
+{
+	RTMP_LogSetLevel(level);
 }
 
 // Destroy a stream object / free it
 void rtmpcast_close (struct rtmpcast_t * r)
 {
+	// threaded mode: stop encoding and send whatever is still queued
+	if (r->thread.started)
+		stopThreads(r);
+	else if (! r->thread.enable) {
+		// push mode: encode what was handed over before the close
+		if (! drainInputs(r))
+			fputs("Failed to encode the last pushed frames\n", stderr);
+		// then get out what the encoder still holds
+		else if (r->video.encoder && ! flushVideo(r))
+			fputs("Failed to flush delayed frames\n", stderr);
+	}
+
 	/* Flush delayed frames for a clean shutdown */
 	// send the end-of-stream indicator
-	uint8_t * p = flv_TagHeader(r->rtmp.tag, 9, 1000 * (r->video.timestamp_next - r->rtmp.start));
-	// write the empty-body "stream end" tag
-	p = flv_AVCVideoPacket(p, 1, 2, 0);
-	// calculate tag size and write it
-	uint32_t tagSize = flv_TagFinish(r->rtmp.tag, p);
+	struct tag_t * tag = controlTag(r);
+	if (tag) {
+		uint8_t * p = flv_TagHeader(tag->data, 9, r->video.timestamp_last);
+		// write the empty-body "stream end" tag
+		p = flv_AVCVideoPacket(p, 1, 2, 0);
+		// calculate tag size and write it
+		tag->size = flv_TagFinish(tag->data, p);
 
-	//  cast to char* avoids a warning
-	if (RTMP_Write(r->rtmp.rtmp, (const char *)r->rtmp.tag, tagSize) <= 0) {
-		fputs("Failed to RTMP_Write\n", stderr);
+		if (! dispatchTag(r, tag) || ! drainOutputs(r)) {
+			fputs("librtmpcast: ERROR: rtmpcast_close: sending the end of stream failed: no destinations left\n", stderr);
+		}
 	}
-	if (r->rtmp.flv) fwrite(r->rtmp.tag, 1, tagSize, r->rtmp.flv);
 
 	/* *************************************************** */
 	// CLEANUP CODE
 	// Shut down
-	if (r->rtmp.flv) fclose(r->rtmp.flv);
-	RTMP_Free(r->rtmp.rtmp);
-	if (r->audio.encoder) audio_fdkaac_close(r->audio.encoder);
-	if (r->video.encoder) video_x264_close(r->video.encoder);
-	free(r->rtmp.tag);
+	if (r->rtmp.recorder) recorder_close(r->rtmp.recorder);
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++)
+		if (r->rtmp.output[i]) output_close(r->rtmp.output[i]);
+	free(r->rtmp.resume);
+	free(r->rtmp.output);
+	if (r->audio.encoder) closeAudio(r);
+	if (r->video.encoder) closeVideo(r);
+	if (r->audio.queue) queue_close(r->audio.queue);
+	if (r->video.queue) queue_close(r->video.queue);
+	if (r->audio.input) input_close(r->audio.input);
+	if (r->video.input) input_close(r->video.input);
+	free(r->video.frames);
+	if (r->video.convert) {
+		colorspace_close(r->video.convert);
+		free(r->video.source[0]);
+	}
+	free(r->video.frame[0]);
+	if (r->audio.ring) ring_close(r->audio.ring);
+	free(r->audio.buffer);
+	free(r->audio.samples);
+	pthread_mutex_destroy(&r->push.lock);
+	pthread_mutex_destroy(&r->stats.lock);
+	if (r->thread.wake != -1) close(r->thread.wake);
+	free(r->video.iov);
+	if (r->audio.pool) pool_close(r->audio.pool);
+	if (r->video.pool) pool_close(r->video.pool);
+	pool_close(r->rtmp.pool);
+	free(r);
+}
+
+// Report tag buffer memory across all tracks
+void rtmpcast_get_buffer_usage (const struct rtmpcast_t * r, size_t * allocated, size_t * peak)
+{
+	size_t a_now = 0, a_peak = 0, v_now = 0, v_peak = 0;
+
+	if (r->audio.pool) pool_usage(r->audio.pool, &a_now, &a_peak);
+	if (r->video.pool) pool_usage(r->video.pool, &v_now, &v_peak);
+
+	if (allocated) *allocated = a_now + v_now;
+	if (peak) *peak = a_peak + v_peak;
+}
+
+static void copyLatency(struct rtmpcast_latency_t * const dst, const struct latency_t * const src)
+{
+	for (int i = 0; i < RTMPCAST_LATENCY_BUCKETS; i ++)
+		dst->count[i] = atomic_load_explicit(&src->count[i], memory_order_relaxed);
+}
+
+// Snapshot of the counters: only holds stats.lock (never taken for long),
+//  so it can be polled freely
+void rtmpcast_get_stats (const struct rtmpcast_t * r, struct rtmpcast_stats_t * stats)
+{
+	const double now = streamNow(r);
+	// the writing side may close a failed output meanwhile
+	pthread_mutex_t * const lock = (pthread_mutex_t *)&r->stats.lock;
+
+	stats->video.frames = atomic_load_explicit(&r->stats.frames, memory_order_relaxed);
+	stats->video.late = atomic_load_explicit(&r->stats.frames_late, memory_order_relaxed);
+	stats->video.target = atomic_load(&r->abr.target);
+	const double video_next = r->video.timestamp_next;
+	stats->video.lag = (isinf(video_next) ? 0 : now - video_next);
+
+	stats->audio.samples = atomic_load_explicit(&r->stats.samples, memory_order_relaxed);
+	stats->audio.late = atomic_load_explicit(&r->stats.samples_late, memory_order_relaxed);
+	const double audio_next = r->audio.timestamp_next;
+	stats->audio.lag = (isinf(audio_next) ? 0 : now - audio_next);
+
+	stats->output.destinations = r->rtmp.outputs;
+	stats->output.live = atomic_load_explicit(&r->rtmp.live, memory_order_relaxed);
+	stats->output.reconnecting = 0;
+	stats->output.queued = 0;
+	stats->output.queued_max = 0;
+
+	pthread_mutex_lock(lock);
+	stats->video.qp = r->stats.qp;
+	stats->video.bitrate = r->stats.bitrate;
+	stats->output.dropped = r->stats.dropped;
+	stats->video.bytes = r->stats.sent[1];
+	stats->audio.bytes = r->stats.sent[0];
+	for (unsigned int i = 0; i < r->rtmp.outputs; i ++) {
+		const struct output_t * const o = r->rtmp.output[i];
+		if (o == NULL)
+			continue;
+
+		if (output_fd(o) == -1)
+			stats->output.reconnecting ++;
+
+		const unsigned int pending = output_pending(o);
+		stats->output.queued += pending;
+		if (pending > stats->output.queued_max)
+			stats->output.queued_max = pending;
+
+		stats->output.dropped += output_dropped(o);
+		stats->video.bytes += output_sent(o, 9);
+		stats->audio.bytes += output_sent(o, 8);
+	}
+	pthread_mutex_unlock(lock);
+	// threaded mode: tags still on their way to the send thread
+	if (r->video.queue) stats->output.queued += queue_count(r->video.queue);
+	if (r->audio.queue) stats->output.queued += queue_count(r->audio.queue);
+
+	copyLatency(&stats->latency.callback, &r->stats.callback);
+	copyLatency(&stats->latency.encode, &r->stats.encode);
+	copyLatency(&stats->latency.mux, &r->stats.mux);
+	copyLatency(&stats->latency.write, &r->stats.write);
 }
@@ -2,34 +2,191 @@
 #define RTMPCAST_RTMPCAST_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+// video rate control modes
+//  CBR: constant bitrate, what most ingest services want
+//  ABR: average bitrate, no cap on peaks
+//  CRF: constant quality, peaks capped at the bitrate
+#define RTMPCAST_RC_CBR 0
+#define RTMPCAST_RC_ABR 1
+#define RTMPCAST_RC_CRF 2
+
+// video frame formats: what the callback fills and push mode takes
+//  I420: planar Y, U, V; U and V at half width and height
+//  NV12: planar Y, then U and V interleaved (half height, full width)
+//  YUY2: packed Y0 U Y1 V
+//  RGB24: packed R G B; RGBA, BGRA: four bytes per pixel, alpha ignored
+// Anything but I420 is converted to it before encoding (BT.601, with SSE2
+//  or AVX2 where the CPU has them); the planes are laid out back to back.
+#define RTMPCAST_FORMAT_I420 0
+#define RTMPCAST_FORMAT_NV12 1
+#define RTMPCAST_FORMAT_YUY2 2
+#define RTMPCAST_FORMAT_RGB24 3
+#define RTMPCAST_FORMAT_RGBA 4
+#define RTMPCAST_FORMAT_BGRA 5
+
+// audio sample formats: what the callback fills and push mode takes
+//  S16: int16, FLOAT: -1.0 to 1.0; channels interleaved, or one plane each
+#define RTMPCAST_SAMPLE_S16 0
+#define RTMPCAST_SAMPLE_FLOAT 1
+#define RTMPCAST_SAMPLE_S16_PLANAR 2
+#define RTMPCAST_SAMPLE_FLOAT_PLANAR 3
 
 // opaque ptr to the encoder / streamer object
 struct rtmpcast_t;
 
+// An extra place to send the stream, with its own connection and queue
+struct rtmpcast_destination_t
+{
+	char * url;
+
+	// 0 to use the values in rtmpcast_param_t.queue
+	struct {
+		unsigned int length;
+		unsigned int watermark;
+	} queue;
+};
+
 // struct containing parameters for the connection
 struct rtmpcast_param_t
 {
 	char * url;
+	// local FLV copy (NULL for none), written on a background thread
+	//  so a slow disk does not hold up the stream.  onMetaData gets the
+	//  duration, file size and a keyframe index on close, for seeking.
 	char * filename;
 
+	// Further destinations, fed from the same encoders.
+	//  url may be NULL if there is at least one of these.
+	// With no url and no destinations, only the file is written, offline:
+	//  the stream runs on a virtual clock, timestamps come from the frame
+	//  and sample counts, and each rtmpcast_update encodes a batch straight
+	//  away instead of waiting for frames to fall due.  Stop by closing when
+	//  your callbacks run out of content (threaded is ignored).
+	const struct rtmpcast_destination_t * destinations;
+	unsigned int destination_count;
+
+	// Run video encode, audio encode and network send on their own threads.
+	//  Callbacks are then invoked from the encode threads, and
+	//  rtmpcast_update only reports errors.
+	int threaded;
+
+	// When a destination's connection drops, how many times to try to
+	//  reconnect, waiting longer each time, before giving up on it.
+	//  Encoding carries on meanwhile, and the destination holds on to the
+	//  current GOP, to replay after the stream headers once reconnected
+	//  (or asks the encoder for a keyframe).  0 for the default (10),
+	//  -1 to give up straight away.
+	int reconnect;
+
+	// Outgoing queue for each destination: how many tags it holds, and how
+	//  many milliseconds of media may wait in it before video frames are
+	//  dropped.  0 for defaults.
+	struct {
+		unsigned int length;
+		unsigned int watermark;
+	} queue;
+
 	struct {
 		int enable;
 
+		// called for each frame, when it is due
+		//  NULL for push mode: frames come from rtmpcast_push_video instead
 		int (* callback)(void *);
 
 		unsigned int width, height;
 		unsigned int framerate;
 		unsigned int bitrate;
+
+		// RTMPCAST_FORMAT_*, default I420; width and height must be even
+		int format;
+		// threads to split format conversion across, 0 or 1 for none
+		unsigned int convert_threads;
+
+		// Adaptive bitrate: when a destination falls behind, step the bitrate
+		//  down as far as this, and back up to bitrate once the network
+		//  keeps up again.  Watches the outgoing queues and the sockets'
+		//  unsent bytes.  0 to keep the bitrate fixed.  Not with
+		//  RTMPCAST_RC_ABR, which has no cap to move.
+		unsigned int min_bitrate;
+
+		// drop disposable NALs (SEI, non-reference slices) instead of sending them
+		int drop_disposable;
+
+		// Already H.264 (from a hardware encoder, or a camera that encodes
+		//  it): push Annex B access units with rtmpcast_push_h264, and they
+		//  are sent on without re-encoding.  The SPS / PPS come in-band, and
+		//  nothing goes out until the first IDR frame.  callback must be
+		//  NULL, and min_bitrate 0; format, convert_threads and options are
+		//  unused.  width, height, framerate and bitrate should still describe
+		//  the stream, for the metadata (and bitrate sizes the buffers).
+		int passthrough;
+
+		// Encoder by name: NULL for x264, or "null" for frames of filler at
+		//  the bitrate (to time the mux and network without encoding)
+		const char * backend;
+
+		// Encoder tuning, checked by rtmpcast_init.  0 / NULL for the defaults.
+		struct {
+			// encoder threads: 0 for one, -1 for one per core
+			int threads;
+			// split each frame between the threads, adding no latency,
+			//  instead of encoding several frames at once (a frame of delay each)
+			int sliced_threads;
+			// frames of lookahead for rate control and frame types (adds delay)
+			unsigned int lookahead;
+			// x264 names, default "veryfast", "zerolatency" and "baseline"
+			//  B-frames need a "main" or "high" profile, and a tune other
+			//  than "zerolatency" (which turns them off)
+			const char * preset;
+			const char * tune;
+			const char * profile;
+			// max frames between keyframes, default 4 seconds' worth
+			unsigned int keyint;
+			// RTMPCAST_RC_*, default CBR; crf is the quality (0 - 51) for CRF
+			int rc;
+			float crf;
+		} options;
 	} video;
 
 	struct {
 		int enable;
 
+		// Called when more samples are due, with room for up to 1024 per
+		//  channel: a buffer for interleaved formats, or an array of one
+		//  per channel for planar.  Returns how many it gave (all channels),
+		//  or negative on error; the next call is due once those have played.
+		//  NULL for push mode: samples come from rtmpcast_push_audio instead
 		int (* callback)(void *);
 
+		// Encoder by name: NULL for fdkaac, or "null" for frames of filler
+		//  at the bitrate
+		const char * backend;
+
+		// encoded at samplerate
 		unsigned int samplerate;
 		unsigned int channels;
 		unsigned int bitrate;
+
+		// RTMPCAST_SAMPLE_*, default S16; and the rate of the samples given,
+		//  if not samplerate (0).  Either way they are gathered into whole
+		//  AAC frames, timestamped by sample count.
+		int format;
+		unsigned int input_samplerate;
+
+		// Already AAC (from a file, or a device that encodes it): push it
+		//  with rtmpcast_push_aac, and it is sent on without re-encoding.
+		//  With a config (AudioSpecificConfig, config_size bytes) pushes are
+		//  raw frames; without, an ADTS stream, whose headers give the config.
+		//  callback must be NULL; samplerate, channels and bitrate should
+		//  still describe the stream, for the metadata.
+		int passthrough;
+		const unsigned char * config;
+		unsigned int config_size;
 	} audio;
 };
 
@@ -42,9 +199,203 @@ int rtmpcast_connect (struct rtmpcast_t * rtmpcast);
 // Call this periodically to keep the stream flowing
 //  Returns number of microseconds until the next update is expected
 //  A negative number indicates a stream error
+//  In threaded mode this only checks for errors from the worker threads
+//  Offline, this is 0 while there is more to encode
 double rtmpcast_update (struct rtmpcast_t * rtmpcast);
 
+// Push mode: hand over a frame / samples from any thread, after rtmpcast_connect.
+//  timestamp is in seconds, on any clock shared by both tracks; the first
+//  push on either track lines up with the moment it was made.
+//  Frames are planes in video.format, as for the callback.  Samples are in
+//  audio.format: interleaved for push_audio, one plane per channel for
+//  push_audio_planar.  count is per channel, and any count is fine: samples
+//  are timed by their count from the last push, until the timestamps stray
+//  from that by more than a tenth of a second (a gap, or a new clock).
+//  These never wait for the encoder: they return 0 if it is too far behind
+//  and the frame (or some of the samples) was dropped, 1 if queued,
+//  or -1 if the track is not in push mode.
+int rtmpcast_push_video (struct rtmpcast_t * rtmpcast, const uint8_t * const plane[3], double timestamp);
+int rtmpcast_push_audio (struct rtmpcast_t * rtmpcast, const void * samples, unsigned int count, double timestamp);
+int rtmpcast_push_audio_planar (struct rtmpcast_t * rtmpcast, const void * const planes[], unsigned int count, double timestamp);
+// Passthrough: one raw frame, or any amount of ADTS (frames may be split
+//  across pushes); timestamp is that of the first frame starting in it.
+//  Frames are timed as for samples.
+int rtmpcast_push_aac (struct rtmpcast_t * rtmpcast, const uint8_t * data, size_t size, double timestamp);
+// Passthrough: one access unit (start codes and all), in decode order and
+//  without B-frames, as the timestamp is both decode and presentation time.
+//  A dropped access unit drops the rest of its GOP with it.
+int rtmpcast_push_h264 (struct rtmpcast_t * rtmpcast, const uint8_t * data, size_t size, double timestamp);
+
+// Push mode video without the copy: take a frame from the pool, fill its
+//  planes in place, and submit it, from any thread.  get_frame returns NULL
+//  when every frame is in flight (the encoder is behind: skip this frame).
+//  Every frame taken must be submitted.
+struct rtmpcast_frame_t
+{
+	// in video.format (unused planes are NULL), stride bytes per row
+	uint8_t * plane[3];
+	unsigned int stride[3];
+
+	// private
+	void * buffer;
+};
+
+struct rtmpcast_frame_t * rtmpcast_get_frame (struct rtmpcast_t * rtmpcast);
+void rtmpcast_submit_frame (struct rtmpcast_t * rtmpcast, struct rtmpcast_frame_t * frame, double timestamp);
+
+// For driving rtmpcast_update from your own event loop:
+//  the fds to watch (sockets and push mode queues: call update when any is
+//  ready), and the
+//  CLOCK_MONOTONIC time of the next frame (call update then at the latest).
+//  Both can change with every update.
+// get_pollfds fills up to max entries, and returns how many there are
+//  (0 in threaded mode, where the send thread watches the sockets)
+int rtmpcast_get_pollfds (const struct rtmpcast_t * rtmpcast, struct pollfd * fds, int max);
+void rtmpcast_get_deadline (const struct rtmpcast_t * rtmpcast, struct timespec * deadline);
+
+// Or let the library run the loop: calls rtmpcast_update whenever a frame is
+//  due or a socket is ready, until *running is cleared (e.g. by a signal
+//  handler) or an error occurs.  running may be NULL to go until error.
+//  Returns 0 on error
+int rtmpcast_run (struct rtmpcast_t * rtmpcast, const volatile sig_atomic_t * running);
+
 // Destroy a stream object / free it
 void rtmpcast_close (struct rtmpcast_t * rtmpcast);
 
+// librtmp logs (to stderr) through settings shared by the whole process,
+//  which no stream touches.  Set them here, once, if wanted.
+#define RTMPCAST_LOG_ERROR 1
+#define RTMPCAST_LOG_WARNING 2
+#define RTMPCAST_LOG_INFO 3
+#define RTMPCAST_LOG_DEBUG 4
+void rtmpcast_set_log_level (int level);
+
+// Many streams in one process: a host runs one event loop (epoll) for the
+//  sockets and push queues of all of them, and a fixed pool of workers
+//  that update whichever stream has the earliest deadline, one worker to a
+//  stream at a time.  Streams are connected first, and not threaded; once
+//  added, only the host calls rtmpcast_update for them (pushes are fine).
+struct rtmpcast_host_t;
+
+// workers: threads to encode with, 0 for one per core.  on_error (may be
+//  NULL) is called from a worker when a stream's update fails: it gets no
+//  more updates, and should be removed.
+struct rtmpcast_host_t * rtmpcast_host_create (unsigned int workers, void (* on_error)(struct rtmpcast_t * rtmpcast, void * user), void * user);
+// Both from any thread.  remove waits for an update in progress, and
+//  returns 0 if the stream had failed (or was not on the host)
+int rtmpcast_host_add (struct rtmpcast_host_t * host, struct rtmpcast_t * rtmpcast);
+int rtmpcast_host_remove (struct rtmpcast_host_t * host, struct rtmpcast_t * rtmpcast);
+// Stop the threads.  The streams still on it are left to the caller to close.
+void rtmpcast_host_close (struct rtmpcast_host_t * host);
+
+// Simulcast: one input encoded at several sizes, each rendition a threaded
+//  stream of its own (its own encoder thread, bitrate and destinations).
+//  Each frame is converted (if not I420) once, and scaled to every size in
+//  one pass over it: area averaging going down, bilinear going up.  Audio
+//  goes to every rendition, each encoding its own.
+struct rtmpcast_rendition_t
+{
+	// even, as for video.width and height
+	unsigned int width, height;
+	unsigned int bitrate;
+
+	// where this one goes, as in rtmpcast_param_t
+	char * url;
+	char * filename;
+	const struct rtmpcast_destination_t * destinations;
+	unsigned int destination_count;
+};
+
+struct rtmpcast_ladder_t;
+
+// param describes the input (video.width, height and format) and what the
+//  renditions share: framerate, encoder, options, audio.  Both tracks must
+//  be in push mode, and video not passthrough.  Its url, filename and
+//  destinations are unused, and threaded is implied.  min_bitrate scales
+//  with each rendition's bitrate, as a share of video.bitrate.
+struct rtmpcast_ladder_t * rtmpcast_ladder_init (const struct rtmpcast_param_t * param, const struct rtmpcast_rendition_t * renditions, unsigned int count);
+int rtmpcast_ladder_connect (struct rtmpcast_ladder_t * ladder);
+// As rtmpcast_update over every rendition: the least, or negative if any failed
+double rtmpcast_ladder_update (struct rtmpcast_ladder_t * ladder);
+// As the push functions, to every rendition: 0 if any dropped it.
+//  Video from one thread at a time (the scaling happens in the call).
+int rtmpcast_ladder_push_video (struct rtmpcast_ladder_t * ladder, const uint8_t * const plane[3], double timestamp);
+int rtmpcast_ladder_push_audio (struct rtmpcast_ladder_t * ladder, const void * samples, unsigned int count, double timestamp);
+int rtmpcast_ladder_push_audio_planar (struct rtmpcast_ladder_t * ladder, const void * const planes[], unsigned int count, double timestamp);
+// Each rendition's stream, in the order given: for stats, not to close
+struct rtmpcast_t * rtmpcast_ladder_rendition (const struct rtmpcast_ladder_t * ladder, unsigned int index);
+void rtmpcast_ladder_close (struct rtmpcast_ladder_t * ladder);
+
+// Tag buffer memory in bytes: allocated right now, and the peak so far
+//  (peak is the sum of each track's own peak)
+void rtmpcast_get_buffer_usage (const struct rtmpcast_t * rtmpcast, size_t * allocated, size_t * peak);
+
+// How long each stage of the pipeline takes: a count of calls per bucket,
+//  bucket i for durations from 2^i up to 2^(i+1) microseconds
+//  (the first also takes anything shorter, the last anything longer)
+#define RTMPCAST_LATENCY_BUCKETS 20
+struct rtmpcast_latency_t
+{
+	uint64_t count[RTMPCAST_LATENCY_BUCKETS];
+};
+
+// Counters since rtmpcast_init, and the state right now, from any thread
+//  In threaded mode, fields are read while the threads update them:
+//  each is right, but they may be a frame apart from each other.
+struct rtmpcast_stats_t
+{
+	struct {
+		// pictures given to the encoder
+		uint64_t frames;
+		// frames skipped: too far behind schedule, or pushed while the
+		//  encoder was busy
+		uint64_t late;
+		// payload bytes sent, summed over destinations
+		uint64_t bytes;
+		// over about the last second: average quantizer (lower is better
+		//  quality) and the bitrate in kbps coming out of the encoder
+		double qp;
+		double bitrate;
+		// what the encoder is set to, in kbps (changes with min_bitrate)
+		unsigned int target;
+		// seconds since the next frame was due: negative while waiting for it
+		//  (0 in push mode, which has no schedule)
+		double lag;
+	} video;
+
+	struct {
+		// per channel
+		uint64_t samples;
+		// pushed while the encoder was busy
+		uint64_t late;
+		uint64_t bytes;
+		double lag;
+	} audio;
+
+	struct {
+		unsigned int destinations;
+		// still connected, or trying to reconnect; and of those, how many
+		//  are trying
+		unsigned int live;
+		unsigned int reconnecting;
+		// tags waiting to be written, over all destinations (and, in
+		//  threaded mode, for the send thread); and the most for any one
+		unsigned int queued;
+		unsigned int queued_max;
+		// tags dropped by the queue policy, summed over destinations
+		uint64_t dropped;
+	} output;
+
+	// callback: the application's callbacks
+	// encode: each call to an encoder
+	// mux: framing its output into tags and handing them to the queues
+	// write: each pass of writing to the sockets
+	struct {
+		struct rtmpcast_latency_t callback, encode, mux, write;
+	} latency;
+};
+
+// Fill in stats: only copies counters, cheap enough to call often
+void rtmpcast_get_stats (const struct rtmpcast_t * rtmpcast, struct rtmpcast_stats_t * stats);
+
 #endif
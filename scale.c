@@ -0,0 +1,368 @@
+#include "scale.h"
+
+// for malloc
+#include <stdlib.h>
+// for perror
+#include <stdio.h>
+// for memcpy
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// weights are fixed point, summing to 1 << SCALE_BITS
+#define SCALE_BITS 14
+// the horizontal pass keeps 7 bits below each pixel value: up to
+//  255 << 7, which fits in int16 (and so in _mm_madd_epi16)
+#define SCALE_ROW_BITS 7
+
+// one direction of one plane: output i is the weighted sum of the taps
+//  source pixels starting at first[i]
+struct axis_t {
+	unsigned int taps;
+	unsigned int * first;
+	int16_t * weight;
+};
+
+struct plane_t {
+	unsigned int src_width, src_height;
+	unsigned int width, height;
+	struct axis_t x, y;
+	// every source row scaled across: src_height rows of width
+	int16_t * rows;
+};
+
+struct target_t {
+	// the same size as the source
+	int copy;
+	struct plane_t plane[3];
+};
+
+// structure definition for the scaler (private data)
+struct scale_t {
+	unsigned int width, height;
+	unsigned int count;
+	struct target_t * target;
+};
+
+/* ************************************************************************ */
+// Weights
+
+// Going down, each output pixel averages the span of source it covers
+//  (area), partial pixels at the ends in proportion.  Going up, it is a
+//  blend of the two nearest (bilinear), pixel centres lined up.  Rows
+//  with fewer taps than the most are padded with zero weights, moved back
+//  where they would run off the end.  across pads the count to what the
+//  SSE2 kernels take: 2, or a multiple of 4.
+static int makeAxis(struct axis_t * const axis, const unsigned int src, const unsigned int dst, const int across)
+{
+	// work in units of 1 / dst of a source pixel (down), or of 1 / (2 dst)
+	//  (up, for the half pixel offsets)
+	unsigned int taps;
+	if (dst == src)
+		taps = 1;
+	else if (dst < src) {
+		taps = 0;
+		for (unsigned int i = 0; i < dst; i ++) {
+			const unsigned int first = i * src / dst;
+			const unsigned int last = ((i + 1) * src - 1) / dst;
+			if (last - first + 1 > taps)
+				taps = last - first + 1;
+		}
+	} else
+		taps = (src > 1 ? 2 : 1);
+
+	if (across) {
+		taps = (taps <= 2 ? 2 : (taps + 3) & ~3u);
+		if (taps > src)
+			taps = src;
+	}
+
+	axis->taps = taps;
+	axis->first = malloc(dst * sizeof(unsigned int));
+	axis->weight = calloc(dst * taps, sizeof(int16_t));
+	if (axis->first == NULL || axis->weight == NULL) {
+		perror("librtmpcast: ERROR: scale::makeAxis: malloc() returned NULL");
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < dst; i ++) {
+		int16_t * const w = axis->weight + i * taps;
+		unsigned int first;
+
+		if (dst == src) {
+			first = i;
+			w[0] = 1 << SCALE_BITS;
+		} else if (dst < src) {
+			const unsigned int lo = i * src, hi = (i + 1) * src;
+			first = lo / dst;
+			const unsigned int last = (hi - 1) / dst;
+
+			// rounded separately: put what is left over on the largest
+			int sum = 0, largest = 0;
+			for (unsigned int k = first; k <= last; k ++) {
+				const unsigned int start = (k * dst > lo ? k * dst : lo);
+				const unsigned int end = ((k + 1) * dst < hi ? (k + 1) * dst : hi);
+				const int t = k - first;
+				w[t] = (int16_t)(((end - start) * (1u << SCALE_BITS) + src / 2) / src);
+				sum += w[t];
+				if (w[t] > w[largest])
+					largest = t;
+			}
+			w[largest] += (1 << SCALE_BITS) - sum;
+		} else if (src == 1) {
+			first = 0;
+			w[0] = 1 << SCALE_BITS;
+		} else {
+			// centre of output i, in source pixels times 2 dst, less half a pixel
+			const long centre = (long)(2 * i + 1) * src - dst;
+			if (centre <= 0) {
+				first = 0;
+				w[0] = 1 << SCALE_BITS;
+			} else {
+				first = centre / (2 * dst);
+				const unsigned int frac = centre % (2 * dst);
+				if (first >= src - 1) {
+					first = src - 1;
+					w[0] = 1 << SCALE_BITS;
+				} else {
+					w[1] = (int16_t)((frac * (1u << SCALE_BITS) + dst) / (2 * dst));
+					w[0] = (1 << SCALE_BITS) - w[1];
+				}
+			}
+		}
+
+		// keep all taps inside the source
+		if (first + taps > src) {
+			const unsigned int shift = first + taps - src;
+			memmove(w + shift, w, (taps - shift) * sizeof(int16_t));
+			memset(w, 0, shift * sizeof(int16_t));
+			first -= shift;
+		}
+		axis->first[i] = first;
+	}
+
+	return 1;
+}
+
+/* ************************************************************************ */
+// Passes
+
+// one source row across, from output i on, keeping SCALE_ROW_BITS of
+//  fraction; a constant tap count lets the compiler unroll the inner loop
+static inline void scaleRowTaps(const struct axis_t * const x, const uint8_t * const src, int16_t * const dst, unsigned int i, const unsigned int width, const unsigned int taps)
+{
+	const int16_t * w = x->weight + i * taps;
+
+	for ( ; i < width; i ++, w += taps) {
+		const uint8_t * const p = src + x->first[i];
+		int sum = 0;
+		for (unsigned int t = 0; t < taps; t ++)
+			sum += p[t] * w[t];
+		dst[i] = (int16_t)((sum + (1 << (SCALE_BITS - SCALE_ROW_BITS - 1))) >> (SCALE_BITS - SCALE_ROW_BITS));
+	}
+}
+
+#ifdef __SSE2__
+// An output's taps, zero-extended to 16 bits each, as one 32-bit lane
+//  (two taps) or the low half of one (four)
+static inline int tapPair(const uint8_t * const p)
+{
+	return p[0] | p[1] << 16;
+}
+
+static inline int tapQuad(const uint8_t * const p)
+{
+	uint32_t q;
+	memcpy(&q, p, sizeof(q));
+	return (int)q;
+}
+#endif
+
+static void scaleRow(const struct axis_t * const x, const uint8_t * const src, int16_t * const dst, const unsigned int width)
+{
+	unsigned int i = 0;
+#ifdef __SSE2__
+	// four outputs at a time: each one's taps are gathered into 16-bit
+	//  lanes beside its weights (which lie in the same order), and madd
+	//  weighs and sums them in pairs
+	const int shift = SCALE_BITS - SCALE_ROW_BITS;
+	const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+	const unsigned int * const f = x->first;
+
+	if (x->taps == 2) {
+		for ( ; i + 4 <= width; i += 4) {
+			const __m128i p = _mm_set_epi32(tapPair(src + f[i + 3]), tapPair(src + f[i + 2]), tapPair(src + f[i + 1]), tapPair(src + f[i]));
+			const __m128i w = _mm_loadu_si128((const __m128i *)(x->weight + 2 * i));
+			const __m128i sum = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(p, w), round), shift);
+			_mm_storel_epi64((__m128i *)(dst + i), _mm_packs_epi32(sum, sum));
+		}
+	} else if (x->taps == 4) {
+		const __m128i zero = _mm_setzero_si128();
+		for ( ; i + 4 <= width; i += 4) {
+			const __m128i p = _mm_set_epi32(tapQuad(src + f[i + 3]), tapQuad(src + f[i + 2]), tapQuad(src + f[i + 1]), tapQuad(src + f[i]));
+			const int16_t * const w = x->weight + 4 * i;
+			// half sums: outputs 0 and 1 in lo, 2 and 3 in hi
+			const __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(p, zero), _mm_loadu_si128((const __m128i *)w));
+			const __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(p, zero), _mm_loadu_si128((const __m128i *)(w + 8)));
+			const __m128 a = _mm_castsi128_ps(lo), b = _mm_castsi128_ps(hi);
+			const __m128i even = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+			const __m128i odd = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+			const __m128i sum = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(even, odd), round), shift);
+			_mm_storel_epi64((__m128i *)(dst + i), _mm_packs_epi32(sum, sum));
+		}
+	}
+#endif
+
+	// the rest, and wider taps (down by more than 3x)
+	switch (x->taps) {
+	case 1: scaleRowTaps(x, src, dst, i, width, 1); break;
+	case 2: scaleRowTaps(x, src, dst, i, width, 2); break;
+	case 4: scaleRowTaps(x, src, dst, i, width, 4); break;
+	default: scaleRowTaps(x, src, dst, i, width, x->taps);
+	}
+}
+
+// taps rows down (stride apart) into one output row
+static void blendRows(const int16_t * const src, const unsigned int stride, const int16_t * const w, const unsigned int taps, uint8_t * const dst, const unsigned int width)
+{
+	const int shift = SCALE_BITS + SCALE_ROW_BITS;
+	unsigned int i = 0;
+#ifdef __SSE2__
+	const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+	for ( ; i + 8 <= width; i += 8) {
+		__m128i lo = round, hi = round;
+		// two rows at a time: interleaved, madd weighs and sums each pair
+		for (unsigned int t = 0; t < taps; t += 2) {
+			const __m128i a = _mm_loadu_si128((const __m128i *)(src + t * stride + i));
+			const __m128i b = (t + 1 < taps ? _mm_loadu_si128((const __m128i *)(src + (t + 1) * stride + i)) : _mm_setzero_si128());
+			const uint16_t w1 = (t + 1 < taps ? (uint16_t)w[t + 1] : 0);
+			const __m128i k = _mm_set1_epi32((int)((uint32_t)(uint16_t)w[t] | (uint32_t)w1 << 16));
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k));
+		}
+		const __m128i v = _mm_packs_epi32(_mm_srai_epi32(lo, shift), _mm_srai_epi32(hi, shift));
+		_mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(v, v));
+	}
+#endif
+	for ( ; i < width; i ++) {
+		int sum = 1 << (shift - 1);
+		for (unsigned int t = 0; t < taps; t ++)
+			sum += src[t * stride + i] * w[t];
+		sum >>= shift;
+		dst[i] = (uint8_t)(sum > 255 ? 255 : sum);
+	}
+}
+
+/* ************************************************************************ */
+// Public
+
+struct scale_t * scale_create(const unsigned int src_width, const unsigned int src_height, const unsigned int count, const unsigned int * const width, const unsigned int * const height)
+{
+	if (src_width < 2 || src_height < 2 || (src_width | src_height) & 1) {
+		fputs("librtmpcast: ERROR: scale::scale_create: source size must be even\n", stderr);
+		return NULL;
+	}
+	for (unsigned int i = 0; i < count; i ++) {
+		if (width[i] < 2 || height[i] < 2 || (width[i] | height[i]) & 1) {
+			fputs("librtmpcast: ERROR: scale::scale_create: sizes must be even\n", stderr);
+			return NULL;
+		}
+	}
+
+	// create a structure
+	struct scale_t * s = malloc(sizeof(struct scale_t));
+	if (s == NULL) {
+		perror("librtmpcast: ERROR: scale::scale_create: malloc() returned NULL");
+		return NULL;
+	}
+	s->width = src_width;
+	s->height = src_height;
+	s->count = count;
+	s->target = calloc(count, sizeof(struct target_t));
+	if (s->target == NULL) {
+		perror("librtmpcast: ERROR: scale::scale_create: calloc() returned NULL");
+		free(s);
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < count; i ++) {
+		struct target_t * const target = &s->target[i];
+		target->copy = (width[i] == src_width && height[i] == src_height);
+		if (target->copy)
+			continue;
+
+		for (int p = 0; p < 3; p ++) {
+			struct plane_t * const plane = &target->plane[p];
+			plane->src_width = (p ? src_width / 2 : src_width);
+			plane->src_height = (p ? src_height / 2 : src_height);
+			plane->width = (p ? width[i] / 2 : width[i]);
+			plane->height = (p ? height[i] / 2 : height[i]);
+
+			plane->rows = malloc((size_t)plane->src_height * plane->width * sizeof(int16_t));
+			if (plane->rows == NULL) {
+				perror("librtmpcast: ERROR: scale::scale_create: malloc() returned NULL");
+				scale_close(s);
+				return NULL;
+			}
+			if (! makeAxis(&plane->x, plane->src_width, plane->width, 1) ||
+				! makeAxis(&plane->y, plane->src_height, plane->height, 0)) {
+				scale_close(s);
+				return NULL;
+			}
+		}
+	}
+
+	return s;
+}
+
+void scale_frame(struct scale_t * const s, const uint8_t * const src[3], uint8_t * const * const dst[])
+{
+	for (int p = 0; p < 3; p ++) {
+		const unsigned int src_width = (p ? s->width / 2 : s->width);
+		const unsigned int src_height = (p ? s->height / 2 : s->height);
+
+		// across: each source row for every size, while it is in cache
+		for (unsigned int y = 0; y < src_height; y ++) {
+			const uint8_t * const row = src[p] + (size_t)y * src_width;
+			for (unsigned int i = 0; i < s->count; i ++) {
+				if (dst[i] == NULL || s->target[i].copy)
+					continue;
+				const struct plane_t * const plane = &s->target[i].plane[p];
+				scaleRow(&plane->x, row, plane->rows + (size_t)y * plane->width, plane->width);
+			}
+		}
+
+		// then down, from the (smaller) rows
+		for (unsigned int i = 0; i < s->count; i ++) {
+			if (dst[i] == NULL)
+				continue;
+			if (s->target[i].copy) {
+				memcpy(dst[i][p], src[p], (size_t)src_width * src_height);
+				continue;
+			}
+			const struct plane_t * const plane = &s->target[i].plane[p];
+			for (unsigned int y = 0; y < plane->height; y ++)
+				blendRows(plane->rows + (size_t)plane->y.first[y] * plane->width, plane->width,
+					plane->y.weight + y * plane->y.taps, plane->y.taps,
+					dst[i][p] + (size_t)y * plane->width, plane->width);
+		}
+	}
+}
+
+void scale_close(struct scale_t * const s)
+{
+	for (unsigned int i = 0; i < s->count; i ++) {
+		for (int p = 0; p < 3; p ++) {
+			struct plane_t * const plane = &s->target[i].plane[p];
+			free(plane->rows);
+			free(plane->x.first);
+			free(plane->x.weight);
+			free(plane->y.first);
+			free(plane->y.weight);
+		}
+	}
+	free(s->target);
+	free(s);
+}
@@ -0,0 +1,24 @@
+#ifndef RTMPCAST_SCALE_H
+#define RTMPCAST_SCALE_H
+
+// Resizing one I420 frame to several sizes at once, for the rendition
+//  ladder.  Area averaging going down, bilinear going up; separable, with
+//  fixed-point weights.  The horizontal pass takes each source row for
+//  every size while it is in cache, so the source is read once however
+//  many sizes there are.  Both passes use SSE2 where the compiler targets
+//  it: across, for anything up to shrinking by 3x (4 taps), and down, for
+//  any size.
+// One thread at a time.
+
+#include <stdint.h>
+
+struct scale_t;
+
+// From src_width x src_height to each of count sizes (all even)
+struct scale_t * scale_create(unsigned int src_width, unsigned int src_height, unsigned int count, const unsigned int * width, const unsigned int * height);
+// src and each dst[i] are I420 planes, strides width and width / 2.
+//  A NULL dst[i] skips that size for this frame.
+void scale_frame(struct scale_t * s, const uint8_t * const src[3], uint8_t * const * const dst[]);
+void scale_close(struct scale_t * s);
+
+#endif
@@ -2,10 +2,80 @@
 #define RTMPCAST_VIDEO_H
 
 // Common structures shared between rtmpcast lib and the video modules.
+
+#include <stdint.h>
+
+// One length-prefixed NAL unit of encoder output
+struct video_nal_t {
+	const unsigned char * payload;
+	int size;
+	// can be dropped without breaking decode of other frames (SEI, non-reference slices)
+	int disposable;
+};
+
+// rate control modes
+#define VIDEO_RC_CBR 0
+#define VIDEO_RC_ABR 1
+#define VIDEO_RC_CRF 2
+
+// Encoder tuning, copied from rtmpcast_param_t (which documents each field)
+//  rc takes the same values as RTMPCAST_RC_*
+//  0 / NULL always means "the default"
+struct video_options_t {
+	int threads;
+	int sliced_threads;
+	unsigned int lookahead;
+	const char * preset;
+	const char * tune;
+	const char * profile;
+	unsigned int keyint;
+	int rc;
+	float crf;
+};
+
 struct video_return_t {
 	int keyframe;
-	int pts;
+	// milliseconds: presentation time as passed in with this frame, and
+	//  decode time, which runs behind it when there are B-frames
+	//  (so can start out negative: see the encoder's dts shift)
+	int64_t pts;
+	int64_t dts;
 	int size;
+	// average quantizer of the frame that came out
+	int qp;
+
+	// the NAL units making up size, in order
+	//  these point into encoder-owned memory, valid until the next update
+	int nal_count;
+	const struct video_nal_t * nal;
+};
+
+struct encoder_video;
+
+// An encoder backend: what rtmpcast calls, and nothing else.  Every entry
+//  is required; rtmpcast_param_t picks one by name (see backend.h).
+struct video_backend_t {
+	const char * name;
+
+	// Check options before anything is allocated.  Returns 0 (with a message) if invalid.
+	int (* validate)(const struct video_options_t * options);
+	struct encoder_video * (* create)(unsigned int width, unsigned int height, unsigned int framerate, unsigned int bitrate, const struct video_options_t * options);
+	// Writes the AVCDecoderConfigurationRecord, returns its size or -1
+	int (* init)(const struct encoder_video * video, unsigned char * destination, unsigned int capacity);
+	// Encode a YUV420 frame.  pts is in milliseconds, and comes back in the
+	//  result with the frame it belongs to (frames may come out later).
+	struct video_return_t (* encode)(struct encoder_video * video, unsigned char * const plane[3], int64_t pts);
+	// Frames still held inside the encoder, and (at the end of the stream)
+	//  getting the next of them out
+	int (* delayed)(const struct encoder_video * video);
+	struct video_return_t (* flush)(struct encoder_video * video);
+	// Change the bitrate (kbps) from the next frame on.  Returns 0 if refused.
+	int (* set_bitrate)(struct encoder_video * video, unsigned int bitrate);
+	// Make the next frame passed in an IDR frame
+	void (* force_keyframe)(struct encoder_video * video);
+	// Milliseconds to add to every timestamp so decode times never go negative
+	int (* dts_shift)(const struct encoder_video * video);
+	void (* close)(struct encoder_video * video);
 };
 
 #endif
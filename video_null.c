@@ -0,0 +1,166 @@
+#include "video_null.h"
+#include "avc.h"
+
+// for malloc
+#include <stdlib.h>
+// for memset
+#include <string.h>
+// for perror
+#include <stdio.h>
+
+// keyframes as often as the x264 default
+#define DEFAULT_KEYINT_SECONDS 4
+
+// Baseline 3.1 parameter sets: enough for the record, not for a decoder
+static const unsigned char sps[] = { 0x67, 0x42, 0xC0, 0x1F, 0x8C, 0x8D, 0x40 };
+static const unsigned char pps[] = { 0x68, 0xCE, 0x3C, 0x80 };
+
+// structure definition for the encoder (private data)
+struct encoder_video {
+	unsigned int framerate;
+	unsigned int bitrate;
+	unsigned int keyint;
+
+	// frames since the last IDR, and whether the next one must be
+	unsigned int frame;
+	int keyframe;
+
+	// the last frame: length prefix, NAL header, filler
+	unsigned char * buffer;
+	size_t capacity;
+	struct video_nal_t nal;
+};
+
+static int validate(const struct video_options_t * const o)
+{
+	(void)o;
+	return 1;
+}
+
+static struct encoder_video * create(const unsigned int width, const unsigned int height, const unsigned int framerate, const unsigned int bitrate, const struct video_options_t * const o)
+{
+	(void)width;
+	(void)height;
+
+	// create a structure
+	struct encoder_video * e = calloc(1, sizeof(struct encoder_video));
+	if (e == NULL) {
+		perror("librtmpcast: ERROR: video_null::create: calloc() returned NULL");
+		return NULL;
+	}
+
+	e->framerate = framerate;
+	e->bitrate = bitrate;
+	e->keyint = (o->keyint ? o->keyint : framerate * DEFAULT_KEYINT_SECONDS);
+	e->keyframe = 1;
+
+	return e;
+}
+
+static int init(const struct encoder_video * const e, unsigned char * const destination, const unsigned int capacity)
+{
+	(void)e;
+	return avc_config_record(destination, capacity, sps, sizeof(sps), pps, sizeof(pps));
+}
+
+static struct video_return_t encode(struct encoder_video * const e, unsigned char * const plane[3], const int64_t pts)
+{
+	(void)plane;
+
+	struct video_return_t ret;
+	ret.keyframe = (e->keyframe || e->frame >= e->keyint);
+	ret.pts = pts;
+	ret.dts = pts;
+	ret.qp = 0;
+	ret.nal_count = 1;
+	ret.nal = &e->nal;
+
+	// the bitrate's share of a second, and at least a NAL header
+	size_t size = (size_t)e->bitrate * 1000 / 8 / e->framerate;
+	if (size < 4 + 1)
+		size = 4 + 1;
+
+	if (size > e->capacity) {
+		unsigned char * buffer = realloc(e->buffer, size);
+		if (buffer == NULL) {
+			perror("librtmpcast: ERROR: video_null::encode: realloc() returned NULL");
+			ret.size = -1;
+			return ret;
+		}
+		// filler that cannot be mistaken for a start code
+		memset(buffer + e->capacity, 0xAA, size - e->capacity);
+		e->buffer = buffer;
+		e->capacity = size;
+	}
+
+	const size_t length = size - 4;
+	e->buffer[0] = length >> 24 & 0xFF;
+	e->buffer[1] = length >> 16 & 0xFF;
+	e->buffer[2] = length >> 8 & 0xFF;
+	e->buffer[3] = length & 0xFF;
+	// IDR slice, or a reference slice
+	e->buffer[4] = (ret.keyframe ? 0x65 : 0x41);
+
+	e->nal.payload = e->buffer;
+	e->nal.size = size;
+	e->nal.disposable = 0;
+	ret.size = size;
+
+	if (ret.keyframe) {
+		e->keyframe = 0;
+		e->frame = 0;
+	}
+	e->frame ++;
+
+	return ret;
+}
+
+static int delayed(const struct encoder_video * const e)
+{
+	(void)e;
+	return 0;
+}
+
+static struct video_return_t flush(struct encoder_video * const e)
+{
+	(void)e;
+	const struct video_return_t ret = { 0 };
+	return ret;
+}
+
+static int set_bitrate(struct encoder_video * const e, const unsigned int bitrate)
+{
+	e->bitrate = bitrate;
+	return 1;
+}
+
+static void force_keyframe(struct encoder_video * const e)
+{
+	e->keyframe = 1;
+}
+
+static int dts_shift(const struct encoder_video * const e)
+{
+	(void)e;
+	return 0;
+}
+
+static void close_encoder(struct encoder_video * const e)
+{
+	free(e->buffer);
+	free(e);
+}
+
+const struct video_backend_t video_null_backend = {
+	.name = "null",
+	.validate = validate,
+	.create = create,
+	.init = init,
+	.encode = encode,
+	.delayed = delayed,
+	.flush = flush,
+	.set_bitrate = set_bitrate,
+	.force_keyframe = force_keyframe,
+	.dts_shift = dts_shift,
+	.close = close_encoder
+};
@@ -0,0 +1,13 @@
+#ifndef RTMPCAST_VIDEO_NULL_H
+#define RTMPCAST_VIDEO_NULL_H
+
+// A video "encoder" that encodes nothing: each frame comes out at once as
+//  one NAL of filler, sized for the bitrate (an IDR slice every keyint
+//  frames, or when asked for).  The stream is well formed but shows no
+//  picture; it is for timing the mux and the network on their own.
+
+#include "video.h"
+
+extern const struct video_backend_t video_null_backend;
+
+#endif
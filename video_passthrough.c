@@ -0,0 +1,157 @@
+#include "video_passthrough.h"
+#include "avc.h"
+
+// for malloc
+#include <stdlib.h>
+// for memcpy
+#include <string.h>
+// for fprintf
+#include <stdio.h>
+
+// SPS / PPS: room for anything a stream is likely to carry
+#define PARAMETER_MAX 256
+
+struct parameter_set_t {
+	unsigned char data[PARAMETER_MAX];
+	unsigned int size;
+};
+
+// structure definition for the passthrough (private data)
+struct encoder_video {
+	// the latest of each, and the ones last written by init
+	struct parameter_set_t sps, pps;
+	struct parameter_set_t sent_sps, sent_pps;
+
+	// an IDR frame has gone out: anything after it can be decoded
+	int started;
+
+	struct video_nal_t * nal;
+	int nal_max;
+};
+
+static int sameSet(const struct parameter_set_t * const a, const struct parameter_set_t * const b)
+{
+	return a->size == b->size && memcmp(a->data, b->data, a->size) == 0;
+}
+
+static void keepSet(struct parameter_set_t * const set, const unsigned char * const nal, const unsigned int size)
+{
+	if (size > PARAMETER_MAX) {
+		fprintf(stderr, "librtmpcast: WARNING: video_passthrough: ignored a parameter set of %u bytes\n", size);
+		return;
+	}
+	memcpy(set->data, nal, size);
+	set->size = size;
+}
+
+struct encoder_video * video_passthrough_create(void)
+{
+	// create a structure
+	struct encoder_video * e = calloc(1, sizeof(struct encoder_video));
+	if (e == NULL) {
+		perror("librtmpcast: ERROR: video_passthrough::video_passthrough_create: calloc() returned NULL");
+		return NULL;
+	}
+
+	return e;
+}
+
+int video_passthrough_init(struct encoder_video * const e, unsigned char * const destination, const unsigned int capacity)
+{
+	if (e->sps.size == 0 || e->pps.size == 0)
+		return 0;
+
+	const int size = avc_config_record(destination, capacity, e->sps.data, e->sps.size, e->pps.data, e->pps.size);
+	if (size < 0) {
+		fputs("librtmpcast: ERROR: video_passthrough::video_passthrough_init: headers too large\n", stderr);
+		return -1;
+	}
+
+	// the frames after this one can go out under it
+	e->sent_sps = e->sps;
+	e->sent_pps = e->pps;
+	return size;
+}
+
+struct video_return_t video_passthrough_encode(struct encoder_video * const e, unsigned char * const data, size_t size, const int64_t pts)
+{
+	struct video_return_t ret;
+	ret.keyframe = 0;
+	ret.pts = pts;
+	ret.dts = pts;
+	ret.size = 0;
+	// not ours to know
+	ret.qp = 0;
+	ret.nal_count = 0;
+	ret.nal = e->nal;
+
+	size = avc_annexb_to_avcc(data, size);
+
+	for (size_t at = 0; at + 4 < size; ) {
+		const unsigned char * const p = data + at;
+		const size_t length = ((size_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		at += 4 + length;
+
+		// parameter sets go in the sequence header instead, and
+		//  delimiters are for Annex B only
+		const int type = AVC_NAL_TYPE(p[4]);
+		if (type == AVC_NAL_SPS) {
+			keepSet(&e->sps, p + 4, length);
+			continue;
+		}
+		if (type == AVC_NAL_PPS) {
+			keepSet(&e->pps, p + 4, length);
+			continue;
+		}
+		if (type == AVC_NAL_AUD)
+			continue;
+
+		if (ret.nal_count == e->nal_max) {
+			const int max = (e->nal_max ? 2 * e->nal_max : 16);
+			struct video_nal_t * nal = realloc(e->nal, max * sizeof(struct video_nal_t));
+			if (nal == NULL) {
+				perror("librtmpcast: ERROR: video_passthrough::video_passthrough_encode: realloc() returned NULL");
+				ret.size = -1;
+				return ret;
+			}
+			e->nal = nal;
+			e->nal_max = max;
+			ret.nal = nal;
+		}
+
+		struct video_nal_t * const nal = &e->nal[ret.nal_count ++];
+		nal->payload = p;
+		nal->size = 4 + length;
+		nal->disposable = AVC_NAL_DISPOSABLE(p[4]);
+
+		ret.size += nal->size;
+		if (type == AVC_NAL_IDR)
+			ret.keyframe = 1;
+	}
+
+	// joined mid-stream: wait for a frame that can be decoded on its own
+	if (! e->started && ! (ret.keyframe && e->sps.size && e->pps.size)) {
+		ret.size = 0;
+		ret.nal_count = 0;
+	} else if (ret.size > 0)
+		e->started = 1;
+
+	return ret;
+}
+
+int video_passthrough_changed(const struct encoder_video * const e)
+{
+	return ! (sameSet(&e->sps, &e->sent_sps) && sameSet(&e->pps, &e->sent_pps));
+}
+
+void video_passthrough_resync(struct encoder_video * const e)
+{
+	e->started = 0;
+}
+
+// shut everything down
+void video_passthrough_close(struct encoder_video * const e)
+{
+	free(e->nal);
+	free(e);
+}
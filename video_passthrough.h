@@ -0,0 +1,32 @@
+#ifndef RTMPCAST_VIDEO_PASSTHROUGH_H
+#define RTMPCAST_VIDEO_PASSTHROUGH_H
+
+// H.264 that is already encoded, sent on as it is: Annex B access units
+//  (from a hardware encoder, a camera, a file) are rewritten where they lie
+//  with length prefixes, and their in-band SPS / PPS become the sequence
+//  header.  Nothing goes out until there is an IDR frame to start from.
+
+#include "video.h"
+
+#include <stddef.h>
+
+struct encoder_video;
+
+struct encoder_video * video_passthrough_create(void);
+// Writes the AVCDecoderConfigurationRecord for the latest SPS and PPS,
+//  returns its size, 0 if the stream has yet to give them, or -1
+int video_passthrough_init(struct encoder_video * video, unsigned char * destination, unsigned int capacity);
+// Take one access unit of size bytes in Annex B, converted in place (data
+//  needs room for AVC_AVCC_CAPACITY(size) bytes).  Its NALs, less SPS / PPS
+//  / AUD, come back pointing into data; a keyframe if it holds an IDR slice.
+//  pts (milliseconds) is the decode time too: frames come in decode order,
+//  without reordering.  size 0 if there is nothing to send yet.
+struct video_return_t video_passthrough_encode(struct encoder_video * video, unsigned char * data, size_t size, int64_t pts);
+// Whether the SPS / PPS differ from the ones video_passthrough_init last
+//  wrote (send that first)
+int video_passthrough_changed(const struct encoder_video * video);
+// Access units were lost: send nothing more until the next IDR frame
+void video_passthrough_resync(struct encoder_video * video);
+void video_passthrough_close(struct encoder_video * video);
+
+#endif
@@ -1,4 +1,5 @@
 #include "video_x264.h"
+#include "avc.h"
 
 // h.264 encoder lib
 //  this requires stdint.h first or else it complains...
@@ -9,22 +10,104 @@
 #include <stdlib.h>
 // for fprintf
 #include <stdio.h>
+// for memcpy
+#include <string.h>
+
+// defaults, for options left at 0 / NULL
+#define DEFAULT_PRESET "veryfast"
+#define DEFAULT_TUNE "zerolatency"
+#define DEFAULT_PROFILE "baseline"
+// Twitch likes keyframes every 4 sec or less
+#define DEFAULT_KEYINT_SECONDS 4
+
+// x264's own limits, which x264.h does not export
+#define MAX_THREADS 128
+#define MAX_LOOKAHEAD 250
+
+// Is name in a NULL-terminated list
+static int inList(const char * const name, const char * const * list)
+{
+	for ( ; *list; list ++)
+		if (strcmp(name, *list) == 0)
+			return 1;
+
+	return 0;
+}
 
 // structure definition for the encoder (private data)
 struct encoder_video {
 	// user callback to generate more audio
 	int (* callback)(unsigned char ** frame);
 
-	// buffer we will write to
-	unsigned char * buffer;
+	// NAL list handed back from update, grown as needed
+	struct video_nal_t * nal;
+	int nal_max;
+
+	// B-frame reordering delay, in ms
+	int dts_shift;
+	// frame type for the next picture: X264_TYPE_AUTO, or an IDR on request
+	int type;
 
 	// x264 objects
 	x264_t * encoder;
 	x264_picture_t picture;
 };
 
+int video_x264_validate(const struct video_options_t * const o)
+{
+	if (o->preset && ! inList(o->preset, x264_preset_names)) {
+		fprintf(stderr, "librtmpcast: ERROR: video_x264: unknown preset '%s'\n", o->preset);
+		return 0;
+	}
+
+	// tunes may be combined, e.g. "film,fastdecode"
+	if (o->tune) {
+		char tunes[64];
+		if (strlen(o->tune) >= sizeof(tunes)) {
+			fprintf(stderr, "librtmpcast: ERROR: video_x264: tune '%s' is too long\n", o->tune);
+			return 0;
+		}
+		strcpy(tunes, o->tune);
+
+		char * save;
+		for (char * t = strtok_r(tunes, ",./-+", &save); t; t = strtok_r(NULL, ",./-+", &save)) {
+			if (! inList(t, x264_tune_names)) {
+				fprintf(stderr, "librtmpcast: ERROR: video_x264: unknown tune '%s'\n", t);
+				return 0;
+			}
+		}
+	}
+
+	if (o->profile && ! inList(o->profile, x264_profile_names)) {
+		fprintf(stderr, "librtmpcast: ERROR: video_x264: unknown profile '%s'\n", o->profile);
+		return 0;
+	}
+
+	if (o->threads < -1 || o->threads > MAX_THREADS) {
+		fprintf(stderr, "librtmpcast: ERROR: video_x264: threads must be -1 (auto) to %d, not %d\n", MAX_THREADS, o->threads);
+		return 0;
+	}
+
+	if (o->lookahead > MAX_LOOKAHEAD) {
+		fprintf(stderr, "librtmpcast: ERROR: video_x264: lookahead must be at most %d, not %u\n", MAX_LOOKAHEAD, o->lookahead);
+		return 0;
+	}
+
+	if (o->rc != VIDEO_RC_CBR && o->rc != VIDEO_RC_ABR && o->rc != VIDEO_RC_CRF) {
+		fprintf(stderr, "librtmpcast: ERROR: video_x264: unknown rate control mode %d\n", o->rc);
+		return 0;
+	}
+
+	if (o->rc == VIDEO_RC_CRF && (o->crf < 0 || o->crf > 51)) {
+		fprintf(stderr, "librtmpcast: ERROR: video_x264: crf must be 0 to 51, not %f\n", o->crf);
+		return 0;
+	}
+
+	return 1;
+}
+
 // init
-struct encoder_video * video_x264_create(const unsigned int width, const unsigned int height, const unsigned int framerate, const unsigned int bitrate, int (* callback)(unsigned char ** frame), unsigned char * destination)
+struct encoder_video * video_x264_create(const unsigned int width, const unsigned int height, const unsigned int framerate, const unsigned int bitrate, const struct video_options_t * const o, int (* callback)(unsigned char ** frame))
 {
 	// create a structure
 	struct encoder_video * e = malloc(sizeof(struct encoder_video));
@@ -36,16 +119,20 @@ struct encoder_video * video_x264_create(const unsigned int width, const unsigne
 
 	// store the callback
 	e->callback = callback;
-	e->buffer = destination;
+
+	e->nal = NULL;
+	e->nal_max = 0;
+	e->type = X264_TYPE_AUTO;
 
 	// return code handler
 	int ret;
 
 	// Initialize the x264 encoder
 	//  First set up the parameters struct
-	//  TODO: we probably want to allow other things in here
 	x264_param_t x_p;
-	ret = x264_param_default_preset(&x_p, "veryfast", "zerolatency");
+	ret = x264_param_default_preset(&x_p,
+		(o->preset ? o->preset : DEFAULT_PRESET),
+		(o->tune ? o->tune : DEFAULT_TUNE));
 	if (ret) {
 		fprintf(stderr, "librtmpcast: ERROR: x264_param_default_preset returned %d\n", ret);
 		x264_param_cleanup(&x_p);
@@ -53,22 +140,41 @@ struct encoder_video * video_x264_create(const unsigned int width, const unsigne
 		return NULL;
 	}
 	//x_p.i_log_level = X264_LOG_INFO;
-	x_p.i_threads = 1;
+	// threading: sliced keeps zero frames of latency, frame threads scale better
+	//  but delay output by a frame per thread
+	x_p.i_threads = (o->threads == -1 ? X264_THREADS_AUTO : o->threads == 0 ? 1 : o->threads);
+	x_p.b_sliced_threads = (o->sliced_threads != 0);
+	if (o->lookahead)
+		x_p.rc.i_lookahead = o->lookahead;
 	x_p.i_width = width;
 	x_p.i_height = height;
 	x_p.i_fps_num = framerate;
 	x_p.i_fps_den = 1;
-	x_p.i_keyint_max = framerate * 4; // Twitch likes keyframes every 4 sec or less
+	// pts in milliseconds, same as FLV
+	x_p.i_timebase_num = 1;
+	x_p.i_timebase_den = 1000;
+	x_p.i_keyint_max = (o->keyint ? o->keyint : framerate * DEFAULT_KEYINT_SECONDS);
 
 	// Enable intra refresh instead of IDR
 	//x_p.b_intra_refresh = 1;
 
-	// Rate control - use CBR not CRF.
-	//  Chosen by setting bitrate and vbv_max_bitrate to same value.
-	x_p.rc.i_rc_method = X264_RC_ABR;
-	x_p.rc.i_bitrate = bitrate;
-	x_p.rc.i_vbv_max_bitrate = bitrate;
-	x_p.rc.i_vbv_buffer_size = bitrate;
+	// Rate control
+	if (o->rc == VIDEO_RC_CRF) {
+		// constant quality, capped at the bitrate so the stream still fits
+		x_p.rc.i_rc_method = X264_RC_CRF;
+		x_p.rc.f_rf_constant = o->crf;
+		x_p.rc.i_vbv_max_bitrate = bitrate;
+		x_p.rc.i_vbv_buffer_size = bitrate;
+	} else {
+		x_p.rc.i_rc_method = X264_RC_ABR;
+		x_p.rc.i_bitrate = bitrate;
+		// CBR: chosen by setting bitrate and vbv_max_bitrate to same value.
+		//  ABR only hits the average, with no cap
+		if (o->rc == VIDEO_RC_CBR) {
+			x_p.rc.i_vbv_max_bitrate = bitrate;
+			x_p.rc.i_vbv_buffer_size = bitrate;
+		}
+	}
 
 	// Control x264 output for muxing
 	x_p.b_aud = 0; // do not generate Access Unit Delimiters
@@ -76,9 +182,7 @@ struct encoder_video * video_x264_create(const unsigned int width, const unsigne
 	x_p.b_annexb = 0; // Annex B uses startcodes before NALU, but we want sizes
 
 	// constraints
-	//  TODO: this should be switchable?  baseline / main / high
-	ret = x264_param_apply_profile(&x_p, "baseline");
-	//ret = x264_param_apply_profile(&x_p, "high");
+	ret = x264_param_apply_profile(&x_p, (o->profile ? o->profile : DEFAULT_PROFILE));
 	if (ret) {
 		fprintf(stderr, "librtmpcast: ERROR: x264_param_apply_profile returned %d\n", ret);
 		x264_param_cleanup(&x_p);
@@ -98,6 +202,13 @@ struct encoder_video * video_x264_create(const unsigned int width, const unsigne
 		return NULL;
 	}
 
+	// With B-frames, x264 starts dts this many frames before pts:
+	//  one frame, or two with B-pyramid
+	x264_param_t x_o;
+	x264_encoder_parameters(e->encoder, &x_o);
+	const int delay = (x_o.i_bframe ? (x_o.i_bframe_pyramid ? 2 : 1) : 0);
+	e->dts_shift = (delay * 1000 * x_o.i_fps_den + x_o.i_fps_num - 1) / x_o.i_fps_num;
+
 	// These are the two picture structs.  Input must be alloc()
 	//  Output will be created by the encode process
 	ret = x264_picture_alloc(&e->picture, X264_CSP_I420, width, height);
@@ -111,93 +222,183 @@ struct encoder_video * video_x264_create(const unsigned int width, const unsigne
 	return e;
 }
 
-int video_x264_init(const struct encoder_video * e)
+int video_x264_init(const struct encoder_video * e, unsigned char * const destination, const unsigned int capacity)
 {
 	// write the h.264 header now
 	x264_nal_t * pp_nal;
 	int pi_nal;
 
-	int header_size = x264_encoder_headers(e->encoder, &pp_nal, &pi_nal);
-
-	// TODO: identify SPS / PPS instead of assuming
-	unsigned char * sps = pp_nal[0].p_payload + 4;
-	const unsigned short sps_length = pp_nal[0].i_payload;
-	unsigned char * pps = pp_nal[1].p_payload + 4;
-	const unsigned short pps_length = pp_nal[1].i_payload;
-
-	// write the decoder config record, the initial SPS and PPS
-	// AVCDecoder record - some of this data comes out of the SPS for this block
-	unsigned char * p = e->buffer;
-	*p = 0x01;	// version
-	*(p + 1) = sps[1];	// Required profile ID
-	*(p + 2) = sps[2];	// Profile compatibility
-	*(p + 3) = sps[3];	// AVC Level (3.0)
-	*(p + 4) = 0b11111100 | 0b11;	// NAL lengthSizeMinusOne (4 bytes)
-	*(p + 5) = 0b11100000 | 1;	// number of SPS sets
-	p += 6;
-
-	// write the SPS - length (uint16), then data
-	*p = sps_length >> 8 & 0xFF; p++;
-	*p = sps_length & 0xFF; p++;
-	memcpy(p, sps, sps_length);
-	p += sps_length;
-
-	// write the PPS now
-	*p = pps_length >> 8 & 0xFF; p++;
-	*p = pps_length & 0xFF; p++;
-	memcpy(p, pps, pps_length);
-	p += pps_length;
-
-	return p - e->buffer;
+	if (x264_encoder_headers(e->encoder, &pp_nal, &pi_nal) < 0) {
+		fputs("librtmpcast: ERROR: video_x264::video_x264_init: x264_encoder_headers failed\n", stderr);
+		return -1;
+	}
+
+	// payloads come after their 4-byte length
+	const x264_nal_t * sps = NULL;
+	const x264_nal_t * pps = NULL;
+	for (int i = 0; i < pi_nal; i ++) {
+		if (pp_nal[i].i_type == NAL_SPS)
+			sps = &pp_nal[i];
+		else if (pp_nal[i].i_type == NAL_PPS)
+			pps = &pp_nal[i];
+	}
+
+	if (sps == NULL || pps == NULL) {
+		fputs("librtmpcast: ERROR: video_x264::video_x264_init: no SPS / PPS in the headers\n", stderr);
+		return -1;
+	}
 
+	const int size = avc_config_record(destination, capacity, sps->p_payload + 4, sps->i_payload - 4, pps->p_payload + 4, pps->i_payload - 4);
+	if (size < 0)
+		fputs("librtmpcast: ERROR: video_x264::video_x264_init: headers too large\n", stderr);
+	return size;
 }
 
-struct video_return_t video_x264_update(const struct encoder_video * e)
+// Encode one picture, and describe what came out
+static struct video_return_t encodePicture(struct encoder_video * const e, x264_picture_t * const picture)
 {
-	// update
-	e->callback(e->picture.img.plane);
-
 	/* Encode an x264 frame */
 	x264_nal_t * nals;
 	int i_nals;
 	x264_picture_t pic_out;
 
 	struct video_return_t ret;
-	ret.size = x264_encoder_encode(e->encoder, &nals, &i_nals, &e->picture, &pic_out);
+	ret.size = x264_encoder_encode(e->encoder, &nals, &i_nals, picture, &pic_out);
 	ret.keyframe = pic_out.b_keyframe;
-	//ret.dts = pic_out.i_dts;
-	
+	ret.pts = pic_out.i_pts;
+	ret.dts = pic_out.i_dts;
+	// x264 reports the frame's average QP here, off by one like the input
+	ret.qp = pic_out.i_qpplus1 - 1;
+	ret.nal_count = 0;
+	ret.nal = e->nal;
+
 	if (ret.size < 0) {
 		// error in encoding
 		fputs("Error when encoding frame\n", stderr);
 	} else if (ret.size > 0) {
-		// write every NALU to the packet for this pic
-		//  x264 guarantees all p_payload are sequential
-		// TODO: would be nice if we could tell the payload where to go!
-		//  or at a minimum maybe skip disposable NALs
-		memcpy(e->buffer, nals[0].p_payload, ret.size);
+		// describe every NALU for this pic, and let the caller decide
+		//  where the bytes go (socket, tag buffer) and which to skip
+		if (i_nals > e->nal_max) {
+			struct video_nal_t * nal = realloc(e->nal, i_nals * sizeof(struct video_nal_t));
+			if (nal == NULL) {
+				perror("librtmpcast: ERROR: video_x264::video_x264_update: realloc() returned NULL");
+				ret.size = -1;
+				return ret;
+			}
+			e->nal = nal;
+			e->nal_max = i_nals;
+		}
+
+		for (int i = 0; i < i_nals; i ++) {
+			e->nal[i].payload = nals[i].p_payload;
+			e->nal[i].size = nals[i].i_payload;
+			e->nal[i].disposable = (nals[i].i_ref_idc == NAL_PRIORITY_DISPOSABLE);
+		}
+		ret.nal = e->nal;
+		ret.nal_count = i_nals;
 	}
 
 	return ret;
 }
 
-void video_x264_close(struct encoder_video * e)
+struct video_return_t video_x264_update(struct encoder_video * e, const int64_t pts)
+{
+	// update
+	e->callback(e->picture.img.plane);
+
+	e->picture.i_pts = pts;
+	e->picture.i_type = e->type;
+	e->type = X264_TYPE_AUTO;
+	return encodePicture(e, &e->picture);
+}
+
+struct video_return_t video_x264_encode(struct encoder_video * e, unsigned char * const plane[3], const int64_t pts)
+{
+	// same layout as our own picture, but reading from the caller's planes
+	//  x264 copies the input into its own frames, which is what lets it keep
+	//  several in flight: nothing here needs to outlive the call
+	x264_picture_t picture = e->picture;
+	for (int i = 0; i < 3; i ++)
+		picture.img.plane[i] = plane[i];
+	picture.i_pts = pts;
+	picture.i_type = e->type;
+	e->type = X264_TYPE_AUTO;
+
+	return encodePicture(e, &picture);
+}
+
+int video_x264_set_bitrate(struct encoder_video * e, const unsigned int bitrate)
+{
+	x264_param_t x_p;
+	x264_encoder_parameters(e->encoder, &x_p);
+
+	// x264 only takes a new rate through the VBV, which plain ABR leaves off
+	if (x_p.rc.i_vbv_max_bitrate == 0) {
+		fputs("librtmpcast: ERROR: video_x264_set_bitrate: ABR has no VBV to change\n", stderr);
+		return 0;
+	}
+
+	// the same fields video_x264_create set for this mode
+	if (x_p.rc.i_rc_method == X264_RC_ABR)
+		x_p.rc.i_bitrate = bitrate;
+	x_p.rc.i_vbv_max_bitrate = bitrate;
+	x_p.rc.i_vbv_buffer_size = bitrate;
+
+	const int ret = x264_encoder_reconfig(e->encoder, &x_p);
+	if (ret < 0) {
+		fprintf(stderr, "librtmpcast: ERROR: x264_encoder_reconfig returned %d\n", ret);
+		return 0;
+	}
+
+	return 1;
+}
+
+void video_x264_force_keyframe(struct encoder_video * e)
+{
+	e->type = X264_TYPE_IDR;
+}
+
+int video_x264_dts_shift(const struct encoder_video * e)
+{
+	return e->dts_shift;
+}
+
+int video_x264_delayed(const struct encoder_video * e)
+{
+	return x264_encoder_delayed_frames(e->encoder);
+}
+
+struct video_return_t video_x264_flush(struct encoder_video * e)
 {
-	/*
-	   while( x264_encoder_delayed_frames( h ) )
-	   {
-	   i_frame_size = x264_encoder_encode( h, &nal, &i_nal, NULL, &pic_out );
-	   if( i_frame_size < 0 )
-	   goto fail;
-	   else if( i_frame_size )
-	   {
-	   if( !fwrite( nal->p_payload, i_frame_size, 1, stdout ) )
-	   goto fail;
-	   }
-	   }
-	 */
+	// no input picture: x264 hands back one it was holding
+	return encodePicture(e, NULL);
+}
 
+// held frames are discarded: see video_x264_flush
+void video_x264_close(struct encoder_video * e)
+{
 	x264_picture_clean(&e->picture);
 	x264_encoder_close(e->encoder);
+	free(e->nal);
 	free(e);
 }
+
+// the backend table: frames always come from rtmpcast, not the callback
+static struct encoder_video * create(const unsigned int width, const unsigned int height, const unsigned int framerate, const unsigned int bitrate, const struct video_options_t * const o)
+{
+	return video_x264_create(width, height, framerate, bitrate, o, NULL);
+}
+
+const struct video_backend_t video_x264_backend = {
+	.name = "x264",
+	.validate = video_x264_validate,
+	.create = create,
+	.init = video_x264_init,
+	.encode = video_x264_encode,
+	.delayed = video_x264_delayed,
+	.flush = video_x264_flush,
+	.set_bitrate = video_x264_set_bitrate,
+	.force_keyframe = video_x264_force_keyframe,
+	.dts_shift = video_x264_dts_shift,
+	.close = video_x264_close
+};
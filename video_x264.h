@@ -5,9 +5,31 @@
 
 struct encoder_video;
 
-struct encoder_video * video_x264_create(const unsigned int width, const unsigned int height, const unsigned int framerate, const unsigned int bitrate, int (* callback)(unsigned char ** frame), unsigned char * destination);
-int video_x264_init(const struct encoder_video * video);
-struct video_return_t video_x264_update(const struct encoder_video * video);
+// these, as a backend for rtmpcast to pick
+extern const struct video_backend_t video_x264_backend;
+
+// Check options before anything is allocated.  Returns 0 (with a message) if invalid.
+int video_x264_validate(const struct video_options_t * options);
+struct encoder_video * video_x264_create(const unsigned int width, const unsigned int height, const unsigned int framerate, const unsigned int bitrate, const struct video_options_t * options, int (* callback)(unsigned char ** frame));
+// Writes the AVCDecoderConfigurationRecord, returns its size or -1
+int video_x264_init(const struct encoder_video * video, unsigned char * destination, unsigned int capacity);
+// Encode a frame from the callback.  pts is in milliseconds, and comes back
+//  in the result with the frame it belongs to (frames may come out later).
+struct video_return_t video_x264_update(struct encoder_video * video, int64_t pts);
+// Encode a frame the caller already has (YUV420, same layout as the callback's)
+struct video_return_t video_x264_encode(struct encoder_video * video, unsigned char * const plane[3], int64_t pts);
+// Change the bitrate (kbps) from the next frame on, keeping the rate control
+//  mode.  Returns 0 if x264 refused.
+int video_x264_set_bitrate(struct encoder_video * video, unsigned int bitrate);
+// Make the next frame passed in an IDR frame
+void video_x264_force_keyframe(struct encoder_video * video);
+// Milliseconds to add to every timestamp in the stream so that decode
+//  times never go negative (B-frame reordering delay)
+int video_x264_dts_shift(const struct encoder_video * video);
+// Frames still held inside the encoder (lookahead, frame threads)
+int video_x264_delayed(const struct encoder_video * video);
+// At the end of the stream: get the next held frame out
+struct video_return_t video_x264_flush(struct encoder_video * video);
 void video_x264_close(struct encoder_video * video);
 
 #endif